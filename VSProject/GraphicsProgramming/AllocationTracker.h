@@ -0,0 +1,247 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <iostream>
+
+// Counts every heap allocation of the program by what it is for. The global operator new and delete are replaced and
+// stb_image allocates through trackedMalloc, every block carries a small header with its size and tag, so frees are
+// attributed to the tag that allocated them.
+// The tag of an allocation is the one of the innermost AllocationScope of the thread, or the phase of the program,
+// which the main thread sets: loading, terrain and models during startup, frame in the main loop. beginFrame and
+// endFrame count the frame allocations of every frame, and with failOnFrameAllocations every frame after the warm up
+// that allocates is reported as a failure.
+// Building with ALLOCATION_TRACKING 0 leaves operator new alone and only keeps the counters at zero.
+#ifndef ALLOCATION_TRACKING
+#define ALLOCATION_TRACKING 1
+#endif
+
+enum AllocationTag {
+    ALLOCATION_LOADING,
+    ALLOCATION_TERRAIN,
+    ALLOCATION_MODELS,
+    ALLOCATION_FRAME,
+    // Statistics output and debug dumps, not part of rendering a frame
+    ALLOCATION_DIAGNOSTICS,
+    ALLOCATION_TAG_COUNT
+};
+
+class AllocationTracker {
+public:
+    // Frames before this are still filling caches and growing lists to their final size
+    static const int WARMUP_FRAMES = 120;
+    // Steady state frames that allocate are printed up to this many times
+    static const int MAX_REPORTED_FRAMES = 5;
+
+    struct TagStats {
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        uint64_t frees = 0;
+        int64_t liveBytes = 0;
+        int64_t peakLiveBytes = 0;
+    };
+
+    struct FrameStats {
+        int frames = 0;
+        // Of the last frame
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        // Of the worst frame
+        uint64_t maxAllocations = 0;
+        uint64_t maxBytes = 0;
+        // Frames after the warm up that allocated
+        int allocatingFrames = 0;
+    };
+
+private:
+    struct Counters {
+        std::atomic<uint64_t> allocations{ 0 };
+        std::atomic<uint64_t> bytes{ 0 };
+        std::atomic<uint64_t> frees{ 0 };
+        std::atomic<int64_t> liveBytes{ 0 };
+        std::atomic<int64_t> peakLiveBytes{ 0 };
+    };
+
+    // Everything is constant initialized, operator new can run before the constructors of other globals
+    Counters counters[ALLOCATION_TAG_COUNT];
+    std::atomic<int> phase{ ALLOCATION_LOADING };
+    uint64_t frameStartAllocations = 0;
+    uint64_t frameStartBytes = 0;
+    FrameStats frameStats;
+    bool failOnFrameAllocations = false;
+
+    static int& threadTag() {
+        thread_local int tag = -1;
+        return tag;
+    }
+
+public:
+    static const char* getTagName(AllocationTag tag);
+
+    // Tag of the allocations of the calling thread right now
+    AllocationTag currentTag() const {
+        int tag = threadTag();
+        return (AllocationTag)(tag >= 0 ? tag : phase.load(std::memory_order_relaxed));
+    }
+    void setPhase(AllocationTag tag) { phase.store(tag, std::memory_order_relaxed); }
+    void setFailOnFrameAllocations(bool fail) { failOnFrameAllocations = fail; }
+
+    void recordAllocation(AllocationTag tag, size_t size);
+    void recordFree(AllocationTag tag, size_t size);
+
+    void beginFrame();
+    // Returns false when a steady state frame allocated and the failing mode is on
+    bool endFrame();
+
+    TagStats getTagStats(AllocationTag tag) const;
+    const FrameStats& getFrameStats() const { return frameStats; }
+    // Per tag totals and the frame statistics
+    void print() const;
+
+    friend class AllocationScope;
+};
+
+AllocationTracker allocationTracker;
+
+// Attributes the allocations of the calling thread to a tag until the end of the scope
+class AllocationScope {
+private:
+    int previousTag;
+
+public:
+    explicit AllocationScope(AllocationTag tag) : previousTag(AllocationTracker::threadTag()) { AllocationTracker::threadTag() = tag; }
+    ~AllocationScope() { AllocationTracker::threadTag() = previousTag; }
+};
+
+const char* AllocationTracker::getTagName(AllocationTag tag) {
+    const char* names[ALLOCATION_TAG_COUNT] = { "loading", "terrain", "models", "frame", "diagnostics" };
+    return names[tag];
+}
+
+void AllocationTracker::recordAllocation(AllocationTag tag, size_t size) {
+    Counters& tagCounters = counters[tag];
+    tagCounters.allocations.fetch_add(1, std::memory_order_relaxed);
+    tagCounters.bytes.fetch_add(size, std::memory_order_relaxed);
+    int64_t live = tagCounters.liveBytes.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+    int64_t peak = tagCounters.peakLiveBytes.load(std::memory_order_relaxed);
+    while (live > peak && !tagCounters.peakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+}
+
+void AllocationTracker::recordFree(AllocationTag tag, size_t size) {
+    counters[tag].frees.fetch_add(1, std::memory_order_relaxed);
+    counters[tag].liveBytes.fetch_sub((int64_t)size, std::memory_order_relaxed);
+}
+
+void AllocationTracker::beginFrame() {
+    frameStartAllocations = counters[ALLOCATION_FRAME].allocations.load(std::memory_order_relaxed);
+    frameStartBytes = counters[ALLOCATION_FRAME].bytes.load(std::memory_order_relaxed);
+}
+
+bool AllocationTracker::endFrame() {
+    frameStats.frames++;
+    frameStats.allocations = counters[ALLOCATION_FRAME].allocations.load(std::memory_order_relaxed) - frameStartAllocations;
+    frameStats.bytes = counters[ALLOCATION_FRAME].bytes.load(std::memory_order_relaxed) - frameStartBytes;
+    frameStats.maxAllocations = std::max(frameStats.maxAllocations, frameStats.allocations);
+    frameStats.maxBytes = std::max(frameStats.maxBytes, frameStats.bytes);
+    if (frameStats.frames <= WARMUP_FRAMES || frameStats.allocations == 0)
+        return true;
+
+    frameStats.allocatingFrames++;
+    if (!failOnFrameAllocations)
+        return true;
+    if (frameStats.allocatingFrames <= MAX_REPORTED_FRAMES) {
+        AllocationScope scope(ALLOCATION_DIAGNOSTICS);
+        std::cout << "Allocation check failed: frame " << frameStats.frames << " allocated " << frameStats.allocations
+            << " times (" << frameStats.bytes << " bytes) after the warm up" << std::endl;
+    }
+    return false;
+}
+
+AllocationTracker::TagStats AllocationTracker::getTagStats(AllocationTag tag) const {
+    TagStats stats;
+    stats.allocations = counters[tag].allocations.load(std::memory_order_relaxed);
+    stats.bytes = counters[tag].bytes.load(std::memory_order_relaxed);
+    stats.frees = counters[tag].frees.load(std::memory_order_relaxed);
+    stats.liveBytes = counters[tag].liveBytes.load(std::memory_order_relaxed);
+    stats.peakLiveBytes = counters[tag].peakLiveBytes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void AllocationTracker::print() const {
+    AllocationScope scope(ALLOCATION_DIAGNOSTICS);
+    for (int tag = 0; tag < ALLOCATION_TAG_COUNT; ++tag) {
+        TagStats stats = getTagStats((AllocationTag)tag);
+        std::cout << "    " << getTagName((AllocationTag)tag) << ": " << stats.allocations << " allocations, " << stats.bytes / 1024
+            << " KB, " << stats.frees << " frees, " << stats.liveBytes / 1024 << " KB live, " << stats.peakLiveBytes / 1024 << " KB peak" << std::endl;
+    }
+    std::cout << "    per frame: " << frameStats.allocations << " allocations (" << frameStats.bytes << " bytes) in the last frame, at most "
+        << frameStats.maxAllocations << " (" << frameStats.maxBytes << " bytes), " << frameStats.allocatingFrames << " of "
+        << std::max(frameStats.frames - WARMUP_FRAMES, 0) << " frames after the warm up allocated" << std::endl;
+}
+
+// Header in front of every tracked block, a multiple of the fundamental alignment so the block keeps it
+struct alignas(16) AllocationHeader {
+    size_t size;
+    int tag;
+};
+
+void* trackedMalloc(size_t size) {
+#if ALLOCATION_TRACKING
+    AllocationHeader* header = (AllocationHeader*)malloc(sizeof(AllocationHeader) + size);
+    if (header == nullptr) return nullptr;
+    header->size = size;
+    header->tag = allocationTracker.currentTag();
+    allocationTracker.recordAllocation((AllocationTag)header->tag, size);
+    return header + 1;
+#else
+    return malloc(size);
+#endif
+}
+
+void trackedFree(void* pointer) {
+#if ALLOCATION_TRACKING
+    if (pointer == nullptr) return;
+    AllocationHeader* header = (AllocationHeader*)pointer - 1;
+    allocationTracker.recordFree((AllocationTag)header->tag, header->size);
+    free(header);
+#else
+    free(pointer);
+#endif
+}
+
+void* trackedRealloc(void* pointer, size_t size) {
+#if ALLOCATION_TRACKING
+    if (pointer == nullptr) return trackedMalloc(size);
+    AllocationHeader* header = (AllocationHeader*)pointer - 1;
+    AllocationTag tag = (AllocationTag)header->tag;
+    size_t oldSize = header->size;
+    AllocationHeader* resized = (AllocationHeader*)realloc(header, sizeof(AllocationHeader) + size);
+    if (resized == nullptr) return nullptr;
+    // Counts as a free of the old block and an allocation of the new one, under the tag of the old one
+    allocationTracker.recordFree(tag, oldSize);
+    allocationTracker.recordAllocation(tag, size);
+    resized->size = size;
+    return resized + 1;
+#else
+    return realloc(pointer, size);
+#endif
+}
+
+#if ALLOCATION_TRACKING
+void* operator new(size_t size) {
+    void* pointer = trackedMalloc(size > 0 ? size : 1);
+    if (pointer == nullptr) throw std::bad_alloc();
+    return pointer;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return trackedMalloc(size > 0 ? size : 1); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return trackedMalloc(size > 0 ? size : 1); }
+void operator delete(void* pointer) noexcept { trackedFree(pointer); }
+void operator delete[](void* pointer) noexcept { trackedFree(pointer); }
+void operator delete(void* pointer, size_t) noexcept { trackedFree(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { trackedFree(pointer); }
+void operator delete(void* pointer, const std::nothrow_t&) noexcept { trackedFree(pointer); }
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept { trackedFree(pointer); }
+#endif
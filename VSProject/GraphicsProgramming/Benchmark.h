@@ -0,0 +1,357 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "GLExtensions.h"
+#include "DrawStats.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX 0x9048
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+
+// Camera key frames for the benchmark, scripted or recorded in an interactive session.
+// Positions are interpolated with Catmull-Rom splines, the angles linearly.
+class CameraPath {
+public:
+    struct Key {
+        float time;
+        glm::vec3 position;
+        float yaw;
+        float pitch;
+    };
+
+private:
+    std::vector<Key> keys;
+
+public:
+    // Flies over the terrain, comes down to the backpack and circles it once
+    static CameraPath createDefault();
+
+    // One key per line: time, position x y z, yaw, pitch
+    bool load(const char* path);
+    bool save(const char* path) const;
+
+    void add(const Key& key) { keys.push_back(key); }
+    float getDuration() const { return keys.empty() ? 0.0f : keys.back().time; }
+    // Loops around when the time is past the last key
+    void sample(float time, glm::vec3& position, float& yaw, float& pitch) const;
+};
+
+CameraPath CameraPath::createDefault() {
+    CameraPath path;
+    path.add({ 0.0f, glm::vec3(-40.0f, 15.0f, 40.0f), -45.0f, -20.0f });
+    path.add({ 4.0f, glm::vec3(0.0f, 12.0f, 20.0f), -90.0f, -25.0f });
+    path.add({ 8.0f, glm::vec3(30.0f, 8.0f, 0.0f), -180.0f, -15.0f });
+    path.add({ 11.0f, glm::vec3(4.0f, 1.0f, -5.0f), -180.0f, -5.0f });
+    path.add({ 13.0f, glm::vec3(0.0f, 1.0f, -1.0f), -90.0f, -5.0f });
+    path.add({ 15.0f, glm::vec3(-4.0f, 1.0f, -5.0f), 0.0f, -5.0f });
+    path.add({ 17.0f, glm::vec3(0.0f, 1.0f, -9.0f), 90.0f, -5.0f });
+    path.add({ 20.0f, glm::vec3(0.0f, 2.5f, -3.0f), -90.0f, 0.0f });
+    return path;
+}
+
+bool CameraPath::load(const char* path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open camera path: " << path << std::endl;
+        return false;
+    }
+
+    keys.clear();
+    Key key;
+    while (file >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch)
+        keys.push_back(key);
+    return !keys.empty();
+}
+
+bool CameraPath::save(const char* path) const {
+    std::ofstream file(path);
+    if (!file) return false;
+    for (const Key& key : keys)
+        file << key.time << " " << key.position.x << " " << key.position.y << " " << key.position.z << " " << key.yaw << " " << key.pitch << "\n";
+    return true;
+}
+
+void CameraPath::sample(float time, glm::vec3& position, float& yaw, float& pitch) const {
+    if (keys.empty()) return;
+    if (keys.size() == 1 || getDuration() <= 0.0f) {
+        position = keys[0].position;
+        yaw = keys[0].yaw;
+        pitch = keys[0].pitch;
+        return;
+    }
+
+    time = std::fmod(time, getDuration());
+    size_t next = 1;
+    while (next < keys.size() - 1 && keys[next].time < time)
+        ++next;
+    const Key& a = keys[next - 1];
+    const Key& b = keys[next];
+    const glm::vec3& before = keys[next > 1 ? next - 2 : 0].position;
+    const glm::vec3& after = keys[std::min(next + 1, keys.size() - 1)].position;
+
+    float t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 1.0f;
+    float t2 = t * t;
+    float t3 = t2 * t;
+    position = 0.5f * (2.0f * a.position + (b.position - before) * t
+        + (2.0f * before - 5.0f * a.position + 4.0f * b.position - after) * t2
+        + (3.0f * a.position - before - 3.0f * b.position + after) * t3);
+    yaw = a.yaw + (b.yaw - a.yaw) * t;
+    pitch = a.pitch + (b.pitch - a.pitch) * t;
+}
+
+// Renders a fixed number of frames into an offscreen framebuffer of a fixed size and collects the frame times.
+// Every frame ends with glFinish so the time covers the GPU work, and the scene time advances by a fixed step
+// instead of the wall clock, so every run renders exactly the same frames.
+class Benchmark {
+public:
+    // Warmup and measured frames together cover the default path once
+    static const int DEFAULT_FRAMES = 1140;
+    static const int WARMUP_FRAMES = 60;
+    static constexpr float FRAME_TIME = 1.0f / 60.0f;
+
+    struct Result {
+        int frames = 0;
+        int width = 0;
+        int height = 0;
+        double meanMilliseconds = 0.0;
+        double p50Milliseconds = 0.0;
+        double p90Milliseconds = 0.0;
+        double p95Milliseconds = 0.0;
+        double p99Milliseconds = 0.0;
+        double maxMilliseconds = 0.0;
+        double drawCallsPerFrame = 0.0;
+        double trianglesPerFrame = 0.0;
+        double peakMemoryMegabytes = 0.0;
+        // Only with GL_NVX_gpu_memory_info, -1 otherwise
+        double gpuMemoryMegabytes = -1.0;
+    };
+
+private:
+    GLuint framebuffer = 0;
+    GLuint colorBuffer = 0;
+    GLuint depthBuffer = 0;
+    int width = 0;
+    int height = 0;
+    int frameCount = DEFAULT_FRAMES;
+    int frame = 0;
+
+    std::chrono::high_resolution_clock::time_point frameStart;
+    std::vector<double> frameMilliseconds;
+    int64_t drawCalls = 0;
+    int64_t triangles = 0;
+
+    static double percentile(const std::vector<double>& sorted, double fraction);
+    static double getPeakMemoryMegabytes();
+    static bool readValue(const std::string& json, const char* key, double& value);
+
+public:
+    bool create(int width, int height, int frameCount);
+    void destroy();
+
+    // Binds the offscreen framebuffer, call before anything is drawn
+    void beginFrame();
+    // Returns false when all frames are done
+    bool endFrame();
+    // Scene time of the current frame
+    float getTime() const { return frame * FRAME_TIME; }
+
+    Result getResult() const;
+    bool writeJson(const char* path, const std::string& configuration) const;
+    // Prints every metric next to the baseline, returns false if one got worse by more than the tolerance
+    static bool compare(const char* resultPath, const char* baselinePath, double tolerance);
+};
+
+constexpr float Benchmark::FRAME_TIME;
+
+bool Benchmark::create(int width, int height, int frameCount) {
+    this->width = width;
+    this->height = height;
+    this->frameCount = frameCount;
+    frameMilliseconds.reserve(frameCount);
+
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+        std::cerr << "Benchmark framebuffer is incomplete" << std::endl;
+    return complete;
+}
+
+void Benchmark::destroy() {
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &colorBuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+}
+
+void Benchmark::beginFrame() {
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
+    drawStats.reset();
+    frameStart = std::chrono::high_resolution_clock::now();
+}
+
+bool Benchmark::endFrame() {
+    glFinish();
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - frameStart).count();
+
+    // Shader permutations, first uploads and caches settle during the warmup
+    if (frame >= WARMUP_FRAMES) {
+        frameMilliseconds.push_back(milliseconds);
+        drawCalls += drawStats.drawCalls.load();
+        triangles += drawStats.triangles.load();
+    }
+    frame++;
+    return frame < WARMUP_FRAMES + frameCount;
+}
+
+double Benchmark::percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) return 0.0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(fraction * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+double Benchmark::getPeakMemoryMegabytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+    return 0.0;
+#else
+    // Kilobytes on Linux
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+Benchmark::Result Benchmark::getResult() const {
+    Result result;
+    result.frames = (int)frameMilliseconds.size();
+    result.width = width;
+    result.height = height;
+    if (frameMilliseconds.empty()) return result;
+
+    std::vector<double> sorted = frameMilliseconds;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    for (double milliseconds : sorted)
+        total += milliseconds;
+    result.meanMilliseconds = total / sorted.size();
+    result.p50Milliseconds = percentile(sorted, 0.50);
+    result.p90Milliseconds = percentile(sorted, 0.90);
+    result.p95Milliseconds = percentile(sorted, 0.95);
+    result.p99Milliseconds = percentile(sorted, 0.99);
+    result.maxMilliseconds = sorted.back();
+    result.drawCallsPerFrame = (double)drawCalls / sorted.size();
+    result.trianglesPerFrame = (double)triangles / sorted.size();
+    result.peakMemoryMegabytes = getPeakMemoryMegabytes();
+
+    if (hasGLExtension("GL_NVX_gpu_memory_info")) {
+        GLint totalKilobytes = 0, availableKilobytes = 0;
+        glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &totalKilobytes);
+        glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &availableKilobytes);
+        result.gpuMemoryMegabytes = (totalKilobytes - availableKilobytes) / 1024.0;
+    }
+    return result;
+}
+
+bool Benchmark::writeJson(const char* path, const std::string& configuration) const {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        std::cerr << "Failed to write benchmark results: " << path << std::endl;
+        return false;
+    }
+
+    auto escape = [](const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    };
+
+    // Flat on purpose, compare reads it back with a simple key search
+    Result result = getResult();
+    fprintf(file, "{\n");
+    fprintf(file, "  \"configuration\": \"%s\",\n", escape(configuration).c_str());
+    fprintf(file, "  \"renderer\": \"%s\",\n", escape((const char*)glGetString(GL_RENDERER)).c_str());
+    fprintf(file, "  \"frames\": %d,\n", result.frames);
+    fprintf(file, "  \"width\": %d,\n", result.width);
+    fprintf(file, "  \"height\": %d,\n", result.height);
+    fprintf(file, "  \"meanMilliseconds\": %.4f,\n", result.meanMilliseconds);
+    fprintf(file, "  \"p50Milliseconds\": %.4f,\n", result.p50Milliseconds);
+    fprintf(file, "  \"p90Milliseconds\": %.4f,\n", result.p90Milliseconds);
+    fprintf(file, "  \"p95Milliseconds\": %.4f,\n", result.p95Milliseconds);
+    fprintf(file, "  \"p99Milliseconds\": %.4f,\n", result.p99Milliseconds);
+    fprintf(file, "  \"maxMilliseconds\": %.4f,\n", result.maxMilliseconds);
+    fprintf(file, "  \"drawCallsPerFrame\": %.2f,\n", result.drawCallsPerFrame);
+    fprintf(file, "  \"trianglesPerFrame\": %.1f,\n", result.trianglesPerFrame);
+    fprintf(file, "  \"peakMemoryMegabytes\": %.2f,\n", result.peakMemoryMegabytes);
+    fprintf(file, "  \"gpuMemoryMegabytes\": %.2f\n", result.gpuMemoryMegabytes);
+    fprintf(file, "}\n");
+    fclose(file);
+    return true;
+}
+
+bool Benchmark::readValue(const std::string& json, const char* key, double& value) {
+    std::string quoted = std::string("\"") + key + "\":";
+    size_t position = json.find(quoted);
+    if (position == std::string::npos) return false;
+    value = strtod(json.c_str() + position + quoted.size(), nullptr);
+    return true;
+}
+
+bool Benchmark::compare(const char* resultPath, const char* baselinePath, double tolerance) {
+    std::ifstream resultFile(resultPath);
+    std::ifstream baselineFile(baselinePath);
+    if (!resultFile || !baselineFile) {
+        std::cerr << "Failed to open " << (!resultFile ? resultPath : baselinePath) << std::endl;
+        return false;
+    }
+    std::stringstream resultText, baselineText;
+    resultText << resultFile.rdbuf();
+    baselineText << baselineFile.rdbuf();
+
+    // Lower is better for all of them
+    const char* keys[] = { "meanMilliseconds", "p50Milliseconds", "p95Milliseconds", "p99Milliseconds", "drawCallsPerFrame", "peakMemoryMegabytes" };
+    bool passed = true;
+    for (const char* key : keys) {
+        double value = 0.0, baseline = 0.0;
+        if (!readValue(resultText.str(), key, value) || !readValue(baselineText.str(), key, baseline)) continue;
+
+        double change = baseline > 0.0 ? value / baseline - 1.0 : 0.0;
+        bool regressed = change > tolerance;
+        passed = passed && !regressed;
+        printf("%-22s %12.3f baseline %12.3f %+7.1f%%%s\n", key, value, baseline, 100.0 * change, regressed ? "  REGRESSION" : "");
+    }
+    return passed;
+}
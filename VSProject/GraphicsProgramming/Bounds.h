@@ -0,0 +1,124 @@
+#pragma once
+#include <cfloat>
+#include <glm/glm.hpp>
+
+// Axis aligned bounding box, starts out empty (min > max)
+struct AABB {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    AABB() {}
+    AABB(const glm::vec3& min, const glm::vec3& max) : min(min), max(max) {}
+
+    bool isValid() const {
+        return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+    }
+
+    void expand(const glm::vec3& point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void expand(const AABB& other) {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    glm::vec3 extents() const { return (max - min) * 0.5f; }
+
+    float surfaceArea() const {
+        glm::vec3 size = max - min;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    bool contains(const AABB& other) const {
+        return glm::all(glm::lessThanEqual(min, other.min)) && glm::all(glm::greaterThanEqual(max, other.max));
+    }
+
+    // Slab test of a ray, inverseDirection comes from inverseRayDirection. Returns the entry distance, 0 inside, when the ray
+    // enters before maxDistance.
+    bool intersectsRay(const glm::vec3& origin, const glm::vec3& inverseDirection, float maxDistance, float& distance) const {
+        glm::vec3 t0 = (min - origin) * inverseDirection;
+        glm::vec3 t1 = (max - origin) * inverseDirection;
+        glm::vec3 nearT = glm::min(t0, t1);
+        glm::vec3 farT = glm::max(t0, t1);
+        distance = glm::max(glm::max(nearT.x, nearT.y), glm::max(nearT.z, 0.0f));
+        float exit = glm::min(glm::min(farT.x, farT.y), glm::min(farT.z, maxDistance));
+        return distance <= exit;
+    }
+
+    // Distance from a point to the closest point of the box, 0 inside
+    float distance(const glm::vec3& point) const {
+        return glm::length(point - glm::clamp(point, min, max));
+    }
+
+    // Bounds of this box after applying an affine transformation
+    AABB transformed(const glm::mat4& matrix) const {
+        glm::vec3 newCenter = glm::vec3(matrix * glm::vec4(center(), 1.0f));
+        glm::vec3 halfSize = extents();
+
+        // Every axis of the new box is the sum of the absolute projected half sizes
+        glm::mat3 absolute = glm::mat3(matrix);
+        for (int column = 0; column < 3; ++column)
+            absolute[column] = glm::abs(absolute[column]);
+        glm::vec3 newHalfSize = absolute * halfSize;
+
+        return AABB(newCenter - newHalfSize, newCenter + newHalfSize);
+    }
+};
+
+// 1 / direction for AABB::intersectsRay. Zero components become tiny instead, 0 * infinity in the slab test would
+// be NaN for rays that start on a slab.
+inline glm::vec3 inverseRayDirection(const glm::vec3& direction) {
+    glm::vec3 inverse;
+    for (int axis = 0; axis < 3; ++axis)
+        inverse[axis] = 1.0f / (direction[axis] != 0.0f ? direction[axis] : 1e-30f);
+    return inverse;
+}
+
+// The six planes of a view frustum, pointing inwards
+struct Frustum {
+    glm::vec4 planes[6];
+
+    Frustum() {}
+    explicit Frustum(const glm::mat4& viewProjection) {
+        // Rows of the matrix, glm stores columns
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; ++i)
+            rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+        planes[0] = rows[3] + rows[0]; // left
+        planes[1] = rows[3] - rows[0]; // right
+        planes[2] = rows[3] + rows[1]; // bottom
+        planes[3] = rows[3] - rows[1]; // top
+        planes[4] = rows[3] + rows[2]; // near
+        planes[5] = rows[3] - rows[2]; // far
+        for (glm::vec4& plane : planes)
+            plane /= glm::length(glm::vec3(plane));
+    }
+
+    // Conservative, boxes near the corners can pass although they are outside
+    bool intersects(const AABB& box) const {
+        glm::vec3 center = box.center();
+        glm::vec3 halfSize = box.extents();
+        for (const glm::vec4& plane : planes) {
+            glm::vec3 normal = glm::vec3(plane);
+            if (glm::dot(normal, center) + plane.w + glm::dot(glm::abs(normal), halfSize) < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+    // True when the whole box is inside, everything in it is visible without further tests
+    bool contains(const AABB& box) const {
+        glm::vec3 center = box.center();
+        glm::vec3 halfSize = box.extents();
+        for (const glm::vec4& plane : planes) {
+            glm::vec3 normal = glm::vec3(plane);
+            if (glm::dot(normal, center) + plane.w - glm::dot(glm::abs(normal), halfSize) < 0.0f)
+                return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,332 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <emmintrin.h>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// Clustered forward lighting for many local point and spot lights.
+// The view frustum is split into a grid of froxels (screen tiles times exponential depth slices). Every frame the
+// lights are binned into the froxels they touch on the CPU, four froxels of a row at a time with SSE, and the
+// result is uploaded into texture buffers. The clustered fragment shaders find their froxel from gl_FragCoord and
+// the view depth and only loop over the lights in it, so shading cost depends on local light density instead of
+// the total number of lights.
+class ClusteredLighting {
+public:
+    static const int TILES_X = 16;
+    static const int TILES_Y = 9;
+    static const int SLICES = 24;
+    static const int CLUSTER_COUNT = TILES_X * TILES_Y * SLICES;
+    static const int MAX_LIGHTS = 65535;
+
+    // Texture units of the light buffers, after the three material textures
+    static const int LIGHT_DATA_UNIT = 3;
+    static const int LIGHT_GRID_UNIT = 4;
+    static const int LIGHT_INDEX_UNIT = 5;
+
+    struct Light {
+        glm::vec3 position = glm::vec3(0.0f);
+        float range = 1.0f;
+        glm::vec3 color = glm::vec3(1.0f);
+        // Spot lights only, the default cone of a point light is below -1 so every direction is fully lit
+        glm::vec3 direction = glm::vec3(0.0f, -1.0f, 0.0f);
+        float innerConeCos = -1.5f;
+        float outerConeCos = -2.0f;
+    };
+
+    struct Stats {
+        int lights = 0;
+        int visibleLights = 0;
+        int lightIndices = 0;
+        int occupiedClusters = 0;
+        int maxLightsPerCluster = 0;
+        double binMilliseconds = 0.0;
+    };
+
+private:
+    // View space bounds of every cluster, one array per component so a row of four clusters is one SSE load
+    std::vector<float> clusterMinX, clusterMinY, clusterMinZ;
+    std::vector<float> clusterMaxX, clusterMaxY, clusterMaxZ;
+    glm::mat4 clusterProjection = glm::mat4(0.0f);
+    float nearPlane = 0.0f;
+    float farPlane = 0.0f;
+    int screenWidth = 0;
+    int screenHeight = 0;
+
+    // Depth slice of a view depth: log(depth) * sliceScale + sliceBias
+    float sliceScale = 0.0f;
+    float sliceBias = 0.0f;
+
+    // Cluster << 16 | light for every light in every cluster it touches, in light order
+    std::vector<uint32_t> pairs;
+    std::vector<GLuint> clusterGrid;
+    std::vector<GLushort> lightIndices;
+    std::vector<glm::vec4> lightData;
+
+    GLuint buffers[3] = { 0, 0, 0 };
+    GLuint textures[3] = { 0, 0, 0 };
+    Stats stats;
+
+    void buildClusters(const glm::mat4& projection, float near, float far, int width, int height);
+    int sliceOf(float depth) const {
+        return std::min(std::max((int)(std::log(depth) * sliceScale + sliceBias), 0), SLICES - 1);
+    }
+    void binLight(int light, const glm::vec3& center, float radius);
+    void upload(GLuint buffer, const void* data, size_t size);
+
+public:
+    void create();
+    void destroy();
+
+    // Bins the lights into the clusters of this view and uploads the result.
+    // The projection has to be a symmetric perspective projection with the given near and far planes.
+    void update(const std::vector<Light>& lights, const glm::mat4& view, const glm::mat4& projection, float near, float far, int width, int height);
+    // Binds the light buffers and sets the cluster uniforms of a program that uses a clustered fragment shader
+    void setupProgram(GLuint program) const;
+
+    const Stats& getStats() const { return stats; }
+};
+
+void ClusteredLighting::create() {
+    glGenBuffers(3, buffers);
+    glGenTextures(3, textures);
+
+    const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R16UI };
+    for (int i = 0; i < 3; ++i) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    clusterGrid.resize(CLUSTER_COUNT * 2);
+}
+
+void ClusteredLighting::destroy() {
+    glDeleteTextures(3, textures);
+    glDeleteBuffers(3, buffers);
+}
+
+void ClusteredLighting::buildClusters(const glm::mat4& projection, float near, float far, int width, int height) {
+    clusterProjection = projection;
+    nearPlane = near;
+    farPlane = far;
+    screenWidth = width;
+    screenHeight = height;
+
+    sliceScale = SLICES / std::log(far / near);
+    sliceBias = -std::log(near) * sliceScale;
+
+    clusterMinX.resize(CLUSTER_COUNT);
+    clusterMinY.resize(CLUSTER_COUNT);
+    clusterMinZ.resize(CLUSTER_COUNT);
+    clusterMaxX.resize(CLUSTER_COUNT);
+    clusterMaxY.resize(CLUSTER_COUNT);
+    clusterMaxZ.resize(CLUSTER_COUNT);
+
+    // The tiles cover whole pixels, the last column and row can reach past the screen
+    float tileWidth = std::ceil(width / (float)TILES_X);
+    float tileHeight = std::ceil(height / (float)TILES_Y);
+
+    for (int slice = 0; slice < SLICES; ++slice) {
+        float sliceNear = near * std::pow(far / near, slice / (float)SLICES);
+        float sliceFar = near * std::pow(far / near, (slice + 1) / (float)SLICES);
+
+        for (int y = 0; y < TILES_Y; ++y) {
+            float ndcY0 = 2.0f * y * tileHeight / height - 1.0f;
+            float ndcY1 = 2.0f * (y + 1) * tileHeight / height - 1.0f;
+
+            for (int x = 0; x < TILES_X; ++x) {
+                float ndcX0 = 2.0f * x * tileWidth / width - 1.0f;
+                float ndcX1 = 2.0f * (x + 1) * tileWidth / width - 1.0f;
+
+                // Corners of the tile at both depths, a view space point at depth d has x = ndc.x * d / P[0][0]
+                glm::vec3 minimum = glm::vec3(FLT_MAX);
+                glm::vec3 maximum = glm::vec3(-FLT_MAX);
+                float depths[2] = { sliceNear, sliceFar };
+                for (float depth : depths) {
+                    for (float ndcX : { ndcX0, ndcX1 }) {
+                        for (float ndcY : { ndcY0, ndcY1 }) {
+                            glm::vec3 corner = glm::vec3(ndcX * depth / projection[0][0], ndcY * depth / projection[1][1], -depth);
+                            minimum = glm::min(minimum, corner);
+                            maximum = glm::max(maximum, corner);
+                        }
+                    }
+                }
+
+                int cluster = (slice * TILES_Y + y) * TILES_X + x;
+                clusterMinX[cluster] = minimum.x;
+                clusterMinY[cluster] = minimum.y;
+                clusterMinZ[cluster] = minimum.z;
+                clusterMaxX[cluster] = maximum.x;
+                clusterMaxY[cluster] = maximum.y;
+                clusterMaxZ[cluster] = maximum.z;
+            }
+        }
+    }
+}
+
+void ClusteredLighting::binLight(int light, const glm::vec3& center, float radius) {
+    float depth = -center.z;
+    float minDepth = depth - radius;
+    float maxDepth = depth + radius;
+    if (maxDepth < nearPlane || minDepth > farPlane) return;
+
+    int firstSlice = sliceOf(std::max(minDepth, nearPlane));
+    int lastSlice = sliceOf(std::min(maxDepth, farPlane));
+
+    // Tile range from the extremes of the projected sphere bounds, everything when the sphere reaches the camera
+    int firstX = 0, lastX = TILES_X - 1;
+    int firstY = 0, lastY = TILES_Y - 1;
+    if (minDepth > nearPlane) {
+        float ndcMinX = std::min((center.x - radius) / minDepth, (center.x - radius) / maxDepth) * clusterProjection[0][0];
+        float ndcMaxX = std::max((center.x + radius) / minDepth, (center.x + radius) / maxDepth) * clusterProjection[0][0];
+        float ndcMinY = std::min((center.y - radius) / minDepth, (center.y - radius) / maxDepth) * clusterProjection[1][1];
+        float ndcMaxY = std::max((center.y + radius) / minDepth, (center.y + radius) / maxDepth) * clusterProjection[1][1];
+        if (ndcMaxX < -1.0f || ndcMinX > 1.0f || ndcMaxY < -1.0f || ndcMinY > 1.0f) return;
+
+        float tilesPerNdcX = screenWidth / std::ceil(screenWidth / (float)TILES_X) * 0.5f;
+        float tilesPerNdcY = screenHeight / std::ceil(screenHeight / (float)TILES_Y) * 0.5f;
+        firstX = std::max((int)((ndcMinX + 1.0f) * tilesPerNdcX), 0);
+        lastX = std::min((int)((ndcMaxX + 1.0f) * tilesPerNdcX), TILES_X - 1);
+        firstY = std::max((int)((ndcMinY + 1.0f) * tilesPerNdcY), 0);
+        lastY = std::min((int)((ndcMaxY + 1.0f) * tilesPerNdcY), TILES_Y - 1);
+    }
+
+    const __m128 centerX = _mm_set1_ps(center.x);
+    const __m128 centerY = _mm_set1_ps(center.y);
+    const __m128 centerZ = _mm_set1_ps(center.z);
+    const __m128 radiusSquared = _mm_set1_ps(radius * radius);
+    const __m128 zero = _mm_setzero_ps();
+
+    for (int slice = firstSlice; slice <= lastSlice; ++slice) {
+        for (int y = firstY; y <= lastY; ++y) {
+            int row = (slice * TILES_Y + y) * TILES_X;
+
+            // Rows are a multiple of four clusters long, start at the group that contains the first tile
+            for (int x = firstX & ~3; x <= lastX; x += 4) {
+                int cluster = row + x;
+
+                // Squared distance from the sphere center to the box, per axis max(min - c, 0) + max(c - max, 0)
+                __m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusterMinX[cluster]), centerX), zero),
+                    _mm_max_ps(_mm_sub_ps(centerX, _mm_loadu_ps(&clusterMaxX[cluster])), zero));
+                __m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusterMinY[cluster]), centerY), zero),
+                    _mm_max_ps(_mm_sub_ps(centerY, _mm_loadu_ps(&clusterMaxY[cluster])), zero));
+                __m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusterMinZ[cluster]), centerZ), zero),
+                    _mm_max_ps(_mm_sub_ps(centerZ, _mm_loadu_ps(&clusterMaxZ[cluster])), zero));
+                __m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                int mask = _mm_movemask_ps(_mm_cmple_ps(distanceSquared, radiusSquared));
+
+                for (int lane = 0; lane < 4; ++lane) {
+                    if ((mask & (1 << lane)) && x + lane >= firstX && x + lane <= lastX)
+                        pairs.push_back((uint32_t)(cluster + lane) << 16 | (uint32_t)light);
+                }
+            }
+        }
+    }
+}
+
+void ClusteredLighting::upload(GLuint buffer, const void* data, size_t size) {
+    // Orphan the buffer every frame so the driver does not have to wait for the previous frame
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, std::max(size, (size_t)16), nullptr, GL_STREAM_DRAW);
+    if (size > 0)
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+}
+
+void ClusteredLighting::update(const std::vector<Light>& lights, const glm::mat4& view, const glm::mat4& projection, float near, float far, int width, int height) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (projection != clusterProjection || near != nearPlane || far != farPlane || width != screenWidth || height != screenHeight)
+        buildClusters(projection, near, far, width, height);
+
+    int lightCount = std::min((int)lights.size(), MAX_LIGHTS);
+    lightData.resize(lightCount * 3);
+    pairs.clear();
+
+    for (int i = 0; i < lightCount; ++i) {
+        const Light& light = lights[i];
+        lightData[i * 3 + 0] = glm::vec4(light.position, light.range);
+        lightData[i * 3 + 1] = glm::vec4(light.color, light.outerConeCos);
+        lightData[i * 3 + 2] = glm::vec4(light.direction, light.innerConeCos);
+
+        // Spot lights with narrow cones get a tighter bounding sphere around the cone
+        glm::vec3 center = light.position;
+        float radius = light.range;
+        if (light.outerConeCos > 0.0f) {
+            float coneCos = light.outerConeCos;
+            if (coneCos > 0.7071f) {
+                radius = light.range / (2.0f * coneCos);
+                center = light.position + light.direction * radius;
+            }
+            else {
+                radius = light.range * std::sqrt(1.0f - coneCos * coneCos);
+                center = light.position + light.direction * (light.range * coneCos);
+            }
+        }
+
+        binLight(i, glm::vec3(view * glm::vec4(center, 1.0f)), radius);
+    }
+
+    // Counting sort of the pairs by cluster, lights stay in order within a cluster
+    std::fill(clusterGrid.begin(), clusterGrid.end(), 0);
+    for (uint32_t pair : pairs)
+        clusterGrid[(pair >> 16) * 2 + 1]++;
+
+    stats = Stats();
+    GLuint offset = 0;
+    for (int cluster = 0; cluster < CLUSTER_COUNT; ++cluster) {
+        GLuint count = clusterGrid[cluster * 2 + 1];
+        clusterGrid[cluster * 2] = offset;
+        offset += count;
+        if (count > 0) stats.occupiedClusters++;
+        stats.maxLightsPerCluster = std::max(stats.maxLightsPerCluster, (int)count);
+    }
+
+    lightIndices.resize(pairs.size());
+    for (int cluster = 0; cluster < CLUSTER_COUNT; ++cluster)
+        clusterGrid[cluster * 2 + 1] = 0;
+    int visibleLights = 0;
+    int lastLight = -1;
+    for (uint32_t pair : pairs) {
+        GLuint* entry = &clusterGrid[(pair >> 16) * 2];
+        lightIndices[entry[0] + entry[1]++] = (GLushort)(pair & 0xFFFF);
+        if ((int)(pair & 0xFFFF) != lastLight) {
+            lastLight = pair & 0xFFFF;
+            visibleLights++;
+        }
+    }
+
+    upload(buffers[0], lightData.data(), lightData.size() * sizeof(glm::vec4));
+    upload(buffers[1], clusterGrid.data(), clusterGrid.size() * sizeof(GLuint));
+    upload(buffers[2], lightIndices.data(), lightIndices.size() * sizeof(GLushort));
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    stats.lights = lightCount;
+    stats.visibleLights = visibleLights;
+    stats.lightIndices = (int)lightIndices.size();
+    stats.binMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void ClusteredLighting::setupProgram(GLuint program) const {
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "lightData"), LIGHT_DATA_UNIT);
+    glUniform1i(glGetUniformLocation(program, "lightGrid"), LIGHT_GRID_UNIT);
+    glUniform1i(glGetUniformLocation(program, "lightIndices"), LIGHT_INDEX_UNIT);
+    glUniform3i(glGetUniformLocation(program, "clusterCount"), TILES_X, TILES_Y, SLICES);
+    glUniform2f(glGetUniformLocation(program, "clusterTileSize"), std::ceil(screenWidth / (float)TILES_X), std::ceil(screenHeight / (float)TILES_Y));
+    glUniform2f(glGetUniformLocation(program, "clusterSliceScaleBias"), sliceScale, sliceBias);
+
+    const int units[3] = { LIGHT_DATA_UNIT, LIGHT_GRID_UNIT, LIGHT_INDEX_UNIT };
+    for (int i = 0; i < 3; ++i) {
+        glActiveTexture(GL_TEXTURE0 + units[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,208 @@
+#pragma once
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "RingBuffer.h"
+#include "DrawStats.h"
+
+// Uniform locations of a program, looked up once on the GL thread so commands can be recorded without a context
+struct UniformLocations {
+    GLint view = -1;
+    GLint projection = -1;
+    GLint lightDirection = -1;
+    GLint ambientLightColor = -1;
+    GLint viewPos = -1;
+    GLint albedoTexture = -1;
+    GLint normalTexture = -1;
+    GLint specularTexture = -1;
+    GLint materialId = -1;
+
+    UniformLocations() {}
+    UniformLocations(GLuint program) {
+        view = glGetUniformLocation(program, "view");
+        projection = glGetUniformLocation(program, "projection");
+        lightDirection = glGetUniformLocation(program, "lightDirection");
+        ambientLightColor = glGetUniformLocation(program, "ambientLightColor");
+        viewPos = glGetUniformLocation(program, "viewPos");
+        albedoTexture = glGetUniformLocation(program, "albedoTexture");
+        normalTexture = glGetUniformLocation(program, "normalTexture");
+        specularTexture = glGetUniformLocation(program, "specularTexture");
+        materialId = glGetUniformLocation(program, "materialId");
+    }
+};
+
+// Compact list of GL commands that can be recorded on any thread and executed later on the thread that owns the context.
+// Commands are packed back to back in one byte array as a small header followed by their arguments.
+class CommandList {
+private:
+    enum CommandType : uint16_t {
+        COMMAND_VIEWPORT,
+        COMMAND_CLEAR,
+        COMMAND_ENABLE,
+        COMMAND_DISABLE,
+        COMMAND_DEPTH_MASK,
+        COMMAND_USE_PROGRAM,
+        COMMAND_UNIFORM_1I,
+        COMMAND_UNIFORM_3F,
+        COMMAND_UNIFORM_MATRIX_4F,
+        COMMAND_UNIFORM_BLOCK,
+        COMMAND_BIND_TEXTURE,
+        COMMAND_BIND_VERTEX_ARRAY,
+        COMMAND_DRAW_ELEMENTS,
+    };
+
+    struct CommandHeader {
+        uint16_t type;
+        // Size of the arguments that follow the header
+        uint16_t size;
+    };
+
+    std::vector<unsigned char> data;
+    int commandCount = 0;
+
+    // Appends the header of a command and returns where its arguments go
+    size_t beginCommand(CommandType type, size_t size) {
+        CommandHeader header = { (uint16_t)type, (uint16_t)size };
+        size_t start = data.size();
+        data.resize(start + sizeof(header) + size);
+        memcpy(&data[start], &header, sizeof(header));
+        commandCount++;
+        return start + sizeof(header);
+    }
+
+    void write(CommandType type, const void* arguments, size_t size) {
+        size_t start = beginCommand(type, size);
+        memcpy(&data[start], arguments, size);
+    }
+
+    template<typename T>
+    static T read(const unsigned char* source) {
+        T value;
+        memcpy(&value, source, sizeof(T));
+        return value;
+    }
+
+public:
+    void reset() {
+        data.clear();
+        commandCount = 0;
+    }
+
+    void viewport(GLint width, GLint height) {
+        GLint arguments[] = { width, height };
+        write(COMMAND_VIEWPORT, arguments, sizeof(arguments));
+    }
+    void clear(GLbitfield mask, const glm::vec4& color) {
+        struct { GLbitfield mask; glm::vec4 color; } arguments = { mask, color };
+        write(COMMAND_CLEAR, &arguments, sizeof(arguments));
+    }
+    void enable(GLenum capability) { write(COMMAND_ENABLE, &capability, sizeof(capability)); }
+    void disable(GLenum capability) { write(COMMAND_DISABLE, &capability, sizeof(capability)); }
+    void depthMask(GLboolean mask) { write(COMMAND_DEPTH_MASK, &mask, sizeof(mask)); }
+    void useProgram(GLuint program) { write(COMMAND_USE_PROGRAM, &program, sizeof(program)); }
+
+    void uniform1i(GLint location, GLint value) {
+        if (location < 0) return;
+        GLint arguments[] = { location, value };
+        write(COMMAND_UNIFORM_1I, arguments, sizeof(arguments));
+    }
+    void uniform3f(GLint location, const glm::vec3& value) {
+        if (location < 0) return;
+        struct { GLint location; glm::vec3 value; } arguments = { location, value };
+        write(COMMAND_UNIFORM_3F, &arguments, sizeof(arguments));
+    }
+    void uniformMatrix4f(GLint location, const glm::mat4& value) {
+        if (location < 0) return;
+        struct { GLint location; glm::mat4 value; } arguments = { location, value };
+        write(COMMAND_UNIFORM_MATRIX_4F, &arguments, sizeof(arguments));
+    }
+
+    // The data is copied into the ring buffer on the GL thread and bound to the uniform block binding point
+    void uniformBlock(GLuint binding, const void* blockData, size_t size) {
+        size_t start = beginCommand(COMMAND_UNIFORM_BLOCK, sizeof(GLuint) + size);
+        memcpy(&data[start], &binding, sizeof(GLuint));
+        memcpy(&data[start + sizeof(GLuint)], blockData, size);
+    }
+
+    void bindTexture(GLuint unit, GLuint texture) {
+        GLuint arguments[] = { unit, texture };
+        write(COMMAND_BIND_TEXTURE, arguments, sizeof(arguments));
+    }
+    void bindVertexArray(GLuint vao) { write(COMMAND_BIND_VERTEX_ARRAY, &vao, sizeof(vao)); }
+    void drawElements(GLsizei indexCount) { write(COMMAND_DRAW_ELEMENTS, &indexCount, sizeof(indexCount)); }
+
+    int getCommandCount() const { return commandCount; }
+    size_t getByteSize() const { return data.size(); }
+
+    // Has to be called on the thread that owns the GL context
+    void execute(RingBuffer& ringBuffer) const;
+};
+
+void CommandList::execute(RingBuffer& ringBuffer) const {
+    size_t position = 0;
+    while (position < data.size()) {
+        CommandHeader header = read<CommandHeader>(&data[position]);
+        const unsigned char* arguments = &data[position + sizeof(CommandHeader)];
+        position += sizeof(CommandHeader) + header.size;
+
+        switch (header.type) {
+        case COMMAND_VIEWPORT:
+            glViewport(0, 0, read<GLint>(arguments), read<GLint>(arguments + sizeof(GLint)));
+            break;
+        case COMMAND_CLEAR: {
+            glm::vec4 color = read<glm::vec4>(arguments + sizeof(GLbitfield));
+            glClearColor(color.r, color.g, color.b, color.a);
+            glClear(read<GLbitfield>(arguments));
+            break;
+        }
+        case COMMAND_ENABLE:
+            glEnable(read<GLenum>(arguments));
+            break;
+        case COMMAND_DISABLE:
+            glDisable(read<GLenum>(arguments));
+            break;
+        case COMMAND_DEPTH_MASK:
+            glDepthMask(read<GLboolean>(arguments));
+            break;
+        case COMMAND_USE_PROGRAM:
+            glUseProgram(read<GLuint>(arguments));
+            break;
+        case COMMAND_UNIFORM_1I:
+            glUniform1i(read<GLint>(arguments), read<GLint>(arguments + sizeof(GLint)));
+            break;
+        case COMMAND_UNIFORM_3F: {
+            glm::vec3 value = read<glm::vec3>(arguments + sizeof(GLint));
+            glUniform3fv(read<GLint>(arguments), 1, glm::value_ptr(value));
+            break;
+        }
+        case COMMAND_UNIFORM_MATRIX_4F: {
+            glm::mat4 value = read<glm::mat4>(arguments + sizeof(GLint));
+            glUniformMatrix4fv(read<GLint>(arguments), 1, GL_FALSE, glm::value_ptr(value));
+            break;
+        }
+        case COMMAND_UNIFORM_BLOCK: {
+            GLsizeiptr size = header.size - sizeof(GLuint);
+            RingBuffer::Allocation allocation = ringBuffer.allocateUniforms(size);
+            if (allocation.data == nullptr) break;
+            memcpy(allocation.data, arguments + sizeof(GLuint), size);
+            ringBuffer.flush();
+            glBindBufferRange(GL_UNIFORM_BUFFER, read<GLuint>(arguments), ringBuffer.getBuffer(), allocation.offset, size);
+            break;
+        }
+        case COMMAND_BIND_TEXTURE:
+            glActiveTexture(GL_TEXTURE0 + read<GLuint>(arguments));
+            glBindTexture(GL_TEXTURE_2D, read<GLuint>(arguments + sizeof(GLuint)));
+            break;
+        case COMMAND_BIND_VERTEX_ARRAY:
+            glBindVertexArray(read<GLuint>(arguments));
+            break;
+        case COMMAND_DRAW_ELEMENTS:
+            glDrawElements(GL_TRIANGLES, read<GLsizei>(arguments), GL_UNSIGNED_INT, 0);
+            drawStats.add(read<GLsizei>(arguments));
+            break;
+        }
+    }
+}
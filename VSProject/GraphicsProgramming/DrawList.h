@@ -0,0 +1,186 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <glm/glm.hpp>
+#include "Bounds.h"
+#include "JobSystem.h"
+
+// Everything the scene traversal needs to know about an object to turn it into a draw
+struct SceneObject {
+    // World space bounds
+    AABB bounds;
+    int mesh = 0;
+    int material = 0;
+    // The object has lodCount meshes starting at mesh, every lodDistance units away from the camera uses the next one
+    int lodCount = 1;
+    float lodDistance = FLT_MAX;
+};
+
+struct DrawPacket {
+    // Material in the high bits so state changes are minimized, then front to back within a material
+    uint64_t sortKey;
+    uint32_t object;
+    uint32_t mesh;
+};
+
+// Builds the sorted draw list of a frame on all threads of a JobSystem.
+// Every thread culls, selects LODs and generates sort keys for the chunks it takes and writes the packets into
+// its own list, so no thread ever waits for another one. The per thread lists keep their memory between frames.
+// The lists are then sorted and merged in parallel: splitters sampled from all lists cut the key range into
+// one partition per thread and every partition is merged on its own.
+// Packets are ordered by sort key and object index, which is unique, so the result is the same for any thread
+// count and any distribution of work between the threads.
+class DrawListBuilder {
+public:
+    struct Stats {
+        int visibleObjects = 0;
+        double buildMilliseconds = 0.0;
+        double mergeMilliseconds = 0.0;
+    };
+
+private:
+    JobSystem& jobs;
+    std::vector<std::vector<DrawPacket>> threadLists;
+    std::vector<DrawPacket> drawList;
+    Stats stats;
+
+    // Merge state, kept between frames so merging does not allocate
+    std::vector<DrawPacket> samples;
+    std::vector<DrawPacket> splitters;
+    // Start of every partition in every thread list, partitionCount + 1 rows of one entry per list
+    std::vector<size_t> partitionStarts;
+    struct MergeState {
+        // Lists that still have packets in the partition, as a heap ordered by their next packet
+        std::vector<int> heap;
+        std::vector<size_t> cursors;
+    };
+    std::vector<MergeState> mergeStates;
+
+    static bool comesBefore(const DrawPacket& a, const DrawPacket& b) {
+        if (a.sortKey != b.sortKey) return a.sortKey < b.sortKey;
+        return a.object < b.object;
+    }
+
+    void merge();
+
+public:
+    // Objects handled per job, small enough to balance, large enough to hide the stealing overhead
+    static const int GRAIN_SIZE = 256;
+
+    DrawListBuilder(JobSystem& jobs) : jobs(jobs), threadLists(jobs.getThreadCount()) {}
+
+    const std::vector<DrawPacket>& build(const std::vector<SceneObject>& objects, const glm::mat4& viewProjection, const glm::vec3& cameraPosition);
+
+    const std::vector<DrawPacket>& getDrawList() const { return drawList; }
+    const Stats& getStats() const { return stats; }
+};
+
+const std::vector<DrawPacket>& DrawListBuilder::build(const std::vector<SceneObject>& objects, const glm::mat4& viewProjection, const glm::vec3& cameraPosition) {
+    auto start = std::chrono::high_resolution_clock::now();
+    Frustum frustum(viewProjection);
+
+    for (auto& list : threadLists)
+        list.clear();
+
+    jobs.parallelForRange((int)objects.size(), GRAIN_SIZE, [&](int begin, int end, int thread) {
+        std::vector<DrawPacket>& list = threadLists[thread];
+        for (int i = begin; i < end; ++i) {
+            const SceneObject& object = objects[i];
+            if (!frustum.intersects(object.bounds)) continue;
+
+            float distance = glm::length(object.bounds.center() - cameraPosition);
+            int lod = std::min((int)(distance / object.lodDistance), object.lodCount - 1);
+
+            // 16 bits material, 16 bits mesh, 32 bits depth (positive floats sort like their bit patterns)
+            uint32_t depthBits;
+            memcpy(&depthBits, &distance, sizeof(depthBits));
+            DrawPacket packet;
+            packet.mesh = (uint32_t)(object.mesh + lod);
+            packet.sortKey = (uint64_t)(object.material & 0xFFFF) << 48 | (uint64_t)(packet.mesh & 0xFFFF) << 32 | depthBits;
+            packet.object = (uint32_t)i;
+            list.push_back(packet);
+        }
+    });
+    jobs.parallelFor((int)threadLists.size(), [&](int thread) {
+        std::sort(threadLists[thread].begin(), threadLists[thread].end(), comesBefore);
+    });
+    auto built = std::chrono::high_resolution_clock::now();
+
+    merge();
+    auto merged = std::chrono::high_resolution_clock::now();
+
+    stats.visibleObjects = (int)drawList.size();
+    stats.buildMilliseconds = std::chrono::duration<double, std::milli>(built - start).count();
+    stats.mergeMilliseconds = std::chrono::duration<double, std::milli>(merged - built).count();
+    return drawList;
+}
+
+void DrawListBuilder::merge() {
+    int listCount = (int)threadLists.size();
+    size_t total = 0;
+    for (const auto& list : threadLists)
+        total += list.size();
+    drawList.resize(total);
+
+    // Evenly spaced samples of every sorted list give splitters that balance the partitions
+    samples.clear();
+    for (const auto& list : threadLists)
+        for (int sample = 1; sample <= listCount && !list.empty(); ++sample)
+            samples.push_back(list[list.size() * sample / (listCount + 1)]);
+    std::sort(samples.begin(), samples.end(), comesBefore);
+
+    splitters.clear();
+    for (int partition = 1; partition < listCount && !samples.empty(); ++partition)
+        splitters.push_back(samples[samples.size() * partition / listCount]);
+    int partitionCount = (int)splitters.size() + 1;
+
+    partitionStarts.resize((partitionCount + 1) * listCount);
+    for (int list = 0; list < listCount; ++list) {
+        const std::vector<DrawPacket>& packets = threadLists[list];
+        partitionStarts[list] = 0;
+        for (int partition = 1; partition < partitionCount; ++partition) {
+            auto split = std::lower_bound(packets.begin(), packets.end(), splitters[partition - 1], comesBefore);
+            partitionStarts[partition * listCount + list] = split - packets.begin();
+        }
+        partitionStarts[partitionCount * listCount + list] = packets.size();
+    }
+
+    if ((int)mergeStates.size() < partitionCount)
+        mergeStates.resize(partitionCount);
+
+    jobs.parallelFor(partitionCount, [&](int partition) {
+        const size_t* starts = &partitionStarts[partition * listCount];
+        const size_t* ends = &partitionStarts[(partition + 1) * listCount];
+
+        // Everything before this partition in all lists comes before it in the output
+        size_t output = 0;
+        for (int list = 0; list < listCount; ++list)
+            output += starts[list];
+
+        std::vector<int>& heap = mergeStates[partition].heap;
+        std::vector<size_t>& cursor = mergeStates[partition].cursors;
+        heap.clear();
+        cursor.resize(listCount);
+        for (int list = 0; list < listCount; ++list) {
+            cursor[list] = starts[list];
+            if (starts[list] < ends[list])
+                heap.push_back(list);
+        }
+
+        auto later = [&](int a, int b) { return comesBefore(threadLists[b][cursor[b]], threadLists[a][cursor[a]]); };
+        std::make_heap(heap.begin(), heap.end(), later);
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            int list = heap.back();
+            drawList[output++] = threadLists[list][cursor[list]++];
+            if (cursor[list] < ends[list])
+                std::push_heap(heap.begin(), heap.end(), later);
+            else
+                heap.pop_back();
+        }
+    });
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Draw calls and triangles sent to GL, counted next to every draw call.
+// The render thread draws as well, so the counters are atomic.
+struct DrawStats {
+    std::atomic<int> drawCalls{ 0 };
+    std::atomic<int64_t> triangles{ 0 };
+
+    void add(int64_t indexCount) {
+        drawCalls.fetch_add(1, std::memory_order_relaxed);
+        triangles.fetch_add(indexCount / 3, std::memory_order_relaxed);
+    }
+
+    void reset() {
+        drawCalls.store(0, std::memory_order_relaxed);
+        triangles.store(0, std::memory_order_relaxed);
+    }
+};
+
+DrawStats drawStats;
@@ -0,0 +1,472 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
+#include <glm/glm.hpp>
+#include "Bounds.h"
+
+// Dynamic bounding volume hierarchy over moving objects, for culling, picking and proximity queries.
+// Every object is a leaf, its proxy, with fattened bounds: the tight bounds grown by a margin and by the predicted
+// motion, so small movements do not touch the tree. A proxy that leaves its fat bounds is removed and inserted
+// again, next to the sibling with the smallest increase of the surface area heuristic (SAH) cost, found by a
+// descent that prunes subtrees with a lower bound of their cost. Reinsertions slowly degrade the tree, so rebuildIfDegraded builds it again top
+// down with binned SAH once its cost has grown too much. Proxy IDs stay the same across rebuilds.
+// Queries only read the nodes and walk the tree through parent links without a stack, so any number of threads can
+// query at the same time without locks or allocations. Writes have to happen while nobody queries.
+class DynamicBVH {
+public:
+    static const int NULL_NODE = -1;
+    // Fat bounds extend this many frames of the displacement passed to moveProxy
+    static constexpr float DISPLACEMENT_FRAMES = 2.0f;
+    static const int SAH_BINS = 16;
+
+    struct Stats {
+        int proxies = 0;
+        int internalNodes = 0;
+        int height = 0;
+        // Sum of the internal node surface areas relative to the root, lower is better
+        float cost = 0.0f;
+        // Since the last resetStats
+        int moves = 0;
+        int reinsertions = 0;
+        int rebuilds = 0;
+        double rebuildMilliseconds = 0.0;
+    };
+
+private:
+    struct Node {
+        // Fat bounds for leaves
+        AABB bounds;
+        // Next free node while the node is unused
+        int parent = NULL_NODE;
+        int children[2] = { NULL_NODE, NULL_NODE };
+        // 0 for leaves, -1 for free nodes
+        int height = -1;
+        uint32_t object = 0;
+
+        bool isLeaf() const { return children[0] == NULL_NODE; }
+    };
+
+    std::vector<Node> nodes;
+    int root = NULL_NODE;
+    int firstFreeNode = NULL_NODE;
+    float margin;
+    float rebuildRatio;
+    // Cost of the tree after the last rebuild, 0 before the first one
+    float rebuiltCost = 0.0f;
+    bool changedSinceCheck = false;
+    Stats stats;
+
+    // Scratch memory of the writer, kept between calls
+    std::vector<int> leaves;
+    std::vector<glm::vec3> centroids;
+
+    static AABB combine(const AABB& a, const AABB& b) {
+        return AABB(glm::min(a.min, b.min), glm::max(a.max, b.max));
+    }
+
+    int allocateNode();
+    void freeNode(int node);
+    int findBestSibling(const AABB& bounds);
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+    // Recomputes bounds and heights from the node up to the root
+    void refit(int node);
+    int build(int begin, int end, int parent);
+    float computeCost() const;
+
+    // Walks every node for which enter(node) is true and calls leaf(object) for the leaves among them.
+    // enter can return 2 to accept the whole subtree without calling enter for the nodes in it.
+    template<typename Enter, typename Leaf>
+    void traverse(Enter enter, Leaf leaf) const;
+
+public:
+    DynamicBVH(float margin = 0.5f, float rebuildRatio = 1.3f) : margin(margin), rebuildRatio(rebuildRatio) {}
+
+    // Returns the proxy of the object, tight bounds
+    int createProxy(const AABB& bounds, uint32_t object);
+    void destroyProxy(int proxy);
+    // Updates the tight bounds, displacement is the motion since the last frame. Returns true when the proxy left its
+    // fat bounds and was reinserted.
+    bool moveProxy(int proxy, const AABB& bounds, const glm::vec3& displacement = glm::vec3(0.0f));
+    const AABB& getFatBounds(int proxy) const { return nodes[proxy].bounds; }
+    uint32_t getObject(int proxy) const { return nodes[proxy].object; }
+    void setObject(int proxy, uint32_t object) { nodes[proxy].object = object; }
+    void reserve(size_t proxies);
+
+    // Rebuilds when the cost has grown by rebuildRatio since the last rebuild, once per frame after the moves.
+    // The first call always rebuilds. Returns true when it rebuilt.
+    bool rebuildIfDegraded();
+    void rebuild();
+
+    // callback(object) for every proxy whose fat bounds intersect the frustum
+    template<typename Callback>
+    void queryFrustum(const Frustum& frustum, Callback callback) const;
+    // callback(object) for every proxy whose fat bounds are within radius of the center
+    template<typename Callback>
+    void querySphere(const glm::vec3& center, float radius, Callback callback) const;
+    // callback(object, maxDistance) for every proxy whose fat bounds the ray hits before maxDistance. The callback
+    // returns the distance of its own hit test or maxDistance, nodes beyond the returned distance are skipped.
+    // Returns the final maxDistance. The direction has to be normalized.
+    template<typename Callback>
+    float raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, Callback callback) const;
+
+    const Stats& getStats() const { return stats; }
+    void resetStats();
+};
+
+int DynamicBVH::allocateNode() {
+    int node;
+    if (firstFreeNode != NULL_NODE) {
+        node = firstFreeNode;
+        firstFreeNode = nodes[node].parent;
+    }
+    else {
+        node = (int)nodes.size();
+        nodes.push_back(Node());
+    }
+    nodes[node] = Node();
+    nodes[node].height = 0;
+    return node;
+}
+
+void DynamicBVH::freeNode(int node) {
+    nodes[node].height = -1;
+    nodes[node].parent = firstFreeNode;
+    firstFreeNode = node;
+}
+
+void DynamicBVH::reserve(size_t proxies) {
+    // A binary tree with n leaves has n - 1 internal nodes
+    nodes.reserve(proxies * 2);
+    leaves.reserve(proxies);
+    centroids.reserve(proxies);
+}
+
+int DynamicBVH::findBestSibling(const AABB& bounds) {
+    // Cost of a sibling: the area of the new parent plus the area every ancestor grows by, the inherited cost.
+    // A subtree can not do better than the area of the new leaf plus the cost inherited by its root, so the search
+    // descends into the child with the lower bound and stops when no child can beat the best sibling so far.
+    float leafArea = bounds.surfaceArea();
+    int best = root;
+    float bestCost = combine(nodes[root].bounds, bounds).surfaceArea();
+    float inheritedCost = 0.0f;
+
+    int index = root;
+    while (!nodes[index].isLeaf()) {
+        const Node& node = nodes[index];
+        float combinedArea = combine(node.bounds, bounds).surfaceArea();
+        if (combinedArea + inheritedCost < bestCost) {
+            best = index;
+            bestCost = combinedArea + inheritedCost;
+        }
+        inheritedCost += combinedArea - node.bounds.surfaceArea();
+
+        float lowerBounds[2];
+        for (int i = 0; i < 2; ++i) {
+            const Node& child = nodes[node.children[i]];
+            float childCombinedArea = combine(child.bounds, bounds).surfaceArea();
+            if (child.isLeaf()) {
+                if (childCombinedArea + inheritedCost < bestCost) {
+                    best = node.children[i];
+                    bestCost = childCombinedArea + inheritedCost;
+                }
+                lowerBounds[i] = FLT_MAX;
+            }
+            else
+                lowerBounds[i] = inheritedCost + childCombinedArea - child.bounds.surfaceArea() + leafArea;
+        }
+
+        if (bestCost <= lowerBounds[0] && bestCost <= lowerBounds[1])
+            break;
+        index = lowerBounds[0] <= lowerBounds[1] ? node.children[0] : node.children[1];
+    }
+    return best;
+}
+
+void DynamicBVH::insertLeaf(int leaf) {
+    changedSinceCheck = true;
+    if (root == NULL_NODE) {
+        root = leaf;
+        nodes[leaf].parent = NULL_NODE;
+        return;
+    }
+
+    int sibling = findBestSibling(nodes[leaf].bounds);
+    int oldParent = nodes[sibling].parent;
+    int newParent = allocateNode();
+    nodes[newParent].parent = oldParent;
+    nodes[newParent].children[0] = sibling;
+    nodes[newParent].children[1] = leaf;
+    nodes[sibling].parent = newParent;
+    nodes[leaf].parent = newParent;
+
+    if (oldParent == NULL_NODE)
+        root = newParent;
+    else if (nodes[oldParent].children[0] == sibling)
+        nodes[oldParent].children[0] = newParent;
+    else
+        nodes[oldParent].children[1] = newParent;
+    refit(newParent);
+}
+
+void DynamicBVH::removeLeaf(int leaf) {
+    changedSinceCheck = true;
+    if (leaf == root) {
+        root = NULL_NODE;
+        return;
+    }
+
+    // The sibling takes the place of the parent
+    int parent = nodes[leaf].parent;
+    int grandParent = nodes[parent].parent;
+    int sibling = nodes[parent].children[0] == leaf ? nodes[parent].children[1] : nodes[parent].children[0];
+    nodes[sibling].parent = grandParent;
+    freeNode(parent);
+
+    if (grandParent == NULL_NODE) {
+        root = sibling;
+        return;
+    }
+    if (nodes[grandParent].children[0] == parent)
+        nodes[grandParent].children[0] = sibling;
+    else
+        nodes[grandParent].children[1] = sibling;
+    refit(grandParent);
+}
+
+void DynamicBVH::refit(int node) {
+    while (node != NULL_NODE) {
+        Node& current = nodes[node];
+        const Node& left = nodes[current.children[0]];
+        const Node& right = nodes[current.children[1]];
+        current.bounds = combine(left.bounds, right.bounds);
+        current.height = 1 + std::max(left.height, right.height);
+        node = current.parent;
+    }
+}
+
+int DynamicBVH::createProxy(const AABB& bounds, uint32_t object) {
+    int proxy = allocateNode();
+    nodes[proxy].bounds = AABB(bounds.min - glm::vec3(margin), bounds.max + glm::vec3(margin));
+    nodes[proxy].object = object;
+    insertLeaf(proxy);
+    stats.proxies++;
+    return proxy;
+}
+
+void DynamicBVH::destroyProxy(int proxy) {
+    removeLeaf(proxy);
+    freeNode(proxy);
+    stats.proxies--;
+}
+
+bool DynamicBVH::moveProxy(int proxy, const AABB& bounds, const glm::vec3& displacement) {
+    stats.moves++;
+    if (nodes[proxy].bounds.contains(bounds))
+        return false;
+
+    removeLeaf(proxy);
+    // Grow towards the motion so steadily moving objects stay inside for a few frames
+    AABB fat(bounds.min - glm::vec3(margin), bounds.max + glm::vec3(margin));
+    glm::vec3 predicted = displacement * DISPLACEMENT_FRAMES;
+    fat.min += glm::min(predicted, glm::vec3(0.0f));
+    fat.max += glm::max(predicted, glm::vec3(0.0f));
+    nodes[proxy].bounds = fat;
+    insertLeaf(proxy);
+    stats.reinsertions++;
+    return true;
+}
+
+float DynamicBVH::computeCost() const {
+    if (root == NULL_NODE) return 0.0f;
+    float area = 0.0f;
+    for (const Node& node : nodes)
+        if (node.height > 0)
+            area += node.bounds.surfaceArea();
+    return area / std::max(nodes[root].bounds.surfaceArea(), FLT_MIN);
+}
+
+bool DynamicBVH::rebuildIfDegraded() {
+    stats.internalNodes = root == NULL_NODE ? 0 : stats.proxies - 1;
+    stats.height = root == NULL_NODE ? 0 : nodes[root].height;
+    if (!changedSinceCheck) return false;
+    changedSinceCheck = false;
+    stats.cost = computeCost();
+    if (rebuiltCost > 0.0f && stats.cost <= rebuiltCost * rebuildRatio)
+        return false;
+    rebuild();
+    return true;
+}
+
+void DynamicBVH::rebuild() {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Keep the leaves, they are the proxy IDs, and throw the internal nodes away
+    leaves.clear();
+    for (int node = 0; node < (int)nodes.size(); ++node) {
+        if (nodes[node].height == 0)
+            leaves.push_back(node);
+        else if (nodes[node].height > 0)
+            freeNode(node);
+    }
+    centroids.resize(nodes.size());
+    for (int leaf : leaves)
+        centroids[leaf] = nodes[leaf].bounds.center();
+
+    root = leaves.empty() ? NULL_NODE : build(0, (int)leaves.size(), NULL_NODE);
+
+    stats.cost = rebuiltCost = computeCost();
+    stats.height = root == NULL_NODE ? 0 : nodes[root].height;
+    stats.rebuilds++;
+    stats.rebuildMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    changedSinceCheck = false;
+}
+
+int DynamicBVH::build(int begin, int end, int parent) {
+    if (end - begin == 1) {
+        int leaf = leaves[begin];
+        nodes[leaf].parent = parent;
+        return leaf;
+    }
+
+    AABB centroidBounds;
+    for (int i = begin; i < end; ++i)
+        centroidBounds.expand(centroids[leaves[i]]);
+    glm::vec3 size = centroidBounds.max - centroidBounds.min;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+    int middle = begin + (end - begin) / 2;
+    if (size[axis] > 0.0f) {
+        // Bin the centroids along the longest axis and take the plane between two bins with the lowest SAH cost
+        AABB binBounds[SAH_BINS];
+        int binCounts[SAH_BINS] = {};
+        float scale = SAH_BINS * 0.9999f / size[axis];
+        for (int i = begin; i < end; ++i) {
+            int bin = (int)((centroids[leaves[i]][axis] - centroidBounds.min[axis]) * scale);
+            binCounts[bin]++;
+            binBounds[bin].expand(nodes[leaves[i]].bounds);
+        }
+
+        float rightCosts[SAH_BINS] = {};
+        AABB rightBounds;
+        int rightCount = 0;
+        for (int bin = SAH_BINS - 1; bin > 0; --bin) {
+            rightBounds.expand(binBounds[bin]);
+            rightCount += binCounts[bin];
+            rightCosts[bin] = rightCount > 0 ? rightCount * rightBounds.surfaceArea() : 0.0f;
+        }
+        AABB leftBounds;
+        int leftCount = 0;
+        int bestBin = -1;
+        float bestCost = FLT_MAX;
+        for (int bin = 1; bin < SAH_BINS; ++bin) {
+            leftBounds.expand(binBounds[bin - 1]);
+            leftCount += binCounts[bin - 1];
+            if (leftCount == 0 || leftCount == end - begin) continue;
+            float cost = leftCount * leftBounds.surfaceArea() + rightCosts[bin];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestBin = bin;
+            }
+        }
+
+        if (bestBin > 0) {
+            float minimum = centroidBounds.min[axis];
+            middle = (int)(std::partition(leaves.begin() + begin, leaves.begin() + end, [&](int leaf) {
+                return (int)((centroids[leaf][axis] - minimum) * scale) < bestBin;
+            }) - leaves.begin());
+        }
+        else {
+            std::nth_element(leaves.begin() + begin, leaves.begin() + middle, leaves.begin() + end, [&](int a, int b) {
+                return centroids[a][axis] < centroids[b][axis];
+            });
+        }
+    }
+
+    int node = allocateNode();
+    int left = build(begin, middle, node);
+    int right = build(middle, end, node);
+    Node& current = nodes[node];
+    current.parent = parent;
+    current.children[0] = left;
+    current.children[1] = right;
+    current.bounds = combine(nodes[left].bounds, nodes[right].bounds);
+    current.height = 1 + std::max(nodes[left].height, nodes[right].height);
+    return node;
+}
+
+void DynamicBVH::resetStats() {
+    stats.moves = 0;
+    stats.reinsertions = 0;
+    stats.rebuilds = 0;
+    stats.rebuildMilliseconds = 0.0;
+}
+
+template<typename Enter, typename Leaf>
+void DynamicBVH::traverse(Enter enter, Leaf leaf) const {
+    // Stackless: coming from the parent tests the node and descends, coming from the first child goes to the
+    // second one, coming from the second child goes up
+    int current = root;
+    int previous = NULL_NODE;
+    // Root of the subtree that is accepted without tests
+    int acceptedRoot = NULL_NODE;
+    while (current != NULL_NODE) {
+        const Node& node = nodes[current];
+        int next;
+        if (previous == node.parent) {
+            int result = acceptedRoot != NULL_NODE ? 2 : enter(node.bounds);
+            if (result == 0)
+                next = node.parent;
+            else if (node.isLeaf()) {
+                leaf(node.object);
+                next = node.parent;
+            }
+            else {
+                if (result == 2 && acceptedRoot == NULL_NODE)
+                    acceptedRoot = current;
+                next = node.children[0];
+            }
+        }
+        else if (previous == node.children[0])
+            next = node.children[1];
+        else
+            next = node.parent;
+
+        if (next == node.parent && current == acceptedRoot)
+            acceptedRoot = NULL_NODE;
+        previous = current;
+        current = next;
+    }
+}
+
+template<typename Callback>
+void DynamicBVH::queryFrustum(const Frustum& frustum, Callback callback) const {
+    traverse([&frustum](const AABB& bounds) {
+        if (!frustum.intersects(bounds)) return 0;
+        return frustum.contains(bounds) ? 2 : 1;
+    }, callback);
+}
+
+template<typename Callback>
+void DynamicBVH::querySphere(const glm::vec3& center, float radius, Callback callback) const {
+    float radiusSquared = radius * radius;
+    traverse([&](const AABB& bounds) {
+        glm::vec3 offset = center - glm::clamp(center, bounds.min, bounds.max);
+        return glm::dot(offset, offset) <= radiusSquared ? 1 : 0;
+    }, callback);
+}
+
+template<typename Callback>
+float DynamicBVH::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, Callback callback) const {
+    glm::vec3 inverseDirection = inverseRayDirection(direction);
+    traverse([&](const AABB& bounds) {
+        float distance;
+        return bounds.intersectsRay(origin, inverseDirection, maxDistance, distance) ? 1 : 0;
+    }, [&](uint32_t object) {
+        maxDistance = std::min(maxDistance, callback(object, maxDistance));
+    });
+    return maxDistance;
+}
@@ -0,0 +1,260 @@
+#pragma once
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <glad/glad.h>
+#include "DrawStats.h"
+
+// Dynamic resolution scaling. The scene is rendered into an offscreen target at a fraction of the output size
+// and upscaled to the output framebuffer with a sharpening filter.
+// The GPU time of every frame is measured with two GL_TIMESTAMP queries, read GPU_LATENCY frames later so the CPU
+// never waits for them. Every ADJUST_INTERVAL frames a controller compares the average with the budget: it lowers the
+// scale at once when the frames are over budget and raises it in small steps when there is plenty of headroom.
+// The target is allocated at the full output size, changing the scale only changes the viewport.
+class DynamicResolution {
+public:
+    static const int GPU_LATENCY = 3;
+    static const int ADJUST_INTERVAL = 8;
+    static constexpr float MIN_SCALE = 0.5f;
+    static constexpr float MAX_SCALE = 1.0f;
+    // Largest change of the scale per adjustment, raising it is slower so it does not oscillate
+    static constexpr float MAX_DECREASE = 0.15f;
+    static constexpr float MAX_INCREASE = 0.05f;
+    // The controller aims for this fraction of the budget, lowers the scale above OVER_BUDGET and raises it below UNDER_BUDGET
+    static constexpr float TARGET_BUDGET = 0.85f;
+    static constexpr float OVER_BUDGET = 0.95f;
+    static constexpr float UNDER_BUDGET = 0.75f;
+
+    enum Decision {
+        DECISION_HOLD,
+        DECISION_DECREASE,
+        DECISION_INCREASE,
+    };
+
+    struct Stats {
+        float scale = MAX_SCALE;
+        int renderWidth = 0;
+        int renderHeight = 0;
+        // Average GPU frame time of the last adjustment interval
+        double gpuMilliseconds = 0.0;
+        Decision lastDecision = DECISION_HOLD;
+        // Decisions since create
+        int decreases = 0;
+        int increases = 0;
+        int holds = 0;
+    };
+
+private:
+    GLuint colorTexture = 0;
+    GLuint depthBuffer = 0;
+    GLuint framebuffer = 0;
+    GLuint program = 0;
+    GLuint emptyVao = 0;
+    GLint renderSizeLocation = -1;
+    GLint outputSizeLocation = -1;
+    GLint sharpnessLocation = -1;
+
+    int targetWidth = 0;
+    int targetHeight = 0;
+    int outputWidth = 0;
+    int outputHeight = 0;
+    GLint outputFramebuffer = 0;
+
+    float budgetMilliseconds = 16.6f;
+    float sharpness = 0.5f;
+
+    GLuint timestampQueries[GPU_LATENCY + 1][2];
+    bool timestampPending[GPU_LATENCY + 1] = {};
+    int frameIndex = 0;
+    // Frames before this one were rendered at an older scale and are not measured
+    int scaleChangeFrame = 0;
+    double intervalMilliseconds = 0.0;
+    int intervalFrames = 0;
+    Stats stats;
+
+    void resizeTarget(int width, int height);
+    void readTimestamps();
+    void adjustScale();
+
+public:
+    // The program is the upscale pass of FullscreenVertexShader and UpscaleFragmentShader
+    bool create(GLuint upscaleProgram, float budgetMilliseconds, float sharpness = 0.5f);
+    void destroy();
+
+    // Binds the scene target with the viewport at the current scale, everything up to endFrame renders into it.
+    // The framebuffer bound before is the output of endFrame.
+    void beginFrame(int outputWidth, int outputHeight);
+    // Upscales the scene into the output framebuffer
+    void endFrame();
+
+    float getBudget() const { return budgetMilliseconds; }
+    int getRenderWidth() const { return stats.renderWidth; }
+    int getRenderHeight() const { return stats.renderHeight; }
+    const Stats& getStats() const { return stats; }
+};
+
+constexpr float DynamicResolution::MIN_SCALE;
+constexpr float DynamicResolution::MAX_SCALE;
+constexpr float DynamicResolution::MAX_DECREASE;
+constexpr float DynamicResolution::MAX_INCREASE;
+constexpr float DynamicResolution::TARGET_BUDGET;
+constexpr float DynamicResolution::OVER_BUDGET;
+constexpr float DynamicResolution::UNDER_BUDGET;
+
+bool DynamicResolution::create(GLuint upscaleProgram, float budgetMilliseconds, float sharpness) {
+    this->budgetMilliseconds = budgetMilliseconds;
+    this->sharpness = sharpness;
+    program = upscaleProgram;
+    renderSizeLocation = glGetUniformLocation(program, "renderSize");
+    outputSizeLocation = glGetUniformLocation(program, "outputSize");
+    sharpnessLocation = glGetUniformLocation(program, "sharpness");
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "sceneTexture"), 0);
+    glUseProgram(0);
+
+    // The core profile needs a vertex array object even when nothing is read from buffers
+    glGenVertexArrays(1, &emptyVao);
+    for (int i = 0; i <= GPU_LATENCY; ++i)
+        glGenQueries(2, timestampQueries[i]);
+
+    glGenTextures(1, &colorTexture);
+    glGenRenderbuffers(1, &depthBuffer);
+    glGenFramebuffers(1, &framebuffer);
+    resizeTarget(1, 1);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+        std::cerr << "Dynamic resolution framebuffer is incomplete" << std::endl;
+    return complete;
+}
+
+void DynamicResolution::destroy() {
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &colorTexture);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    glDeleteVertexArrays(1, &emptyVao);
+    for (int i = 0; i <= GPU_LATENCY; ++i)
+        glDeleteQueries(2, timestampQueries[i]);
+}
+
+void DynamicResolution::resizeTarget(int width, int height) {
+    targetWidth = width;
+    targetHeight = height;
+
+    // Bilinear filtering does the upscale, clamping keeps the edges from wrapping around
+    glBindTexture(GL_TEXTURE_2D, colorTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // The scene uses the stencil buffer, so the target keeps the layout of the default framebuffer
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+}
+
+void DynamicResolution::readTimestamps() {
+    // The oldest slot is reused this frame, its queries were issued GPU_LATENCY frames ago
+    int slot = frameIndex % (GPU_LATENCY + 1);
+    if (!timestampPending[slot]) return;
+    timestampPending[slot] = false;
+    if (frameIndex - (GPU_LATENCY + 1) < scaleChangeFrame) return;
+
+    GLuint available = 0;
+    glGetQueryObjectuiv(timestampQueries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return;
+
+    GLuint64 start = 0, end = 0;
+    glGetQueryObjectui64v(timestampQueries[slot][0], GL_QUERY_RESULT, &start);
+    glGetQueryObjectui64v(timestampQueries[slot][1], GL_QUERY_RESULT, &end);
+    intervalMilliseconds += (end - start) / 1000000.0;
+    intervalFrames++;
+}
+
+void DynamicResolution::adjustScale() {
+    double milliseconds = intervalMilliseconds / intervalFrames;
+    stats.gpuMilliseconds = milliseconds;
+    intervalMilliseconds = 0.0;
+    intervalFrames = 0;
+
+    // The cost mostly follows the pixel count, so the scale changes with the square root of the time ratio
+    float ratio = std::sqrt(budgetMilliseconds * TARGET_BUDGET / (float)std::max(milliseconds, 0.01));
+    float scale = stats.scale;
+    if (milliseconds > budgetMilliseconds * OVER_BUDGET && scale > MIN_SCALE) {
+        scale = std::max(scale * std::max(ratio, 1.0f - MAX_DECREASE), MIN_SCALE);
+        stats.lastDecision = DECISION_DECREASE;
+        stats.decreases++;
+    }
+    else if (milliseconds < budgetMilliseconds * UNDER_BUDGET && scale < MAX_SCALE) {
+        scale = std::min(scale * std::min(ratio, 1.0f + MAX_INCREASE), MAX_SCALE);
+        stats.lastDecision = DECISION_INCREASE;
+        stats.increases++;
+    }
+    else {
+        stats.lastDecision = DECISION_HOLD;
+        stats.holds++;
+    }
+    if (scale != stats.scale)
+        scaleChangeFrame = frameIndex;
+    stats.scale = scale;
+}
+
+void DynamicResolution::beginFrame(int outputWidth, int outputHeight) {
+    readTimestamps();
+    if (intervalFrames >= ADJUST_INTERVAL)
+        adjustScale();
+
+    this->outputWidth = outputWidth;
+    this->outputHeight = outputHeight;
+    if (outputWidth != targetWidth || outputHeight != targetHeight)
+        resizeTarget(outputWidth, outputHeight);
+    stats.renderWidth = std::max((int)(outputWidth * stats.scale + 0.5f), 1);
+    stats.renderHeight = std::max((int)(outputHeight * stats.scale + 0.5f), 1);
+
+    int slot = frameIndex % (GPU_LATENCY + 1);
+    glQueryCounter(timestampQueries[slot][0], GL_TIMESTAMP);
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &outputFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, stats.renderWidth, stats.renderHeight);
+}
+
+void DynamicResolution::endFrame() {
+    glBindFramebuffer(GL_FRAMEBUFFER, outputFramebuffer);
+    glViewport(0, 0, outputWidth, outputHeight);
+
+    // Every output pixel is written, nothing to clear or test
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean stencilTest = glIsEnabled(GL_STENCIL_TEST);
+    GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_STENCIL_TEST);
+    glDisable(GL_CULL_FACE);
+
+    glUseProgram(program);
+    glUniform2f(renderSizeLocation, (float)stats.renderWidth, (float)stats.renderHeight);
+    glUniform2f(outputSizeLocation, (float)outputWidth, (float)outputHeight);
+    glUniform1f(sharpnessLocation, sharpness);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, colorTexture);
+    glBindVertexArray(emptyVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    drawStats.add(3);
+    glBindVertexArray(0);
+
+    if (depthTest) glEnable(GL_DEPTH_TEST);
+    if (stencilTest) glEnable(GL_STENCIL_TEST);
+    if (cullFace) glEnable(GL_CULL_FACE);
+
+    int slot = frameIndex % (GPU_LATENCY + 1);
+    glQueryCounter(timestampQueries[slot][1], GL_TIMESTAMP);
+    timestampPending[slot] = true;
+    frameIndex++;
+}
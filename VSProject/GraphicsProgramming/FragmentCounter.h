@@ -0,0 +1,71 @@
+#pragma once
+#include <glad/glad.h>
+#include "GLExtensions.h"
+
+// Counts the fragment shader invocations of a range of draws with a query.
+// Uses GL_ARB_pipeline_statistics_query when available, otherwise GL_SAMPLES_PASSED, which is the same with
+// early depth testing but does not count fragments that are shaded and then fail the depth test.
+// Like the occlusion queries the results are picked up one frame later and never waited for.
+class FragmentCounter {
+private:
+    GLuint queries[2] = { 0, 0 };
+    bool pending[2] = { false, false };
+    int slot = 0;
+
+    GLuint64 invocations = 0;
+    int frames = 0;
+
+    GLenum target() const { return glExtensions.pipelineStatistics ? GL_FRAGMENT_SHADER_INVOCATIONS_ARB : GL_SAMPLES_PASSED; }
+    void collectResults();
+
+public:
+    void create() { glGenQueries(2, queries); }
+    void destroy() { glDeleteQueries(2, queries); }
+
+    // Only one counter can be active at a time
+    void begin();
+    void end();
+
+    // Average invocations per frame of the results that arrived since the last call
+    double takeAverage();
+
+    static bool isExact() { return glExtensions.pipelineStatistics; }
+};
+
+void FragmentCounter::collectResults() {
+    for (int query = 0; query < 2; ++query) {
+        if (!pending[query]) continue;
+
+        GLuint available = 0;
+        glGetQueryObjectuiv(queries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+
+        GLuint64 result = 0;
+        glGetQueryObjectui64v(queries[query], GL_QUERY_RESULT, &result);
+        pending[query] = false;
+        invocations += result;
+        frames++;
+    }
+}
+
+void FragmentCounter::begin() {
+    // A query that is still not done after two frames is dropped instead of waited for
+    collectResults();
+    pending[slot] = false;
+
+    glBeginQuery(target(), queries[slot]);
+}
+
+void FragmentCounter::end() {
+    glEndQuery(target());
+    pending[slot] = true;
+    slot = 1 - slot;
+}
+
+double FragmentCounter::takeAverage() {
+    collectResults();
+    double average = frames > 0 ? (double)invocations / frames : 0.0;
+    invocations = 0;
+    frames = 0;
+    return average;
+}
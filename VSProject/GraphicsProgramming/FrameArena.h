@@ -0,0 +1,182 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <iostream>
+
+// Linear allocator for data that only lives until the end of the frame, like temporary lists of the render path.
+// Every thread bumps a pointer in its own sub-arena, so allocating is a few instructions without locks, and freeing
+// is a no-op: reset throws everything away at the start of the next frame.
+// An allocation that does not fit goes to the heap and is freed by reset as well. That keeps the program correct but
+// defeats the purpose, so debug builds assert that no frame overflowed and the stats report it.
+class FrameArena {
+public:
+    static const size_t DEFAULT_BYTES_PER_THREAD = 1 << 20;
+    static const int MAX_THREADS = 64;
+
+    struct Stats {
+        // Of the last frame, all threads together
+        size_t usedBytes = 0;
+        int allocations = 0;
+        int overflowAllocations = 0;
+        size_t overflowBytes = 0;
+        // Since create
+        size_t peakBytes = 0;
+        int frames = 0;
+    };
+
+private:
+    struct Overflow {
+        Overflow* next;
+    };
+
+    struct SubArena {
+        unsigned char* memory = nullptr;
+        size_t capacity = 0;
+        size_t used = 0;
+        int allocations = 0;
+        // Heap blocks of the allocations that did not fit, freed by reset
+        Overflow* overflow = nullptr;
+        int overflowAllocations = 0;
+        size_t overflowBytes = 0;
+        // Keep the bump pointers of different threads on different cache lines
+        char padding[64];
+    };
+
+    std::unique_ptr<unsigned char[]> memory;
+    SubArena arenas[MAX_THREADS];
+    int threadCount = 0;
+    std::atomic<int> registeredThreads{ 0 };
+    Stats stats;
+
+    // Sub-arena of the calling thread, threads get one in the order of their first allocation
+    SubArena& getSubArena();
+
+public:
+    // Reserves the memory of threadCount sub-arenas. Threads beyond that count allocate from the heap, at most
+    // MAX_THREADS threads can use the arena.
+    void create(int threadCount, size_t bytesPerThread = DEFAULT_BYTES_PER_THREAD);
+    void destroy();
+
+    // Nothing allocated since the last reset may be used afterwards, only call it while no other thread allocates
+    void reset();
+    void* allocate(size_t size, size_t alignment);
+    // Only gives the memory back when it is the last allocation of the calling thread, like a vector that is freed
+    // right after its last use
+    void deallocate(void* pointer, size_t size);
+
+    const Stats& getStats() const { return stats; }
+};
+
+FrameArena frameArena;
+
+// Allocator of the frame arena for the standard containers. Deallocation is free, memory of a growing container is
+// only reclaimed by the next reset, so reserve the final size where it is known.
+template<typename T>
+class FrameAllocator {
+public:
+    typedef T value_type;
+
+    FrameAllocator() {}
+    template<typename U>
+    FrameAllocator(const FrameAllocator<U>&) {}
+
+    T* allocate(size_t count) { return (T*)frameArena.allocate(count * sizeof(T), alignof(T)); }
+    void deallocate(T* pointer, size_t count) { frameArena.deallocate(pointer, count * sizeof(T)); }
+
+    template<typename U>
+    bool operator==(const FrameAllocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const FrameAllocator<U>&) const { return false; }
+};
+
+// Vector for data that is thrown away by the end of the frame
+template<typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+FrameArena::SubArena& FrameArena::getSubArena() {
+    thread_local int index = -1;
+    if (index < 0) {
+        index = registeredThreads.fetch_add(1);
+        assert(index < MAX_THREADS && "too many threads use the frame arena");
+    }
+    return arenas[index];
+}
+
+void FrameArena::create(int threadCount, size_t bytesPerThread) {
+    this->threadCount = std::min(std::max(threadCount, 1), MAX_THREADS);
+    // Whole cache lines per thread
+    bytesPerThread = (bytesPerThread + 63) & ~(size_t)63;
+    memory.reset(new unsigned char[bytesPerThread * this->threadCount + 64]);
+    unsigned char* base = (unsigned char*)(((uintptr_t)memory.get() + 63) & ~(uintptr_t)63);
+    for (int thread = 0; thread < this->threadCount; ++thread) {
+        arenas[thread].memory = base + bytesPerThread * thread;
+        arenas[thread].capacity = bytesPerThread;
+    }
+}
+
+void FrameArena::destroy() {
+    reset();
+    for (SubArena& arena : arenas) {
+        arena.memory = nullptr;
+        arena.capacity = 0;
+    }
+    memory.reset();
+}
+
+void FrameArena::reset() {
+    stats.usedBytes = 0;
+    stats.allocations = 0;
+    stats.overflowAllocations = 0;
+    stats.overflowBytes = 0;
+    for (SubArena& arena : arenas) {
+        stats.usedBytes += arena.used;
+        stats.allocations += arena.allocations;
+        stats.overflowAllocations += arena.overflowAllocations;
+        stats.overflowBytes += arena.overflowBytes;
+        while (arena.overflow != nullptr) {
+            Overflow* next = arena.overflow->next;
+            ::operator delete(arena.overflow);
+            arena.overflow = next;
+        }
+        arena.used = 0;
+        arena.allocations = 0;
+        arena.overflowAllocations = 0;
+        arena.overflowBytes = 0;
+    }
+    stats.peakBytes = std::max(stats.peakBytes, stats.usedBytes + stats.overflowBytes);
+    stats.frames++;
+
+    // Raise the bytes per thread when this fires
+    assert(stats.overflowAllocations == 0 && "the frame arena overflowed into the heap");
+}
+
+void* FrameArena::allocate(size_t size, size_t alignment) {
+    SubArena& arena = getSubArena();
+    arena.allocations++;
+    size_t start = (arena.used + alignment - 1) & ~(alignment - 1);
+    if (start + size <= arena.capacity) {
+        arena.used = start + size;
+        return arena.memory + start;
+    }
+
+    // The header keeps the block in the list of the arena, it is a multiple of every fundamental alignment
+    const size_t headerSize = alignof(std::max_align_t) > sizeof(Overflow) ? alignof(std::max_align_t) : sizeof(Overflow);
+    Overflow* block = (Overflow*)::operator new(headerSize + size);
+    block->next = arena.overflow;
+    arena.overflow = block;
+    arena.overflowAllocations++;
+    arena.overflowBytes += size;
+    return (unsigned char*)block + headerSize;
+}
+
+void FrameArena::deallocate(void* pointer, size_t size) {
+    SubArena& arena = getSubArena();
+    unsigned char* bytes = (unsigned char*)pointer;
+    if (bytes >= arena.memory && bytes + size == arena.memory + arena.used)
+        arena.used = bytes - arena.memory;
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <cstring>
+#include <iostream>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+// The glad loader only covers OpenGL 3.3 core, newer entry points and extensions are loaded here.
+// Every feature that depends on one of these checks the matching flag and falls back to the 3.3 path.
+
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#define GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT 0x90DF
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_FRAGMENT_SHADER_INVOCATIONS_ARB 0x82F4
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+
+typedef void (APIENTRYP PFNGLMULTIDRAWELEMENTSINDIRECTPROC)(GLenum mode, GLenum type, const void* indirect, GLsizei drawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void* binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+// Layout of a single command in the GL_DRAW_INDIRECT_BUFFER
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+struct GLExtensions {
+    int majorVersion = 3;
+    int minorVersion = 3;
+
+    // GL 4.3 or ARB_multi_draw_indirect together with ARB_shader_draw_parameters (gl_DrawIDARB)
+    bool multiDrawIndirect = false;
+    PFNGLMULTIDRAWELEMENTSINDIRECTPROC glMultiDrawElementsIndirect = nullptr;
+
+    // GL 4.4 or ARB_buffer_storage, needed for persistently mapped buffers
+    bool bufferStorage = false;
+    PFNGLBUFFERSTORAGEPROC glBufferStorage = nullptr;
+
+    // GL 4.6 or ARB_pipeline_statistics_query, only adds query targets
+    bool pipelineStatistics = false;
+
+    // GL 4.1 or ARB_get_program_binary with at least one binary format, used to cache linked programs on disk
+    bool programBinary = false;
+    PFNGLGETPROGRAMBINARYPROC glGetProgramBinary = nullptr;
+    PFNGLPROGRAMBINARYPROC glProgramBinary = nullptr;
+    PFNGLPROGRAMPARAMETERIPROC glProgramParameteri = nullptr;
+
+    // KHR_parallel_shader_compile (or the ARB version), compiles and links run on driver threads
+    bool parallelShaderCompile = false;
+    PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR = nullptr;
+};
+
+GLExtensions glExtensions;
+
+bool hasGLExtension(const char* name) {
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    for (GLint i = 0; i < extensionCount; ++i) {
+        const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (extension != nullptr && strcmp(extension, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool hasGLVersion(int major, int minor) {
+    return glExtensions.majorVersion > major || (glExtensions.majorVersion == major && glExtensions.minorVersion >= minor);
+}
+
+// Has to be called after gladLoadGLLoader with the context current
+void loadGLExtensions() {
+    glGetIntegerv(GL_MAJOR_VERSION, &glExtensions.majorVersion);
+    glGetIntegerv(GL_MINOR_VERSION, &glExtensions.minorVersion);
+
+    if (hasGLVersion(4, 3) || hasGLExtension("GL_ARB_multi_draw_indirect"))
+        glExtensions.glMultiDrawElementsIndirect = (PFNGLMULTIDRAWELEMENTSINDIRECTPROC)glfwGetProcAddress("glMultiDrawElementsIndirect");
+    glExtensions.multiDrawIndirect = glExtensions.glMultiDrawElementsIndirect != nullptr
+        && hasGLVersion(4, 3) && hasGLExtension("GL_ARB_shader_draw_parameters");
+
+    if (hasGLVersion(4, 4) || hasGLExtension("GL_ARB_buffer_storage"))
+        glExtensions.glBufferStorage = (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage");
+    glExtensions.bufferStorage = glExtensions.glBufferStorage != nullptr;
+
+    glExtensions.pipelineStatistics = hasGLVersion(4, 6) || hasGLExtension("GL_ARB_pipeline_statistics_query");
+
+    if (hasGLVersion(4, 1) || hasGLExtension("GL_ARB_get_program_binary")) {
+        glExtensions.glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)glfwGetProcAddress("glGetProgramBinary");
+        glExtensions.glProgramBinary = (PFNGLPROGRAMBINARYPROC)glfwGetProcAddress("glProgramBinary");
+        glExtensions.glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)glfwGetProcAddress("glProgramParameteri");
+    }
+    // Drivers may support the extension without offering any format
+    GLint binaryFormatCount = 0;
+    if (glExtensions.glGetProgramBinary != nullptr)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormatCount);
+    glExtensions.programBinary = glExtensions.glProgramBinary != nullptr && glExtensions.glProgramParameteri != nullptr && binaryFormatCount > 0;
+
+    if (hasGLExtension("GL_KHR_parallel_shader_compile"))
+        glExtensions.glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    else if (hasGLExtension("GL_ARB_parallel_shader_compile"))
+        glExtensions.glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+    glExtensions.parallelShaderCompile = glExtensions.glMaxShaderCompilerThreadsKHR != nullptr;
+
+    std::cout << "OpenGL " << glExtensions.majorVersion << "." << glExtensions.minorVersion
+        << " (" << (const char*)glGetString(GL_RENDERER) << ")" << std::endl;
+}
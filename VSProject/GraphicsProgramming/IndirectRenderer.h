@@ -0,0 +1,223 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "GLExtensions.h"
+#include "Vertex.h"
+#include "RingBuffer.h"
+#include "DrawStats.h"
+
+// Multi draw indirect path (GL 4.3+).
+// Every mesh is packed into one shared vertex and index buffer, the draws of a frame are grouped per
+// material and every group is submitted with a single glMultiDrawElementsIndirect call.
+// The vertex shader finds the model matrix of a draw in a storage buffer through gl_DrawIDARB.
+class IndirectRenderer {
+public:
+    // Draws can only be merged when they use the same program and textures
+    struct Material {
+        GLuint program = 0;
+        GLuint textures[3] = { 0, 0, 0 };
+
+        bool operator<(const Material& other) const {
+            if (program != other.program) return program < other.program;
+            return std::lexicographical_compare(textures, textures + 3, other.textures, other.textures + 3);
+        }
+    };
+
+private:
+    struct MeshRange {
+        GLuint indexCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        int material;
+    };
+
+    struct QueuedDraw {
+        int mesh;
+        glm::mat4 model;
+    };
+
+    std::vector<Vertex> vertices;
+    std::vector<GLuint> indices;
+    std::vector<MeshRange> meshes;
+    std::vector<Material> materials;
+    std::map<Material, int> materialIndices;
+
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLuint ebo = 0;
+    GLuint indirectBuffer = 0;
+    GLuint drawDataBuffer = 0;
+
+    // Draws of the current frame, one list per material
+    std::vector<std::vector<QueuedDraw>> queuedDraws;
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<glm::mat4> drawData;
+    int submittedCalls = 0;
+
+public:
+    // Copies the mesh into the shared buffers, returns the id used to draw it
+    int addMesh(const std::vector<Vertex>& meshVertices, const std::vector<GLuint>& meshIndices, const Material& material);
+    // Uploads the shared buffers, no meshes can be added afterwards
+    void finalize();
+
+    void draw(int mesh, const glm::mat4& model);
+    // Submits all queued draws, one multi draw call per material.
+    // The commands and per draw data go through the ring buffer when one is given.
+    void submit(RingBuffer* ringBuffer, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& ambientLightColor, const glm::vec3& lightDirection);
+
+    // Number of GL draw calls made by the last submit
+    int getSubmittedCalls() const { return submittedCalls; }
+};
+
+int IndirectRenderer::addMesh(const std::vector<Vertex>& meshVertices, const std::vector<GLuint>& meshIndices, const Material& material) {
+    auto it = materialIndices.find(material);
+    if (it == materialIndices.end()) {
+        it = materialIndices.insert(std::make_pair(material, (int)materials.size())).first;
+        materials.push_back(material);
+        queuedDraws.emplace_back();
+    }
+
+    MeshRange range;
+    range.indexCount = (GLuint)meshIndices.size();
+    range.firstIndex = (GLuint)indices.size();
+    range.baseVertex = (GLint)vertices.size();
+    range.material = it->second;
+
+    vertices.insert(vertices.end(), meshVertices.begin(), meshVertices.end());
+    indices.insert(indices.end(), meshIndices.begin(), meshIndices.end());
+    meshes.push_back(range);
+    return (int)meshes.size() - 1;
+}
+
+void IndirectRenderer::finalize() {
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glGenBuffers(1, &ebo);
+    glGenBuffers(1, &indirectBuffer);
+    glGenBuffers(1, &drawDataBuffer);
+
+    glBindVertexArray(vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+    // Same layout as Model::Mesh
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tangent));
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bitangent));
+
+    glBindVertexArray(0);
+
+    // The GPU has its own copy now
+    vertices = std::vector<Vertex>();
+    indices = std::vector<GLuint>();
+}
+
+void IndirectRenderer::draw(int mesh, const glm::mat4& model) {
+    queuedDraws[meshes[mesh].material].push_back({ mesh, model });
+}
+
+void IndirectRenderer::submit(RingBuffer* ringBuffer, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& ambientLightColor, const glm::vec3& lightDirection) {
+    // Build the commands and per draw data of all materials in one go so they are uploaded once
+    commands.clear();
+    drawData.clear();
+    for (const auto& draws : queuedDraws) {
+        for (const QueuedDraw& draw : draws) {
+            const MeshRange& range = meshes[draw.mesh];
+            commands.push_back({ range.indexCount, 1, range.firstIndex, range.baseVertex, 0 });
+            drawData.push_back(draw.model);
+        }
+    }
+
+    submittedCalls = 0;
+    if (commands.empty()) return;
+
+    // Write the frame data into the ring buffer when there is one, it is never waited on by the driver
+    GLsizeiptr commandBytes = commands.size() * sizeof(DrawElementsIndirectCommand);
+    GLsizeiptr drawDataBytes = drawData.size() * sizeof(glm::mat4);
+    RingBuffer::Allocation commandAllocation;
+    RingBuffer::Allocation drawDataAllocation;
+    if (ringBuffer != nullptr) {
+        commandAllocation = ringBuffer->allocate(commandBytes, sizeof(GLuint));
+        drawDataAllocation = ringBuffer->allocateStorage(drawDataBytes);
+    }
+
+    GLintptr commandOffset = 0;
+    if (commandAllocation.data != nullptr && drawDataAllocation.data != nullptr) {
+        memcpy(commandAllocation.data, commands.data(), commandBytes);
+        memcpy(drawDataAllocation.data, drawData.data(), drawDataBytes);
+        ringBuffer->flush();
+
+        commandOffset = commandAllocation.offset;
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, ringBuffer->getBuffer());
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ringBuffer->getBuffer(), drawDataAllocation.offset, drawDataBytes);
+    }
+    else {
+        // Orphan the buffers every frame so the driver does not have to wait for the previous frame
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, commandBytes, commands.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawDataBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, drawDataBytes, drawData.data(), GL_STREAM_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, drawDataBuffer);
+    }
+
+    glm::vec3 cameraPosition = glm::vec3(glm::inverse(view)[3]);
+    glBindVertexArray(vao);
+
+    GLuint currentProgram = 0;
+    GLuint firstDraw = 0;
+    for (size_t materialIndex = 0; materialIndex < materials.size(); ++materialIndex) {
+        std::vector<QueuedDraw>& draws = queuedDraws[materialIndex];
+        if (draws.empty()) continue;
+
+        const Material& material = materials[materialIndex];
+        if (material.program != currentProgram) {
+            currentProgram = material.program;
+            glUseProgram(currentProgram);
+            glUniformMatrix4fv(glGetUniformLocation(currentProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+            glUniformMatrix4fv(glGetUniformLocation(currentProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+            glUniform3fv(glGetUniformLocation(currentProgram, "ambientLightColor"), 1, glm::value_ptr(ambientLightColor));
+            glUniform3fv(glGetUniformLocation(currentProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
+            glUniform3fv(glGetUniformLocation(currentProgram, "viewPos"), 1, glm::value_ptr(cameraPosition));
+            glUniform1i(glGetUniformLocation(currentProgram, "albedoTexture"), 0);
+            glUniform1i(glGetUniformLocation(currentProgram, "normalTexture"), 1);
+            glUniform1i(glGetUniformLocation(currentProgram, "specularTexture"), 2);
+        }
+
+        for (int unit = 0; unit < 3; ++unit) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_2D, material.textures[unit]);
+        }
+
+        // gl_DrawIDARB restarts at zero for every call, so tell the shader where this group starts
+        glUniform1ui(glGetUniformLocation(currentProgram, "firstDraw"), firstDraw);
+        glExtensions.glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+            (const void*)(commandOffset + firstDraw * sizeof(DrawElementsIndirectCommand)), (GLsizei)draws.size(), 0);
+        GLuint groupIndices = 0;
+        for (size_t i = 0; i < draws.size(); ++i)
+            groupIndices += commands[firstDraw + i].count;
+        drawStats.add(groupIndices);
+
+        firstDraw += (GLuint)draws.size();
+        submittedCalls++;
+        draws.clear();
+    }
+
+    glBindVertexArray(0);
+    glActiveTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+// Small pool of persistent worker threads that can split a loop over all cores.
+// Every thread starts with an equal share of the loop and takes chunks from the front of it. A thread that runs
+// out of work steals the back half of another thread's share, so uneven items do not leave cores idle.
+class JobSystem {
+private:
+    // Remaining part of the loop owned by one thread, begin in the low and end in the high 32 bits so both
+    // can be changed with a single compare and swap
+    struct WorkRange {
+        std::atomic<uint64_t> range{ 0 };
+        // Keep the ranges of different threads on different cache lines
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::condition_variable doneCondition;
+
+    // The loop that is currently being executed, index 0 of the ranges belongs to the calling thread
+    const std::function<void(int, int, int)>* job = nullptr;
+    std::unique_ptr<WorkRange[]> ranges;
+    int grainSize = 1;
+    int busyWorkers = 0;
+    unsigned int generation = 0;
+    bool stopping = false;
+
+    static uint64_t packRange(uint32_t begin, uint32_t end) { return (uint64_t)end << 32 | begin; }
+
+    void workerLoop(int thread);
+    void runJobs(const std::function<void(int, int, int)>& function, int thread);
+    bool popRange(int thread, int& begin, int& end);
+    bool stealRange(int thread, int& begin, int& end);
+
+public:
+    // A negative worker count uses one worker per hardware thread (minus the calling thread)
+    JobSystem(int workerCount = -1);
+    ~JobSystem();
+
+    // Calls function(i) for every i in [0, count) and returns when all calls are done.
+    // The calling thread helps out, so this also works with zero workers.
+    // A template so the std::function below only holds a reference, which fits without a heap allocation.
+    template<typename Function>
+    void parallelFor(int count, const Function& function);
+    // Calls function(begin, end, thread) for chunks of at most grainSize items.
+    // The thread index is in [0, getThreadCount()) and can be used to select per thread data.
+    void parallelForRange(int count, int grainSize, const std::function<void(int, int, int)>& function);
+
+    unsigned int getThreadCount() const { return (unsigned int)workers.size() + 1; }
+};
+
+JobSystem::JobSystem(int workerCount) {
+    if (workerCount < 0) {
+        int hardwareThreads = (int)std::thread::hardware_concurrency();
+        workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+    }
+
+    ranges.reset(new WorkRange[workerCount + 1]);
+    for (int i = 0; i < workerCount; ++i)
+        workers.emplace_back(&JobSystem::workerLoop, this, i + 1);
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+bool JobSystem::popRange(int thread, int& begin, int& end) {
+    std::atomic<uint64_t>& own = ranges[thread].range;
+    uint64_t value = own.load(std::memory_order_acquire);
+    while (true) {
+        uint32_t first = (uint32_t)value;
+        uint32_t last = (uint32_t)(value >> 32);
+        if (first >= last) return false;
+
+        uint32_t split = std::min(first + (uint32_t)grainSize, last);
+        if (own.compare_exchange_weak(value, packRange(split, last), std::memory_order_acq_rel)) {
+            begin = first;
+            end = split;
+            return true;
+        }
+    }
+}
+
+bool JobSystem::stealRange(int thread, int& begin, int& end) {
+    int threadCount = (int)getThreadCount();
+    for (int offset = 1; offset < threadCount; ++offset) {
+        std::atomic<uint64_t>& victim = ranges[(thread + offset) % threadCount].range;
+        uint64_t value = victim.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t first = (uint32_t)value;
+            uint32_t last = (uint32_t)(value >> 32);
+            if (first >= last) break;
+
+            // Take the back half, or everything when only a single chunk is left
+            uint32_t remaining = last - first;
+            uint32_t split = remaining <= (uint32_t)grainSize ? first : last - remaining / 2;
+            if (victim.compare_exchange_weak(value, packRange(first, split), std::memory_order_acq_rel)) {
+                // Run the first chunk right away and publish the rest so it can be stolen again
+                begin = split;
+                end = std::min(split + (uint32_t)grainSize, last);
+                ranges[thread].range.store(packRange(end, last), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void JobSystem::runJobs(const std::function<void(int, int, int)>& function, int thread) {
+    int begin, end;
+    while (popRange(thread, begin, end) || stealRange(thread, begin, end))
+        function(begin, end, thread);
+}
+
+void JobSystem::workerLoop(int thread) {
+    unsigned int seenGeneration = 0;
+    while (true) {
+        const std::function<void(int, int, int)>* currentJob;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping) return;
+
+            seenGeneration = generation;
+            currentJob = job;
+
+            // Woke up too late, the job has already been finished by the others
+            if (currentJob == nullptr) continue;
+            busyWorkers++;
+        }
+
+        runJobs(*currentJob, thread);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busyWorkers--;
+        }
+        doneCondition.notify_one();
+    }
+}
+
+template<typename Function>
+void JobSystem::parallelFor(int count, const Function& function) {
+    parallelForRange(count, 1, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i)
+            function(i);
+    });
+}
+
+void JobSystem::parallelForRange(int count, int grainSize, const std::function<void(int, int, int)>& function) {
+    if (count <= 0) return;
+    grainSize = std::max(grainSize, 1);
+
+    // Not worth waking anyone up for a single chunk
+    if (workers.empty() || count <= grainSize) {
+        for (int begin = 0; begin < count; begin += grainSize)
+            function(begin, std::min(begin + grainSize, count), 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &function;
+        this->grainSize = grainSize;
+
+        // Threads that never get to run have their share stolen by the others
+        int threadCount = (int)getThreadCount();
+        for (int thread = 0; thread < threadCount; ++thread) {
+            uint32_t begin = (uint32_t)((int64_t)count * thread / threadCount);
+            uint32_t end = (uint32_t)((int64_t)count * (thread + 1) / threadCount);
+            ranges[thread].range.store(packRange(begin, end), std::memory_order_relaxed);
+        }
+        generation++;
+    }
+    wakeCondition.notify_all();
+
+    runJobs(function, 0);
+
+    // Wait until every worker that picked up this job has left it
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [&] { return busyWorkers == 0; });
+    job = nullptr;
+}
@@ -6,9 +6,39 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <FastNoiseLite/FastNoiseLite.h>
 #include "Model.h"
+#include "JobSystem.h"
+#include "OcclusionCuller.h"
+#include "GLExtensions.h"
+#include "IndirectRenderer.h"
+#include "RingBuffer.h"
+#include "PerObjectBuffer.h"
+#include "CommandList.h"
+#include "RenderThread.h"
+#include "DrawList.h"
+#include "FragmentCounter.h"
+#include "ClusteredLighting.h"
+#include "ShadowMaps.h"
+#include "ShaderCache.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "DynamicResolution.h"
+#include "TemporalAA.h"
+#include "TextureStreamer.h"
+#include "VirtualTexture.h"
+#include "MaterialTable.h"
+#include "Scene.h"
+#include "FrameArena.h"
+#include "AllocationTracker.h"
+#include "Terrain.h"
+#include "TextFile.h"
 
 #include <fstream>
+#include <cstring>
 
+// Decoded images are counted by the allocation tracker like everything allocated with new
+#define STBI_MALLOC(size) trackedMalloc(size)
+#define STBI_REALLOC(pointer, size) trackedRealloc(pointer, size)
+#define STBI_FREE(pointer) trackedFree(pointer)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <vector>
@@ -19,21 +49,31 @@ struct Mesh {
     GLuint ebo;
     std::vector<Vertex> vertices;
     std::vector<GLuint> indices;
+    PositionStream positions;
 };
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 glm::mat4 updateCameraView();
-int init(GLFWwindow*& window);
-void loadTextFromFile(const char* filename, char*& text);
+int init(GLFWwindow*& window, bool hidden = false, bool osmesa = false);
+bool hasArgument(int argc, char** argv, const char* argument);
+const char* getArgument(int argc, char** argv, const char* argument);
 unsigned int loadTexture(const char* filename);
 void createBox(GLuint& vao, GLuint& ebo, int& size, int& indexCount);
 Mesh createTerrain(int width, int depth, float scale, float amplitude, int seed);
-GLuint compileShader(GLenum shaderType, const char* shaderSource);
-GLuint createShaders(const char* vertexShaderFilename, const char* fragmentShaderFilename);
-void renderSkybox(GLFWwindow* window, GLuint skyboxProgram, GLuint squareVAO, int squareIndexCount, glm::mat4 view, glm::mat4 projection, glm::vec3 lightDirection);
-void renderMesh(GLuint program, const Mesh& mesh, const glm::mat4& modelMatrix, int texture);
+// Programs are owned by the shader cache and deleted with it
+GLuint createShaders(const char* vertexShaderFilename, const char* fragmentShaderFilename, const std::vector<std::string>& defines = std::vector<std::string>());
+void renderSkybox(GLFWwindow* window, GLuint skyboxProgram, GLuint squareVAO, int squareIndexCount, glm::mat4 view, glm::mat4 projection, glm::vec3 lightDirection, bool afterScene = false);
+void renderMesh(GLuint program, const Mesh& mesh, MaterialTable::MaterialId material);
+void recordSkybox(CommandList& commands, GLuint skyboxProgram, const UniformLocations& uniforms, GLuint squareVAO, int squareIndexCount, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightDirection);
+void recordMesh(CommandList& commands, GLuint program, const UniformLocations& uniforms, const Mesh& mesh, MaterialTable::MaterialId material);
+void runUniformBenchmark(GLFWwindow* window, RingBuffer& ringBuffer, GLuint boxVAO, int boxIndexCount);
+void runDrawListBenchmark();
+void runSpatialIndexBenchmark();
+OcclusionCuller::Occluder createOccluder(const Mesh& mesh);
+std::vector<ClusteredLighting::Light> createLights(int count, std::vector<glm::vec3>& origins);
+void animateLights(std::vector<ClusteredLighting::Light>& lights, const std::vector<glm::vec3>& origins, float time);
 
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
@@ -48,13 +88,48 @@ float pitch = 0.0f;
 float yaw = -90.0f;
 bool firstMouse = true;
 
-int main() {
+ShaderCache shaderCache;
+
+int main(int argc, char** argv) {
+    // Pure CPU benchmark, does not need a window
+    if (hasArgument(argc, argv, "--bench-draw-lists")) {
+        runDrawListBenchmark();
+        return 0;
+    }
+    if (hasArgument(argc, argv, "--bench-bvh")) {
+        runSpatialIndexBenchmark();
+        return 0;
+    }
+
+    // Compares two stored benchmark results without rendering anything, fails on a regression
+    const char* comparedResult = getArgument(argc, argv, "--benchmark-compare");
+    const char* baselineResult = getArgument(argc, argv, "--benchmark-baseline");
+    const char* tolerance = getArgument(argc, argv, "--benchmark-tolerance");
+    double regressionTolerance = tolerance != nullptr ? atof(tolerance) : 0.1;
+    if (comparedResult != nullptr) {
+        if (baselineResult == nullptr) {
+            std::cout << "--benchmark-compare needs --benchmark-baseline" << std::endl;
+            return 1;
+        }
+        return Benchmark::compare(comparedResult, baselineResult, regressionTolerance) ? 0 : 1;
+    }
+
+    // Headless benchmark, renders a camera path offscreen in a hidden window.
+    // --osmesa creates a software context, so it also runs on machines without a GPU.
+    bool benchmark = hasArgument(argc, argv, "--benchmark");
+
     GLFWwindow* window;
-    int res = init(window);
+    int res = init(window, benchmark, hasArgument(argc, argv, "--osmesa"));
     if (res != 0) return res;
 
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    // Transient memory of the frame for the main thread, the job workers and the render thread
+    frameArena.create((int)std::thread::hardware_concurrency() + 1);
+    shaderCache.create("ShaderCache");
+    materialTable.create();
+    if (!benchmark) {
+        glfwSetCursorPosCallback(window, mouse_callback);
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
 
     GLuint squareVAO;
     GLuint squareEBO;
@@ -62,22 +137,63 @@ int main() {
     int squareIndexCount;
     createBox(squareVAO, squareEBO, squareSize, squareIndexCount);
 
-    // Create shaders and get the program ID
-    GLuint simpleMaterialProgram = createShaders(
+    // Start building all programs, the driver compiles them while the assets are loaded
+    GLuint simpleMaterialProgram = shaderCache.requestProgram(
         "Shaders/SimpleVertexShader.shader",
         "Shaders/SimpleFragmentShader.shader"
     );
-    GLuint complexMaterialProgram = createShaders(
+    GLuint complexMaterialProgram = shaderCache.requestProgram(
         "Shaders/ComplexVertexShader.shader",
         "Shaders/ComplexFragmentShader.shader"
     );
-    GLuint skyboxProgram = createShaders(
+    GLuint skyboxProgram = shaderCache.requestProgram(
         "Shaders/SkyVertexShader.shader",
         "Shaders/SkyFragmentShader.shader"
     );
+    GLuint proxyProgram = shaderCache.requestProgram(
+        "Shaders/ProxyVertexShader.shader",
+        "Shaders/ProxyFragmentShader.shader"
+    );
+    GLuint depthProgram = shaderCache.requestProgram(
+        "Shaders/DepthVertexShader.shader",
+        "Shaders/DepthFragmentShader.shader"
+    );
+    // Mip streaming of the textures, only the small levels are uploaded now and the rest follows as the draws need it.
+    // The uploads need the context, so it does not work with the render thread.
+    bool streamTextures = hasArgument(argc, argv, "--stream-textures");
+    if (streamTextures && hasArgument(argc, argv, "--render-thread")) {
+        std::cout << "Texture streaming does not work with --render-thread, ignoring it" << std::endl;
+        streamTextures = false;
+    }
+    TextureStreamer textureStreamer;
+    if (streamTextures) {
+        const char* uploadBudget = getArgument(argc, argv, "--texture-upload-budget");
+        const char* memoryBudget = getArgument(argc, argv, "--texture-memory-budget");
+        textureStreamer.create((size_t)((uploadBudget != nullptr ? atof(uploadBudget) : 2.0) * 1024 * 1024),
+            (size_t)((memoryBudget != nullptr ? atof(memoryBudget) : 64.0) * 1024 * 1024));
+    }
+
+    // Material textures of the backpack packed into texture arrays, so all its meshes are drawn together.
+    // The record and indirect paths bind single textures per mesh.
+    bool textureArrays = hasArgument(argc, argv, "--texture-arrays");
+    if (textureArrays && (streamTextures || hasArgument(argc, argv, "--render-thread") || hasArgument(argc, argv, "--multi-draw"))) {
+        std::cout << "Texture arrays do not work with --stream-textures, --render-thread and --multi-draw, ignoring it" << std::endl;
+        textureArrays = false;
+    }
+    std::vector<std::string> backpackDefines;
+    if (textureArrays)
+        backpackDefines.push_back("TEXTURE_ARRAYS");
+    GLuint backpackProgram = complexMaterialProgram;
+    if (textureArrays) {
+        backpackProgram = shaderCache.requestProgram(
+            "Shaders/ComplexVertexShader.shader",
+            "Shaders/ComplexFragmentShader.shader",
+            backpackDefines
+        );
+    }
 
     // Load texture
-    unsigned int terrainTex = loadTexture("Textures/Terrain.jpg");
+    unsigned int terrainTex = streamTextures ? textureStreamer.load("Textures/Terrain.jpg") : loadTexture("Textures/Terrain.jpg");
 
     glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
     glEnable(GL_STENCIL_TEST);
@@ -85,67 +201,926 @@ int main() {
     glStencilMask(0xFF);
 
 
-    glm::mat4 world = glm::mat4(1.0f);
-
     glm::mat4 projection = glm::perspective(45.0f, SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
 
     glm::vec3 ambientLightColor = glm::vec3(0.2f, 0.2f, 0.2f);
     glm::vec3 lightDirection = glm::normalize(glm::vec3(1.0f, -1.0f, 0.0f));
 
+    allocationTracker.setPhase(ALLOCATION_TERRAIN);
     Mesh terrainMesh = createTerrain(100, 100, 10.0f, 2.0f, 1000);
-    Model backpack = Model("Models/backpack/backpack.obj", complexMaterialProgram);
+    allocationTracker.setPhase(ALLOCATION_MODELS);
+    Model backpack = Model("Models/backpack/backpack.obj", backpackProgram, streamTextures ? &textureStreamer : nullptr, textureArrays);
+    allocationTracker.setPhase(ALLOCATION_LOADING);
+    float terrainUvDensity = TextureStreamer::uvDensity(terrainMesh.vertices, terrainMesh.indices);
+    AABB terrainMeshBounds;
+    for (const Vertex& vertex : terrainMesh.vertices)
+        terrainMeshBounds.expand(vertex.position);
+    if (streamTextures) {
+        const TextureStreamer::Stats& stats = textureStreamer.getStats();
+        std::cout << "Texture streaming: " << stats.textures << " textures loaded in " << stats.loadMilliseconds << " ms, "
+            << stats.residentBytes / 1024 << " KB resident of " << stats.fullBytes / 1024 << " KB" << std::endl;
+    }
 
-    float angle = 0.0f;
+    shaderCache.waitForPrograms();
+    PerObjectBuffer::setupProgram(simpleMaterialProgram);
+    PerObjectBuffer::setupProgram(complexMaterialProgram);
+    PerObjectBuffer::setupProgram(backpackProgram);
+    PerObjectBuffer::setupProgram(depthProgram);
+    MaterialTable::setupProgram(simpleMaterialProgram);
+    MaterialTable::setupProgram(complexMaterialProgram);
+    MaterialTable::setupProgram(backpackProgram);
+
+    // The terrain only has its albedo texture, the backpack interned its materials while loading
+    Material terrainMaterialData;
+    terrainMaterialData.textures[0] = terrainTex;
+    MaterialTable::MaterialId terrainMaterial = materialTable.intern(terrainMaterialData);
+    materialTable.upload();
+    std::cout << "Materials: " << materialTable.getStats().uniqueMaterials << " unique, " << materialTable.getStats().internHits
+        << " duplicates merged" << std::endl;
+
+    const ShaderCache::Stats& shaderStats = shaderCache.getStats();
+    std::cout << "Shader cache: " << shaderStats.programs << " programs, " << shaderStats.binaryHits << " loaded from binaries in "
+        << shaderStats.loadMilliseconds << " ms, " << shaderStats.compiledPrograms << " compiled with " << shaderStats.compileMilliseconds
+        << " ms spent waiting" << (glExtensions.parallelShaderCompile ? " (parallel compile)" : "");
+    if (!glExtensions.programBinary)
+        std::cout << " (no program binary support)";
+    std::cout << std::endl;
+    for (const ShaderCache::Timing& timing : shaderCache.getTimings())
+        std::cout << "    " << timing.name << ": " << timing.milliseconds << " ms" << (timing.fromBinary ? " from binary" : "") << std::endl;
+
+    // Decoupled render thread, the main thread only records command lists.
+    // It covers the regular forward path, the query and multi draw paths need the context on the main thread.
+    bool threadedRendering = hasArgument(argc, argv, "--render-thread");
+    if (threadedRendering && benchmark) {
+        std::cout << "The benchmark renders offscreen on the main thread, ignoring --render-thread" << std::endl;
+        threadedRendering = false;
+    }
+    if (threadedRendering && (hasArgument(argc, argv, "--gpu-occlusion") || hasArgument(argc, argv, "--multi-draw")))
+        std::cout << "The render thread does not support --gpu-occlusion and --multi-draw, ignoring them" << std::endl;
+
+    // GPU occlusion queries, the skybox cube doubles as the bounding box proxy
+    bool gpuOcclusion = hasArgument(argc, argv, "--gpu-occlusion") && !threadedRendering;
+    if (gpuOcclusion)
+        backpack.enableOcclusionQueries(proxyProgram, squareVAO, squareIndexCount);
+    double lastStatsTime = glfwGetTime();
+
+    // Per frame dynamic data goes through a triple buffered ring buffer
+    RingBuffer ringBuffer;
+    ringBuffer.create(4 * 1024 * 1024);
+    size_t ringBytesWritten = 0;
+    double ringFenceWaitMilliseconds = 0.0;
+    int statsFrames = 0;
+
+    if (hasArgument(argc, argv, "--bench-uniforms")) {
+        runUniformBenchmark(window, ringBuffer, squareVAO, squareIndexCount);
+        ringBuffer.destroy();
+        glfwTerminate();
+        return 0;
+    }
+    PerObjectBuffer perObjectBuffer(ringBuffer);
+    bool perObjectFallbackReported = false;
+
+    // Multi draw indirect path, everything is packed into shared buffers and drawn with one call per material
+    bool multiDraw = hasArgument(argc, argv, "--multi-draw") && !threadedRendering;
+    if (multiDraw && !glExtensions.multiDrawIndirect) {
+        std::cout << "Multi draw indirect needs OpenGL 4.3 and GL_ARB_shader_draw_parameters, using the regular path" << std::endl;
+        multiDraw = false;
+    }
+    IndirectRenderer indirectRenderer;
+    GLuint indirectSimpleProgram = 0;
+    GLuint indirectComplexProgram = 0;
+    int terrainIndirectMesh = -1;
+    if (multiDraw) {
+        indirectSimpleProgram = createShaders(
+            "Shaders/IndirectSimpleVertexShader.shader",
+            "Shaders/SimpleFragmentShader.shader"
+        );
+        indirectComplexProgram = createShaders(
+            "Shaders/IndirectComplexVertexShader.shader",
+            "Shaders/ComplexFragmentShader.shader"
+        );
+
+        MaterialTable::setupProgram(indirectSimpleProgram);
+        MaterialTable::setupProgram(indirectComplexProgram);
+
+        IndirectRenderer::Material terrainIndirectMaterial;
+        terrainIndirectMaterial.program = indirectSimpleProgram;
+        terrainIndirectMaterial.textures[0] = materialTable.get(terrainMaterial).textures[0];
+        terrainIndirectMesh = indirectRenderer.addMesh(terrainMesh.vertices, terrainMesh.indices, terrainIndirectMaterial);
+        backpack.addToIndirectRenderer(indirectRenderer, indirectComplexProgram);
+        indirectRenderer.finalize();
+    }
 
+    // Depth pre-pass, F3 switches it on and off to compare the fragment shader invocations of both modes.
+    // The proxies of the occlusion queries would be tested with GL_EQUAL, so the two do not mix.
+    bool depthPrepass = hasArgument(argc, argv, "--depth-prepass");
+    bool depthPrepassAvailable = !threadedRendering && !multiDraw && !gpuOcclusion;
+    if (depthPrepass && !depthPrepassAvailable) {
+        std::cout << "The depth pre-pass only works without --render-thread, --multi-draw and --gpu-occlusion, ignoring it" << std::endl;
+        depthPrepass = false;
+    }
+    // Queries of the same kind cannot nest, so the shading pass is split into ranges that add up to the whole: sky
+    // and terrain, the backpack on its own for the temporal anti-aliasing comparison, and the sky after the pre-pass
+    FragmentCounter prepassCounter;
+    FragmentCounter shadingCounter;
+    FragmentCounter backpackCounter;
+    FragmentCounter skyCounter;
+    prepassCounter.create();
+    shadingCounter.create();
+    backpackCounter.create();
+    skyCounter.create();
+    // Last measured shading invocations per frame without [0] and with [1] the pre-pass
+    double shadingInvocations[2] = { 0.0, 0.0 };
+    double prepassInvocations = 0.0;
+    bool prepassKeyWasPressed = false;
+
+    // Clustered forward lighting with many local lights
+    bool clusteredLighting = hasArgument(argc, argv, "--clustered");
+    if (clusteredLighting && (threadedRendering || multiDraw)) {
+        std::cout << "Clustered lighting only works without --render-thread and --multi-draw, ignoring it" << std::endl;
+        clusteredLighting = false;
+    }
+    ClusteredLighting clusteredLights;
+    std::vector<ClusteredLighting::Light> lights;
+    std::vector<glm::vec3> lightOrigins;
+    double clusterBinMilliseconds = 0.0;
+    if (clusteredLighting) {
+        clusteredLights.create();
+        lights = createLights(1000, lightOrigins);
+    }
+
+    // Cascaded shadow maps of the directional light, rendered before the main pass
+    bool shadows = hasArgument(argc, argv, "--shadows");
+    if (shadows && (threadedRendering || multiDraw)) {
+        std::cout << "Shadows only work without --render-thread and --multi-draw, ignoring them" << std::endl;
+        shadows = false;
+    }
+    GLuint shadowProgram = 0;
+    CascadedShadowMaps shadowMaps;
+    std::vector<CascadedShadowMaps::Caster> shadowCasters(2);
+    double shadowCpuMilliseconds = 0.0;
+    double shadowGpuMilliseconds = 0.0;
+    int shadowCascadesRendered = 0;
+    if (shadows) {
+        shadowProgram = createShaders(
+            "Shaders/ShadowVertexShader.shader",
+            "Shaders/DepthFragmentShader.shader"
+        );
+        shadowMaps.create(shadowProgram);
+
+        // The terrain never moves, so it is the only caster of the cached far cascades
+        shadowCasters[0].isStatic = true;
+        shadowCasters[0].positions = &terrainMesh.positions;
+        shadowCasters[1].object = &backpack;
+    }
+
+    // Temporal anti-aliasing, the scene is rendered at --taa-scale of the output resolution and reconstructed over
+    // several frames. F6 switches it on and off to compare the shading cost at both resolutions.
+    bool temporalAntiAliasing = hasArgument(argc, argv, "--taa");
+    if (temporalAntiAliasing && (threadedRendering || multiDraw)) {
+        std::cout << "Temporal anti-aliasing only works without --render-thread and --multi-draw, ignoring it" << std::endl;
+        temporalAntiAliasing = false;
+    }
+    TemporalAA temporalAA;
+    std::vector<TemporalAA::MovingObject> movingObjects;
+    glm::mat4 previousBackpackMatrix = glm::mat4(1.0f);
+    // Last measured ComplexFragmentShader invocations of the backpack per frame at full [0] and at the reduced [1]
+    // resolution
+    double taaBackpackInvocations[2] = { 0.0, 0.0 };
+    bool taaKeyWasPressed = false;
+    if (temporalAntiAliasing) {
+        GLuint velocityProgram = createShaders(
+            "Shaders/VelocityVertexShader.shader",
+            "Shaders/VelocityFragmentShader.shader"
+        );
+        GLuint resolveProgram = createShaders(
+            "Shaders/FullscreenVertexShader.shader",
+            "Shaders/TemporalResolveFragmentShader.shader"
+        );
+        const char* scale = getArgument(argc, argv, "--taa-scale");
+        temporalAntiAliasing = temporalAA.create(velocityProgram, resolveProgram, scale != nullptr ? (float)atof(scale) : 0.6f);
+    }
+    bool taaActive = temporalAntiAliasing;
+    // The backpack spins with --rotate-backpack, the only object that needs its own motion vectors
+    bool rotateBackpack = hasArgument(argc, argv, "--rotate-backpack");
+
+    // Dynamic resolution, the scene is rendered at the scale that keeps the GPU frame time within --frame-budget milliseconds
+    bool dynamicResolution = hasArgument(argc, argv, "--dynamic-resolution");
+    if (dynamicResolution && (threadedRendering || temporalAntiAliasing)) {
+        std::cout << "Dynamic resolution does not work with --render-thread and --taa, ignoring it" << std::endl;
+        dynamicResolution = false;
+    }
+    DynamicResolution resolution;
+    if (dynamicResolution) {
+        GLuint upscaleProgram = createShaders(
+            "Shaders/FullscreenVertexShader.shader",
+            "Shaders/UpscaleFragmentShader.shader"
+        );
+        const char* budget = getArgument(argc, argv, "--frame-budget");
+        dynamicResolution = resolution.create(upscaleProgram, budget != nullptr ? (float)atof(budget) : 16.6f);
+    }
+
+    // Sparse virtual texture of the terrain, a unique texel for every spot of the terrain instead of one repeating image.
+    // The pages are composed on worker threads from the detail image and noise, the feedback pass needs the forward renderer.
+    bool virtualTexturing = hasArgument(argc, argv, "--virtual-texture");
+    if (virtualTexturing && (threadedRendering || multiDraw)) {
+        std::cout << "Virtual texturing only works without --render-thread and --multi-draw, ignoring it" << std::endl;
+        virtualTexturing = false;
+    }
+    TerrainComposer terrainComposer;
+    VirtualTexture virtualTexture;
+    if (virtualTexturing) {
+        // The terrain is drawn translated by (-50, -5, -50)
+        glm::vec2 terrainOrigin = glm::vec2(terrainMeshBounds.min.x, terrainMeshBounds.min.z) - glm::vec2(50.0f);
+        glm::vec2 terrainSize = glm::vec2(terrainMeshBounds.max.x, terrainMeshBounds.max.z) - glm::vec2(terrainMeshBounds.min.x, terrainMeshBounds.min.z);
+        terrainComposer.create("Textures/Terrain.jpg", 10.0f, terrainOrigin, terrainSize, 1000);
+
+        GLuint feedbackProgram = createShaders(
+            "Shaders/VirtualFeedbackVertexShader.shader",
+            "Shaders/VirtualFeedbackFragmentShader.shader"
+        );
+        PerObjectBuffer::setupProgram(feedbackProgram);
+        VirtualTexture::Producer producer = [&terrainComposer](int level, int x, int y, int count, unsigned char* rgba) {
+            terrainComposer.compose(level, x, y, count, VirtualTexture::VIRTUAL_SIZE, rgba);
+        };
+        virtualTexturing = virtualTexture.create(producer, terrainOrigin, terrainSize, feedbackProgram);
+    }
+
+    // Both features are #ifdef blocks of the material shaders, the enabled ones select the permutation
+    std::vector<std::string> materialDefines;
+    if (clusteredLighting)
+        materialDefines.push_back("CLUSTERED_LIGHTING");
+    if (shadows)
+        materialDefines.push_back("SHADOWS");
+    // The virtual texture only covers the terrain
+    std::vector<std::string> terrainDefines = materialDefines;
+    if (virtualTexturing)
+        terrainDefines.push_back("VIRTUAL_TEXTURE");
+    // They are built in the background, the plain material programs are drawn until both are ready
+    GLuint terrainProgram = simpleMaterialProgram;
+    GLuint pendingTerrainProgram = 0;
+    GLuint pendingBackpackProgram = 0;
+    if (!terrainDefines.empty()) {
+        pendingTerrainProgram = shaderCache.requestProgram(
+            "Shaders/SimpleVertexShader.shader",
+            "Shaders/SimpleFragmentShader.shader",
+            terrainDefines
+        );
+        pendingBackpackProgram = backpackProgram;
+    }
+    if (!materialDefines.empty()) {
+        backpackDefines.insert(backpackDefines.end(), materialDefines.begin(), materialDefines.end());
+        pendingBackpackProgram = shaderCache.requestProgram(
+            "Shaders/ComplexVertexShader.shader",
+            "Shaders/ComplexFragmentShader.shader",
+            backpackDefines
+        );
+    }
+
+    // Transforms of the scene objects, the renderer reads their world matrices every frame
+    Scene scene;
+    Scene::Transform terrainTransform;
+    terrainTransform.position = glm::vec3(-50.0f, -5.0f, -50.0f);
+    Scene::Renderable terrainRenderable;
+    terrainRenderable.material = terrainMaterial;
+    EntityHandle terrainEntity = scene.create(terrainTransform, terrainMeshBounds, terrainRenderable);
+    Scene::Transform backpackTransform;
+    backpackTransform.position = glm::vec3(0.0f, -1.0f, -5.0f);
+    Scene::Renderable backpackRenderable;
+    backpackRenderable.mesh = 1;
+    EntityHandle backpackEntity = scene.create(backpackTransform, backpack.getBounds(), backpackRenderable);
+    // The scene moves in fixed steps, one per frame, so benchmark runs stay repeatable.
+    // With --rotate-backpack the backpack turns 0.01 radians per frame.
+    const float sceneStepSeconds = 1.0f / 60.0f;
+    if (rotateBackpack)
+        scene.setSpin(backpackEntity, 0.01f / sceneStepSeconds);
+    scene.updateTransforms(0.0f);
+
+    // CPU occlusion culling, the terrain is the occluder for everything else
+    bool cpuOcclusion = hasArgument(argc, argv, "--cpu-occlusion");
+    JobSystem jobs;
+    OcclusionCuller occlusionCuller(jobs);
+    OcclusionCuller::Occluder terrainOccluder = createOccluder(terrainMesh);
+    bool dumpKeyWasPressed = false;
+
+    // Scoped CPU timers and GPU timestamps, the GPU ones need the context on this thread
+    if (hasArgument(argc, argv, "--profile")) {
+        profiler.enable(!threadedRendering);
+        std::cout << "Profiling" << (threadedRendering ? " the CPU only" : "") << ", press F4 to write profile.json" << std::endl;
+    }
+    bool profileKeyWasPressed = false;
+
+    // Heap allocations of the frames, a steady state frame is expected to allocate nothing
+    bool trackAllocations = hasArgument(argc, argv, "--track-allocations");
+    bool failOnFrameAllocations = hasArgument(argc, argv, "--fail-on-frame-allocations");
+    if (failOnFrameAllocations && !ALLOCATION_TRACKING)
+        std::cout << "--fail-on-frame-allocations needs a build with ALLOCATION_TRACKING" << std::endl;
+    allocationTracker.setFailOnFrameAllocations(failOnFrameAllocations);
+    bool frameAllocationsFailed = false;
+
+    // Camera path of the benchmark, or the interactive camera recorded into a file for later runs
+    Benchmark benchmarkRun;
+    CameraPath cameraPath = CameraPath::createDefault();
+    const char* recordedPathFile = getArgument(argc, argv, "--record-camera");
+    CameraPath recordedPath;
+    double recordStart = glfwGetTime();
+    if (benchmark) {
+        const char* pathFile = getArgument(argc, argv, "--camera-path");
+        if (pathFile != nullptr && !cameraPath.load(pathFile)) {
+            std::cout << "Using the default camera path" << std::endl;
+            cameraPath = CameraPath::createDefault();
+        }
+
+        const char* frames = getArgument(argc, argv, "--benchmark-frames");
+        if (!benchmarkRun.create(SCR_WIDTH, SCR_HEIGHT, frames != nullptr ? atoi(frames) : Benchmark::DEFAULT_FRAMES)) {
+            glfwTerminate();
+            return 1;
+        }
+        glfwSwapInterval(0);
+
+        // Every run has to render the same frames, so the permutations are not swapped in halfway
+        shaderCache.waitForPrograms();
+    }
+
+    UniformLocations skyboxUniforms(skyboxProgram);
+    UniformLocations simpleMaterialUniforms(simpleMaterialProgram);
+    RenderThread renderThread(window, ringBuffer);
+    if (threadedRendering)
+        renderThread.start();
+
+    allocationTracker.setPhase(ALLOCATION_FRAME);
     while (!glfwWindowShouldClose(window))
     {
-        processInput(window);
+        // Everything of the last frame in the arena is dead now, the render thread only reads its command list
+        frameArena.reset();
+        allocationTracker.beginFrame();
+        if (!threadedRendering)
+            profiler.beginFrame();
+        PROFILE_SCOPE("Frame");
+        if (benchmark) {
+            benchmarkRun.beginFrame();
+            cameraPath.sample(benchmarkRun.getTime(), cameraPosition, yaw, pitch);
+        }
+        else {
+            processInput(window);
+        }
+        if (recordedPathFile != nullptr) {
+            AllocationScope allocationScope(ALLOCATION_DIAGNOSTICS);
+            recordedPath.add({ (float)(glfwGetTime() - recordStart), cameraPosition, yaw, pitch });
+        }
 
-        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);  // Also clear the depth buffer
+        // F4 writes the profile of the last frames as a Chrome trace
+        bool profileKeyPressed = glfwGetKey(window, GLFW_KEY_F4) == GLFW_PRESS;
+        if (profileKeyPressed && !profileKeyWasPressed && profiler.isEnabled()) {
+            AllocationScope allocationScope(ALLOCATION_DIAGNOSTICS);
+            if (profiler.exportChromeTrace("profile.json"))
+                std::cout << "Wrote profile.json" << std::endl;
+        }
+        profileKeyWasPressed = profileKeyPressed;
+
+        // Switch to the material permutations once the driver has finished them, never waits for it
+        if (pendingTerrainProgram != 0 || pendingBackpackProgram != 0) {
+            ShaderCache::ProgramStatus terrainStatus = shaderCache.getStatus(pendingTerrainProgram);
+            ShaderCache::ProgramStatus backpackStatus = shaderCache.getStatus(pendingBackpackProgram);
+            if (terrainStatus == ShaderCache::PROGRAM_READY && backpackStatus == ShaderCache::PROGRAM_READY) {
+                PerObjectBuffer::setupProgram(pendingTerrainProgram);
+                PerObjectBuffer::setupProgram(pendingBackpackProgram);
+                MaterialTable::setupProgram(pendingTerrainProgram);
+                MaterialTable::setupProgram(pendingBackpackProgram);
+                terrainProgram = pendingTerrainProgram;
+                backpack.setProgram(pendingBackpackProgram);
+                std::cout << "Material permutations ready after " << shaderCache.getTimings().back().milliseconds << " ms" << std::endl;
+                pendingTerrainProgram = pendingBackpackProgram = 0;
+            }
+            else if (terrainStatus == ShaderCache::PROGRAM_FAILED || backpackStatus == ShaderCache::PROGRAM_FAILED) {
+                std::cout << "Material permutations failed to build, keeping the plain material shaders" << std::endl;
+                pendingTerrainProgram = pendingBackpackProgram = 0;
+            }
+        }
+
+        if (dynamicResolution) {
+            int width = SCR_WIDTH, height = SCR_HEIGHT;
+            if (!benchmark)
+                glfwGetFramebufferSize(window, &width, &height);
+            resolution.beginFrame(std::max(width, 1), std::max(height, 1));
+        }
 
         glm::mat4 view = updateCameraView();
 
-        renderSkybox(window, skyboxProgram, squareVAO, squareIndexCount, view, projection, lightDirection);
+        bool taaKeyPressed = glfwGetKey(window, GLFW_KEY_F6) == GLFW_PRESS;
+        if (taaKeyPressed && !taaKeyWasPressed && temporalAntiAliasing) {
+            taaActive = !taaActive;
+            temporalAA.resetHistory();
+            // Results of the frames before the switch belong to the other resolution
+            shadingCounter.takeAverage();
+            backpackCounter.takeAverage();
+            skyCounter.takeAverage();
+            prepassCounter.takeAverage();
+            shadingInvocations[0] = shadingInvocations[1] = 0.0;
+            std::cout << "Temporal anti-aliasing " << (taaActive ? "on" : "off") << std::endl;
+        }
+        taaKeyWasPressed = taaKeyPressed;
+
+        // Every pass of the scene uses the jittered projection, culling and light binning keep the plain one
+        glm::mat4 sceneProjection = projection;
+        if (taaActive) {
+            int width = SCR_WIDTH, height = SCR_HEIGHT;
+            if (!benchmark)
+                glfwGetFramebufferSize(window, &width, &height);
+            temporalAA.beginFrame(std::max(width, 1), std::max(height, 1), view, projection);
+            sceneProjection = temporalAA.getJitteredProjection();
+        }
+
+        materialTable.beginFrame();
+        if (!threadedRendering) {
+            ringBuffer.beginFrame();
+            materialTable.upload();
+
+            glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);  // Also clear the depth buffer
+        }
+
+        glm::mat4 terrainMatrix = scene.getWorldMatrix(terrainEntity);
+        glm::mat4 backpackMatrix = scene.getWorldMatrix(backpackEntity);
+
+        bool backpackVisible = true;
+        if (cpuOcclusion) {
+            PROFILE_SCOPE("Occlusion culling");
+            occlusionCuller.beginFrame(projection * view);
+            occlusionCuller.addOccluder(terrainOccluder, terrainMatrix);
+            occlusionCuller.rasterize();
+            backpackVisible = occlusionCuller.isVisible(backpack.getBounds().transformed(backpackMatrix));
+
+            // F2 writes the occlusion buffer to disk for debugging
+            bool dumpKeyPressed = glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS;
+            if (dumpKeyPressed && !dumpKeyWasPressed && occlusionCuller.dumpDepth("occlusion.pgm")) {
+                const OcclusionCuller::Stats& stats = occlusionCuller.getStats();
+                std::cout << "Wrote occlusion.pgm (" << stats.rasterizedTriangles << " triangles, "
+                    << stats.culledObjects << "/" << stats.testedObjects << " objects culled)" << std::endl;
+            }
+            dumpKeyWasPressed = dumpKeyPressed;
+        }
+
+        if (streamTextures) {
+            PROFILE_SCOPE("Texture streaming");
+            int width = SCR_WIDTH, height = SCR_HEIGHT;
+            if (!benchmark)
+                glfwGetFramebufferSize(window, &width, &height);
+            float pixelScale = projection[1][1] * std::max(height, 1) * 0.5f;
+            textureStreamer.request(terrainTex, terrainUvDensity, terrainMeshBounds.transformed(terrainMatrix).distance(cameraPosition), pixelScale);
+            if (backpackVisible)
+                backpack.requestTextures(backpackMatrix, cameraPosition, pixelScale);
+            textureStreamer.update();
+        }
+
+        if (virtualTexturing) {
+            PROFILE_SCOPE("Virtual texture");
+            virtualTexture.update();
+        }
+
+        bool prepassKeyPressed = glfwGetKey(window, GLFW_KEY_F3) == GLFW_PRESS;
+        if (prepassKeyPressed && !prepassKeyWasPressed && depthPrepassAvailable) {
+            depthPrepass = !depthPrepass;
+            // Results of the frames before the switch belong to the other mode
+            shadingCounter.takeAverage();
+            backpackCounter.takeAverage();
+            skyCounter.takeAverage();
+            prepassCounter.takeAverage();
+            std::cout << "Depth pre-pass " << (depthPrepass ? "on" : "off") << std::endl;
+        }
+        prepassKeyWasPressed = prepassKeyPressed;
+
+        if (threadedRendering) {
+            // Record frame N while the render thread is still executing frame N-1
+            CommandList& commands = renderThread.beginFrame();
+
+            int width, height;
+            glfwGetFramebufferSize(window, &width, &height);
+            commands.viewport(width, height);
+            commands.clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT, glm::vec4(0.2f, 0.3f, 0.3f, 1.0f));
+
+            recordSkybox(commands, skyboxProgram, skyboxUniforms, squareVAO, squareIndexCount, view, projection, lightDirection);
+
+            commands.useProgram(simpleMaterialProgram);
+            commands.uniformMatrix4f(simpleMaterialUniforms.view, view);
+            commands.uniformMatrix4f(simpleMaterialUniforms.projection, projection);
+            commands.uniform3f(simpleMaterialUniforms.lightDirection, lightDirection);
+            commands.uniform3f(simpleMaterialUniforms.ambientLightColor, ambientLightColor);
 
-        // Use the shader program
-        glUseProgram(simpleMaterialProgram);
+            PerObjectData terrainData = { terrainMatrix };
+            commands.uniformBlock(PerObjectBuffer::BINDING, &terrainData, sizeof(terrainData));
+            recordMesh(commands, simpleMaterialProgram, simpleMaterialUniforms, terrainMesh, terrainMaterial);
 
-        glUniformMatrix4fv(glGetUniformLocation(simpleMaterialProgram, "model"), 1, GL_FALSE, glm::value_ptr(world));
-        glUniformMatrix4fv(glGetUniformLocation(simpleMaterialProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(simpleMaterialProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+            if (backpackVisible) {
+                PerObjectData backpackData = { backpackMatrix };
+                commands.uniformBlock(PerObjectBuffer::BINDING, &backpackData, sizeof(backpackData));
+                backpack.record(commands, view, projection, ambientLightColor, lightDirection);
+            }
 
-        // Update the light position
-        glUniform3fv(glGetUniformLocation(simpleMaterialProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-        glUniform3fv(glGetUniformLocation(simpleMaterialProgram, "ambientLightColor"), 1, glm::value_ptr(ambientLightColor));
+            renderThread.submitFrame();
+        }
+        else if (multiDraw) {
+            renderSkybox(window, skyboxProgram, squareVAO, squareIndexCount, view, projection, lightDirection);
 
-        glm::mat4 terrainMatrix = glm::mat4(1.0f);
-        terrainMatrix = glm::translate(terrainMatrix, glm::vec3(-50.0f, -5.0f, -50.0f));
-        renderMesh(simpleMaterialProgram, terrainMesh, terrainMatrix, terrainTex);
+            indirectRenderer.draw(terrainIndirectMesh, terrainMatrix);
+            if (backpackVisible)
+                backpack.renderIndirect(indirectRenderer, backpackMatrix);
+            indirectRenderer.submit(&ringBuffer, view, projection, ambientLightColor, lightDirection);
+        }
+        else {
+            // Write the data of every object at once, the draws only select their slice
+            PerObjectData terrainData = { terrainMatrix };
+            PerObjectData backpackData = { backpackMatrix };
+            if (!perObjectBuffer.begin(2) && !perObjectFallbackReported) {
+                std::cout << "Ring buffer full, per object data falls back to one upload per draw" << std::endl;
+                perObjectFallbackReported = true;
+            }
+            perObjectBuffer.set(0, terrainData);
+            perObjectBuffer.set(1, backpackData);
+            perObjectBuffer.upload();
+
+            if (clusteredLighting) {
+                PROFILE_SCOPE("Light binning");
+                animateLights(lights, lightOrigins, benchmark ? benchmarkRun.getTime() : (float)glfwGetTime());
+
+                int width, height;
+                glfwGetFramebufferSize(window, &width, &height);
+                if (dynamicResolution) {
+                    width = resolution.getRenderWidth();
+                    height = resolution.getRenderHeight();
+                }
+                else if (taaActive) {
+                    width = temporalAA.getRenderWidth();
+                    height = temporalAA.getRenderHeight();
+                }
+                clusteredLights.update(lights, view, projection, 0.1f, 100.0f, width, height);
+                clusteredLights.setupProgram(terrainProgram);
+                clusteredLights.setupProgram(backpack.getProgram());
+                clusterBinMilliseconds += clusteredLights.getStats().binMilliseconds;
+            }
+
+            if (shadows) {
+                PROFILE_SCOPE("Shadow pass");
+                PROFILE_GPU_SCOPE("Shadow pass");
+                shadowCasters[0].model = terrainMatrix;
+                shadowCasters[0].bounds = terrainMeshBounds.transformed(terrainMatrix);
+                shadowCasters[1].model = backpackMatrix;
+                shadowCasters[1].bounds = backpack.getBounds().transformed(backpackMatrix);
+                shadowMaps.render(view, projection, 0.1f, 100.0f, lightDirection, shadowCasters);
+                shadowMaps.setupProgram(terrainProgram);
+                shadowMaps.setupProgram(backpack.getProgram());
+
+                const CascadedShadowMaps::Stats& stats = shadowMaps.getStats();
+                shadowCpuMilliseconds += stats.cpuMilliseconds;
+                shadowGpuMilliseconds += stats.gpuMilliseconds;
+                shadowCascadesRendered += stats.renderedCascades;
+            }
+
+            if (depthPrepass) {
+                // Lay down the depth of all opaque geometry with the position only streams first
+                PROFILE_SCOPE("Depth pre-pass");
+                PROFILE_GPU_SCOPE("Depth pre-pass");
+                prepassCounter.begin();
+                glEnable(GL_DEPTH_TEST);
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                glUseProgram(depthProgram);
+                glUniformMatrix4fv(glGetUniformLocation(depthProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+                glUniformMatrix4fv(glGetUniformLocation(depthProgram, "projection"), 1, GL_FALSE, glm::value_ptr(sceneProjection));
+
+                perObjectBuffer.bind(0);
+                terrainMesh.positions.draw();
+                perObjectBuffer.bind(1);
+                if (backpackVisible)
+                    backpack.renderDepth();
+
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                prepassCounter.end();
+
+                // Only the closest fragment of every pixel gets shaded now
+                glDepthFunc(GL_EQUAL);
+                glDepthMask(GL_FALSE);
+                shadingCounter.begin();
+            }
+            else {
+                shadingCounter.begin();
+                renderSkybox(window, skyboxProgram, squareVAO, squareIndexCount, view, sceneProjection, lightDirection);
+            }
+
+            {
+                PROFILE_SCOPE("Terrain");
+                PROFILE_GPU_SCOPE("Terrain");
+
+                // Use the shader program
+                glUseProgram(terrainProgram);
+
+                glUniformMatrix4fv(glGetUniformLocation(terrainProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+                glUniformMatrix4fv(glGetUniformLocation(terrainProgram, "projection"), 1, GL_FALSE, glm::value_ptr(sceneProjection));
+
+                // Update the light position
+                glUniform3fv(glGetUniformLocation(terrainProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
+                glUniform3fv(glGetUniformLocation(terrainProgram, "ambientLightColor"), 1, glm::value_ptr(ambientLightColor));
+
+                if (virtualTexturing)
+                    virtualTexture.setupProgram(terrainProgram);
+
+                perObjectBuffer.bind(0);
+                renderMesh(terrainProgram, terrainMesh, terrainMaterial);
+            }
+            shadingCounter.end();
+
+            perObjectBuffer.bind(1);
+            backpackCounter.begin();
+            if (backpackVisible)
+                backpack.render(backpackMatrix, view, sceneProjection, ambientLightColor, lightDirection);
+            backpackCounter.end();
+
+            // The sky only covers the pixels that are still at the far plane, this also restores the depth state
+            if (depthPrepass) {
+                skyCounter.begin();
+                renderSkybox(window, skyboxProgram, squareVAO, squareIndexCount, view, sceneProjection, lightDirection, true);
+                skyCounter.end();
+            }
+
+            if (taaActive) {
+                PROFILE_SCOPE("Temporal resolve");
+                PROFILE_GPU_SCOPE("Temporal resolve");
+                movingObjects.clear();
+                if (backpackVisible && backpackMatrix != previousBackpackMatrix) {
+                    TemporalAA::MovingObject object;
+                    object.model = backpackMatrix;
+                    object.previousModel = previousBackpackMatrix;
+                    object.object = &backpack;
+                    movingObjects.push_back(object);
+                }
+                temporalAA.renderVelocity(view, movingObjects);
+                temporalAA.endFrame();
+            }
+
+            // Pages needed by this frame, read back a few frames later. Uses the plain projection, the jitter is below a
+            // feedback pixel anyway.
+            if (virtualTexturing) {
+                PROFILE_SCOPE("Virtual texture feedback");
+                PROFILE_GPU_SCOPE("Virtual texture feedback");
+                int width = SCR_WIDTH, height = SCR_HEIGHT;
+                if (!benchmark)
+                    glfwGetFramebufferSize(window, &width, &height);
+                virtualTexture.beginFeedback(std::max(width, 1), std::max(height, 1), view, projection);
+                perObjectBuffer.bind(0);
+                terrainMesh.positions.draw();
+                virtualTexture.endFeedback();
+            }
+        }
+        previousBackpackMatrix = backpackMatrix;
 
-        glm::mat4 backpackMatrix = glm::mat4(1.0f);
-        backpackMatrix = glm::translate(backpackMatrix, glm::vec3(0.0f, -1.0f, -5.0f));
-        backpackMatrix = glm::rotate(backpackMatrix, angle, glm::vec3(0, 1, 0));
-        backpack.render(backpackMatrix, view, projection, ambientLightColor, lightDirection);
-        //angle += 0.01f;
+        if (dynamicResolution) {
+            PROFILE_SCOPE("Upscale");
+            PROFILE_GPU_SCOPE("Upscale");
+            resolution.endFrame();
+        }
+        {
+            PROFILE_SCOPE("Scene update");
+            scene.updateTransforms(sceneStepSeconds);
+        }
 
-        glfwSwapBuffers(window);
+        // The ring buffer belongs to the render thread in threaded mode
+        if (!threadedRendering) {
+            ringBuffer.endFrame();
+            ringBytesWritten += ringBuffer.getStats().bytesWritten;
+            ringFenceWaitMilliseconds += ringBuffer.getStats().fenceWaitMilliseconds;
+        }
+        statsFrames++;
+
+        // Report frame statistics every few seconds
+        if (glfwGetTime() - lastStatsTime > 2.0) {
+            AllocationScope allocationScope(ALLOCATION_DIAGNOSTICS);
+            if (threadedRendering) {
+                // Without a render thread a frame costs the main thread work plus the render thread work,
+                // the overlap is how much of that is hidden by running both at the same time
+                RenderThread::Stats stats = renderThread.takeStats();
+                double frameMilliseconds = 1000.0 * (glfwGetTime() - lastStatsTime) / statsFrames;
+                double mainMilliseconds = frameMilliseconds - stats.waitMilliseconds / statsFrames;
+                double renderMilliseconds = (stats.executeMilliseconds + stats.swapMilliseconds) / statsFrames;
+                double overlapMilliseconds = std::max(0.0, mainMilliseconds + renderMilliseconds - frameMilliseconds);
+                std::cout << "Render thread: " << frameMilliseconds << " ms/frame, main thread " << mainMilliseconds
+                    << " ms busy, render thread " << stats.executeMilliseconds / statsFrames << " ms execute + "
+                    << stats.swapMilliseconds / statsFrames << " ms swap, "
+                    << overlapMilliseconds << " ms overlap (" << 100.0 * overlapMilliseconds / frameMilliseconds << "% of the frame)" << std::endl;
+            }
+            else {
+                std::cout << "Ring buffer: " << ringBytesWritten / statsFrames << " bytes/frame, "
+                    << ringFenceWaitMilliseconds / statsFrames << " ms fence wait/frame"
+                    << (ringBuffer.isPersistent() ? " (persistent)" : " (glBufferSubData)") << std::endl;
+            }
+
+            double backpackShading = backpackCounter.takeAverage();
+            double shading = shadingCounter.takeAverage() + backpackShading + skyCounter.takeAverage();
+            if (depthPrepassAvailable) {
+                shadingInvocations[depthPrepass ? 1 : 0] = shading;
+                if (depthPrepass)
+                    prepassInvocations = prepassCounter.takeAverage();
+
+                const char* counted = FragmentCounter::isExact() ? "Fragment shader invocations" : "Samples passed (no pipeline statistics)";
+                std::cout << counted << ": " << shadingInvocations[depthPrepass ? 1 : 0] << "/frame "
+                    << (depthPrepass ? "with" : "without") << " depth pre-pass";
+                if (shadingInvocations[0] > 0.0 && shadingInvocations[1] > 0.0) {
+                    std::cout << ", " << shadingInvocations[1] << " with (+" << prepassInvocations << " in the pre-pass) vs "
+                        << shadingInvocations[0] << " without, " << 100.0 * (1.0 - shadingInvocations[1] / shadingInvocations[0]) << "% saved";
+                }
+                else {
+                    std::cout << ", press F3 to compare";
+                }
+                std::cout << std::endl;
+            }
+
+            if (clusteredLighting) {
+                const ClusteredLighting::Stats& stats = clusteredLights.getStats();
+                std::cout << "Clustered lighting: " << 1000.0 * (glfwGetTime() - lastStatsTime) / statsFrames << " ms/frame, "
+                    << clusterBinMilliseconds / statsFrames << " ms binning, " << stats.visibleLights << "/" << stats.lights << " lights visible, "
+                    << stats.lightIndices << " light indices, " << stats.occupiedClusters << "/" << ClusteredLighting::CLUSTER_COUNT
+                    << " clusters lit, at most " << stats.maxLightsPerCluster << " lights per cluster" << std::endl;
+                clusterBinMilliseconds = 0.0;
+            }
+
+            if (shadows) {
+                const CascadedShadowMaps::Stats& stats = shadowMaps.getStats();
+                std::cout << "Shadow pass: " << shadowGpuMilliseconds / statsFrames << " ms GPU, " << shadowCpuMilliseconds / statsFrames << " ms CPU, "
+                    << (double)shadowCascadesRendered / statsFrames << "/" << CascadedShadowMaps::CASCADE_COUNT << " cascades rendered per frame, "
+                    << stats.drawnCasters << " casters drawn and " << stats.culledCasters << " culled in the last frame" << std::endl;
+                shadowCpuMilliseconds = 0.0;
+                shadowGpuMilliseconds = 0.0;
+                shadowCascadesRendered = 0;
+            }
+
+            if (temporalAntiAliasing) {
+                taaBackpackInvocations[taaActive ? 1 : 0] = backpackShading;
+                std::cout << "Temporal anti-aliasing: ";
+                if (taaActive)
+                    std::cout << temporalAA.getRenderWidth() << "x" << temporalAA.getRenderHeight() << " internal resolution, "
+                        << temporalAA.getStats().gpuMilliseconds << " ms GPU resolve";
+                else
+                    std::cout << "off";
+                if (taaBackpackInvocations[0] > 0.0 && taaBackpackInvocations[1] > 0.0) {
+                    std::cout << ", backpack " << taaBackpackInvocations[1] << " ComplexFragmentShader invocations/frame vs "
+                        << taaBackpackInvocations[0] << " at full resolution, "
+                        << 100.0 * (1.0 - taaBackpackInvocations[1] / taaBackpackInvocations[0]) << "% fewer";
+                }
+                else {
+                    std::cout << ", press F6 to compare the backpack shading cost";
+                }
+                std::cout << std::endl;
+            }
+
+            if (dynamicResolution) {
+                const DynamicResolution::Stats& stats = resolution.getStats();
+                const char* decisions[] = { "held", "lowered", "raised" };
+                std::cout << "Dynamic resolution: scale " << stats.scale << " (" << stats.renderWidth << "x" << stats.renderHeight << "), "
+                    << stats.gpuMilliseconds << " ms GPU for a " << resolution.getBudget() << " ms budget, last "
+                    << decisions[stats.lastDecision] << ", " << stats.decreases << " times lowered, " << stats.increases << " raised and "
+                    << stats.holds << " held" << std::endl;
+            }
+
+            if (streamTextures) {
+                const TextureStreamer::Stats& stats = textureStreamer.getStats();
+                std::cout << "Texture streaming: " << stats.residentBytes / 1024 << " KB resident of " << stats.fullBytes / 1024 << " KB, "
+                    << stats.uploadedLevels << " levels uploaded (" << stats.uploadedBytes / 1024 << " KB), " << stats.evictedLevels
+                    << " evicted, " << stats.missingLevels << " levels still missing" << std::endl;
+                textureStreamer.resetStats();
+            }
+
+            if (virtualTexturing) {
+                const VirtualTexture::Stats& stats = virtualTexture.getStats();
+                std::cout << "Virtual texture: " << stats.visiblePages << " pages visible, " << stats.residentPages << " resident, "
+                    << stats.pendingPages << " pending, " << stats.producedPages << " produced, " << stats.evictedPages << " evicted, "
+                    << stats.droppedPages << " dropped, " << stats.feedbackMilliseconds << " ms feedback, "
+                    << stats.memoryBytes / 1024 << " KB" << std::endl;
+                virtualTexture.resetStats();
+            }
+
+            if (!multiDraw) {
+                const MaterialTable::Stats& stats = materialTable.getStats();
+                std::cout << "Materials: " << stats.uniqueMaterials << " unique, " << (float)stats.switches / std::max(stats.frames, 1)
+                    << " switches and " << (float)stats.textureBinds / std::max(stats.frames, 1) << " texture binds per frame for "
+                    << (float)stats.applies / std::max(stats.frames, 1) << " draws" << std::endl;
+                materialTable.resetStats();
+            }
+
+            {
+                const FrameArena::Stats& stats = frameArena.getStats();
+                std::cout << "Frame arena: " << stats.usedBytes << " bytes in " << stats.allocations << " allocations last frame, "
+                    << stats.peakBytes / 1024 << " KB peak, " << stats.overflowAllocations << " allocations overflowed to the heap" << std::endl;
+            }
+
+            if (trackAllocations) {
+                const AllocationTracker::FrameStats& stats = allocationTracker.getFrameStats();
+                AllocationTracker::TagStats frameTag = allocationTracker.getTagStats(ALLOCATION_FRAME);
+                std::cout << "Heap allocations: " << stats.allocations << " (" << stats.bytes << " bytes) last frame, at most "
+                    << stats.maxAllocations << " (" << stats.maxBytes << " bytes) per frame, " << stats.allocatingFrames
+                    << " frames after the warm up allocated, " << frameTag.liveBytes / 1024 << " KB live and "
+                    << frameTag.peakLiveBytes / 1024 << " KB peak of frame allocations" << std::endl;
+            }
+
+            const Model::OcclusionQueryStats& stats = backpack.getOcclusionQueryStats();
+            if (gpuOcclusion && stats.draws > 0) {
+                std::cout << "Occlusion queries: " << 100.0f * stats.skippedDraws / stats.draws << "% of draws skipped, "
+                    << 100.0f * stats.unqueriedDraws / stats.draws << "% of draws without a query" << std::endl;
+            }
+            backpack.resetOcclusionQueryStats();
+
+            ringBytesWritten = 0;
+            ringFenceWaitMilliseconds = 0.0;
+            statsFrames = 0;
+            lastStatsTime = glfwGetTime();
+        }
+
+        if (benchmark) {
+            if (!benchmarkRun.endFrame())
+                glfwSetWindowShouldClose(window, true);
+        }
+        else if (!threadedRendering) {
+            PROFILE_SCOPE("SwapBuffers");
+            glfwSwapBuffers(window);
+        }
         glfwPollEvents();
+
+        // Polling is part of the frame, window and input events must not allocate either
+        if (!allocationTracker.endFrame())
+            frameAllocationsFailed = true;
     }
 
-    // Cleanup
-    glDeleteTextures(1, &terrainTex);
+    // Cleanup, the context has to be back on this thread
+    renderThread.stop();
+    allocationTracker.setPhase(ALLOCATION_LOADING);
+
+    int exitCode = 0;
+    if (trackAllocations) {
+        std::cout << "Heap allocations by phase:" << std::endl;
+        allocationTracker.print();
+    }
+    if (frameAllocationsFailed) {
+        std::cout << "Frames allocated from the heap after the warm up" << std::endl;
+        exitCode = 1;
+    }
+    if (benchmark) {
+        std::string configuration;
+        for (int i = 1; i < argc; ++i)
+            configuration += std::string(i > 1 ? " " : "") + argv[i];
+
+        const char* output = getArgument(argc, argv, "--benchmark-output");
+        if (output == nullptr)
+            output = "benchmark.json";
+        Benchmark::Result result = benchmarkRun.getResult();
+        std::cout << "Benchmark: " << result.frames << " frames at " << result.width << "x" << result.height << ", "
+            << result.p50Milliseconds << " ms median, " << result.p99Milliseconds << " ms p99, "
+            << result.drawCallsPerFrame << " draw calls/frame, " << result.peakMemoryMegabytes << " MB peak memory" << std::endl;
+        if (benchmarkRun.writeJson(output, configuration))
+            std::cout << "Wrote " << output << std::endl;
+
+        if (baselineResult != nullptr && !Benchmark::compare(output, baselineResult, regressionTolerance)) {
+            std::cout << "Performance regression against " << baselineResult << std::endl;
+            exitCode = 1;
+        }
+        benchmarkRun.destroy();
+    }
+    if (recordedPathFile != nullptr && recordedPath.save(recordedPathFile))
+        std::cout << "Wrote camera path " << recordedPathFile << std::endl;
+    if (profiler.isEnabled() && profiler.exportChromeTrace("profile.json"))
+        std::cout << "Wrote profile.json" << std::endl;
+    profiler.disable();
+    perObjectBuffer.destroy();
+    ringBuffer.destroy();
+    prepassCounter.destroy();
+    shadingCounter.destroy();
+    backpackCounter.destroy();
+    skyCounter.destroy();
+    if (clusteredLighting)
+        clusteredLights.destroy();
+    if (shadows)
+        shadowMaps.destroy();
+    if (dynamicResolution)
+        resolution.destroy();
+    if (temporalAntiAliasing)
+        temporalAA.destroy();
+    if (virtualTexturing)
+        virtualTexture.destroy();
+    if (streamTextures)
+        textureStreamer.destroy();
+    else
+        glDeleteTextures(1, &terrainTex);
     glDeleteVertexArrays(1, &squareVAO);
     glDeleteBuffers(1, &squareEBO);
-    glDeleteProgram(simpleMaterialProgram);
+    materialTable.destroy();
+    shaderCache.destroy();
+    frameArena.destroy();
 
     glfwTerminate();
-    return 0;
+    return exitCode;
 }
 
 
 void processInput(GLFWwindow* window)
 {
+    PROFILE_SCOPE("processInput");
+
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         glfwSetWindowShouldClose(window, true);
 
@@ -213,17 +1188,31 @@ glm::mat4 updateCameraView()
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
-    glViewport(0, 0, width, height);
+    // The render thread owns the context in threaded mode and sets the viewport itself every frame
+    if (glfwGetCurrentContext() == window)
+        glViewport(0, 0, width, height);
 }
 
-int init(GLFWwindow*& window) {
+int init(GLFWwindow*& window, bool hidden, bool osmesa) {
     glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
+    if (hidden)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    // Software rendering through Mesa's off-screen interface
+    if (osmesa)
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+
+    // Prefer a 4.3 context for the multi draw indirect path, 3.3 is enough for everything else
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "GraphicsProgramming", NULL, NULL);
     if (window == NULL)
+    {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "GraphicsProgramming", NULL, NULL);
+    }
+    if (window == NULL)
     {
         std::cout << "Failed to create GLFW window" << std::endl;
         glfwTerminate();
@@ -237,17 +1226,44 @@ int init(GLFWwindow*& window) {
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
+    loadGLExtensions();
 
     return 0;
 }
 
-void renderSkybox(GLFWwindow* window, GLuint skyboxProgram, GLuint squareVAO, int squareIndexCount, glm::mat4 view, glm::mat4 projection, glm::vec3 lightDirection) {
+bool hasArgument(int argc, char** argv, const char* argument) {
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], argument) == 0)
+            return true;
+    return false;
+}
+
+// Value after the argument, nullptr if the argument is missing or the last one
+const char* getArgument(int argc, char** argv, const char* argument) {
+    for (int i = 1; i < argc - 1; ++i)
+        if (strcmp(argv[i], argument) == 0)
+            return argv[i + 1];
+    return nullptr;
+}
+
+void renderSkybox(GLFWwindow* window, GLuint skyboxProgram, GLuint squareVAO, int squareIndexCount, glm::mat4 view, glm::mat4 projection, glm::vec3 lightDirection, bool afterScene) {
+    PROFILE_SCOPE("renderSkybox");
+    PROFILE_GPU_SCOPE("Sky");
+
     // Disable depth writing (we always want the skybox behind everything else)
     glDepthMask(GL_FALSE);
 
     // Culling is not necessary for skybox (it's always viewed from the inside)
     glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
+
+    // Drawn last the sky sits exactly on the far plane and only passes where nothing else was drawn
+    if (afterScene) {
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LEQUAL);
+    }
+    else {
+        glDisable(GL_DEPTH_TEST);
+    }
 
     // Use the skybox shader
     glUseProgram(skyboxProgram);
@@ -262,29 +1278,358 @@ void renderSkybox(GLFWwindow* window, GLuint skyboxProgram, GLuint squareVAO, in
     // Draw the skybox cube
     glBindVertexArray(squareVAO);
     glDrawElements(GL_TRIANGLES, squareIndexCount, GL_UNSIGNED_INT, 0);
+    drawStats.add(squareIndexCount);
     glBindVertexArray(0);
 
     // Restore the previous OpenGL state
     glEnable(GL_CULL_FACE);
     glDepthMask(GL_TRUE);
     glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
 
     glUseProgram(0); // Unbind the shader program
 }
 
-void renderMesh(GLuint program, const Mesh& mesh, const glm::mat4& modelMatrix, int texture)
+void renderMesh(GLuint program, const Mesh& mesh, MaterialTable::MaterialId material)
 {
     glUseProgram(program);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glUniform1i(glGetUniformLocation(program, "albedoTexture"), GL_TEXTURE0);
-    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(modelMatrix));
+    materialTable.apply(material, glGetUniformLocation(program, "materialId"));
+    glUniform1i(glGetUniformLocation(program, "albedoTexture"), 0);
     glBindVertexArray(mesh.vao);
     glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, 0);
+    drawStats.add(mesh.indices.size());
     glBindVertexArray(0);
 }
 
+void recordSkybox(CommandList& commands, GLuint skyboxProgram, const UniformLocations& uniforms, GLuint squareVAO, int squareIndexCount, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightDirection)
+{
+    // Same state changes as renderSkybox
+    commands.depthMask(GL_FALSE);
+    commands.disable(GL_CULL_FACE);
+    commands.disable(GL_DEPTH_TEST);
+
+    commands.useProgram(skyboxProgram);
+    commands.uniformMatrix4f(uniforms.view, glm::mat4(glm::mat3(view)));
+    commands.uniformMatrix4f(uniforms.projection, projection);
+    commands.uniform3f(uniforms.lightDirection, lightDirection);
+
+    commands.bindVertexArray(squareVAO);
+    commands.drawElements(squareIndexCount);
+    commands.bindVertexArray(0);
+
+    commands.enable(GL_CULL_FACE);
+    commands.depthMask(GL_TRUE);
+    commands.enable(GL_DEPTH_TEST);
+    commands.useProgram(0);
+}
+
+void recordMesh(CommandList& commands, GLuint program, const UniformLocations& uniforms, const Mesh& mesh, MaterialTable::MaterialId material)
+{
+    commands.useProgram(program);
+    materialTable.record(commands, material, uniforms.materialId);
+    commands.uniform1i(uniforms.albedoTexture, 0);
+    commands.bindVertexArray(mesh.vao);
+    commands.drawElements((GLsizei)mesh.indices.size());
+    commands.bindVertexArray(0);
+}
+
+
+// Draws a grid of boxes with a different model matrix each, once with a glUniformMatrix4fv per draw and
+// once with all matrices in one uniform buffer selected with glBindBufferRange
+void runUniformBenchmark(GLFWwindow* window, RingBuffer& ringBuffer, GLuint boxVAO, int boxIndexCount)
+{
+    const int objectCount = 10000;
+    const int frameCount = 100;
+
+    GLuint uniformProgram = createShaders(
+        "Shaders/UniformBenchmarkVertexShader.shader",
+        "Shaders/SimpleFragmentShader.shader"
+    );
+    GLuint blockProgram = createShaders(
+        "Shaders/SimpleVertexShader.shader",
+        "Shaders/SimpleFragmentShader.shader"
+    );
+    PerObjectBuffer::setupProgram(blockProgram);
+    MaterialTable::setupProgram(uniformProgram);
+    MaterialTable::setupProgram(blockProgram);
+    materialTable.upload();
+
+    std::vector<glm::mat4> matrices(objectCount);
+    for (int i = 0; i < objectCount; ++i) {
+        glm::mat4 matrix = glm::translate(glm::mat4(1.0f), glm::vec3((i % 100 - 50) * 0.5f, (i / 100 - 50) * 0.5f, -60.0f));
+        matrices[i] = glm::scale(matrix, glm::vec3(0.3f));
+    }
 
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(45.0f, SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+    glm::vec3 lightDirection = glm::normalize(glm::vec3(1.0f, -1.0f, 0.0f));
+    glm::vec3 ambientLightColor = glm::vec3(0.2f);
+
+    PerObjectBuffer perObjectBuffer(ringBuffer);
+    glfwSwapInterval(0);
+    glEnable(GL_DEPTH_TEST);
+
+    const char* names[] = { "Per draw uniforms", "Uniform buffer offsets" };
+    for (int mode = 0; mode < 2; ++mode) {
+        GLuint program = mode == 0 ? uniformProgram : blockProgram;
+        GLint modelLocation = glGetUniformLocation(program, "model");
+        double submitSeconds = 0.0;
+
+        glFinish();
+        double start = glfwGetTime();
+        for (int frame = 0; frame < frameCount; ++frame) {
+            ringBuffer.beginFrame();
+            double submitStart = glfwGetTime();
+
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glUseProgram(program);
+            glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+            glUniformMatrix4fv(glGetUniformLocation(program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+            glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+            glUniform3fv(glGetUniformLocation(program, "ambientLightColor"), 1, glm::value_ptr(ambientLightColor));
+            glBindVertexArray(boxVAO);
+
+            if (mode == 0) {
+                for (int i = 0; i < objectCount; ++i) {
+                    glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(matrices[i]));
+                    glDrawElements(GL_TRIANGLES, boxIndexCount, GL_UNSIGNED_INT, 0);
+                }
+            }
+            else {
+                // The fallback uploads every object on its own, that is not what this mode measures
+                if (!perObjectBuffer.begin(objectCount)) {
+                    std::cout << names[mode] << ": the ring buffer is too small for " << objectCount << " objects" << std::endl;
+                    perObjectBuffer.destroy();
+                    return;
+                }
+                for (int i = 0; i < objectCount; ++i) {
+                    PerObjectData data = { matrices[i] };
+                    perObjectBuffer.set(i, data);
+                }
+                perObjectBuffer.upload();
+
+                for (int i = 0; i < objectCount; ++i) {
+                    perObjectBuffer.bind(i);
+                    glDrawElements(GL_TRIANGLES, boxIndexCount, GL_UNSIGNED_INT, 0);
+                }
+            }
+
+            glBindVertexArray(0);
+            submitSeconds += glfwGetTime() - submitStart;
+            ringBuffer.endFrame();
+
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+        glFinish();
+        double totalSeconds = glfwGetTime() - start;
+
+        std::cout << names[mode] << ": " << 1000.0 * submitSeconds / frameCount << " ms CPU submit/frame, "
+            << 1000.0 * totalSeconds / frameCount << " ms total/frame (" << objectCount << " draws)" << std::endl;
+    }
+}
+
+// Builds the draw list of a synthetic scene of 200k objects with 1, 2, 4, ... threads up to the core count
+// and checks that every thread count produces exactly the same list
+void runDrawListBenchmark()
+{
+    const int objectCount = 200000;
+    const int frameCount = 50;
+
+    // Objects scattered over a large plane, 64 materials with 256 meshes of 3 LODs each
+    std::vector<SceneObject> objects(objectCount);
+    for (int i = 0; i < objectCount; ++i) {
+        unsigned int hash = (unsigned int)i * 2654435761u;
+        glm::vec3 position = glm::vec3((float)(hash % 2000) - 1000.0f, (float)((hash >> 7) % 20), (float)((hash >> 11) % 2000) - 1000.0f);
+        SceneObject& object = objects[i];
+        object.bounds = AABB(position - glm::vec3(1.0f), position + glm::vec3(1.0f));
+        object.material = (hash >> 22) % 64;
+        object.mesh = (int)((hash >> 5) % 256) * 3;
+        object.lodCount = 3;
+        object.lodDistance = 100.0f;
+    }
+
+    glm::vec3 camera = glm::vec3(0.0f, 10.0f, 0.0f);
+    glm::mat4 view = glm::lookAt(camera, camera + glm::vec3(0.0f, -0.2f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 1500.0f);
+
+    int hardwareThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < hardwareThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(hardwareThreads);
+
+    std::vector<DrawPacket> reference;
+    double singleThreadMilliseconds = 0.0;
+    for (int threads : threadCounts) {
+        JobSystem jobs(threads - 1);
+        DrawListBuilder builder(jobs);
+        // Warm up so the lists have their final capacity
+        builder.build(objects, projection * view, camera);
+
+        double buildMilliseconds = 0.0;
+        double mergeMilliseconds = 0.0;
+        for (int frame = 0; frame < frameCount; ++frame) {
+            builder.build(objects, projection * view, camera);
+            buildMilliseconds += builder.getStats().buildMilliseconds;
+            mergeMilliseconds += builder.getStats().mergeMilliseconds;
+        }
+        buildMilliseconds /= frameCount;
+        mergeMilliseconds /= frameCount;
+        double totalMilliseconds = buildMilliseconds + mergeMilliseconds;
+
+        const std::vector<DrawPacket>& drawList = builder.getDrawList();
+        bool identical = true;
+        if (threads == 1) {
+            reference = drawList;
+            singleThreadMilliseconds = totalMilliseconds;
+        }
+        else {
+            identical = drawList.size() == reference.size();
+            for (size_t i = 0; identical && i < drawList.size(); ++i)
+                identical = drawList[i].sortKey == reference[i].sortKey && drawList[i].object == reference[i].object;
+        }
+
+        std::cout << threads << " threads: " << buildMilliseconds << " ms build + " << mergeMilliseconds << " ms merge, "
+            << singleThreadMilliseconds / totalMilliseconds << "x speedup, " << builder.getStats().visibleObjects << "/" << objectCount
+            << " objects visible" << (identical ? "" : ", draw list differs from 1 thread") << std::endl;
+    }
+}
+
+// Moves 100k objects around for a number of frames, once with linear culling and once with the spatial index, and
+// compares the update and query times. The ray and sphere queries run on all threads at the same time and are
+// checked against testing every object.
+void runSpatialIndexBenchmark()
+{
+    const int objectCount = 100000;
+    const int frameCount = 60;
+    const int queryCount = 20000;
+    const int checkedQueries = 200;
+    const float frameSeconds = 1.0f / 60.0f;
+
+    // Objects of different sizes drifting over a 2000 x 2000 area, a third of them stands still
+    std::vector<glm::vec3> origins(objectCount);
+    std::vector<glm::vec3> velocities(objectCount);
+    std::vector<AABB> bounds(objectCount);
+    for (int i = 0; i < objectCount; ++i) {
+        unsigned int hash = (unsigned int)i * 2654435761u;
+        origins[i] = glm::vec3((float)(hash % 2000) - 1000.0f, (float)((hash >> 7) % 20), (float)((hash >> 11) % 2000) - 1000.0f);
+        velocities[i] = i % 3 == 0 ? glm::vec3(0.0f) : glm::vec3((float)((hash >> 3) % 21) - 10.0f, 0.0f, (float)((hash >> 13) % 21) - 10.0f);
+        float size = 0.5f + (float)((hash >> 17) % 8) * 0.5f;
+        bounds[i] = AABB(glm::vec3(-size), glm::vec3(size));
+    }
+
+    glm::vec3 camera = glm::vec3(0.0f, 10.0f, 0.0f);
+    glm::mat4 view = glm::lookAt(camera, camera + glm::vec3(0.0f, -0.2f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(glm::radians(60.0f), SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 500.0f);
+    Frustum frustum(projection * view);
+
+    // Rays from the camera height in all directions, spheres around random objects
+    std::vector<glm::vec3> rayDirections(queryCount);
+    std::vector<int> sphereObjects(queryCount);
+    for (int i = 0; i < queryCount; ++i) {
+        float angle = i * 2.399963f;
+        rayDirections[i] = glm::normalize(glm::vec3(cos(angle), -0.01f - 0.05f * (i % 7), sin(angle)));
+        sphereObjects[i] = (int)(((unsigned int)i * 40503u) % objectCount);
+    }
+    const float rayLength = 1000.0f;
+    const float sphereRadius = 10.0f;
+
+    JobSystem jobs;
+    for (int indexed = 0; indexed < 2; ++indexed) {
+        Scene scene;
+        scene.reserve(objectCount);
+        std::vector<EntityHandle> entities(objectCount);
+        for (int i = 0; i < objectCount; ++i) {
+            Scene::Transform transform;
+            transform.position = origins[i];
+            entities[i] = scene.create(transform, bounds[i], Scene::Renderable());
+        }
+        scene.updateTransforms(0.0f);
+        if (indexed)
+            scene.enableSpatialIndex();
+
+        double updateMilliseconds = 0.0;
+        double cullMilliseconds = 0.0;
+        size_t visibleObjects = 0;
+        for (int frame = 1; frame <= frameCount; ++frame) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < objectCount; ++i) {
+                Scene::Transform transform;
+                transform.position = origins[i] + velocities[i] * (frame * frameSeconds);
+                scene.setTransform(entities[i], transform);
+            }
+            scene.updateTransforms(frameSeconds);
+            auto culled = std::chrono::high_resolution_clock::now();
+            visibleObjects = scene.cull(frustum).size();
+            updateMilliseconds += std::chrono::duration<double, std::milli>(culled - start).count();
+            cullMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - culled).count();
+        }
+
+        std::cout << (indexed ? "Spatial index: " : "Linear: ") << updateMilliseconds / frameCount << " ms update, "
+            << cullMilliseconds / frameCount << " ms cull, " << visibleObjects << "/" << objectCount << " objects visible" << std::endl;
+        if (!indexed) continue;
+
+        const DynamicBVH::Stats& treeStats = scene.getSpatialIndex().getStats();
+        std::cout << "    " << (double)treeStats.reinsertions / treeStats.moves * 100.0 << "% of the moves reinserted, "
+            << treeStats.rebuilds << " rebuilds in " << treeStats.rebuildMilliseconds << " ms, height " << treeStats.height
+            << ", SAH cost " << treeStats.cost << std::endl;
+
+        // Queries from every thread at once on the same tree
+        std::vector<EntityHandle> rayHits(queryCount);
+        std::vector<float> rayDistances(queryCount);
+        std::vector<std::vector<EntityHandle>> threadResults(jobs.getThreadCount());
+        std::vector<size_t> sphereCounts(queryCount);
+        auto start = std::chrono::high_resolution_clock::now();
+        jobs.parallelFor(queryCount, [&](int i) {
+            rayHits[i] = scene.raycast(camera, rayDirections[i], rayLength, rayDistances[i]);
+        });
+        auto raysDone = std::chrono::high_resolution_clock::now();
+        jobs.parallelForRange(queryCount, 64, [&](int begin, int end, int thread) {
+            std::vector<EntityHandle>& result = threadResults[thread];
+            for (int i = begin; i < end; ++i) {
+                result.clear();
+                scene.querySphere(scene.getWorldBounds(entities[sphereObjects[i]]).center(), sphereRadius, result);
+                sphereCounts[i] = result.size();
+            }
+        });
+        auto spheresDone = std::chrono::high_resolution_clock::now();
+
+        // Testing every object has to find the same closest hits and the same number of objects in the spheres
+        int mismatches = 0;
+        for (int i = 0; i < checkedQueries; ++i) {
+            float closest = rayLength;
+            glm::vec3 inverseDirection = inverseRayDirection(rayDirections[i]);
+            size_t inSphere = 0;
+            glm::vec3 center = scene.getWorldBounds(entities[sphereObjects[i]]).center();
+            for (int j = 0; j < objectCount; ++j) {
+                const AABB& box = scene.getWorldBounds(entities[j]);
+                float distance;
+                if (box.intersectsRay(camera, inverseDirection, closest, distance))
+                    closest = distance;
+                if (box.distance(center) <= sphereRadius)
+                    inSphere++;
+            }
+            if (closest != rayDistances[i] || inSphere != sphereCounts[i])
+                mismatches++;
+        }
+
+        std::cout << "    " << jobs.getThreadCount() << " threads: " << queryCount << " rays in "
+            << std::chrono::duration<double, std::milli>(raysDone - start).count() << " ms, " << queryCount << " sphere queries in "
+            << std::chrono::duration<double, std::milli>(spheresDone - raysDone).count() << " ms, "
+            << mismatches << "/" << checkedQueries << " queries differ from testing every object" << std::endl;
+    }
+}
+
+OcclusionCuller::Occluder createOccluder(const Mesh& mesh)
+{
+    OcclusionCuller::Occluder occluder;
+    occluder.positions.reserve(mesh.vertices.size());
+    for (const Vertex& vertex : mesh.vertices)
+        occluder.positions.push_back(vertex.position);
+    occluder.indices = mesh.indices;
+    return occluder;
+}
 
 void createBox(GLuint& vao, GLuint& ebo, int& size, int& indexCount)
 {
@@ -395,47 +1740,14 @@ void createBox(GLuint& vao, GLuint& ebo, int& size, int& indexCount)
 
 Mesh createTerrain(int width, int depth, float scale, float amplitude, int seed) {
     Mesh mesh;
-    mesh.vertices.resize(width * depth);
-    mesh.indices.resize((width - 1) * (depth - 1) * 6);
 
     FastNoiseLite noise;
     noise.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
     noise.SetSeed(seed);
 
-    for (int z = 0; z < depth; ++z) {
-        for (int x = 0; x < width; ++x) {
-            int index = z * width + x;
-            float height = amplitude * noise.GetNoise(x * scale, z * scale);
-            mesh.vertices[index].position = glm::vec3(x, height, z);
-            mesh.vertices[index].uv = glm::vec2(x / 10.0f, z / 10.0f);
-        }
-    }
-
-    for (int z = 0; z < depth - 1; ++z) {
-        for (int x = 0; x < width - 1; ++x) {
-            int index = z * (width - 1) + x;
-            mesh.indices[index * 6 + 0] = z * width + x;
-            mesh.indices[index * 6 + 1] = (z + 1) * width + x;
-            mesh.indices[index * 6 + 2] = z * width + x + 1;
-            mesh.indices[index * 6 + 3] = (z + 1) * width + x;
-            mesh.indices[index * 6 + 4] = (z + 1) * width + x + 1;
-            mesh.indices[index * 6 + 5] = z * width + x + 1;
-        }
-    }
-
-    for (int z = 1; z < depth - 1; ++z) {
-        for (int x = 1; x < width - 1; ++x) {
-            glm::vec3& normal = mesh.vertices[z * width + x].normal;
-            normal = glm::vec3(0, 1, 0);
-            float heightLeft = mesh.vertices[z * width + x - 1].position.y;
-            float heightRight = mesh.vertices[z * width + x + 1].position.y;
-            float heightDown = mesh.vertices[(z - 1) * width + x].position.y;
-            float heightUp = mesh.vertices[(z + 1) * width + x].position.y;
-            normal.x = heightLeft - heightRight;
-            normal.z = heightDown - heightUp;
-            normal = glm::normalize(normal);
-        }
-    }
+    generateTerrainHeights(mesh.vertices, width, depth, scale, amplitude, noise);
+    generateTerrainIndices(mesh.indices, width, depth);
+    generateTerrainNormals(mesh.vertices, width, depth);
 
     glGenVertexArrays(1, &mesh.vao);
     glGenBuffers(1, &mesh.vbo);
@@ -461,140 +1773,19 @@ Mesh createTerrain(int width, int depth, float scale, float amplitude, int seed)
 
     glBindVertexArray(0);
 
+    mesh.positions.create(mesh.vertices, mesh.ebo, (GLsizei)mesh.indices.size());
+
     return mesh;
 }
 
 
 
-GLuint compileShader(GLenum shaderType, const char* shaderSource)
-{
-    GLuint shader = glCreateShader(shaderType);
-    glShaderSource(shader, 1, &shaderSource, nullptr);
-    glCompileShader(shader);
-
-    // Check shader compilation status
-    GLint success;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        GLint infoLogLength;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLogLength);
-        GLchar* infoLog = new GLchar[infoLogLength];
-        glGetShaderInfoLog(shader, infoLogLength, nullptr, infoLog);
-        std::cerr << "Shader compilation error:\n" << infoLog << std::endl;
-        delete[] infoLog;
-        glDeleteShader(shader);
-        return 0;
-    }
-
-    return shader;
-}
-
-GLuint createShaders(const char* vertexShaderFilename, const char* fragmentShaderFilename)
+GLuint createShaders(const char* vertexShaderFilename, const char* fragmentShaderFilename, const std::vector<std::string>& defines)
 {
-    // Load vertex shader
-    char* vertexShaderSource = nullptr;
-    loadTextFromFile(vertexShaderFilename, vertexShaderSource);
-    if (vertexShaderSource == nullptr)
-    {
-        std::cerr << "Failed to load vertex shader: " << vertexShaderFilename << std::endl;
-        return 0;
-    }
-
-    // Compile vertex shader
-    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexShaderSource);
-    delete[] vertexShaderSource;
-    if (vertexShader == 0)
-    {
-        std::cerr << "Failed to compile vertex shader." << std::endl;
-        return 0;
-    }
-
-    // Load fragment shader
-    char* fragmentShaderSource = nullptr;
-    loadTextFromFile(fragmentShaderFilename, fragmentShaderSource);
-    if (fragmentShaderSource == nullptr)
-    {
-        std::cerr << "Failed to load fragment shader: " << fragmentShaderFilename << std::endl;
-        glDeleteShader(vertexShader);
-        return 0;
-    }
-
-    // Compile fragment shader
-    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
-    delete[] fragmentShaderSource;
-    if (fragmentShader == 0)
-    {
-        std::cerr << "Failed to compile fragment shader." << std::endl;
-        glDeleteShader(vertexShader);
-        return 0;
-    }
-
-    // Create shader program
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-
-    // Check program linking status
-    GLint success;
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success)
-    {
-        GLint infoLogLength;
-        glGetProgramiv(shaderProgram, GL_INFO_LOG_LENGTH, &infoLogLength);
-        GLchar* infoLog = new GLchar[infoLogLength];
-        glGetProgramInfoLog(shaderProgram, infoLogLength, nullptr, infoLog);
-        std::cerr << "Shader program linking error:\n" << infoLog << std::endl;
-        delete[] infoLog;
-        glDeleteProgram(shaderProgram);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
-        return 0;
-    }
-
-    // Cleanup
-    glDetachShader(shaderProgram, vertexShader);
-    glDetachShader(shaderProgram, fragmentShader);
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-
-    return shaderProgram;
+    return shaderCache.getProgram(vertexShaderFilename, fragmentShaderFilename, defines);
 }
 
 
-void loadTextFromFile(const char* filename, char*& text)
-{
-    std::ifstream file(filename, std::ios::binary);
-    if (!file)
-    {
-        std::cerr << "Failed to open file: " << filename << std::endl;
-        return;
-    }
-
-    // Determine the file size
-    file.seekg(0, std::ios::end);
-    std::streamsize fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    // Allocate memory for the text buffer
-    text = new char[fileSize + 1];
-
-    // Read the file contents into the text buffer
-    if (!file.read(text, fileSize))
-    {
-        std::cerr << "Failed to read file: " << filename << std::endl;
-        delete[] text;
-        text = nullptr;
-        return;
-    }
-
-    // Null-terminate the text buffer
-    text[fileSize] = '\0';
-
-    // Close the file
-    file.close();
-}
 
 unsigned int loadTexture(const char* filename)
 {
@@ -642,3 +1833,40 @@ unsigned int loadTexture(const char* filename)
 
     return textureID;
 }
+
+// Point and spot lights of random colors scattered over the terrain, every fourth one a spot light pointing down
+std::vector<ClusteredLighting::Light> createLights(int count, std::vector<glm::vec3>& origins)
+{
+    std::vector<ClusteredLighting::Light> lights(count);
+    origins.resize(count);
+
+    unsigned int seed = 1000;
+    auto random = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) / 16777216.0f;
+    };
+
+    for (int i = 0; i < count; ++i) {
+        ClusteredLighting::Light& light = lights[i];
+        origins[i] = glm::vec3(random() * 100.0f - 50.0f, -4.0f + random() * 3.0f, random() * 100.0f - 50.0f);
+        light.position = origins[i];
+        light.range = 2.0f + random() * 4.0f;
+        light.color = glm::vec3(random(), random(), random()) * 4.0f;
+        if (i % 4 == 0) {
+            light.range *= 1.5f;
+            light.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+            light.innerConeCos = std::cos(glm::radians(20.0f));
+            light.outerConeCos = std::cos(glm::radians(30.0f));
+        }
+    }
+    return lights;
+}
+
+void animateLights(std::vector<ClusteredLighting::Light>& lights, const std::vector<glm::vec3>& origins, float time)
+{
+    // Small circles with different phases so the binning changes every frame
+    for (size_t i = 0; i < lights.size(); ++i) {
+        float phase = time + i * 0.37f;
+        lights[i].position = origins[i] + glm::vec3(std::sin(phase), 0.0f, std::cos(phase)) * 1.5f;
+    }
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <map>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <glad/glad.h>
+#include "stb_image.h"
+#include "TextureStreamer.h"
+
+// Material textures of a model packed into one GL_TEXTURE_2D_ARRAY per texture slot, so every mesh samples the same
+// bindings and only needs its layer index.
+// Every distinct combination of textures is a material and gets the same layer in all arrays. All layers of an array
+// have one size, the most common size of the slot's images (the larger one on a tie). Images of another size are
+// halved with a box filter while they are at least twice as large and then resampled bilinearly to the exact size.
+// A missing image becomes a neutral layer: white albedo, a flat normal and white specular.
+class MaterialArrays {
+public:
+    // Albedo, normal and specular, bound to texture units 0-2 like the single textures
+    static const int SLOT_COUNT = 3;
+
+    struct Stats {
+        int layers = 0;
+        int images = 0;
+        int resampledImages = 0;
+        int missingImages = 0;
+        size_t bytes = 0;
+        double loadMilliseconds = 0.0;
+    };
+
+private:
+    struct Material {
+        std::string filenames[SLOT_COUNT];
+    };
+
+    std::vector<Material> materials;
+    std::map<std::string, int> materialLayers;
+    GLuint textures[SLOT_COUNT] = { 0, 0, 0 };
+    int width[SLOT_COUNT] = { 0, 0, 0 };
+    int height[SLOT_COUNT] = { 0, 0, 0 };
+    Stats stats;
+
+    // Bilinear resampling with clamped edges, RGBA
+    static void resample(const TextureStreamer::Level& source, TextureStreamer::Level& target);
+
+public:
+    // Returns the layer of the material, an empty filename is a missing texture. The images are loaded in build.
+    int addMaterial(const std::string filenames[SLOT_COUNT]);
+    // Loads and resamples all images and uploads the arrays, prints the layer assignment
+    bool build();
+    void destroy();
+
+    // Binds the arrays to texture units 0-2
+    void bind() const;
+    GLuint getTexture(int slot) const { return textures[slot]; }
+    int getLayerCount() const { return (int)materials.size(); }
+    const Stats& getStats() const { return stats; }
+};
+
+int MaterialArrays::addMaterial(const std::string filenames[SLOT_COUNT]) {
+    std::string key;
+    for (int slot = 0; slot < SLOT_COUNT; ++slot)
+        key += filenames[slot] + "\n";
+    auto it = materialLayers.find(key);
+    if (it != materialLayers.end())
+        return it->second;
+
+    Material material;
+    for (int slot = 0; slot < SLOT_COUNT; ++slot)
+        material.filenames[slot] = filenames[slot];
+    materials.push_back(material);
+    int layer = (int)materials.size() - 1;
+    materialLayers[key] = layer;
+    return layer;
+}
+
+void MaterialArrays::resample(const TextureStreamer::Level& source, TextureStreamer::Level& target) {
+    target.pixels.resize((size_t)target.width * target.height * 4);
+    for (int y = 0; y < target.height; ++y) {
+        float sourceY = std::max((y + 0.5f) * source.height / target.height - 0.5f, 0.0f);
+        int y0 = std::min((int)sourceY, source.height - 1);
+        int y1 = std::min(y0 + 1, source.height - 1);
+        float fy = sourceY - y0;
+        for (int x = 0; x < target.width; ++x) {
+            float sourceX = std::max((x + 0.5f) * source.width / target.width - 0.5f, 0.0f);
+            int x0 = std::min((int)sourceX, source.width - 1);
+            int x1 = std::min(x0 + 1, source.width - 1);
+            float fx = sourceX - x0;
+            for (int c = 0; c < 4; ++c) {
+                float top = source.pixels[((size_t)y0 * source.width + x0) * 4 + c] * (1.0f - fx) + source.pixels[((size_t)y0 * source.width + x1) * 4 + c] * fx;
+                float bottom = source.pixels[((size_t)y1 * source.width + x0) * 4 + c] * (1.0f - fx) + source.pixels[((size_t)y1 * source.width + x1) * 4 + c] * fx;
+                target.pixels[((size_t)y * target.width + x) * 4 + c] = (unsigned char)(top * (1.0f - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+}
+
+bool MaterialArrays::build() {
+    if (materials.empty()) return false;
+    auto start = std::chrono::high_resolution_clock::now();
+    const char* slotNames[SLOT_COUNT] = { "albedo", "normal", "specular" };
+    const unsigned char neutral[SLOT_COUNT][4] = { { 255, 255, 255, 255 }, { 128, 128, 255, 255 }, { 255, 255, 255, 255 } };
+
+    // Decode every image once, as RGBA so all layers share one format
+    std::map<std::string, TextureStreamer::Level> images;
+    stbi_set_flip_vertically_on_load(true);
+    for (const Material& material : materials) {
+        for (int slot = 0; slot < SLOT_COUNT; ++slot) {
+            const std::string& filename = material.filenames[slot];
+            if (filename.empty() || images.count(filename)) continue;
+
+            TextureStreamer::Level& image = images[filename];
+            int numChannels;
+            unsigned char* data = stbi_load(filename.c_str(), &image.width, &image.height, &numChannels, 4);
+            if (data) {
+                image.pixels.assign(data, data + (size_t)image.width * image.height * 4);
+                stbi_image_free(data);
+                stats.images++;
+            }
+            else {
+                std::cerr << "Failed to load texture: " << filename << std::endl;
+                image.width = image.height = 0;
+            }
+        }
+    }
+
+    std::cout << "Material arrays: " << materials.size() << " layers, every slot uses its most common image size, "
+        << "other sizes are box filtered and resampled bilinearly" << std::endl;
+    for (int slot = 0; slot < SLOT_COUNT; ++slot) {
+        // Most common size of the slot, the larger one on a tie
+        std::map<std::pair<int, int>, int> sizeCounts;
+        for (const Material& material : materials) {
+            auto it = images.find(material.filenames[slot]);
+            if (it != images.end() && it->second.width > 0)
+                sizeCounts[std::make_pair(it->second.width, it->second.height)]++;
+        }
+        std::pair<int, int> size(1, 1);
+        int bestCount = 0;
+        for (const auto& sizeCount : sizeCounts) {
+            if (sizeCount.second > bestCount || (sizeCount.second == bestCount && sizeCount.first.first * sizeCount.first.second > size.first * size.second)) {
+                size = sizeCount.first;
+                bestCount = sizeCount.second;
+            }
+        }
+        width[slot] = size.first;
+        height[slot] = size.second;
+
+        glGenTextures(1, &textures[slot]);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures[slot]);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width[slot], height[slot], (GLsizei)materials.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        std::cout << "    " << slotNames[slot] << ": " << width[slot] << "x" << height[slot] << std::endl;
+
+        for (size_t layer = 0; layer < materials.size(); ++layer) {
+            const std::string& filename = materials[layer].filenames[slot];
+            auto it = images.find(filename);
+            TextureStreamer::Level level;
+            level.width = width[slot];
+            level.height = height[slot];
+
+            if (it == images.end() || it->second.width == 0) {
+                level.pixels.resize((size_t)level.width * level.height * 4);
+                for (size_t i = 0; i < level.pixels.size(); ++i)
+                    level.pixels[i] = neutral[slot][i % 4];
+                stats.missingImages++;
+                std::cout << "        layer " << layer << ": " << (filename.empty() ? "no texture" : filename) << ", neutral" << std::endl;
+            }
+            else if (it->second.width == level.width && it->second.height == level.height) {
+                level.pixels = it->second.pixels;
+                std::cout << "        layer " << layer << ": " << filename << std::endl;
+            }
+            else {
+                TextureStreamer::Level source = it->second;
+                while (source.width >= 2 * level.width && source.height >= 2 * level.height) {
+                    TextureStreamer::Level half;
+                    TextureStreamer::downsample(source, half, 4);
+                    source.width = half.width;
+                    source.height = half.height;
+                    source.pixels.swap(half.pixels);
+                }
+                resample(source, level);
+                stats.resampledImages++;
+                std::cout << "        layer " << layer << ": " << filename << ", resampled from " << it->second.width << "x" << it->second.height << std::endl;
+            }
+
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)layer, level.width, level.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, level.pixels.data());
+        }
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        stats.bytes += (size_t)width[slot] * height[slot] * 4 * materials.size() * 4 / 3;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    stats.layers = (int)materials.size();
+    stats.loadMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "Material arrays: " << stats.images << " images in " << stats.loadMilliseconds << " ms, " << stats.resampledImages
+        << " resampled, " << stats.missingImages << " neutral layers, " << stats.bytes / 1024 << " KB" << std::endl;
+    return true;
+}
+
+void MaterialArrays::destroy() {
+    glDeleteTextures(SLOT_COUNT, textures);
+    for (int slot = 0; slot < SLOT_COUNT; ++slot)
+        textures[slot] = 0;
+}
+
+void MaterialArrays::bind() const {
+    for (int slot = 0; slot < SLOT_COUNT; ++slot) {
+        glActiveTexture(GL_TEXTURE0 + slot);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures[slot]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,213 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "CommandList.h"
+#include "FrameArena.h"
+
+// Matches the std140 MaterialData struct of the Materials block in the material shaders
+struct MaterialParameters {
+    // Multiplies the albedo texture
+    glm::vec4 tint = glm::vec4(1.0f);
+    // x: width of the toon shading bands, y: the outline starts below this cosine of the view angle
+    glm::vec4 shading = glm::vec4(0.2f, 0.2f, 0.0f, 0.0f);
+};
+
+// Textures and shading parameters of a surface, the program stays with the renderer so the material does not change
+// between shader permutations
+struct Material {
+    // Albedo, normal and specular on texture units 0-2, 0 where the material has none
+    GLuint textures[3] = { 0, 0, 0 };
+    MaterialParameters parameters;
+
+    bool operator==(const Material& other) const {
+        return memcmp(textures, other.textures, sizeof(textures)) == 0
+            && parameters.tint == other.parameters.tint && parameters.shading == other.parameters.shading;
+    }
+};
+
+// All materials of the scene. Equal materials are interned into one small ID, and the parameters of every material
+// live in one uniform buffer that the shaders index with the ID, so a material change is one integer uniform plus the
+// textures that actually differ. Renderers draw in the order of the IDs to keep the changes rare.
+// ID 0 is the default material without textures.
+class MaterialTable {
+public:
+    typedef uint16_t MaterialId;
+    static const GLuint BINDING = 1;
+    // Has to match the size of the materials array in the shaders, 256 * 32 bytes fit the 16 KB uniform block minimum
+    static const int MAX_MATERIALS = 256;
+
+    struct Stats {
+        int uniqueMaterials = 0;
+        // Calls to intern that found an equal material
+        int internHits = 0;
+        // Since the last resetStats
+        int applies = 0;
+        int switches = 0;
+        int textureBinds = 0;
+        int frames = 0;
+    };
+
+private:
+    std::vector<Material> materials;
+    // Hash of the material to the IDs with that hash
+    std::unordered_map<size_t, std::vector<MaterialId>> lookup;
+    GLuint buffer = 0;
+    // First material that is not in the buffer yet
+    size_t uploadedMaterials = 0;
+
+    // Last applied material and textures, immediate and recorded separately
+    MaterialId currentMaterial = (MaterialId)-1;
+    GLuint boundTextures[3] = { (GLuint)-1, (GLuint)-1, (GLuint)-1 };
+    MaterialId recordedMaterial = (MaterialId)-1;
+    GLuint recordedTextures[3] = { (GLuint)-1, (GLuint)-1, (GLuint)-1 };
+    Stats stats;
+
+    static size_t hash(const Material& material);
+
+public:
+    bool create();
+    void destroy();
+
+    // Returns the ID of an equal material, or adds it. Returns 0 when the table is full.
+    MaterialId intern(const Material& material);
+    const Material& get(MaterialId id) const { return materials[id]; }
+
+    // Connects the Materials block of a program to the table
+    static void setupProgram(GLuint program);
+    // Uploads the materials added since the last call and binds the buffer, needs the context
+    void upload();
+
+    // Forgets which textures are bound, for the start of a frame and after passes that bind units 0-2 themselves
+    void beginFrame();
+    // Binds the textures that differ from the last applied material and selects it in the current program
+    void apply(MaterialId id, GLint materialIdLocation);
+    // Same for the render thread, the recorded commands only bind what differs from the last recorded material
+    void record(CommandList& commands, MaterialId id, GLint materialIdLocation);
+
+    const Stats& getStats() const { return stats; }
+    void resetStats();
+};
+
+MaterialTable materialTable;
+
+size_t MaterialTable::hash(const Material& material) {
+    // FNV-1a over the textures and parameters
+    size_t result = 14695981039346656037ull;
+    auto add = [&result](const void* data, size_t size) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; ++i)
+            result = (result ^ bytes[i]) * 1099511628211ull;
+    };
+    add(material.textures, sizeof(material.textures));
+    add(&material.parameters.tint, sizeof(material.parameters.tint));
+    add(&material.parameters.shading, sizeof(material.parameters.shading));
+    return result;
+}
+
+bool MaterialTable::create() {
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, MAX_MATERIALS * sizeof(MaterialParameters), nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    intern(Material());
+    upload();
+    return true;
+}
+
+void MaterialTable::destroy() {
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+}
+
+MaterialTable::MaterialId MaterialTable::intern(const Material& material) {
+    std::vector<MaterialId>& candidates = lookup[hash(material)];
+    for (MaterialId id : candidates) {
+        if (materials[id] == material) {
+            stats.internHits++;
+            return id;
+        }
+    }
+    if ((int)materials.size() >= MAX_MATERIALS) {
+        std::cout << "Material table is full, using the default material" << std::endl;
+        return 0;
+    }
+
+    MaterialId id = (MaterialId)materials.size();
+    materials.push_back(material);
+    candidates.push_back(id);
+    stats.uniqueMaterials = (int)materials.size();
+    return id;
+}
+
+void MaterialTable::setupProgram(GLuint program) {
+    GLuint blockIndex = glGetUniformBlockIndex(program, "Materials");
+    if (blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, blockIndex, BINDING);
+}
+
+void MaterialTable::upload() {
+    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING, buffer);
+    if (uploadedMaterials == materials.size()) return;
+
+    FrameVector<MaterialParameters> parameters;
+    parameters.reserve(materials.size() - uploadedMaterials);
+    for (size_t i = uploadedMaterials; i < materials.size(); ++i)
+        parameters.push_back(materials[i].parameters);
+    glBufferSubData(GL_UNIFORM_BUFFER, uploadedMaterials * sizeof(MaterialParameters), parameters.size() * sizeof(MaterialParameters), parameters.data());
+    uploadedMaterials = materials.size();
+}
+
+void MaterialTable::beginFrame() {
+    // Unknown bindings, the first apply binds everything and counts as a switch
+    currentMaterial = recordedMaterial = (MaterialId)-1;
+    for (int unit = 0; unit < 3; ++unit)
+        boundTextures[unit] = recordedTextures[unit] = (GLuint)-1;
+    stats.frames++;
+}
+
+void MaterialTable::apply(MaterialId id, GLint materialIdLocation) {
+    stats.applies++;
+    if (id != currentMaterial)
+        stats.switches++;
+    currentMaterial = id;
+
+    const Material& material = materials[id];
+    for (int unit = 0; unit < 3; ++unit) {
+        if (boundTextures[unit] == material.textures[unit]) continue;
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, material.textures[unit]);
+        boundTextures[unit] = material.textures[unit];
+        stats.textureBinds++;
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(materialIdLocation, id);
+}
+
+void MaterialTable::record(CommandList& commands, MaterialId id, GLint materialIdLocation) {
+    stats.applies++;
+    if (id != recordedMaterial)
+        stats.switches++;
+    recordedMaterial = id;
+
+    const Material& material = materials[id];
+    for (int unit = 0; unit < 3; ++unit) {
+        if (recordedTextures[unit] == material.textures[unit]) continue;
+        commands.bindTexture(unit, material.textures[unit]);
+        recordedTextures[unit] = material.textures[unit];
+        stats.textureBinds++;
+    }
+    commands.uniform1i(materialIdLocation, id);
+}
+
+void MaterialTable::resetStats() {
+    stats.applies = 0;
+    stats.switches = 0;
+    stats.textureBinds = 0;
+    stats.frames = 0;
+}
@@ -0,0 +1,449 @@
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <FastNoiseLite/FastNoiseLite.h>
+#include "Model.h"
+#include "Terrain.h"
+#include "TextFile.h"
+#include "Scene.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+// Times the CPU kernels of the renderer one at a time, without a window or GL context.
+// Every kernel runs for a number of repetitions and is reported in nanoseconds per element with the standard deviation
+// over the repetitions, so a change to one of the functions can be measured on its own.
+//
+// Usage: Microbenchmarks [--filter text] [--repetitions N] [--csv file]
+// Run it from the GraphicsProgramming directory so the textures and shaders are found.
+
+class MicroBenchmarks {
+public:
+    // A repetition runs the kernel as often as needed to take at least this long
+    static const int MIN_REPETITION_MICROSECONDS = 2000;
+    static const int DEFAULT_REPETITIONS = 15;
+
+    struct Measurement {
+        double meanNanoseconds = 0.0;
+        double deviationNanoseconds = 0.0;
+        double minNanoseconds = 0.0;
+    };
+
+private:
+    const char* filter = nullptr;
+    int repetitions = DEFAULT_REPETITIONS;
+    std::ofstream csv;
+
+    // Kernels return a checksum that ends up here so the compiler cannot remove their work
+    volatile float sink = 0.0f;
+
+    static double seconds(std::chrono::high_resolution_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+public:
+    MicroBenchmarks(const char* filter, int repetitions, const char* csvPath);
+
+    // Name and parameters only select the line of the report, elements is the work done by one call of the kernel
+    template<typename Kernel>
+    Measurement run(const char* name, const std::string& parameters, size_t elements, Kernel kernel);
+};
+
+MicroBenchmarks::MicroBenchmarks(const char* filter, int repetitions, const char* csvPath)
+    : filter(filter), repetitions(std::max(repetitions, 2)) {
+    if (csvPath != nullptr) {
+        csv.open(csvPath);
+        if (!csv)
+            std::cerr << "Failed to open " << csvPath << std::endl;
+        else
+            csv << "kernel,parameters,elements,mean_ns,stddev_ns,min_ns" << std::endl;
+    }
+
+    printf("%-22s %-38s %10s %12s %10s %7s %10s\n", "kernel", "parameters", "elements", "ns/element", "stddev", "cv", "min");
+}
+
+template<typename Kernel>
+MicroBenchmarks::Measurement MicroBenchmarks::run(const char* name, const std::string& parameters, size_t elements, Kernel kernel) {
+    Measurement measurement;
+    if (filter != nullptr && strstr(name, filter) == nullptr && strstr(parameters.c_str(), filter) == nullptr)
+        return measurement;
+
+    // The warm up call also decides how many calls make up a repetition
+    auto start = std::chrono::high_resolution_clock::now();
+    sink = kernel();
+    double warmupSeconds = std::max(seconds(start), 1e-9);
+    int calls = std::max((int)std::ceil(MIN_REPETITION_MICROSECONDS * 1e-6 / warmupSeconds), 1);
+
+    std::vector<double> samples(repetitions);
+    for (int repetition = 0; repetition < repetitions; ++repetition) {
+        float checksum = 0.0f;
+        start = std::chrono::high_resolution_clock::now();
+        for (int call = 0; call < calls; ++call)
+            checksum += kernel();
+        samples[repetition] = seconds(start) * 1e9 / ((double)calls * elements);
+        sink = checksum;
+    }
+
+    double sum = 0.0;
+    for (double sample : samples)
+        sum += sample;
+    measurement.meanNanoseconds = sum / repetitions;
+    double variance = 0.0;
+    for (double sample : samples)
+        variance += (sample - measurement.meanNanoseconds) * (sample - measurement.meanNanoseconds);
+    measurement.deviationNanoseconds = std::sqrt(variance / (repetitions - 1));
+    measurement.minNanoseconds = *std::min_element(samples.begin(), samples.end());
+
+    printf("%-22s %-38s %10zu %12.3f %10.3f %6.1f%% %10.3f\n", name, parameters.c_str(), elements,
+        measurement.meanNanoseconds, measurement.deviationNanoseconds,
+        100.0 * measurement.deviationNanoseconds / measurement.meanNanoseconds, measurement.minNanoseconds);
+    if (csv)
+        csv << name << "," << parameters << "," << elements << "," << measurement.meanNanoseconds << ","
+            << measurement.deviationNanoseconds << "," << measurement.minNanoseconds << std::endl;
+    return measurement;
+}
+
+const char* getArgument(int argc, char** argv, const char* name) {
+    for (int i = 1; i < argc - 1; ++i)
+        if (strcmp(argv[i], name) == 0)
+            return argv[i + 1];
+    return nullptr;
+}
+
+void benchmarkNoise(MicroBenchmarks& benchmarks) {
+    const int size = 256;
+    const char* noiseNames[] = { "OpenSimplex2", "OpenSimplex2S", "Cellular", "Perlin", "ValueCubic", "Value" };
+    const int octaveCounts[] = { 1, 3, 6 };
+
+    for (int type = FastNoiseLite::NoiseType_OpenSimplex2; type <= FastNoiseLite::NoiseType_Value; ++type) {
+        for (int octaves : octaveCounts) {
+            FastNoiseLite noise;
+            noise.SetNoiseType((FastNoiseLite::NoiseType)type);
+            noise.SetSeed(1000);
+            if (octaves > 1) {
+                noise.SetFractalType(FastNoiseLite::FractalType_FBm);
+                noise.SetFractalOctaves(octaves);
+            }
+
+            std::string parameters = std::string(noiseNames[type]) + " octaves=" + std::to_string(octaves);
+            benchmarks.run("noise", parameters, size * size, [&]() {
+                float sum = 0.0f;
+                for (int z = 0; z < size; ++z)
+                    for (int x = 0; x < size; ++x)
+                        sum += noise.GetNoise(x * 10.0f, z * 10.0f);
+                return sum;
+            });
+        }
+    }
+}
+
+void benchmarkTerrain(MicroBenchmarks& benchmarks) {
+    // The scene uses a 100 x 100 grid with these settings, see createTerrain in Main.cpp
+    const int gridSizes[] = { 100, 256, 512, 1024 };
+    const float scale = 10.0f;
+    const float amplitude = 2.0f;
+
+    FastNoiseLite noise;
+    noise.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
+    noise.SetSeed(1000);
+
+    for (int size : gridSizes) {
+        std::string parameters = "grid=" + std::to_string(size);
+        std::vector<Vertex> vertices;
+        std::vector<GLuint> indices;
+        // The normals need heights even when the filter skips that kernel
+        generateTerrainHeights(vertices, size, size, scale, amplitude, noise);
+
+        benchmarks.run("terrain heights", parameters, size * size, [&]() {
+            generateTerrainHeights(vertices, size, size, scale, amplitude, noise);
+            return vertices.back().position.y;
+        });
+        benchmarks.run("terrain indices", parameters, (size - 1) * (size - 1) * 6, [&]() {
+            generateTerrainIndices(indices, size, size);
+            return (float)indices.back();
+        });
+        benchmarks.run("terrain normals", parameters, (size - 2) * (size - 2), [&]() {
+            generateTerrainNormals(vertices, size, size);
+            return vertices[size + 1].normal.x;
+        });
+    }
+}
+
+void benchmarkMeshConversion(MicroBenchmarks& benchmarks) {
+    const unsigned int vertexCounts[] = { 3000, 30000, 300000 };
+
+    for (unsigned int vertexCount : vertexCounts) {
+        // A triangle list like the ones aiProcess_Triangulate and aiProcess_CalcTangentSpace produce, the aiMesh frees the arrays
+        aiMesh mesh;
+        mesh.mNumVertices = vertexCount;
+        mesh.mVertices = new aiVector3D[vertexCount];
+        mesh.mNormals = new aiVector3D[vertexCount];
+        mesh.mTangents = new aiVector3D[vertexCount];
+        mesh.mBitangents = new aiVector3D[vertexCount];
+        mesh.mTextureCoords[0] = new aiVector3D[vertexCount];
+        mesh.mNumUVComponents[0] = 2;
+        for (unsigned int i = 0; i < vertexCount; ++i) {
+            mesh.mVertices[i] = aiVector3D((float)(i % 100), (float)(i / 100 % 100), (float)(i / 10000));
+            mesh.mNormals[i] = aiVector3D(0.0f, 1.0f, 0.0f);
+            mesh.mTangents[i] = aiVector3D(1.0f, 0.0f, 0.0f);
+            mesh.mBitangents[i] = aiVector3D(0.0f, 0.0f, 1.0f);
+            mesh.mTextureCoords[0][i] = aiVector3D((i % 100) / 100.0f, (i / 100 % 100) / 100.0f, 0.0f);
+        }
+        mesh.mNumFaces = vertexCount / 3;
+        mesh.mFaces = new aiFace[mesh.mNumFaces];
+        for (unsigned int i = 0; i < mesh.mNumFaces; ++i) {
+            mesh.mFaces[i].mNumIndices = 3;
+            mesh.mFaces[i].mIndices = new unsigned int[3]{ i * 3, i * 3 + 1, i * 3 + 2 };
+        }
+
+        std::vector<Vertex> vertices;
+        std::vector<GLuint> indices;
+        benchmarks.run("mesh conversion", "vertices=" + std::to_string(vertexCount), vertexCount, [&]() {
+            // processMesh starts from empty vectors every time
+            vertices = std::vector<Vertex>();
+            indices = std::vector<GLuint>();
+            Model::convertMesh(&mesh, vertices, indices);
+            return vertices.back().uv.x + (float)indices.back();
+        });
+    }
+}
+
+void benchmarkTextureDecode(MicroBenchmarks& benchmarks) {
+    const char* textures[] = { "Textures/BoxDiffuse.png", "Textures/BoxNormal.png", "Models/backpack/ao.jpg" };
+
+    // Same settings as loadTexture
+    stbi_set_flip_vertically_on_load(true);
+    for (const char* filename : textures) {
+        int width, height, numChannels;
+        if (!stbi_info(filename, &width, &height, &numChannels)) {
+            std::cerr << "Failed to load texture: " << filename << std::endl;
+            continue;
+        }
+
+        benchmarks.run("stbi_load", filename, (size_t)width * height, [&]() {
+            int loadedWidth, loadedHeight, loadedChannels;
+            unsigned char* data = stbi_load(filename, &loadedWidth, &loadedHeight, &loadedChannels, 0);
+            float checksum = data ? data[0] : 0.0f;
+            stbi_image_free(data);
+            return checksum;
+        });
+    }
+}
+
+void benchmarkTextFiles(MicroBenchmarks& benchmarks) {
+    const char* files[] = { "Shaders/SimpleVertexShader.shader", "Shaders/ComplexFragmentShader.shader" };
+
+    for (const char* filename : files) {
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        if (!file) {
+            std::cerr << "Failed to open file: " << filename << std::endl;
+            continue;
+        }
+        size_t size = (size_t)file.tellg();
+
+        // Per byte, the cost is mostly opening the file
+        benchmarks.run("loadTextFromFile", filename, size, [&]() {
+            char* text = nullptr;
+            loadTextFromFile(filename, text);
+            float checksum = text ? text[0] : 0.0f;
+            delete[] text;
+            return checksum;
+        });
+    }
+}
+
+void benchmarkCameraMath(MicroBenchmarks& benchmarks) {
+    const int count = 10000;
+
+    std::vector<glm::vec2> angles(count);
+    std::vector<glm::mat4> models(count);
+    std::vector<AABB> bounds(count);
+    for (int i = 0; i < count; ++i) {
+        angles[i] = glm::vec2(-180.0f + 360.0f * i / count, -89.0f + 178.0f * (i * 7 % count) / count);
+        glm::vec3 position((float)(i % 100), 0.0f, (float)(i / 100));
+        models[i] = glm::rotate(glm::translate(glm::mat4(1.0f), position), (float)i, glm::vec3(0.0f, 1.0f, 0.0f));
+        bounds[i] = AABB(glm::vec3(-1.0f), glm::vec3(1.0f));
+    }
+    glm::vec3 cameraPosition(0.0f, 2.5f, -3.0f);
+    glm::mat4 projection = glm::perspective(45.0f, 800.0f / 600.0f, 0.1f, 100.0f);
+    glm::mat4 view = glm::lookAt(cameraPosition, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    // What updateCameraView does every frame
+    benchmarks.run("camera view", "yaw/pitch + lookAt", count, [&]() {
+        float sum = 0.0f;
+        for (const glm::vec2& angle : angles) {
+            glm::vec3 direction;
+            direction.x = cos(glm::radians(angle.x)) * cos(glm::radians(angle.y));
+            direction.y = sin(glm::radians(angle.y));
+            direction.z = sin(glm::radians(angle.x)) * cos(glm::radians(angle.y));
+            glm::vec3 front = glm::normalize(direction);
+            glm::mat4 cameraView = glm::lookAt(cameraPosition, cameraPosition + front, glm::vec3(0.0f, 1.0f, 0.0f));
+            sum += cameraView[2][2];
+        }
+        return sum;
+    });
+    benchmarks.run("camera projection", "perspective", count, [&]() {
+        float sum = 0.0f;
+        for (int i = 0; i < count; ++i)
+            sum += glm::perspective(glm::radians(45.0f + (i & 15)), 800.0f / 600.0f, 0.1f, 100.0f)[1][1];
+        return sum;
+    });
+    benchmarks.run("matrix multiply", "projection * view * model", count, [&]() {
+        glm::mat4 viewProjection = projection * view;
+        float sum = 0.0f;
+        for (const glm::mat4& model : models)
+            sum += (viewProjection * model)[3][2];
+        return sum;
+    });
+    benchmarks.run("matrix inverse", "inverse(model)", count, [&]() {
+        float sum = 0.0f;
+        for (const glm::mat4& model : models)
+            sum += glm::inverse(model)[3][0];
+        return sum;
+    });
+    benchmarks.run("bounds transform", "AABB::transformed", count, [&]() {
+        float sum = 0.0f;
+        for (int i = 0; i < count; ++i)
+            sum += bounds[i].transformed(models[i]).max.x;
+        return sum;
+    });
+}
+
+// Entity in the array of objects layout the scene used before Scene, every system loads whole objects
+struct SceneObjectBaseline {
+    glm::vec3 position;
+    glm::quat rotation;
+    glm::vec3 scale;
+    float spin;
+    glm::mat4 worldMatrix;
+    AABB localBounds;
+    AABB worldBounds;
+    Scene::Renderable renderable;
+    int lod;
+};
+
+void benchmarkSceneStorage(MicroBenchmarks& benchmarks) {
+    // Looks over the grid from its center, about a seventh of the entities is visible
+    glm::vec3 cameraPosition(0.0f, 10.0f, 0.0f);
+    glm::mat4 viewProjection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 500.0f)
+        * glm::lookAt(cameraPosition, glm::vec3(0.0f, 0.0f, 100.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    Frustum frustum(viewProjection);
+    const float deltaSeconds = 1.0f / 60.0f;
+
+    for (int count : { 10000, 100000 }) {
+        std::string parameters = "entities=" + std::to_string(count);
+        int side = (int)std::sqrt((float)count);
+
+        Scene scene;
+        scene.reserve(count);
+        std::vector<SceneObjectBaseline> objects(count);
+        for (int i = 0; i < count; ++i) {
+            Scene::Transform transform;
+            transform.position = glm::vec3((float)(i % side) * 3.0f - side * 1.5f, 0.0f, (float)(i / side) * 3.0f - side * 1.5f);
+            transform.rotation = glm::angleAxis((float)i, glm::vec3(0.0f, 1.0f, 0.0f));
+            AABB bounds(glm::vec3(-1.0f), glm::vec3(1.0f));
+            Scene::Renderable renderable;
+            renderable.mesh = (i % 8) * 3;
+            renderable.material = i % 16;
+            renderable.lodCount = 3;
+            renderable.lodDistance = 40.0f;
+            EntityHandle entity = scene.create(transform, bounds, renderable);
+            scene.setSpin(entity, (i % 3) * 0.5f);
+
+            SceneObjectBaseline& object = objects[i];
+            object.position = transform.position;
+            object.rotation = transform.rotation;
+            object.scale = transform.scale;
+            object.spin = (i % 3) * 0.5f;
+            object.worldMatrix = glm::mat4(1.0f);
+            object.localBounds = object.worldBounds = bounds;
+            object.renderable = renderable;
+            object.lod = 0;
+        }
+        // Both layouts cull into a list of visible indices and only collect the draws of those
+        std::vector<uint32_t> visibleObjects;
+        visibleObjects.reserve(count);
+        std::vector<DrawPacket> packets;
+        packets.reserve(count);
+
+        benchmarks.run("scene transforms", "SoA " + parameters, count, [&]() {
+            scene.updateTransforms(deltaSeconds);
+            return scene.getWorldMatrices()[count / 2][3][0];
+        });
+        benchmarks.run("scene transforms", "AoS " + parameters, count, [&]() {
+            for (SceneObjectBaseline& object : objects) {
+                if (object.spin != 0.0f)
+                    object.rotation = glm::normalize(glm::angleAxis(object.spin * deltaSeconds, glm::vec3(0.0f, 1.0f, 0.0f)) * object.rotation);
+                glm::mat4 matrix = glm::mat4_cast(object.rotation);
+                matrix[0] *= object.scale.x;
+                matrix[1] *= object.scale.y;
+                matrix[2] *= object.scale.z;
+                matrix[3] = glm::vec4(object.position, 1.0f);
+                object.worldMatrix = matrix;
+                object.worldBounds = object.localBounds.transformed(object.worldMatrix);
+            }
+            return objects[count / 2].worldMatrix[3][0];
+        });
+
+        benchmarks.run("scene cull", "SoA " + parameters, count, [&]() {
+            return (float)scene.cull(frustum).size();
+        });
+        benchmarks.run("scene cull", "AoS " + parameters, count, [&]() {
+            visibleObjects.clear();
+            for (uint32_t i = 0; i < (uint32_t)objects.size(); ++i)
+                if (frustum.intersects(objects[i].worldBounds))
+                    visibleObjects.push_back(i);
+            return (float)visibleObjects.size();
+        });
+
+        // Draw collection runs over the entities of the last cull
+        benchmarks.run("scene draws", "SoA " + parameters, count, [&]() {
+            packets.clear();
+            scene.collectDraws(cameraPosition, packets);
+            return (float)packets.size();
+        });
+        benchmarks.run("scene draws", "AoS " + parameters, count, [&]() {
+            packets.clear();
+            for (uint32_t i : visibleObjects) {
+                SceneObjectBaseline& object = objects[i];
+                float distance = glm::length(object.worldBounds.center() - cameraPosition);
+                object.lod = std::min((int)(distance / object.renderable.lodDistance), object.renderable.lodCount - 1);
+                uint32_t depthBits;
+                memcpy(&depthBits, &distance, sizeof(depthBits));
+                DrawPacket packet;
+                packet.mesh = (uint32_t)(object.renderable.mesh + object.lod);
+                packet.sortKey = (uint64_t)(object.renderable.material & 0xFFFF) << 48 | (uint64_t)(packet.mesh & 0xFFFF) << 32 | depthBits;
+                packet.object = i;
+                packets.push_back(packet);
+            }
+            return (float)packets.size();
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* repetitions = getArgument(argc, argv, "--repetitions");
+    MicroBenchmarks benchmarks(getArgument(argc, argv, "--filter"),
+        repetitions ? atoi(repetitions) : MicroBenchmarks::DEFAULT_REPETITIONS, getArgument(argc, argv, "--csv"));
+
+    benchmarkNoise(benchmarks);
+    benchmarkTerrain(benchmarks);
+    benchmarkMeshConversion(benchmarks);
+    benchmarkTextureDecode(benchmarks);
+    benchmarkTextFiles(benchmarks);
+    benchmarkCameraMath(benchmarks);
+    benchmarkSceneStorage(benchmarks);
+
+    return 0;
+}
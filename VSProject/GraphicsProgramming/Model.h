@@ -8,32 +8,65 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
 #include "stb_image.h"
+#include "Bounds.h"
+#include "Vertex.h"
+#include "IndirectRenderer.h"
+#include "CommandList.h"
+#include "PositionStream.h"
+#include "Profiler.h"
+#include "TextureStreamer.h"
+#include "MaterialArrays.h"
+#include "MaterialTable.h"
+#include "FrameArena.h"
 #include <map>
 
-struct Vertex {
-    glm::vec3 position;
-    glm::vec3 normal;
-    glm::vec3 tangent;
-    glm::vec3 bitangent;
-    glm::vec2 uv;
-};
-
 
 class Model {
+public:
+    struct OcclusionQueryStats {
+        int draws = 0;
+        // Draws that were issued inside a conditional render and turned out to be hidden
+        int skippedDraws = 0;
+        // Draws of stably visible meshes that did not need a query at all
+        int unqueriedDraws = 0;
+    };
+
 private:
+    // Visibility history of a mesh for hardware occlusion queries
+    struct OcclusionState {
+        // Two queries so the result of last frame can be read while this frame issues a new one
+        GLuint queries[2] = { 0, 0 };
+        bool pending[2] = { false, false };
+        int visibleFrames = 0;
+        int framesUntilQuery = 0;
+    };
+
     struct Mesh {
         std::vector<Vertex> vertices;
         std::vector<GLuint> indices;
         GLuint vao;
         GLuint vbo;
         GLuint ebo;
-        GLuint abledoTexture;
-        GLuint normalTexture;
-        GLuint roughnessTexture;
+        MaterialTable::MaterialId material;
+        AABB bounds;
+        // Texture coordinates per model space unit, for the mip levels of the streamed textures
+        float uvDensity;
+        // Layer of the material textures and first index of the mesh in the merged buffers, with texture arrays only
+        int layer = -1;
+        GLsizei firstIndex = 0;
+        OcclusionState occlusion;
+        PositionStream positions;
+
+        Mesh(std::vector<Vertex>& vertices, std::vector<GLuint>& indices, MaterialTable::MaterialId material)
+            : vertices(vertices), indices(indices), material(material) {
+            for (const Vertex& vertex : this->vertices)
+                bounds.expand(vertex.position);
+            uvDensity = TextureStreamer::uvDensity(this->vertices, this->indices);
 
-        Mesh(std::vector<Vertex>& vertices, std::vector<GLuint>& indices, GLuint abledoTexture, GLuint normalTexture, GLuint roughnessTexture)
-            : vertices(vertices), indices(indices), abledoTexture(abledoTexture), normalTexture(normalTexture), roughnessTexture(roughnessTexture) {
             // Create buffers/arrays
             glGenVertexArrays(1, &this->vao);
             glGenBuffers(1, &this->vbo);
@@ -67,21 +100,85 @@ private:
 
 
             glBindVertexArray(0);
+
+            positions.create(this->vertices, this->ebo, (GLsizei)this->indices.size());
         }
     };
 
     std::vector<Model::Mesh> meshes;
+    // Mesh indices sorted by material, so consecutive draws share their textures
+    std::vector<int> drawOrder;
     GLuint program;
+    UniformLocations uniforms;
     std::string directory;
     std::map<std::string, GLuint> textureCache;
+    TextureStreamer* textureStreamer = nullptr;
+    AABB bounds;
+
+    // All meshes in one vertex and index buffer with the material layer and ID as attribute 5, so a run of meshes is one draw
+    bool textureArrays = false;
+    MaterialArrays materialArrays;
+    GLuint mergedVao = 0;
+    GLuint mergedVbo = 0;
+    GLuint mergedLayerVbo = 0;
+    GLuint mergedEbo = 0;
+
+    // Hardware occlusion queries, the proxy is drawn as a unit box stretched over the mesh bounds
+    bool occlusionQueries = false;
+    GLuint proxyProgram = 0;
+    GLuint proxyVao = 0;
+    int proxyIndexCount = 0;
+    unsigned int frameIndex = 0;
+    OcclusionQueryStats occlusionStats;
+
+    // Ids of the meshes inside an IndirectRenderer
+    std::vector<int> indirectMeshes;
 
 
     unsigned int loadTexture(const char* filename);
     Model::Mesh processMesh(aiMesh* mesh, const aiScene* scene);
+    void readOcclusionResults(Model::Mesh& mesh, int slot);
+    bool issueOcclusionQuery(Model::Mesh& mesh, int slot, const glm::mat4& model, const glm::vec3& cameraPosition);
+    void createMergedBuffers();
 
 public:
-    Model(const std::string& path, GLuint program);
+    // The textures are streamed by textureStreamer when it is set, it owns them afterwards.
+    // With textureArrays the material textures are packed into texture arrays instead, the program has to be a
+    // TEXTURE_ARRAYS permutation of the complex material shaders and record() and the indirect path are not supported.
+    Model(const std::string& path, GLuint program, TextureStreamer* textureStreamer = nullptr, bool textureArrays = false);
+    // Vertex and index conversion of processMesh, needs no GL context
+    static void convertMesh(const aiMesh* mesh, std::vector<Vertex>& vertices, std::vector<GLuint>& indices);
     void render(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection, glm::vec3& ambientLightColor, glm::vec3& lightDirection);
+    // Draws the position only streams of all meshes with the program and PerObject block set by the caller
+    void renderDepth() const;
+    // Asks the texture streamer for the mip levels every mesh needs at its distance from the camera
+    void requestTextures(const glm::mat4& model, const glm::vec3& cameraPosition, float pixelScale) const;
+
+    // Switches to another variant of the material shaders with the same inputs
+    void setProgram(GLuint program) {
+        this->program = program;
+        uniforms = UniformLocations(program);
+    }
+    GLuint getProgram() const { return program; }
+    bool usesTextureArrays() const { return textureArrays; }
+
+    // Bounds of all meshes in model space
+    const AABB& getBounds() const { return bounds; }
+
+    // Draws every mesh behind a GL_ANY_SAMPLES_PASSED query on its bounding box.
+    // The proxy VAO has to contain a unit box centered around the origin at attribute 0.
+    void enableOcclusionQueries(GLuint proxyProgram, GLuint proxyVao, int proxyIndexCount);
+    const OcclusionQueryStats& getOcclusionQueryStats() const { return occlusionStats; }
+    void resetOcclusionQueryStats() { occlusionStats = OcclusionQueryStats(); }
+
+    // Copies all meshes into the shared buffers of the multi draw indirect path
+    void addToIndirectRenderer(IndirectRenderer& renderer, GLuint indirectProgram);
+    // Queues the meshes in the renderer instead of drawing them directly
+    void renderIndirect(IndirectRenderer& renderer, const glm::mat4& model);
+
+    // Records the draws into a command list so they can be executed on the render thread.
+    // Like render() the PerObject block has to be set by the caller.
+    void record(CommandList& commands, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& ambientLightColor, const glm::vec3& lightDirection) const;
 };
 
 unsigned int Model::loadTexture(const char* filename) {
@@ -89,6 +186,12 @@ unsigned int Model::loadTexture(const char* filename) {
     if (it != textureCache.end()) {
         return it->second;
     }
+    if (textureStreamer != nullptr) {
+        GLuint texture = textureStreamer->load(filename);
+        if (texture != 0)
+            textureCache[filename] = texture;
+        return texture;
+    }
 
     unsigned int textureID;
     glGenTextures(1, &textureID);
@@ -137,13 +240,7 @@ unsigned int Model::loadTexture(const char* filename) {
     return textureID;
 }
 
-Model::Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene) {
-    std::vector<Vertex> vertices;
-    std::vector<GLuint> indices;
-    GLuint abledoTexture = 0;
-    GLuint normalTexture = 0;
-    GLuint roughnessTexture = 0;
-
+void Model::convertMesh(const aiMesh* mesh, std::vector<Vertex>& vertices, std::vector<GLuint>& indices) {
     // Process vertices
     vertices.resize(mesh->mNumVertices);
     for (unsigned int i = 0; i < mesh->mNumVertices; ++i) {
@@ -165,12 +262,23 @@ Model::Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene) {
         vertices[i] = vertex;
     }
 
-    // Process indices
+    // Process indices, the faces are triangles after aiProcess_Triangulate
+    indices.clear();
+    indices.reserve((size_t)mesh->mNumFaces * 3);
     for (unsigned int i = 0; i < mesh->mNumFaces; ++i) {
-        aiFace face = mesh->mFaces[i];
+        const aiFace& face = mesh->mFaces[i];
         for (unsigned int j = 0; j < face.mNumIndices; ++j)
             indices.push_back(face.mIndices[j]);
     }
+}
+
+Model::Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene) {
+    std::vector<Vertex> vertices;
+    std::vector<GLuint> indices;
+    Material meshMaterial;
+    std::string filenames[MaterialArrays::SLOT_COUNT];
+
+    convertMesh(mesh, vertices, indices);
 
     // Process material
     if (mesh->mMaterialIndex >= 0) {
@@ -179,17 +287,82 @@ Model::Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene) {
 
         // Check for textures
         if (material->GetTexture(aiTextureType_DIFFUSE, 0, &str) == AI_SUCCESS)
-            abledoTexture = loadTexture((directory + "/" + str.C_Str()).c_str());
+            filenames[0] = directory + "/" + str.C_Str();
         if (material->GetTexture(aiTextureType_HEIGHT, 0, &str) == AI_SUCCESS)
-            normalTexture = loadTexture((directory + "/" + str.C_Str()).c_str());
+            filenames[1] = directory + "/" + str.C_Str();
         if (material->GetTexture(aiTextureType_SHININESS, 0, &str) == AI_SUCCESS)
-            roughnessTexture = loadTexture((directory + "/" + str.C_Str()).c_str());
+            filenames[2] = directory + "/" + str.C_Str();
+    }
+
+    // The texture arrays are built once all meshes are known
+    int layer = -1;
+    if (textureArrays) {
+        layer = materialArrays.addMaterial(filenames);
+    }
+    else {
+        for (int slot = 0; slot < MaterialArrays::SLOT_COUNT; ++slot)
+            if (!filenames[slot].empty())
+                meshMaterial.textures[slot] = loadTexture(filenames[slot].c_str());
+    }
+
+    Model::Mesh result(vertices, indices, materialTable.intern(meshMaterial));
+    result.layer = layer;
+    return result;
+}
+
+void Model::createMergedBuffers() {
+    std::vector<Vertex> vertices;
+    std::vector<glm::vec2> layers;
+    std::vector<GLuint> indices;
+    size_t vertexCount = 0, indexCount = 0;
+    for (const auto& mesh : meshes) {
+        vertexCount += mesh.vertices.size();
+        indexCount += mesh.indices.size();
+    }
+    vertices.reserve(vertexCount);
+    layers.reserve(vertexCount);
+    indices.reserve(indexCount);
+    for (auto& mesh : meshes) {
+        GLuint baseVertex = (GLuint)vertices.size();
+        mesh.firstIndex = (GLsizei)indices.size();
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        layers.resize(vertices.size(), glm::vec2((float)mesh.layer, (float)mesh.material));
+        for (GLuint index : mesh.indices)
+            indices.push_back(baseVertex + index);
     }
 
-    return Model::Mesh(vertices, indices, abledoTexture, normalTexture, roughnessTexture);
+    glGenVertexArrays(1, &mergedVao);
+    glGenBuffers(1, &mergedVbo);
+    glGenBuffers(1, &mergedLayerVbo);
+    glGenBuffers(1, &mergedEbo);
+    glBindVertexArray(mergedVao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mergedVbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tangent));
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bitangent));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
+
+    // Material layer and ID
+    glBindBuffer(GL_ARRAY_BUFFER, mergedLayerVbo);
+    glBufferData(GL_ARRAY_BUFFER, layers.size() * sizeof(glm::vec2), layers.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(5);
+    glVertexAttribPointer(5, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void*)0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mergedEbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    glBindVertexArray(0);
 }
 
-Model::Model(const std::string& path, GLuint program) {
+Model::Model(const std::string& path, GLuint program, TextureStreamer* textureStreamer, bool textureArrays)
+    : textureStreamer(textureStreamer), textureArrays(textureArrays) {
     Assimp::Importer importer;
     const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
     if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
@@ -200,38 +373,225 @@ Model::Model(const std::string& path, GLuint program) {
     directory = path.substr(0, path.find_last_of('/'));
 
     // Process all the meshes in the scene
-    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+    meshes.reserve(scene->mNumMeshes);
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
         meshes.push_back(processMesh(scene->mMeshes[i], scene));
+        bounds.expand(meshes.back().bounds);
+    }
+
+    drawOrder.resize(meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i)
+        drawOrder[i] = (int)i;
+    std::stable_sort(drawOrder.begin(), drawOrder.end(), [this](int a, int b) { return meshes[a].material < meshes[b].material; });
+
+    if (this->textureArrays) {
+        if (materialArrays.build()) {
+            createMergedBuffers();
+        }
+        else {
+            std::cout << "No materials for texture arrays" << std::endl;
+            this->textureArrays = false;
+        }
+    }
 
     // save the shader program
     this->program = program;
+    uniforms = UniformLocations(program);
 }
 
-void Model::render(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection, glm::vec3& ambientLightColor, glm::vec3& lightDirection) {
+void Model::renderDepth() const {
+    for (const auto& mesh : meshes)
+        mesh.positions.draw();
+}
+
+void Model::requestTextures(const glm::mat4& model, const glm::vec3& cameraPosition, float pixelScale) const {
+    if (textureStreamer == nullptr) return;
+
+    // Largest scale of the model matrix, a stretched mesh needs the finer level of its longest axis
+    float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+    for (const auto& mesh : meshes) {
+        float distance = mesh.bounds.transformed(model).distance(cameraPosition);
+        float uvDensity = mesh.uvDensity / std::max(scale, 0.0001f);
+        for (GLuint texture : materialTable.get(mesh.material).textures)
+            textureStreamer->request(texture, uvDensity, distance, pixelScale);
+    }
+}
+
+void Model::addToIndirectRenderer(IndirectRenderer& renderer, GLuint indirectProgram) {
     for (auto& mesh : meshes) {
+        IndirectRenderer::Material material;
+        material.program = indirectProgram;
+        for (int slot = 0; slot < 3; ++slot)
+            material.textures[slot] = materialTable.get(mesh.material).textures[slot];
+        indirectMeshes.push_back(renderer.addMesh(mesh.vertices, mesh.indices, material));
+    }
+}
+
+void Model::renderIndirect(IndirectRenderer& renderer, const glm::mat4& model) {
+    for (int mesh : indirectMeshes)
+        renderer.draw(mesh, model);
+}
+
+void Model::enableOcclusionQueries(GLuint proxyProgram, GLuint proxyVao, int proxyIndexCount) {
+    this->proxyProgram = proxyProgram;
+    this->proxyVao = proxyVao;
+    this->proxyIndexCount = proxyIndexCount;
+    occlusionQueries = true;
+
+    for (auto& mesh : meshes)
+        if (mesh.occlusion.queries[0] == 0)
+            glGenQueries(2, mesh.occlusion.queries);
+}
+
+void Model::readOcclusionResults(Model::Mesh& mesh, int slot) {
+    OcclusionState& state = mesh.occlusion;
+    if (!state.pending[slot]) return;
+
+    // Never wait for the GPU, a result that is not there yet is simply skipped
+    GLuint available = 0;
+    glGetQueryObjectuiv(state.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return;
+
+    GLuint anySamplesPassed = 0;
+    glGetQueryObjectuiv(state.queries[slot], GL_QUERY_RESULT, &anySamplesPassed);
+    state.pending[slot] = false;
+
+    if (anySamplesPassed) {
+        // Meshes that keep being visible are queried less and less often
+        state.visibleFrames++;
+        const int stableFrames = 4;
+        const int maxQueryInterval = 16;
+        if (state.visibleFrames >= stableFrames)
+            state.framesUntilQuery = std::min(state.visibleFrames - stableFrames + 1, maxQueryInterval);
+    }
+    else {
+        state.visibleFrames = 0;
+        state.framesUntilQuery = 0;
+        occlusionStats.skippedDraws++;
+    }
+}
+
+bool Model::issueOcclusionQuery(Model::Mesh& mesh, int slot, const glm::mat4& model, const glm::vec3& cameraPosition) {
+    OcclusionState& state = mesh.occlusion;
+    if (state.framesUntilQuery > 0) {
+        state.framesUntilQuery--;
+        return false;
+    }
+
+    // The proxy gets clipped by the near plane when the camera is inside it, just draw the mesh
+    glm::vec3 localCamera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPosition, 1.0f));
+    glm::vec3 margin = glm::vec3(0.2f);
+    if (glm::all(glm::greaterThanEqual(localCamera, mesh.bounds.min - margin)) && glm::all(glm::lessThanEqual(localCamera, mesh.bounds.max + margin)))
+        return false;
+
+    glm::mat4 proxyMatrix = model;
+    proxyMatrix = glm::translate(proxyMatrix, mesh.bounds.center());
+    proxyMatrix = glm::scale(proxyMatrix, mesh.bounds.max - mesh.bounds.min);
+    glUniformMatrix4fv(glGetUniformLocation(proxyProgram, "model"), 1, GL_FALSE, glm::value_ptr(proxyMatrix));
+
+    glBeginQuery(GL_ANY_SAMPLES_PASSED, state.queries[slot]);
+    glDrawElements(GL_TRIANGLES, proxyIndexCount, GL_UNSIGNED_INT, 0);
+    drawStats.add(proxyIndexCount);
+    glEndQuery(GL_ANY_SAMPLES_PASSED);
+    state.pending[slot] = true;
+    return true;
+}
+
+void Model::render(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection, glm::vec3& ambientLightColor, glm::vec3& lightDirection) {
+    PROFILE_SCOPE("Model::render");
+    PROFILE_GPU_SCOPE("Model::render");
+
+    // Which meshes are drawn behind a query this frame
+    FrameVector<bool> conditional(meshes.size(), false);
+
+    if (occlusionQueries) {
+        int slot = frameIndex % 2;
+        frameIndex++;
+
+        // Results of the previous frame update the visibility history
+        for (auto& mesh : meshes)
+            readOcclusionResults(mesh, 1 - slot);
+
+        // Draw all proxies first without touching the color or depth buffer
+        glUseProgram(proxyProgram);
+        glUniformMatrix4fv(glGetUniformLocation(proxyProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+        glUniformMatrix4fv(glGetUniformLocation(proxyProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+        glDisable(GL_CULL_FACE);
+        glBindVertexArray(proxyVao);
+
+        glm::vec3 cameraPosition = glm::vec3(glm::inverse(view)[3]);
+        for (size_t i = 0; i < meshes.size(); ++i)
+            conditional[i] = issueOcclusionQuery(meshes[i], slot, model, cameraPosition);
+
+        glBindVertexArray(0);
+        glEnable(GL_CULL_FACE);
+        glDepthMask(GL_TRUE);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            occlusionStats.draws++;
+            if (!conditional[i])
+                occlusionStats.unqueriedDraws++;
+        }
+    }
+
+    if (textureArrays) {
+        // Every mesh samples the same arrays, so everything is set once and the meshes between two conditional
+        // draws are a single draw of the merged buffers
+        glUseProgram(program);
+        glUniformMatrix4fv(uniforms.view, 1, GL_FALSE, glm::value_ptr(view));
+        glUniformMatrix4fv(uniforms.projection, 1, GL_FALSE, glm::value_ptr(projection));
+        glUniform1i(uniforms.albedoTexture, 0);
+        glUniform1i(uniforms.normalTexture, 1);
+        glUniform1i(uniforms.specularTexture, 2);
+        glUniform3fv(uniforms.ambientLightColor, 1, glm::value_ptr(ambientLightColor));
+        glUniform3fv(uniforms.lightDirection, 1, glm::value_ptr(lightDirection));
+        glm::vec3 cameraPosition = glm::vec3(view[3][0], view[3][1], view[3][2]);
+        glUniform3fv(uniforms.viewPos, 1, glm::value_ptr(cameraPosition));
+        materialArrays.bind();
+        glBindVertexArray(mergedVao);
+
+        // Draws the meshes from first to last, they are consecutive in the index buffer
+        auto drawMeshes = [this](size_t first, size_t last) {
+            GLsizei count = meshes[last].firstIndex + (GLsizei)meshes[last].indices.size() - meshes[first].firstIndex;
+            glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (void*)(meshes[first].firstIndex * sizeof(GLuint)));
+            drawStats.add(count);
+        };
+        size_t runStart = 0;
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            if (!conditional[i]) continue;
+            if (i > runStart)
+                drawMeshes(runStart, i - 1);
+            glBeginConditionalRender(meshes[i].occlusion.queries[(frameIndex - 1) % 2], GL_QUERY_WAIT);
+            drawMeshes(i, i);
+            glEndConditionalRender();
+            runStart = i + 1;
+        }
+        if (runStart < meshes.size())
+            drawMeshes(runStart, meshes.size() - 1);
+
+        glBindVertexArray(0);
+        return;
+    }
+
+    for (int i : drawOrder) {
+        Model::Mesh& mesh = meshes[i];
         // Use the shader program
         glUseProgram(program);
 
-        // Pass the transformation matrices to the shader
-        GLint modelLoc = glGetUniformLocation(program, "model");
+        // Pass the transformation matrices to the shader, the model matrix is in the PerObject block bound by the caller
         GLint viewLoc = glGetUniformLocation(program, "view");
         GLint projLoc = glGetUniformLocation(program, "projection");
 
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
         glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
         glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
-        // Bind textures and pass them to the shader
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, mesh.abledoTexture);
+        // Bind the textures that differ from the previous mesh and pass the units to the shader
+        materialTable.apply(mesh.material, uniforms.materialId);
         glUniform1i(glGetUniformLocation(program, "albedoTexture"), 0);
-
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, mesh.normalTexture);
         glUniform1i(glGetUniformLocation(program, "normalTexture"), 1);
-
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, mesh.roughnessTexture);
         glUniform1i(glGetUniformLocation(program, "specularTexture"), 2);
 
         glUniform3fv(glGetUniformLocation(program, "ambientLightColor"), 1, glm::value_ptr(ambientLightColor));
@@ -243,12 +603,37 @@ void Model::render(const glm::mat4& model, const glm::mat4& view, const glm::mat
         // Bind vertex array object
         glBindVertexArray(mesh.vao);
 
-        // Render the mesh
+        // Render the mesh, the GPU drops the draw by itself when the proxy had no visible samples
+        if (conditional[i])
+            glBeginConditionalRender(mesh.occlusion.queries[(frameIndex - 1) % 2], GL_QUERY_WAIT);
         glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, 0);
+        drawStats.add(mesh.indices.size());
+        if (conditional[i])
+            glEndConditionalRender();
 
-        // Unbind to cleanup
+        // Unbind to cleanup, the textures stay for the next mesh
         glBindVertexArray(0);
-        glBindTexture(GL_TEXTURE_2D, 0);
     }
 }
 
+
+void Model::record(CommandList& commands, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& ambientLightColor, const glm::vec3& lightDirection) const {
+    // All meshes share the program, so the uniforms only have to be set once
+    commands.useProgram(program);
+    commands.uniformMatrix4f(uniforms.view, view);
+    commands.uniformMatrix4f(uniforms.projection, projection);
+    commands.uniform1i(uniforms.albedoTexture, 0);
+    commands.uniform1i(uniforms.normalTexture, 1);
+    commands.uniform1i(uniforms.specularTexture, 2);
+    commands.uniform3f(uniforms.ambientLightColor, ambientLightColor);
+    commands.uniform3f(uniforms.lightDirection, lightDirection);
+    commands.uniform3f(uniforms.viewPos, glm::vec3(view[3][0], view[3][1], view[3][2]));
+
+    for (int i : drawOrder) {
+        const Model::Mesh& mesh = meshes[i];
+        materialTable.record(commands, mesh.material, uniforms.materialId);
+        commands.bindVertexArray(mesh.vao);
+        commands.drawElements((GLsizei)mesh.indices.size());
+    }
+    commands.bindVertexArray(0);
+}
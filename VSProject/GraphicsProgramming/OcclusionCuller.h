@@ -0,0 +1,340 @@
+#pragma once
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "Bounds.h"
+#include "JobSystem.h"
+
+// Depth only software rasterizer used to cull objects that are hidden behind big occluders
+// (terrain, large meshes) before they are submitted to the GPU.
+// Occluders are binned into screen tiles which are rasterized in parallel, four pixels at a time.
+// Every tile is owned by one job and depth uses a min operation, so the result does not depend
+// on thread timing.
+class OcclusionCuller {
+public:
+    static const int WIDTH = 256;
+    static const int HEIGHT = 128;
+    static const int TILE_WIDTH = 64;
+    static const int TILE_HEIGHT = 32;
+    static const int TILES_X = WIDTH / TILE_WIDTH;
+    static const int TILES_Y = HEIGHT / TILE_HEIGHT;
+
+    // Geometry that is rasterized into the occlusion buffer, usually a copy of the real mesh positions
+    struct Occluder {
+        std::vector<glm::vec3> positions;
+        std::vector<GLuint> indices;
+    };
+
+    struct Stats {
+        int occluderTriangles = 0;
+        int rasterizedTriangles = 0;
+        int testedObjects = 0;
+        int culledObjects = 0;
+    };
+
+private:
+    struct ScreenTriangle {
+        glm::vec2 vertices[3];
+        // Depth as a plane equation in screen space: z = zBase + x * zStepX + y * zStepY
+        float zBase, zStepX, zStepY;
+    };
+
+    struct PendingOccluder {
+        const Occluder* occluder;
+        glm::mat4 model;
+    };
+
+    JobSystem& jobs;
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    std::vector<PendingOccluder> pendingOccluders;
+    std::vector<glm::vec4> clipPositions;
+    std::vector<ScreenTriangle> triangles;
+    std::vector<int> tileBins[TILES_X * TILES_Y];
+
+    // Level 0 is the depth buffer itself, every next level stores the farthest depth of 2x2 texels
+    std::vector<std::vector<float>> hierarchicalDepth;
+    Stats stats;
+
+    void setupTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c);
+    void rasterizeTile(int tile);
+    void buildHierarchicalDepth();
+
+public:
+    OcclusionCuller(JobSystem& jobs);
+
+    void beginFrame(const glm::mat4& viewProjection);
+    // The occluder has to stay alive until rasterize() is called
+    void addOccluder(const Occluder& occluder, const glm::mat4& model);
+    void rasterize();
+
+    // Returns false when the box is completely hidden behind the occluders (or outside the view)
+    bool isVisible(const AABB& worldBounds);
+
+    // Writes a level of the occlusion buffer as a greyscale PGM image, near is dark and far is white
+    bool dumpDepth(const char* filename, int level = 0) const;
+
+    const Stats& getStats() const { return stats; }
+};
+
+OcclusionCuller::OcclusionCuller(JobSystem& jobs) : jobs(jobs) {
+    int width = WIDTH;
+    int height = HEIGHT;
+    while (true) {
+        hierarchicalDepth.push_back(std::vector<float>(width * height, 1.0f));
+        if (width == 1 && height == 1) break;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+}
+
+void OcclusionCuller::beginFrame(const glm::mat4& viewProjection) {
+    this->viewProjection = viewProjection;
+    pendingOccluders.clear();
+    triangles.clear();
+    for (auto& bin : tileBins)
+        bin.clear();
+    stats = Stats();
+}
+
+void OcclusionCuller::addOccluder(const Occluder& occluder, const glm::mat4& model) {
+    pendingOccluders.push_back({ &occluder, model });
+    stats.occluderTriangles += (int)occluder.indices.size() / 3;
+}
+
+void OcclusionCuller::setupTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c) {
+    // Triangles crossing the near plane are skipped, leaving them out can only make the culling less aggressive
+    const float nearLimit = 1e-4f;
+    if (a.w < nearLimit || b.w < nearLimit || c.w < nearLimit) return;
+
+    glm::vec3 ndc[3] = { glm::vec3(a) / a.w, glm::vec3(b) / b.w, glm::vec3(c) / c.w };
+
+    ScreenTriangle triangle;
+    glm::vec3 screen[3];
+    for (int i = 0; i < 3; ++i) {
+        screen[i] = glm::vec3((ndc[i].x * 0.5f + 0.5f) * WIDTH, (ndc[i].y * 0.5f + 0.5f) * HEIGHT, ndc[i].z * 0.5f + 0.5f);
+        triangle.vertices[i] = glm::vec2(screen[i]);
+    }
+
+    // Make the winding counter clockwise so the edge functions are positive inside
+    float area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y) - (screen[2].x - screen[0].x) * (screen[1].y - screen[0].y);
+    if (std::fabs(area) < 1e-6f) return;
+    if (area < 0.0f) {
+        std::swap(screen[1], screen[2]);
+        std::swap(triangle.vertices[1], triangle.vertices[2]);
+        area = -area;
+    }
+
+    // Depth plane, z is affine in screen space after the perspective divide
+    glm::vec3 edge1 = screen[1] - screen[0];
+    glm::vec3 edge2 = screen[2] - screen[0];
+    triangle.zStepX = (edge1.z * edge2.y - edge2.z * edge1.y) / area;
+    triangle.zStepY = (edge2.z * edge1.x - edge1.z * edge2.x) / area;
+    triangle.zBase = screen[0].z - screen[0].x * triangle.zStepX - screen[0].y * triangle.zStepY;
+
+    // Bin the triangle into every tile its bounding rectangle touches
+    float minX = std::min({ screen[0].x, screen[1].x, screen[2].x });
+    float maxX = std::max({ screen[0].x, screen[1].x, screen[2].x });
+    float minY = std::min({ screen[0].y, screen[1].y, screen[2].y });
+    float maxY = std::max({ screen[0].y, screen[1].y, screen[2].y });
+    float minZ = std::min({ screen[0].z, screen[1].z, screen[2].z });
+    if (maxX < 0.0f || maxY < 0.0f || minX >= WIDTH || minY >= HEIGHT || minZ > 1.0f) return;
+
+    int tileMinX = std::max((int)minX / TILE_WIDTH, 0);
+    int tileMaxX = std::min((int)maxX / TILE_WIDTH, TILES_X - 1);
+    int tileMinY = std::max((int)minY / TILE_HEIGHT, 0);
+    int tileMaxY = std::min((int)maxY / TILE_HEIGHT, TILES_Y - 1);
+
+    int triangleIndex = (int)triangles.size();
+    triangles.push_back(triangle);
+    for (int tileY = tileMinY; tileY <= tileMaxY; ++tileY)
+        for (int tileX = tileMinX; tileX <= tileMaxX; ++tileX)
+            tileBins[tileY * TILES_X + tileX].push_back(triangleIndex);
+}
+
+void OcclusionCuller::rasterize() {
+    // Transform and bin every occluder, the transform is split into fixed chunks so the order never changes
+    for (const auto& pending : pendingOccluders) {
+        const Occluder& occluder = *pending.occluder;
+        glm::mat4 modelViewProjection = viewProjection * pending.model;
+
+        clipPositions.resize(occluder.positions.size());
+        const int chunkSize = 4096;
+        int chunkCount = ((int)occluder.positions.size() + chunkSize - 1) / chunkSize;
+        jobs.parallelFor(chunkCount, [&](int chunk) {
+            size_t end = std::min(occluder.positions.size(), (size_t)(chunk + 1) * chunkSize);
+            for (size_t i = (size_t)chunk * chunkSize; i < end; ++i)
+                clipPositions[i] = modelViewProjection * glm::vec4(occluder.positions[i], 1.0f);
+        });
+
+        for (size_t i = 0; i + 2 < occluder.indices.size(); i += 3)
+            setupTriangle(clipPositions[occluder.indices[i]], clipPositions[occluder.indices[i + 1]], clipPositions[occluder.indices[i + 2]]);
+    }
+    stats.rasterizedTriangles = (int)triangles.size();
+
+    jobs.parallelFor(TILES_X * TILES_Y, [&](int tile) { rasterizeTile(tile); });
+
+    buildHierarchicalDepth();
+}
+
+void OcclusionCuller::rasterizeTile(int tile) {
+    int tileX = (tile % TILES_X) * TILE_WIDTH;
+    int tileY = (tile / TILES_X) * TILE_HEIGHT;
+    std::vector<float>& depth = hierarchicalDepth[0];
+
+    // Clear the tile to the far plane
+    for (int y = tileY; y < tileY + TILE_HEIGHT; ++y)
+        std::fill(depth.begin() + y * WIDTH + tileX, depth.begin() + y * WIDTH + tileX + TILE_WIDTH, 1.0f);
+
+    const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps();
+
+    for (int triangleIndex : tileBins[tile]) {
+        const ScreenTriangle& triangle = triangles[triangleIndex];
+        const glm::vec2* v = triangle.vertices;
+
+        // Pixel rectangle of the triangle clipped to the tile, x is aligned to the SIMD width
+        int minX = std::max((int)std::floor(std::min({ v[0].x, v[1].x, v[2].x })), tileX) & ~3;
+        int maxX = std::min((int)std::ceil(std::max({ v[0].x, v[1].x, v[2].x })), tileX + TILE_WIDTH - 1);
+        int minY = std::max((int)std::floor(std::min({ v[0].y, v[1].y, v[2].y })), tileY);
+        int maxY = std::min((int)std::ceil(std::max({ v[0].y, v[1].y, v[2].y })), tileY + TILE_HEIGHT - 1);
+
+        // Edge functions: e(x, y) = a * x + b * y + c, positive on the inside
+        float a[3], b[3], c[3];
+        for (int i = 0; i < 3; ++i) {
+            const glm::vec2& from = v[i];
+            const glm::vec2& to = v[(i + 1) % 3];
+            a[i] = from.y - to.y;
+            b[i] = to.x - from.x;
+            c[i] = from.x * to.y - from.y * to.x;
+        }
+
+        for (int y = minY; y <= maxY; ++y) {
+            float pixelY = y + 0.5f;
+            __m128 rowEdge[3];
+            for (int i = 0; i < 3; ++i)
+                rowEdge[i] = _mm_set1_ps(b[i] * pixelY + c[i]);
+            __m128 rowDepth = _mm_set1_ps(triangle.zBase + pixelY * triangle.zStepY);
+
+            for (int x = minX; x <= maxX; x += 4) {
+                __m128 pixelX = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+
+                __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), pixelX), rowEdge[0]), zero);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[1]), pixelX), rowEdge[1]), zero));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[2]), pixelX), rowEdge[2]), zero));
+                if (_mm_movemask_ps(inside) == 0) continue;
+
+                // Keep the nearest depth for every covered pixel
+                float* target = &depth[y * WIDTH + x];
+                __m128 pixelDepth = _mm_add_ps(rowDepth, _mm_mul_ps(_mm_set1_ps(triangle.zStepX), pixelX));
+                pixelDepth = _mm_max_ps(pixelDepth, zero);
+                __m128 current = _mm_loadu_ps(target);
+                __m128 nearest = _mm_min_ps(current, pixelDepth);
+                _mm_storeu_ps(target, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+            }
+        }
+    }
+}
+
+void OcclusionCuller::buildHierarchicalDepth() {
+    int width = WIDTH;
+    int height = HEIGHT;
+    for (size_t level = 1; level < hierarchicalDepth.size(); ++level) {
+        const std::vector<float>& source = hierarchicalDepth[level - 1];
+        std::vector<float>& target = hierarchicalDepth[level];
+        int sourceWidth = width;
+        int sourceHeight = height;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int sourceX = std::min(x * 2 + 1, sourceWidth - 1);
+                int sourceY = std::min(y * 2 + 1, sourceHeight - 1);
+                target[y * width + x] = std::max(
+                    std::max(source[y * 2 * sourceWidth + x * 2], source[y * 2 * sourceWidth + sourceX]),
+                    std::max(source[sourceY * sourceWidth + x * 2], source[sourceY * sourceWidth + sourceX]));
+            }
+        }
+    }
+}
+
+bool OcclusionCuller::isVisible(const AABB& worldBounds) {
+    stats.testedObjects++;
+
+    float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
+    float maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 position = glm::vec3(
+            corner & 1 ? worldBounds.max.x : worldBounds.min.x,
+            corner & 2 ? worldBounds.max.y : worldBounds.min.y,
+            corner & 4 ? worldBounds.max.z : worldBounds.min.z);
+        glm::vec4 clip = viewProjection * glm::vec4(position, 1.0f);
+
+        // The box reaches behind the camera, we cannot say anything about it
+        if (clip.w <= 1e-4f) return true;
+
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        minX = std::min(minX, (ndc.x * 0.5f + 0.5f) * WIDTH);
+        maxX = std::max(maxX, (ndc.x * 0.5f + 0.5f) * WIDTH);
+        minY = std::min(minY, (ndc.y * 0.5f + 0.5f) * HEIGHT);
+        maxY = std::max(maxY, (ndc.y * 0.5f + 0.5f) * HEIGHT);
+        minZ = std::min(minZ, ndc.z * 0.5f + 0.5f);
+    }
+
+    // Completely outside of the view
+    if (maxX < 0.0f || maxY < 0.0f || minX >= WIDTH || minY >= HEIGHT || minZ > 1.0f) {
+        stats.culledObjects++;
+        return false;
+    }
+
+    int pixelMinX = std::max((int)minX, 0);
+    int pixelMaxX = std::min((int)maxX, WIDTH - 1);
+    int pixelMinY = std::max((int)minY, 0);
+    int pixelMaxY = std::min((int)maxY, HEIGHT - 1);
+
+    // Pick the level where the rectangle covers at most a few texels
+    int level = 0;
+    while (level + 1 < (int)hierarchicalDepth.size() && std::max(pixelMaxX - pixelMinX, pixelMaxY - pixelMinY) >> level > 3)
+        level++;
+
+    int levelWidth = std::max(WIDTH >> level, 1);
+    const std::vector<float>& depth = hierarchicalDepth[level];
+    const float bias = 1e-5f;
+    for (int y = pixelMinY >> level; y <= pixelMaxY >> level; ++y)
+        for (int x = pixelMinX >> level; x <= pixelMaxX >> level; ++x)
+            if (depth[y * levelWidth + x] + bias >= minZ)
+                return true;
+
+    stats.culledObjects++;
+    return false;
+}
+
+bool OcclusionCuller::dumpDepth(const char* filename, int level) const {
+    if (level < 0 || level >= (int)hierarchicalDepth.size()) return false;
+
+    int width = std::max(WIDTH >> level, 1);
+    int height = std::max(HEIGHT >> level, 1);
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+
+    file << "P5\n" << width << " " << height << "\n255\n";
+    // PGM rows go from top to bottom, the buffer starts at the bottom like OpenGL
+    std::vector<unsigned char> row(width);
+    for (int y = height - 1; y >= 0; --y) {
+        for (int x = 0; x < width; ++x) {
+            // Perspective depth is bunched up near 1, spread it out a bit so the image is readable
+            float value = std::pow(hierarchicalDepth[level][y * width + x], 32.0f);
+            row[x] = (unsigned char)(glm::clamp(value, 0.0f, 1.0f) * 255.0f);
+        }
+        file.write((const char*)row.data(), width);
+    }
+    return true;
+}
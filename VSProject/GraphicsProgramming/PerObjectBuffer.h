@@ -0,0 +1,92 @@
+#pragma once
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "RingBuffer.h"
+
+// Matches the std140 PerObject uniform block in the vertex shaders
+struct PerObjectData {
+    glm::mat4 model;
+};
+
+// Per object shader data for a whole frame in one uniform buffer.
+// All objects are written in a single pass into the ring buffer and every draw only has to
+// select its slice with glBindBufferRange instead of uploading uniforms one by one.
+// When the ring buffer is full the objects are kept on the CPU and bind() uploads them one by one into a small
+// buffer of its own, slow but still correct.
+class PerObjectBuffer {
+public:
+    static const GLuint BINDING = 0;
+
+private:
+    RingBuffer& ringBuffer;
+    RingBuffer::Allocation allocation;
+    // Distance between two objects, sizeof(PerObjectData) rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    GLsizeiptr stride = 0;
+    int objectCount = 0;
+    // Only used while the ring buffer is full
+    GLuint fallbackBuffer = 0;
+    std::vector<PerObjectData> fallbackData;
+
+public:
+    PerObjectBuffer(RingBuffer& ringBuffer) : ringBuffer(ringBuffer) {}
+
+    // Connects the PerObject block of a program to the binding point used by bind()
+    static void setupProgram(GLuint program);
+
+    // Reserves room for this frame's objects, returns false when the ring buffer is full
+    bool begin(int objectCount);
+    void set(int object, const PerObjectData& data);
+    // Makes the data visible to the GPU, has to be called after all set() calls and before the first draw
+    void upload() { ringBuffer.flush(); }
+    // Selects the object for the following draws
+    void bind(int object);
+    void destroy();
+};
+
+void PerObjectBuffer::setupProgram(GLuint program) {
+    GLuint blockIndex = glGetUniformBlockIndex(program, "PerObject");
+    if (blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, blockIndex, BINDING);
+}
+
+bool PerObjectBuffer::begin(int objectCount) {
+    GLsizeiptr alignment = ringBuffer.getUniformAlignment();
+    stride = (sizeof(PerObjectData) + alignment - 1) / alignment * alignment;
+    this->objectCount = objectCount;
+
+    allocation = ringBuffer.allocateUniforms(stride * objectCount);
+    if (allocation.data != nullptr)
+        return true;
+
+    fallbackData.resize(objectCount);
+    if (fallbackBuffer == 0) {
+        glGenBuffers(1, &fallbackBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, fallbackBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(PerObjectData), nullptr, GL_STREAM_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    return false;
+}
+
+void PerObjectBuffer::set(int object, const PerObjectData& data) {
+    if (allocation.data == nullptr)
+        fallbackData[object] = data;
+    else
+        *(PerObjectData*)((unsigned char*)allocation.data + object * stride) = data;
+}
+
+void PerObjectBuffer::bind(int object) {
+    if (allocation.data == nullptr) {
+        glBindBufferBase(GL_UNIFORM_BUFFER, BINDING, fallbackBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(PerObjectData), &fallbackData[object]);
+        return;
+    }
+    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING, ringBuffer.getBuffer(), allocation.offset + object * stride, sizeof(PerObjectData));
+}
+
+void PerObjectBuffer::destroy() {
+    if (fallbackBuffer != 0)
+        glDeleteBuffers(1, &fallbackBuffer);
+    fallbackBuffer = 0;
+}
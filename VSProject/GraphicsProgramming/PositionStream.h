@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "Vertex.h"
+#include "DrawStats.h"
+
+// Tightly packed copy of the positions of a mesh for depth only passes.
+// Depth passes only need 12 bytes per vertex instead of the whole interleaved Vertex, the index buffer is shared.
+struct PositionStream {
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLsizei indexCount = 0;
+
+    void create(const std::vector<Vertex>& vertices, GLuint ebo, GLsizei indexCount);
+    void destroy();
+    void draw() const;
+};
+
+void PositionStream::create(const std::vector<Vertex>& vertices, GLuint ebo, GLsizei indexCount) {
+    this->indexCount = indexCount;
+
+    std::vector<glm::vec3> positions;
+    positions.reserve(vertices.size());
+    for (const Vertex& vertex : vertices)
+        positions.push_back(vertex.position);
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+
+    glBindVertexArray(0);
+}
+
+void PositionStream::destroy() {
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &vbo);
+    vao = 0;
+    vbo = 0;
+}
+
+void PositionStream::draw() const {
+    glBindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, 0);
+    drawStats.add(indexCount);
+    glBindVertexArray(0);
+}
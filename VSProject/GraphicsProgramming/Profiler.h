@@ -0,0 +1,240 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <glad/glad.h>
+
+// Frame profiler with scoped CPU timers and GPU timestamp queries.
+// Finished scopes go into a rolling buffer of the last MAX_EVENTS events that can be written out as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev). GPU scopes write a GL_TIMESTAMP query at both ends with glQueryCounter.
+// The results are read GPU_LATENCY frames later so the CPU never waits for them, and they are moved onto the CPU
+// timeline with the offset between both clocks measured in the frame they were issued.
+// While disabled every scope costs one branch on a bool. Building with PROFILING 0 removes the scopes completely.
+#ifndef PROFILING
+#define PROFILING 1
+#endif
+
+class Profiler {
+public:
+    static const int MAX_EVENTS = 1 << 16;
+    static const int GPU_LATENCY = 3;
+    static const int MAX_GPU_SCOPES = 64;
+
+    struct Event {
+        // Names have to be string literals, only the pointer is stored
+        const char* name;
+        int64_t startMicroseconds;
+        int64_t durationMicroseconds;
+        // CPU thread index, or GPU_THREAD
+        int thread;
+    };
+    static const int GPU_THREAD = 1000;
+
+private:
+    struct GpuScope {
+        const char* name;
+        GLuint queries[2];
+    };
+    struct GpuFrame {
+        GpuScope scopes[MAX_GPU_SCOPES];
+        int scopeCount = 0;
+        // CPU minus GPU time in microseconds when the frame started
+        int64_t clockOffset = 0;
+    };
+
+    bool enabled = false;
+    bool gpuEnabled = false;
+    std::chrono::high_resolution_clock::time_point epoch = std::chrono::high_resolution_clock::now();
+
+    std::unique_ptr<Event[]> events;
+    std::atomic<uint64_t> eventCount{ 0 };
+    std::atomic<int> threadCount{ 0 };
+
+    GpuFrame gpuFrames[GPU_LATENCY + 1];
+    int64_t frameIndex = 0;
+    int droppedGpuScopes = 0;
+
+    void readGpuFrame(GpuFrame& frame);
+
+public:
+    // The GPU scopes need a current context and may only be used on its thread
+    void enable(bool gpu);
+    void disable();
+    bool isEnabled() const { return enabled; }
+
+    // Collects the GPU scopes of an old frame and starts a new one, called on the context thread
+    void beginFrame();
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - epoch).count();
+    }
+    void addEvent(const char* name, int64_t start, int64_t duration, int thread);
+    // Small index of the calling thread, assigned on its first event
+    int getThreadIndex();
+
+    // Returns the index of the scope to end, or -1 when the frame has no queries left
+    int beginGpuScope(const char* name);
+    void endGpuScope(int scope);
+
+    // Must not run while other threads are inside a scope
+    bool exportChromeTrace(const char* path) const;
+    int getDroppedGpuScopes() const { return droppedGpuScopes; }
+};
+
+Profiler profiler;
+
+class ProfileScope {
+private:
+    const char* name;
+    int64_t start;
+
+public:
+    explicit ProfileScope(const char* name) : name(name), start(profiler.isEnabled() ? profiler.now() : -1) {}
+    ~ProfileScope() {
+        if (start >= 0)
+            profiler.addEvent(name, start, profiler.now() - start, profiler.getThreadIndex());
+    }
+};
+
+class GpuProfileScope {
+private:
+    int scope;
+
+public:
+    explicit GpuProfileScope(const char* name) : scope(profiler.isEnabled() ? profiler.beginGpuScope(name) : -1) {}
+    ~GpuProfileScope() {
+        if (scope >= 0)
+            profiler.endGpuScope(scope);
+    }
+};
+
+#define PROFILE_CONCATENATE_(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_(a, b)
+#if PROFILING
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCATENATE(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCATENATE(gpuProfileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#endif
+
+void Profiler::enable(bool gpu) {
+    if (!events)
+        events.reset(new Event[MAX_EVENTS]);
+
+    if (gpu && !gpuEnabled) {
+        for (GpuFrame& frame : gpuFrames) {
+            for (GpuScope& scope : frame.scopes)
+                glGenQueries(2, scope.queries);
+            frame.scopeCount = 0;
+        }
+    }
+    gpuEnabled = gpuEnabled || gpu;
+    enabled = true;
+}
+
+void Profiler::disable() {
+    enabled = false;
+    if (gpuEnabled) {
+        for (GpuFrame& frame : gpuFrames) {
+            for (GpuScope& scope : frame.scopes)
+                glDeleteQueries(2, scope.queries);
+            frame.scopeCount = 0;
+        }
+        gpuEnabled = false;
+    }
+}
+
+void Profiler::readGpuFrame(GpuFrame& frame) {
+    for (int i = 0; i < frame.scopeCount; ++i) {
+        GpuScope& scope = frame.scopes[i];
+
+        // The end query is the last one written, when it is done the start is as well
+        GLuint available = 0;
+        glGetQueryObjectuiv(scope.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            droppedGpuScopes++;
+            continue;
+        }
+
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(scope.queries[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(scope.queries[1], GL_QUERY_RESULT, &end);
+        addEvent(scope.name, (int64_t)(start / 1000) + frame.clockOffset, (int64_t)(end - start) / 1000, GPU_THREAD);
+    }
+    frame.scopeCount = 0;
+}
+
+void Profiler::beginFrame() {
+    if (!enabled || !gpuEnabled) return;
+
+    // The oldest frame is reused, its queries were issued GPU_LATENCY frames ago
+    frameIndex++;
+    GpuFrame& frame = gpuFrames[frameIndex % (GPU_LATENCY + 1)];
+    readGpuFrame(frame);
+
+    // GL_TIMESTAMP is the GPU time at which all earlier commands have been submitted, close enough to now
+    GLint64 gpuTime = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+    frame.clockOffset = now() - gpuTime / 1000;
+}
+
+void Profiler::addEvent(const char* name, int64_t start, int64_t duration, int thread) {
+    uint64_t index = eventCount.fetch_add(1, std::memory_order_relaxed);
+    Event& event = events[index % MAX_EVENTS];
+    event.name = name;
+    event.startMicroseconds = start;
+    event.durationMicroseconds = duration;
+    event.thread = thread;
+}
+
+int Profiler::getThreadIndex() {
+    thread_local int index = -1;
+    if (index < 0)
+        index = threadCount.fetch_add(1);
+    return index;
+}
+
+int Profiler::beginGpuScope(const char* name) {
+    if (!gpuEnabled) return -1;
+
+    GpuFrame& frame = gpuFrames[frameIndex % (GPU_LATENCY + 1)];
+    if (frame.scopeCount == MAX_GPU_SCOPES) {
+        droppedGpuScopes++;
+        return -1;
+    }
+
+    int scope = frame.scopeCount++;
+    frame.scopes[scope].name = name;
+    glQueryCounter(frame.scopes[scope].queries[0], GL_TIMESTAMP);
+    return scope;
+}
+
+void Profiler::endGpuScope(int scope) {
+    glQueryCounter(gpuFrames[frameIndex % (GPU_LATENCY + 1)].scopes[scope].queries[1], GL_TIMESTAMP);
+}
+
+bool Profiler::exportChromeTrace(const char* path) const {
+    if (!events) return false;
+
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) return false;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", GPU_THREAD);
+    for (int thread = 0; thread < threadCount.load(); ++thread)
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"CPU %d\"}}", thread, thread);
+
+    uint64_t count = eventCount.load();
+    uint64_t first = count > (uint64_t)MAX_EVENTS ? count - MAX_EVENTS : 0;
+    for (uint64_t i = first; i < count; ++i) {
+        const Event& event = events[i % MAX_EVENTS];
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+            event.name, event.thread, (long long)event.startMicroseconds, (long long)event.durationMicroseconds);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include "CommandList.h"
+#include "RingBuffer.h"
+
+// Owns the GL context on a dedicated thread.
+// The main thread records frame N into one command list while the render thread executes frame N-1 from
+// the other one. The two threads only share two frame counters, the main thread may record a list once the
+// render thread has executed the frame that used it before, and the render thread may execute a list once
+// the main thread has recorded it.
+class RenderThread {
+public:
+    struct Stats {
+        int frames = 0;
+        // Time the main thread spent waiting for a free command list
+        double waitMilliseconds = 0.0;
+        // Time the render thread spent executing command lists and swapping buffers
+        double executeMilliseconds = 0.0;
+        double swapMilliseconds = 0.0;
+    };
+
+private:
+    GLFWwindow* window;
+    RingBuffer& ringBuffer;
+    CommandList commandLists[2];
+    std::thread thread;
+
+    std::atomic<bool> running;
+    std::atomic<unsigned> recordedFrames;
+    std::atomic<unsigned> executedFrames;
+
+    // Written by the render thread, read and reset by the main thread
+    std::atomic<int64_t> executeMicroseconds;
+    std::atomic<int64_t> swapMicroseconds;
+    // Only touched by the main thread
+    double waitMilliseconds = 0.0;
+    int frames = 0;
+
+    void run();
+
+    static int64_t microsecondsSince(std::chrono::high_resolution_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+public:
+    RenderThread(GLFWwindow* window, RingBuffer& ringBuffer)
+        : window(window), ringBuffer(ringBuffer), running(false), recordedFrames(0), executedFrames(0), executeMicroseconds(0), swapMicroseconds(0) {}
+
+    // Moves the context of the window from the calling thread to the render thread
+    void start();
+    // Executes the frames that are still queued and moves the context back to the calling thread
+    void stop();
+
+    // Returns the command list to record the next frame into, waits while the render thread still needs it
+    CommandList& beginFrame();
+    // Hands the recorded frame over to the render thread
+    void submitFrame() { recordedFrames.fetch_add(1, std::memory_order_release); frames++; }
+
+    // Statistics since the last call
+    Stats takeStats();
+};
+
+void RenderThread::start() {
+    glfwMakeContextCurrent(NULL);
+    running.store(true);
+    thread = std::thread(&RenderThread::run, this);
+}
+
+void RenderThread::stop() {
+    if (!running.load()) return;
+
+    while (executedFrames.load(std::memory_order_acquire) != recordedFrames.load(std::memory_order_relaxed))
+        std::this_thread::yield();
+    running.store(false);
+    thread.join();
+
+    glfwMakeContextCurrent(window);
+}
+
+CommandList& RenderThread::beginFrame() {
+    // Frame N reuses the list of frame N-2, which is free as soon as frame N-2 has been executed
+    unsigned frame = recordedFrames.load(std::memory_order_relaxed);
+    if (executedFrames.load(std::memory_order_acquire) + 1 < frame) {
+        auto start = std::chrono::high_resolution_clock::now();
+        while (executedFrames.load(std::memory_order_acquire) + 1 < frame)
+            std::this_thread::yield();
+        waitMilliseconds += microsecondsSince(start) / 1000.0;
+    }
+
+    CommandList& commands = commandLists[frame % 2];
+    commands.reset();
+    return commands;
+}
+
+void RenderThread::run() {
+    glfwMakeContextCurrent(window);
+
+    while (true) {
+        unsigned frame = executedFrames.load(std::memory_order_relaxed);
+        if (frame == recordedFrames.load(std::memory_order_acquire)) {
+            if (!running.load()) break;
+            std::this_thread::yield();
+            continue;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        ringBuffer.beginFrame();
+        commandLists[frame % 2].execute(ringBuffer);
+        ringBuffer.endFrame();
+        executeMicroseconds.fetch_add(microsecondsSince(start), std::memory_order_relaxed);
+
+        // The list is not needed anymore, the main thread can start recording into it while this thread swaps
+        executedFrames.store(frame + 1, std::memory_order_release);
+
+        start = std::chrono::high_resolution_clock::now();
+        glfwSwapBuffers(window);
+        swapMicroseconds.fetch_add(microsecondsSince(start), std::memory_order_relaxed);
+    }
+
+    glfwMakeContextCurrent(NULL);
+}
+
+RenderThread::Stats RenderThread::takeStats() {
+    Stats stats;
+    stats.frames = frames;
+    stats.waitMilliseconds = waitMilliseconds;
+    stats.executeMilliseconds = executeMicroseconds.exchange(0, std::memory_order_relaxed) / 1000.0;
+    stats.swapMilliseconds = swapMicroseconds.exchange(0, std::memory_order_relaxed) / 1000.0;
+
+    frames = 0;
+    waitMilliseconds = 0.0;
+    return stats;
+}
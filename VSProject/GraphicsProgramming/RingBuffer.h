@@ -0,0 +1,176 @@
+#pragma once
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <glad/glad.h>
+#include "GLExtensions.h"
+
+// Triple buffered ring allocator for data that changes every frame (uniforms, instances, streaming vertices).
+// The buffer is split into one segment per frame in flight. A fence is placed after the last draw that
+// reads a segment and waited on before the CPU writes into that segment again, so the driver never has to
+// rename or stall on the buffer.
+// With GL_ARB_buffer_storage the buffer is mapped once and stays mapped, otherwise the data is staged in
+// system memory and uploaded with a single glBufferSubData per frame in flush().
+class RingBuffer {
+public:
+    static const int FRAME_COUNT = 3;
+
+    struct Allocation {
+        // Where the CPU writes the data, nullptr when the frame segment is full
+        void* data = nullptr;
+        // Offset from the start of the buffer, as used by glBindBufferRange or indirect draws
+        GLintptr offset = 0;
+        GLsizeiptr size = 0;
+    };
+
+    struct Stats {
+        size_t bytesWritten = 0;
+        double fenceWaitMilliseconds = 0.0;
+        int failedAllocations = 0;
+    };
+
+private:
+    GLuint buffer = 0;
+    GLsizeiptr segmentSize = 0;
+    bool persistent = false;
+    unsigned char* mapped = nullptr;
+    std::vector<unsigned char> staging;
+    GLsync fences[FRAME_COUNT] = { 0, 0, 0 };
+
+    int segment = 0;
+    GLsizeiptr head = 0;
+    GLsizeiptr flushed = 0;
+    GLint uniformAlignment = 256;
+    GLint storageAlignment = 256;
+    Stats stats;
+
+public:
+    // Allocates frameSize bytes for every frame in flight
+    void create(GLsizeiptr frameSize);
+    void destroy();
+
+    // Waits until the GPU is done with the segment of this frame and resets the allocator
+    void beginFrame();
+    Allocation allocate(GLsizeiptr size, GLsizeiptr alignment);
+    // Ranges that will be bound as uniform blocks
+    Allocation allocateUniforms(GLsizeiptr size) { return allocate(size, uniformAlignment); }
+    // Ranges that will be bound as shader storage blocks (instance and per draw data)
+    Allocation allocateStorage(GLsizeiptr size) { return allocate(size, storageAlignment); }
+    // Vertices that are read with glVertexAttribPointer, offsets have to be a multiple of the stride
+    Allocation allocateVertices(GLsizeiptr size, GLsizeiptr stride) { return allocate(size, stride); }
+    // Makes everything written this frame visible to the GPU, has to be called before the draws that use it
+    void flush();
+    // Fences the segment after the last draw that reads from it
+    void endFrame();
+
+    GLuint getBuffer() const { return buffer; }
+    bool isPersistent() const { return persistent; }
+    GLint getUniformAlignment() const { return uniformAlignment; }
+    // Statistics of the current frame
+    const Stats& getStats() const { return stats; }
+};
+
+void RingBuffer::create(GLsizeiptr frameSize) {
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+    if (hasGLVersion(4, 3))
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storageAlignment);
+
+    // Keep the segments aligned to the usual offset alignments, so they do not waste space at the segment start
+    segmentSize = (frameSize + 255) & ~(GLsizeiptr)255;
+    GLsizeiptr totalSize = segmentSize * FRAME_COUNT;
+
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+
+    persistent = glExtensions.bufferStorage;
+    if (persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glExtensions.glBufferStorage(GL_COPY_WRITE_BUFFER, totalSize, nullptr, flags);
+        mapped = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, totalSize, flags);
+        if (mapped == nullptr) {
+            std::cerr << "Failed to persistently map the ring buffer, falling back to glBufferSubData" << std::endl;
+            glDeleteBuffers(1, &buffer);
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            persistent = false;
+        }
+    }
+    if (!persistent) {
+        glBufferData(GL_COPY_WRITE_BUFFER, totalSize, nullptr, GL_STREAM_DRAW);
+        staging.resize(segmentSize);
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void RingBuffer::destroy() {
+    for (GLsync& fence : fences) {
+        if (fence) glDeleteSync(fence);
+        fence = 0;
+    }
+    if (persistent) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+    mapped = nullptr;
+}
+
+void RingBuffer::beginFrame() {
+    segment = (segment + 1) % FRAME_COUNT;
+    head = 0;
+    flushed = 0;
+    stats = Stats();
+
+    GLsync& fence = fences[segment];
+    if (fence) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Usually signaled already, only waits when the CPU runs more than FRAME_COUNT frames ahead
+        const GLuint64 timeout = 100000000; // 100 ms
+        GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        while (result == GL_TIMEOUT_EXPIRED)
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+
+        stats.fenceWaitMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        glDeleteSync(fence);
+        fence = 0;
+    }
+}
+
+RingBuffer::Allocation RingBuffer::allocate(GLsizeiptr size, GLsizeiptr alignment) {
+    Allocation allocation;
+    // Align the offset in the buffer, the segment start is only a multiple of 256 and not of every vertex stride
+    GLsizeiptr base = segment * segmentSize;
+    GLsizeiptr start = (base + head + alignment - 1) / alignment * alignment - base;
+    if (start + size > segmentSize) {
+        stats.failedAllocations++;
+        return allocation;
+    }
+
+    head = start + size;
+    stats.bytesWritten += size;
+
+    allocation.offset = segment * segmentSize + start;
+    allocation.size = size;
+    allocation.data = persistent ? mapped + allocation.offset : staging.data() + start;
+    return allocation;
+}
+
+void RingBuffer::flush() {
+    // Coherent persistent mappings are visible to the GPU without any calls
+    if (persistent || head == flushed) return;
+
+    // Only upload what was allocated since the last flush
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, segment * segmentSize + flushed, head - flushed, staging.data() + flushed);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    flushed = head;
+}
+
+void RingBuffer::endFrame() {
+    fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
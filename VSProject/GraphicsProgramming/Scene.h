@@ -0,0 +1,324 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "Bounds.h"
+#include "DrawList.h"
+#include "DynamicBVH.h"
+
+// Handle of an entity. The generation changes every time a slot is reused, so a handle to a removed entity never
+// reaches the entity that took its place.
+struct EntityHandle {
+    uint32_t index = 0xFFFFFFFF;
+    uint32_t generation = 0;
+
+    bool operator==(const EntityHandle& other) const { return index == other.index && generation == other.generation; }
+    bool operator!=(const EntityHandle& other) const { return !(*this == other); }
+};
+
+// Entity store of the scene with one contiguous array per component, structure of arrays.
+// Every entity has all components, entity i of the dense arrays owns element i of every array. Removing an entity
+// moves the last one into its place, so the arrays never have holes and the systems below always run over packed
+// memory and only touch the arrays they need. Handles go through a slot table to find the dense index.
+// With the spatial index enabled, every entity also has a proxy in a DynamicBVH that updateTransforms keeps up to
+// date, and culling, raycasts and sphere queries go through the tree instead of testing every entity.
+class Scene {
+public:
+    // Transform of an entity, the world matrix and bounds are derived from it by updateTransforms
+    struct Transform {
+        glm::vec3 position = glm::vec3(0.0f);
+        glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        glm::vec3 scale = glm::vec3(1.0f);
+    };
+
+    // What the draw collection needs, same meaning as in SceneObject
+    struct Renderable {
+        int mesh = 0;
+        int material = 0;
+        int lodCount = 1;
+        float lodDistance = FLT_MAX;
+    };
+
+    struct Stats {
+        int entities = 0;
+        int visibleEntities = 0;
+        int lodChanges = 0;
+    };
+
+private:
+    struct Slot {
+        uint32_t generation = 0;
+        // Index into the dense arrays, or the next free slot while the slot is unused
+        uint32_t denseIndex = 0;
+        bool alive = false;
+    };
+
+    std::vector<Slot> slots;
+    uint32_t firstFreeSlot = 0xFFFFFFFF;
+
+    // Dense component arrays
+    std::vector<uint32_t> slotOfEntity;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+    // Radians per second around the y axis
+    std::vector<float> spins;
+    std::vector<glm::mat4> worldMatrices;
+    std::vector<AABB> localBounds;
+    std::vector<AABB> worldBounds;
+    std::vector<Renderable> renderables;
+    // LOD used in the last collectDraws
+    std::vector<int> lods;
+
+    // Proxies in the spatial index, only while it is enabled. The object of a proxy is the dense index of its
+    // entity, so queries do not need the slot table.
+    std::vector<int> proxies;
+    DynamicBVH spatialIndex;
+    bool indexed = false;
+
+    // Dense indices of the entities that passed the last cull
+    std::vector<uint32_t> visible;
+    Stats stats;
+
+    template<typename T>
+    static void removeSwap(std::vector<T>& array, uint32_t index) {
+        array[index] = array.back();
+        array.pop_back();
+    }
+
+public:
+    EntityHandle create(const Transform& transform, const AABB& bounds, const Renderable& renderable);
+    void remove(EntityHandle entity);
+    bool isAlive(EntityHandle entity) const {
+        return entity.index < slots.size() && slots[entity.index].alive && slots[entity.index].generation == entity.generation;
+    }
+    void reserve(size_t count);
+    // Adds all entities to the spatial index and keeps it up to date from now on
+    void enableSpatialIndex();
+
+    // Accessors for single entities, the handle has to be alive
+    uint32_t getDenseIndex(EntityHandle entity) const { return slots[entity.index].denseIndex; }
+    void setTransform(EntityHandle entity, const Transform& transform);
+    void setSpin(EntityHandle entity, float radiansPerSecond) { spins[getDenseIndex(entity)] = radiansPerSecond; }
+    const glm::mat4& getWorldMatrix(EntityHandle entity) const { return worldMatrices[getDenseIndex(entity)]; }
+    const AABB& getWorldBounds(EntityHandle entity) const { return worldBounds[getDenseIndex(entity)]; }
+    size_t size() const { return positions.size(); }
+
+    // Systems, each one a linear pass over the arrays it needs.
+    // Turns the spinning entities, then rebuilds the world matrices and bounds
+    void updateTransforms(float deltaSeconds);
+    // Keeps the entities whose world bounds intersect the frustum, the fat bounds with the spatial index, returns
+    // their dense indices
+    const std::vector<uint32_t>& cull(const Frustum& frustum);
+    // Selects the LOD of every visible entity and appends its draw with the sort key of DrawListBuilder, unsorted.
+    // The object of the packets is the slot index of the handle, which stays the same while the entity lives.
+    void collectDraws(const glm::vec3& cameraPosition, std::vector<DrawPacket>& packets);
+
+    // Closest entity whose world bounds the ray hits before maxDistance, an invalid handle when there is none.
+    // Only with the spatial index.
+    EntityHandle raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& distance) const;
+    // Appends the entities whose world bounds are within radius of the center. Only with the spatial index.
+    void querySphere(const glm::vec3& center, float radius, std::vector<EntityHandle>& entities) const;
+
+    const std::vector<glm::mat4>& getWorldMatrices() const { return worldMatrices; }
+    const DynamicBVH& getSpatialIndex() const { return spatialIndex; }
+    const Stats& getStats() const { return stats; }
+};
+
+EntityHandle Scene::create(const Transform& transform, const AABB& bounds, const Renderable& renderable) {
+    uint32_t slotIndex;
+    if (firstFreeSlot != 0xFFFFFFFF) {
+        slotIndex = firstFreeSlot;
+        firstFreeSlot = slots[slotIndex].denseIndex;
+    }
+    else {
+        slotIndex = (uint32_t)slots.size();
+        slots.push_back(Slot());
+    }
+
+    Slot& slot = slots[slotIndex];
+    slot.alive = true;
+    slot.denseIndex = (uint32_t)positions.size();
+
+    slotOfEntity.push_back(slotIndex);
+    positions.push_back(transform.position);
+    rotations.push_back(transform.rotation);
+    scales.push_back(transform.scale);
+    spins.push_back(0.0f);
+    worldMatrices.push_back(glm::mat4(1.0f));
+    localBounds.push_back(bounds);
+    worldBounds.push_back(bounds);
+    renderables.push_back(renderable);
+    lods.push_back(0);
+    if (indexed)
+        proxies.push_back(spatialIndex.createProxy(bounds, slot.denseIndex));
+    stats.entities = (int)positions.size();
+
+    EntityHandle handle;
+    handle.index = slotIndex;
+    handle.generation = slot.generation;
+    return handle;
+}
+
+void Scene::remove(EntityHandle entity) {
+    if (!isAlive(entity)) return;
+    Slot& slot = slots[entity.index];
+    uint32_t index = slot.denseIndex;
+
+    // The last entity moves into the hole
+    slots[slotOfEntity.back()].denseIndex = index;
+    removeSwap(slotOfEntity, index);
+    removeSwap(positions, index);
+    removeSwap(rotations, index);
+    removeSwap(scales, index);
+    removeSwap(spins, index);
+    removeSwap(worldMatrices, index);
+    removeSwap(localBounds, index);
+    removeSwap(worldBounds, index);
+    removeSwap(renderables, index);
+    removeSwap(lods, index);
+    if (indexed) {
+        spatialIndex.destroyProxy(proxies[index]);
+        removeSwap(proxies, index);
+        if (index < proxies.size())
+            spatialIndex.setObject(proxies[index], index);
+    }
+    stats.entities = (int)positions.size();
+
+    slot.alive = false;
+    slot.generation++;
+    slot.denseIndex = firstFreeSlot;
+    firstFreeSlot = entity.index;
+}
+
+void Scene::reserve(size_t count) {
+    slots.reserve(count);
+    slotOfEntity.reserve(count);
+    positions.reserve(count);
+    rotations.reserve(count);
+    scales.reserve(count);
+    spins.reserve(count);
+    worldMatrices.reserve(count);
+    localBounds.reserve(count);
+    worldBounds.reserve(count);
+    renderables.reserve(count);
+    lods.reserve(count);
+    visible.reserve(count);
+    if (indexed) {
+        proxies.reserve(count);
+        spatialIndex.reserve(count);
+    }
+}
+
+void Scene::enableSpatialIndex() {
+    if (indexed) return;
+    indexed = true;
+    spatialIndex.reserve(positions.capacity());
+    proxies.reserve(positions.capacity());
+    for (size_t i = 0; i < positions.size(); ++i)
+        proxies.push_back(spatialIndex.createProxy(worldBounds[i], (uint32_t)i));
+    spatialIndex.rebuild();
+}
+
+void Scene::setTransform(EntityHandle entity, const Transform& transform) {
+    uint32_t index = getDenseIndex(entity);
+    positions[index] = transform.position;
+    rotations[index] = transform.rotation;
+    scales[index] = transform.scale;
+}
+
+void Scene::updateTransforms(float deltaSeconds) {
+    size_t count = positions.size();
+    for (size_t i = 0; i < count; ++i) {
+        if (spins[i] != 0.0f)
+            rotations[i] = glm::normalize(glm::angleAxis(spins[i] * deltaSeconds, glm::vec3(0.0f, 1.0f, 0.0f)) * rotations[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        // translate * rotate * scale without the full matrix products
+        glm::mat4 matrix = glm::mat4_cast(rotations[i]);
+        matrix[0] *= scales[i].x;
+        matrix[1] *= scales[i].y;
+        matrix[2] *= scales[i].z;
+        matrix[3] = glm::vec4(positions[i], 1.0f);
+        worldMatrices[i] = matrix;
+    }
+    if (!indexed) {
+        for (size_t i = 0; i < count; ++i)
+            worldBounds[i] = localBounds[i].transformed(worldMatrices[i]);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 previousCenter = worldBounds[i].center();
+        worldBounds[i] = localBounds[i].transformed(worldMatrices[i]);
+        spatialIndex.moveProxy(proxies[i], worldBounds[i], worldBounds[i].center() - previousCenter);
+    }
+    spatialIndex.rebuildIfDegraded();
+}
+
+const std::vector<uint32_t>& Scene::cull(const Frustum& frustum) {
+    visible.clear();
+    if (indexed) {
+        // Tests the fat bounds only, a few more entities pass than with the tight ones but the query does not have
+        // to touch the entity arrays at random
+        spatialIndex.queryFrustum(frustum, [this](uint32_t index) { visible.push_back(index); });
+    }
+    else {
+        uint32_t count = (uint32_t)worldBounds.size();
+        for (uint32_t i = 0; i < count; ++i)
+            if (frustum.intersects(worldBounds[i]))
+                visible.push_back(i);
+    }
+    stats.visibleEntities = (int)visible.size();
+    return visible;
+}
+
+void Scene::collectDraws(const glm::vec3& cameraPosition, std::vector<DrawPacket>& packets) {
+    stats.lodChanges = 0;
+    for (uint32_t i : visible) {
+        const Renderable& renderable = renderables[i];
+        float distance = glm::length(worldBounds[i].center() - cameraPosition);
+        int lod = std::min((int)(distance / renderable.lodDistance), renderable.lodCount - 1);
+        if (lod != lods[i]) {
+            lods[i] = lod;
+            stats.lodChanges++;
+        }
+
+        // Same key as DrawListBuilder: 16 bits material, 16 bits mesh, 32 bits depth
+        uint32_t depthBits;
+        memcpy(&depthBits, &distance, sizeof(depthBits));
+        DrawPacket packet;
+        packet.mesh = (uint32_t)(renderable.mesh + lod);
+        packet.sortKey = (uint64_t)(renderable.material & 0xFFFF) << 48 | (uint64_t)(packet.mesh & 0xFFFF) << 32 | depthBits;
+        packet.object = slotOfEntity[i];
+        packets.push_back(packet);
+    }
+}
+
+EntityHandle Scene::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& distance) const {
+    EntityHandle hit;
+    glm::vec3 inverseDirection = inverseRayDirection(direction);
+    distance = spatialIndex.raycast(origin, direction, maxDistance, [&](uint32_t index, float closest) {
+        float entry;
+        if (!worldBounds[index].intersectsRay(origin, inverseDirection, closest, entry))
+            return closest;
+        hit.index = slotOfEntity[index];
+        hit.generation = slots[hit.index].generation;
+        return entry;
+    });
+    return hit;
+}
+
+void Scene::querySphere(const glm::vec3& center, float radius, std::vector<EntityHandle>& entities) const {
+    spatialIndex.querySphere(center, radius, [&](uint32_t index) {
+        if (worldBounds[index].distance(center) > radius) return;
+        EntityHandle entity;
+        entity.index = slotOfEntity[index];
+        entity.generation = slots[entity.index].generation;
+        entities.push_back(entity);
+    });
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <glad/glad.h>
+#include "GLExtensions.h"
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Builds shader programs from a vertex and a fragment shader file and a list of #define keys.
+// Every combination of files and keys is a permutation that is compiled the first time it is requested and shared
+// by everyone asking for it afterwards. Optional features of a shader go into #ifdef blocks instead of new files.
+// Linked programs are stored on disk with glGetProgramBinary, keyed by a hash of both sources, the keys and the
+// driver, so later starts load them with glProgramBinary without running the compiler. A binary that the driver
+// rejects, e.g. after an update with the same version string, is compiled from source and written again.
+// requestProgram only starts the compile and link, the status is queried later, so the driver can work on all
+// programs at once. With GL_KHR_parallel_shader_compile that happens on background threads and getStatus never
+// blocks; without it the first status query of a program waits for it.
+class ShaderCache {
+public:
+    enum ProgramStatus {
+        PROGRAM_PENDING,
+        PROGRAM_READY,
+        PROGRAM_FAILED,
+    };
+
+    struct Stats {
+        int programs = 0;
+        int binaryHits = 0;
+        int compiledPrograms = 0;
+        int failedPrograms = 0;
+        double loadMilliseconds = 0.0;
+        // Time this thread spent issuing compiles and waiting for their results, background work is not included
+        double compileMilliseconds = 0.0;
+    };
+
+    // Time from the request until the program was found to be ready
+    struct Timing {
+        std::string name;
+        double milliseconds;
+        bool fromBinary;
+    };
+
+private:
+    // Written in front of every binary so files of other builds or formats are never handed to the driver
+    struct BinaryHeader {
+        uint32_t magic;
+        uint32_t format;
+        uint64_t hash;
+    };
+    static const uint32_t BINARY_MAGIC = 0x43535047; // "GPSC"
+
+    std::string directory;
+    std::string driver;
+    // Programs by file names and keys
+    std::unordered_map<std::string, GLuint> programs;
+    std::unordered_map<GLuint, ProgramStatus> statuses;
+    // Shader sources by file name, read once
+    std::unordered_map<std::string, std::string> sources;
+    Stats stats;
+    std::vector<Timing> timings;
+
+    // A program whose compile and link may still be running in the driver
+    struct PendingProgram {
+        GLuint program;
+        GLuint vertexShader;
+        GLuint fragmentShader;
+        std::string name;
+        std::string path;
+        uint64_t key;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+    std::vector<PendingProgram> pending;
+
+    const std::string* loadSource(const std::string& filename);
+    static std::string addDefines(const std::string& source, const std::vector<std::string>& defines);
+    static uint64_t hash(const std::string& text, uint64_t seed = 14695981039346656037ull);
+
+    GLuint startShader(GLenum type, const std::string& source);
+    bool checkShader(GLuint shader, const std::string& name);
+    bool isComplete(const PendingProgram& program) const;
+    void finishProgram(const PendingProgram& program);
+    GLuint loadBinary(const std::string& path, uint64_t key);
+    void saveBinary(GLuint program, const std::string& path, uint64_t key);
+
+public:
+    // Needs a current context, the driver is part of every key
+    void create(const std::string& directory);
+    // Deletes all programs handed out by requestProgram and getProgram
+    void destroy();
+
+    // Starts building the permutation and returns its program at once, 0 if a file is missing.
+    // Any query on the program before getStatus returned PROGRAM_READY waits for the driver.
+    GLuint requestProgram(const char* vertexFilename, const char* fragmentFilename, const std::vector<std::string>& defines = std::vector<std::string>());
+    // Errors are printed when a program is found to have failed
+    ProgramStatus getStatus(GLuint program);
+    // Waits for all requested programs
+    void waitForPrograms();
+
+    // Requests the permutation and waits for it, returns 0 if it does not compile or link
+    GLuint getProgram(const char* vertexFilename, const char* fragmentFilename, const std::vector<std::string>& defines = std::vector<std::string>());
+
+    const Stats& getStats() const { return stats; }
+    const std::vector<Timing>& getTimings() const { return timings; }
+};
+
+void ShaderCache::create(const std::string& directory) {
+    this->directory = directory;
+    driver = std::string((const char*)glGetString(GL_VENDOR)) + "|" + (const char*)glGetString(GL_RENDERER) + "|" + (const char*)glGetString(GL_VERSION);
+
+    if (glExtensions.programBinary) {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+
+    // Let the driver use as many threads as it likes
+    if (glExtensions.parallelShaderCompile)
+        glExtensions.glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+}
+
+void ShaderCache::destroy() {
+    waitForPrograms();
+    for (auto& program : programs)
+        glDeleteProgram(program.second);
+    programs.clear();
+    statuses.clear();
+    sources.clear();
+}
+
+const std::string* ShaderCache::loadSource(const std::string& filename) {
+    auto cached = sources.find(filename);
+    if (cached != sources.end())
+        return &cached->second;
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return nullptr;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return &(sources[filename] = text.str());
+}
+
+std::string ShaderCache::addDefines(const std::string& source, const std::vector<std::string>& defines) {
+    if (defines.empty()) return source;
+
+    // The defines have to come after the #version line, which has to be the first statement
+    size_t versionEnd = 0;
+    if (source.compare(0, 8, "#version") == 0) {
+        versionEnd = source.find('\n');
+        versionEnd = versionEnd == std::string::npos ? source.size() : versionEnd + 1;
+    }
+
+    std::string result = source.substr(0, versionEnd);
+    for (const std::string& define : defines)
+        result += "#define " + define + "\n";
+    // Keeps the line numbers of compile errors the same as in the file
+    result += "#line 2\n";
+    result += source.substr(versionEnd);
+    return result;
+}
+
+// FNV-1a, only has to tell permutations apart
+uint64_t ShaderCache::hash(const std::string& text, uint64_t seed) {
+    uint64_t result = seed;
+    for (char c : text) {
+        result ^= (unsigned char)c;
+        result *= 1099511628211ull;
+    }
+    return result;
+}
+
+GLuint ShaderCache::startShader(GLenum type, const std::string& source) {
+    GLuint shader = glCreateShader(type);
+    const char* text = source.c_str();
+    glShaderSource(shader, 1, &text, nullptr);
+    glCompileShader(shader);
+    return shader;
+}
+
+bool ShaderCache::checkShader(GLuint shader, const std::string& name) {
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (success) return true;
+
+    GLint infoLogLength;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLogLength);
+    std::vector<GLchar> infoLog(infoLogLength + 1);
+    glGetShaderInfoLog(shader, infoLogLength, nullptr, infoLog.data());
+    std::cerr << "Shader compilation error in " << name << ":\n" << infoLog.data() << std::endl;
+    return false;
+}
+
+bool ShaderCache::isComplete(const PendingProgram& program) const {
+    // Without the extension every status query blocks until the driver is done
+    if (!glExtensions.parallelShaderCompile) return true;
+
+    GLint complete = GL_FALSE;
+    glGetProgramiv(program.program, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete == GL_TRUE;
+}
+
+void ShaderCache::finishProgram(const PendingProgram& program) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // The link also fails when a shader did not compile, the shader logs say why
+    bool compiled = checkShader(program.vertexShader, program.name) && checkShader(program.fragmentShader, program.name);
+    glDetachShader(program.program, program.vertexShader);
+    glDetachShader(program.program, program.fragmentShader);
+    glDeleteShader(program.vertexShader);
+    glDeleteShader(program.fragmentShader);
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program.program, GL_LINK_STATUS, &linked);
+    if (compiled && !linked) {
+        GLint infoLogLength;
+        glGetProgramiv(program.program, GL_INFO_LOG_LENGTH, &infoLogLength);
+        std::vector<GLchar> infoLog(infoLogLength + 1);
+        glGetProgramInfoLog(program.program, infoLogLength, nullptr, infoLog.data());
+        std::cerr << "Shader program linking error in " << program.name << ":\n" << infoLog.data() << std::endl;
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    stats.compileMilliseconds += std::chrono::duration<double, std::milli>(end - start).count();
+    if (!compiled || !linked) {
+        statuses[program.program] = PROGRAM_FAILED;
+        stats.failedPrograms++;
+        return;
+    }
+
+    statuses[program.program] = PROGRAM_READY;
+    stats.compiledPrograms++;
+    timings.push_back({ program.name, std::chrono::duration<double, std::milli>(end - program.start).count(), false });
+    if (glExtensions.programBinary)
+        saveBinary(program.program, program.path, program.key);
+}
+
+GLuint ShaderCache::loadBinary(const std::string& path, uint64_t key) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return 0;
+
+    std::streamsize size = file.tellg();
+    BinaryHeader header;
+    if (size <= (std::streamsize)sizeof(header)) return 0;
+    file.seekg(0);
+    file.read((char*)&header, sizeof(header));
+    if (header.magic != BINARY_MAGIC || header.hash != key) return 0;
+
+    std::vector<char> binary((size_t)size - sizeof(header));
+    if (!file.read(binary.data(), binary.size())) return 0;
+
+    GLuint program = glCreateProgram();
+    glExtensions.glProgramBinary(program, header.format, binary.data(), (GLsizei)binary.size());
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void ShaderCache::saveBinary(GLuint program, const std::string& path, uint64_t key) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    std::vector<char> binary(length);
+    BinaryHeader header = { BINARY_MAGIC, 0, key };
+    GLenum format = 0;
+    glExtensions.glGetProgramBinary(program, length, nullptr, &format, binary.data());
+    header.format = format;
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to write program binary: " << path << std::endl;
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write(binary.data(), binary.size());
+}
+
+GLuint ShaderCache::requestProgram(const char* vertexFilename, const char* fragmentFilename, const std::vector<std::string>& defines) {
+    std::string name = std::string(vertexFilename) + " + " + fragmentFilename;
+    for (const std::string& define : defines)
+        name += " " + define;
+
+    auto existing = programs.find(name);
+    if (existing != programs.end())
+        return existing->second;
+
+    const std::string* vertexFile = loadSource(vertexFilename);
+    const std::string* fragmentFile = loadSource(fragmentFilename);
+    if (vertexFile == nullptr || fragmentFile == nullptr) return 0;
+    std::string vertexSource = addDefines(*vertexFile, defines);
+    std::string fragmentSource = addDefines(*fragmentFile, defines);
+
+    // The defines are part of the sources, the driver string makes binaries of other drivers miss
+    uint64_t key = hash(driver, hash(fragmentSource, hash(vertexSource)));
+    char keyText[17];
+    snprintf(keyText, sizeof(keyText), "%016llx", (unsigned long long)key);
+    std::string path = directory + "/" + keyText + ".bin";
+
+    auto start = std::chrono::high_resolution_clock::now();
+    GLuint program = glExtensions.programBinary ? loadBinary(path, key) : 0;
+    if (program != 0) {
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats.binaryHits++;
+        stats.loadMilliseconds += milliseconds;
+        timings.push_back({ name, milliseconds, true });
+        statuses[program] = PROGRAM_READY;
+    }
+    else {
+        // Only issue the work here, nothing is queried until the program is needed
+        PendingProgram request;
+        request.start = start;
+        request.vertexShader = startShader(GL_VERTEX_SHADER, vertexSource);
+        request.fragmentShader = startShader(GL_FRAGMENT_SHADER, fragmentSource);
+        request.program = program = glCreateProgram();
+        if (glExtensions.programBinary)
+            glExtensions.glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glAttachShader(program, request.vertexShader);
+        glAttachShader(program, request.fragmentShader);
+        glLinkProgram(program);
+        request.name = name;
+        request.path = path;
+        request.key = key;
+        pending.push_back(request);
+        statuses[program] = PROGRAM_PENDING;
+        stats.compileMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    programs[name] = program;
+    stats.programs++;
+    return program;
+}
+
+ShaderCache::ProgramStatus ShaderCache::getStatus(GLuint program) {
+    auto status = statuses.find(program);
+    if (status == statuses.end()) return PROGRAM_FAILED;
+    if (status->second != PROGRAM_PENDING) return status->second;
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        if (pending[i].program != program) continue;
+        if (!isComplete(pending[i])) return PROGRAM_PENDING;
+
+        finishProgram(pending[i]);
+        pending.erase(pending.begin() + i);
+        break;
+    }
+    return statuses[program];
+}
+
+void ShaderCache::waitForPrograms() {
+    // In request order, the driver has most likely finished the early ones first
+    for (const PendingProgram& program : pending)
+        finishProgram(program);
+    pending.clear();
+}
+
+GLuint ShaderCache::getProgram(const char* vertexFilename, const char* fragmentFilename, const std::vector<std::string>& defines) {
+    GLuint program = requestProgram(vertexFilename, fragmentFilename, defines);
+    if (program == 0) return 0;
+
+    // Finishes the program even when the driver is still busy with it
+    for (size_t i = 0; i < pending.size(); ++i) {
+        if (pending[i].program != program) continue;
+        finishProgram(pending[i]);
+        pending.erase(pending.begin() + i);
+        break;
+    }
+    return statuses[program] == PROGRAM_READY ? program : 0;
+}
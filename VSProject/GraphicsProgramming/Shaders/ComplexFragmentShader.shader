@@ -5,29 +5,146 @@ in vec3 Normal;
 in vec2 TexCoords;
 in mat3 TBN;
 
+#ifdef TEXTURE_ARRAYS
+// All materials of the model in one array per texture, see MaterialArrays.h. The merged draws carry the material
+// per vertex.
+flat in float Layer;
+flat in int MaterialIndex;
+uniform sampler2DArray albedoTexture;
+uniform sampler2DArray normalTexture;
+uniform sampler2DArray specularTexture;
+#define MATERIAL_UV vec3(TexCoords, Layer)
+#define MATERIAL_ID MaterialIndex
+#else
 uniform sampler2D albedoTexture;
 uniform sampler2D normalTexture;
 uniform sampler2D specularTexture;
+uniform int materialId;
+#define MATERIAL_UV TexCoords
+#define MATERIAL_ID materialId
+#endif
+
+// Parameters of all materials, see MaterialTable.h
+struct MaterialData
+{
+    vec4 tint;
+    vec4 shading;
+};
+layout(std140) uniform Materials
+{
+    MaterialData materials[256];
+};
 uniform vec3 ambientLightColor;
 uniform vec3 lightDirection;
 uniform vec3 viewPos;
 
+// Optional features are selected with #define keys, see ShaderCache.h
+#if defined(SHADOWS) || defined(CLUSTERED_LIGHTING)
+uniform mat4 view;
+#endif
+
+#ifdef SHADOWS
+// Cascaded shadow maps of the directional light, see ShadowMaps.h
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4];
+// View space depth where every cascade ends
+uniform vec4 cascadeSplits;
+
+// 1 where the directional light reaches the fragment, 0 in full shadow
+float directionalShadow(vec3 position, vec3 normal)
+{
+    float depth = -(view * vec4(position, 1.0)).z;
+    if (depth > cascadeSplits.w) return 1.0;
+    int cascade = 0;
+    for (int i = 0; i < 3; ++i)
+        if (depth > cascadeSplits[i]) cascade = i + 1;
+
+    // Moving the lookup along the normal keeps surfaces at grazing angles from shadowing themselves
+    vec4 lightPosition = shadowMatrices[cascade] * vec4(position + normal * 0.05, 1.0);
+    vec3 coords = lightPosition.xyz * 0.5 + 0.5;
+
+    // 3x3 percentage closer filtering, every lookup compares and filters 4 texels
+    vec2 texelSize = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    for (int x = -1; x <= 1; ++x)
+        for (int y = -1; y <= 1; ++y)
+            lit += texture(shadowMap, vec4(coords.xy + vec2(x, y) * texelSize, float(cascade), coords.z));
+    return lit / 9.0;
+}
+#else
+float directionalShadow(vec3 position, vec3 normal)
+{
+    return 1.0;
+}
+#endif
+
+#ifdef CLUSTERED_LIGHTING
+// Local lights binned into froxels on the CPU, see ClusteredLighting.h
+uniform samplerBuffer lightData;
+uniform usamplerBuffer lightGrid;
+uniform usamplerBuffer lightIndices;
+uniform ivec3 clusterCount;
+uniform vec2 clusterTileSize;
+uniform vec2 clusterSliceScaleBias;
+
+// Diffuse light of the local lights in the cluster of this fragment
+vec3 localLighting(vec3 position, vec3 normal)
+{
+    float depth = -(view * vec4(position, 1.0)).z;
+    ivec3 cluster;
+    cluster.xy = ivec2(gl_FragCoord.xy / clusterTileSize);
+    cluster.z = int(log(depth) * clusterSliceScaleBias.x + clusterSliceScaleBias.y);
+    cluster = clamp(cluster, ivec3(0), clusterCount - 1);
+    int clusterIndex = (cluster.z * clusterCount.y + cluster.y) * clusterCount.x + cluster.x;
+
+    // Offset and count of the cluster's lights in lightIndices
+    uvec2 range = texelFetch(lightGrid, clusterIndex).xy;
+
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < range.y; ++i) {
+        int light = int(texelFetch(lightIndices, int(range.x + i)).r);
+        vec4 positionRange = texelFetch(lightData, light * 3);
+        vec4 colorOuterCone = texelFetch(lightData, light * 3 + 1);
+        vec4 directionInnerCone = texelFetch(lightData, light * 3 + 2);
+
+        vec3 toLight = positionRange.xyz - position;
+        float lightDistance = length(toLight);
+        if (lightDistance >= positionRange.w) continue;
+        vec3 lightDir = toLight / lightDistance;
+
+        // Falls off to exactly zero at the range of the light
+        float window = clamp(1.0 - pow(lightDistance / positionRange.w, 4.0), 0.0, 1.0);
+        float attenuation = window * window / (lightDistance * lightDistance + 1.0);
+        float spot = smoothstep(colorOuterCone.w, directionInnerCone.w, dot(-lightDir, directionInnerCone.xyz));
+
+        result += colorOuterCone.rgb * max(dot(normal, lightDir), 0.0) * attenuation * spot;
+    }
+    return result;
+}
+#else
+vec3 localLighting(vec3 position, vec3 normal)
+{
+    return vec3(0.0);
+}
+#endif
+
 out vec4 FragColor;
 
 void main()
 {
     // Obtain normal from normal map in range [0,1]
-    vec3 normal = texture(normalTexture, TexCoords).rgb;
+    vec3 normal = texture(normalTexture, MATERIAL_UV).rgb;
     // Transform normal vector to range [-1,1]
     normal = normalize(normal * 2.0 - 1.0);
     // Transform normal vector to world space
     normal = normalize(TBN * normal);
 
     // Obtain specular intensity from specular map
-    float specularIntensity = texture(specularTexture, TexCoords).r;
+    float specularIntensity = texture(specularTexture, MATERIAL_UV).r;
 
     // Obtain diffuse color from albedo map
-    vec3 albedo = texture(albedoTexture, TexCoords).rgb;
+    MaterialData material = materials[MATERIAL_ID];
+    vec3 albedo = texture(albedoTexture, MATERIAL_UV).rgb * material.tint.rgb;
 
     // Ambient lighting
     vec3 ambient = ambientLightColor * albedo;
@@ -35,19 +152,21 @@ void main()
     // Diffuse lighting
     vec3 lightDir = normalize(-lightDirection);
     float diff = max(dot(normal, lightDir), 0.0);
-    diff = floor(diff / 0.2) * 0.2;
+    diff = floor(diff / material.shading.x) * material.shading.x;
+    float shadow = directionalShadow(FragPos, normalize(Normal));
+    diff *= shadow;
     vec3 diffuse = diff * albedo;
 
     // Specular lighting
     vec3 viewDir = normalize(viewPos - FragPos);
     vec3 reflectDir = reflect(-lightDir, normal);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), specularIntensity);
-    spec = floor(spec / 0.2) * 0.2;
-    vec3 specular = spec * ambientLightColor;
+    spec = floor(spec / material.shading.x) * material.shading.x;
+    vec3 specular = spec * shadow * ambientLightColor;
 
     // Outline effect
     vec3 outlineColor = vec3(0.0, 0.0, 0.0); // Black outline color
-    float outlineThreshold = 0.2; // Adjust the threshold for the outline effect
+    float outlineThreshold = material.shading.y;
 
     // Calculate the dot product between the normal and the view direction
     float normalViewDot = dot(normal, viewDir);
@@ -58,7 +177,7 @@ void main()
     }
     else {
         // Combine results
-        vec3 result = ambient + diffuse + specular;
+        vec3 result = ambient + diffuse + specular + localLighting(FragPos, normal) * albedo;
         FragColor = vec4(result, 1.0);
     }
 }
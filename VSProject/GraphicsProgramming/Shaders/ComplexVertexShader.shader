@@ -5,11 +5,25 @@ layout(location = 1) in vec3 aNormal;
 layout(location = 2) in vec2 aTexCoords;
 layout(location = 3) in vec3 aTangent;
 layout(location = 4) in vec3 aBitangent;
+#ifdef TEXTURE_ARRAYS
+// Layer of the mesh's material in the texture arrays and its ID in the material table, see MaterialArrays.h
+layout(location = 5) in vec2 aMaterial;
+flat out float Layer;
+flat out int MaterialIndex;
+#endif
+
+// Per object data, bound with glBindBufferRange for every draw
+layout(std140) uniform PerObject
+{
+    mat4 model;
+};
 
-uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
+// Has to produce the same depth as the depth pre-pass
+invariant gl_Position;
+
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
@@ -20,6 +34,10 @@ void main()
     FragPos = vec3(model * vec4(aPos, 1.0));
     Normal = mat3(transpose(inverse(model))) * aNormal;
     TexCoords = aTexCoords;
+#ifdef TEXTURE_ARRAYS
+    Layer = aMaterial.x;
+    MaterialIndex = int(aMaterial.y);
+#endif
 
     mat3 normalMatrix = mat3(transpose(inverse(model)));
     vec3 T = normalize(normalMatrix * aTangent);
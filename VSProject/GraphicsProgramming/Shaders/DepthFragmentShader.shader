@@ -0,0 +1,6 @@
+#version 330 core
+
+void main()
+{
+    // Depth only, color writes are disabled
+}
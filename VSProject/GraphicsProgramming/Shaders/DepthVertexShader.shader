@@ -0,0 +1,22 @@
+#version 330 core
+
+layout(location = 0) in vec3 aPos;
+
+// Per object data, bound with glBindBufferRange for every draw
+layout(std140) uniform PerObject
+{
+    mat4 model;
+};
+
+uniform mat4 view;
+uniform mat4 projection;
+
+// The depth has to match the shading pass exactly for GL_EQUAL, so gl_Position is computed
+// with the same expression as in the material vertex shaders
+invariant gl_Position;
+
+void main()
+{
+    vec3 FragPos = vec3(model * vec4(aPos, 1.0));
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+}
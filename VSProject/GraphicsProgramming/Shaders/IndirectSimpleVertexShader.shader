@@ -0,0 +1,31 @@
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aUV;
+
+out vec2 UV;
+out vec3 FragPos;
+out vec3 Normal;
+
+// Model matrices of every draw in the frame
+layout(std430, binding = 0) readonly buffer DrawData
+{
+    mat4 models[];
+};
+
+uniform uint firstDraw;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    mat4 model = models[firstDraw + uint(gl_DrawIDARB)];
+
+    FragPos = vec3(model * vec4(aPos, 1.0));
+    Normal = mat3(transpose(inverse(model))) * aNormal;
+    UV = aUV;
+
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+}
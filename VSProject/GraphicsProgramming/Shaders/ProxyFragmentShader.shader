@@ -0,0 +1,9 @@
+#version 330 core
+
+out vec4 FragColor;
+
+void main()
+{
+    // Only used for occlusion queries, color writes are disabled
+    FragColor = vec4(1.0);
+}
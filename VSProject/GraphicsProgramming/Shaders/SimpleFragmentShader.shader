@@ -10,19 +10,165 @@ uniform sampler2D albedoTexture;
 uniform vec3 lightDirection;
 uniform vec3 ambientLightColor;
 
+// Parameters of all materials, see MaterialTable.h
+struct MaterialData
+{
+    vec4 tint;
+    vec4 shading;
+};
+layout(std140) uniform Materials
+{
+    MaterialData materials[256];
+};
+uniform int materialId;
+
+// Optional features are selected with #define keys, see ShaderCache.h
+#if defined(SHADOWS) || defined(CLUSTERED_LIGHTING)
+uniform mat4 view;
+#endif
+
+#ifdef SHADOWS
+// Cascaded shadow maps of the directional light, see ShadowMaps.h
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4];
+// View space depth where every cascade ends
+uniform vec4 cascadeSplits;
+
+// 1 where the directional light reaches the fragment, 0 in full shadow
+float directionalShadow(vec3 position, vec3 normal)
+{
+    float depth = -(view * vec4(position, 1.0)).z;
+    if (depth > cascadeSplits.w) return 1.0;
+    int cascade = 0;
+    for (int i = 0; i < 3; ++i)
+        if (depth > cascadeSplits[i]) cascade = i + 1;
+
+    // Moving the lookup along the normal keeps surfaces at grazing angles from shadowing themselves
+    vec4 lightPosition = shadowMatrices[cascade] * vec4(position + normal * 0.05, 1.0);
+    vec3 coords = lightPosition.xyz * 0.5 + 0.5;
+
+    // 3x3 percentage closer filtering, every lookup compares and filters 4 texels
+    vec2 texelSize = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    for (int x = -1; x <= 1; ++x)
+        for (int y = -1; y <= 1; ++y)
+            lit += texture(shadowMap, vec4(coords.xy + vec2(x, y) * texelSize, float(cascade), coords.z));
+    return lit / 9.0;
+}
+#else
+float directionalShadow(vec3 position, vec3 normal)
+{
+    return 1.0;
+}
+#endif
+
+#ifdef CLUSTERED_LIGHTING
+// Local lights binned into froxels on the CPU, see ClusteredLighting.h
+uniform samplerBuffer lightData;
+uniform usamplerBuffer lightGrid;
+uniform usamplerBuffer lightIndices;
+uniform ivec3 clusterCount;
+uniform vec2 clusterTileSize;
+uniform vec2 clusterSliceScaleBias;
+
+// Diffuse light of the local lights in the cluster of this fragment
+vec3 localLighting(vec3 position, vec3 normal)
+{
+    float depth = -(view * vec4(position, 1.0)).z;
+    ivec3 cluster;
+    cluster.xy = ivec2(gl_FragCoord.xy / clusterTileSize);
+    cluster.z = int(log(depth) * clusterSliceScaleBias.x + clusterSliceScaleBias.y);
+    cluster = clamp(cluster, ivec3(0), clusterCount - 1);
+    int clusterIndex = (cluster.z * clusterCount.y + cluster.y) * clusterCount.x + cluster.x;
+
+    // Offset and count of the cluster's lights in lightIndices
+    uvec2 range = texelFetch(lightGrid, clusterIndex).xy;
+
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < range.y; ++i) {
+        int light = int(texelFetch(lightIndices, int(range.x + i)).r);
+        vec4 positionRange = texelFetch(lightData, light * 3);
+        vec4 colorOuterCone = texelFetch(lightData, light * 3 + 1);
+        vec4 directionInnerCone = texelFetch(lightData, light * 3 + 2);
+
+        vec3 toLight = positionRange.xyz - position;
+        float lightDistance = length(toLight);
+        if (lightDistance >= positionRange.w) continue;
+        vec3 lightDir = toLight / lightDistance;
+
+        // Falls off to exactly zero at the range of the light
+        float window = clamp(1.0 - pow(lightDistance / positionRange.w, 4.0), 0.0, 1.0);
+        float attenuation = window * window / (lightDistance * lightDistance + 1.0);
+        float spot = smoothstep(colorOuterCone.w, directionInnerCone.w, dot(-lightDir, directionInnerCone.xyz));
+
+        result += colorOuterCone.rgb * max(dot(normal, lightDir), 0.0) * attenuation * spot;
+    }
+    return result;
+}
+#else
+vec3 localLighting(vec3 position, vec3 normal)
+{
+    return vec3(0.0);
+}
+#endif
+
+#ifdef VIRTUAL_TEXTURE
+// Sparse virtual texture mapped onto the xz plane, see VirtualTexture.h
+uniform sampler2D pageTable;
+uniform sampler2D pageAtlas;
+// Corner and size of the mapped world rectangle
+uniform vec4 virtualRect;
+// Width of level 0 in texels
+uniform float virtualSize;
+uniform int virtualLevels;
+// Pages across level 0 of the page table
+uniform int pageTableSize;
+// Page size and border in texels, atlas size in texels
+uniform vec3 pageLayout;
+
+vec3 albedo()
+{
+    vec2 uv = clamp((FragPos.xz - virtualRect.xy) / virtualRect.zw, 0.0, 0.99999);
+    vec2 texel = uv * virtualSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8));
+    int level = clamp(int(floor(lod)), 0, virtualLevels - 1);
+
+    // The entry points at the resident page covering this one, the level in b may be coarser than the wanted one.
+    // The position inside it is derived from the same page index, so both always agree at the page edges.
+    vec2 position = uv * float(pageTableSize >> level);
+    ivec2 page = ivec2(position);
+    vec3 entry = texelFetch(pageTable, page, level).rgb * 255.0;
+    int coarser = int(entry.b + 0.5) - level;
+    vec2 inPage = (position - vec2((page >> coarser) << coarser)) / float(1 << coarser);
+    vec2 slot = entry.rg * (pageLayout.x + 2.0 * pageLayout.y) + pageLayout.y;
+    return textureLod(pageAtlas, (slot + inPage * pageLayout.x) / pageLayout.z, 0.0).rgb;
+}
+#else
+vec3 albedo()
+{
+    return vec3(texture(albedoTexture, UV));
+}
+#endif
+
 void main()
 {
+    MaterialData material = materials[materialId];
+    vec3 color = albedo() * material.tint.rgb;
+
     // Ambient
-    vec3 ambient = ambientLightColor * vec3(texture(albedoTexture, UV));
+    vec3 ambient = ambientLightColor * color;
 
     // Diffuse 
     vec3 norm = normalize(Normal);
     vec3 lightDir = normalize(-lightDirection);
     float diff = max(dot(norm, lightDir), 0.0);
-    diff = floor(diff / 0.2) * 0.2;
-    vec3 diffuse = diff * vec3(texture(albedoTexture, UV));
+    diff = floor(diff / material.shading.x) * material.shading.x;
+    diff *= directionalShadow(FragPos, norm);
+    vec3 diffuse = diff * color;
 
     // Combining all
-    vec3 result = ambient + diffuse;
+    vec3 result = ambient + diffuse + localLighting(FragPos, norm) * color;
     FragColor = vec4(result, 1.0);
 }
@@ -8,10 +8,18 @@ out vec2 UV;
 out vec3 FragPos;
 out vec3 Normal;
 
-uniform mat4 model;
+// Per object data, bound with glBindBufferRange for every draw
+layout(std140) uniform PerObject
+{
+    mat4 model;
+};
+
 uniform mat4 view;
 uniform mat4 projection;
 
+// Has to produce the same depth as the depth pre-pass
+invariant gl_Position;
+
 void main()
 {
     FragPos = vec3(model * vec4(aPos, 1.0));
@@ -0,0 +1,132 @@
+#version 330 core
+
+// Temporal anti-aliasing and upsampling, see TemporalAA.h
+uniform sampler2D sceneColor;
+uniform sampler2D sceneDepth;
+uniform sampler2D sceneVelocity;
+uniform sampler2D history;
+
+uniform vec2 renderSize;
+uniform vec2 outputSize;
+// Offset of this frame's samples in render pixels
+uniform vec2 jitter;
+// From the current to the previous clip space of the camera, without jitter
+uniform mat4 reprojection;
+uniform bool historyValid;
+
+out vec4 FragColor;
+
+vec3 toYCoCg(vec3 color)
+{
+    return vec3(
+        0.25 * color.r + 0.5 * color.g + 0.25 * color.b,
+        0.5 * color.r - 0.5 * color.b,
+        -0.25 * color.r + 0.5 * color.g - 0.25 * color.b);
+}
+
+vec3 fromYCoCg(vec3 color)
+{
+    return vec3(color.x + color.y - color.z, color.x + color.z, color.x - color.y - color.z);
+}
+
+// Catmull-Rom filtered history with 5 bilinear lookups, sharper than a single bilinear one
+vec3 sampleHistory(vec2 uv)
+{
+    vec2 size = vec2(textureSize(history, 0));
+    vec2 position = uv * size;
+    vec2 center = floor(position - 0.5) + 0.5;
+    vec2 f = position - center;
+    vec2 f2 = f * f;
+    vec2 f3 = f2 * f;
+
+    vec2 w0 = -0.5 * f3 + f2 - 0.5 * f;
+    vec2 w1 = 1.5 * f3 - 2.5 * f2 + 1.0;
+    vec2 w2 = -1.5 * f3 + 2.0 * f2 + 0.5 * f;
+    vec2 w3 = 0.5 * f3 - 0.5 * f2;
+    vec2 w12 = w1 + w2;
+
+    vec2 uv0 = (center - 1.0) / size;
+    vec2 uv3 = (center + 2.0) / size;
+    vec2 uv12 = (center + w2 / w12) / size;
+
+    vec3 result = texture(history, vec2(uv12.x, uv0.y)).rgb * w12.x * w0.y
+        + texture(history, vec2(uv0.x, uv12.y)).rgb * w0.x * w12.y
+        + texture(history, uv12).rgb * w12.x * w12.y
+        + texture(history, vec2(uv3.x, uv12.y)).rgb * w3.x * w12.y
+        + texture(history, vec2(uv12.x, uv3.y)).rgb * w12.x * w3.y;
+    float weight = w12.x * w0.y + w0.x * w12.y + w12.x * w12.y + w3.x * w12.y + w12.x * w3.y;
+    return max(result / weight, 0.0);
+}
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy / outputSize;
+
+    // Texel i holds the scene at i + 0.5 - jitter, the 3x3 texels around the pixel center are this frame's samples
+    vec2 position = uv * renderSize;
+    ivec2 base = ivec2(floor(position + jitter));
+    ivec2 maxTexel = ivec2(renderSize) - 1;
+
+    vec3 color = vec3(0.0);
+    float totalWeight = 0.0;
+    float nearestWeight = 0.0;
+    vec3 moment1 = vec3(0.0);
+    vec3 moment2 = vec3(0.0);
+    vec3 minimum = vec3(1e4);
+    vec3 maximum = vec3(-1e4);
+    float closestDepth = 1.0;
+    ivec2 closestTexel = clamp(base, ivec2(0), maxTexel);
+    for (int y = -1; y <= 1; ++y) {
+        for (int x = -1; x <= 1; ++x) {
+            ivec2 texel = clamp(base + ivec2(x, y), ivec2(0), maxTexel);
+            vec3 sampleColor = toYCoCg(texelFetch(sceneColor, texel, 0).rgb);
+
+            // Gaussian fit of a Blackman-Harris window over the distance to the pixel center
+            vec2 offset = vec2(base + ivec2(x, y)) + 0.5 - jitter - position;
+            float weight = exp(-2.29 * dot(offset, offset));
+            color += sampleColor * weight;
+            totalWeight += weight;
+            nearestWeight = max(nearestWeight, weight);
+
+            moment1 += sampleColor;
+            moment2 += sampleColor * sampleColor;
+            minimum = min(minimum, sampleColor);
+            maximum = max(maximum, sampleColor);
+
+            // The velocity of the closest surface keeps the edges of moving objects from smearing
+            float depth = texelFetch(sceneDepth, texel, 0).r;
+            if (depth < closestDepth) {
+                closestDepth = depth;
+                closestTexel = texel;
+            }
+        }
+    }
+    color /= totalWeight;
+
+    // Moving objects wrote their own motion, everything else only moved with the camera
+    vec4 velocity = texelFetch(sceneVelocity, closestTexel, 0);
+    vec2 previousUv;
+    if (velocity.z > 0.5) {
+        previousUv = uv - velocity.xy;
+    }
+    else {
+        vec4 previous = reprojection * vec4(uv * 2.0 - 1.0, closestDepth * 2.0 - 1.0, 1.0);
+        previousUv = previous.xy / previous.w * 0.5 + 0.5;
+    }
+
+    if (!historyValid || any(lessThan(previousUv, vec2(0.0))) || any(greaterThan(previousUv, vec2(1.0)))) {
+        FragColor = vec4(fromYCoCg(color), 1.0);
+        return;
+    }
+
+    // Clamp the history to the color range of the neighbourhood, narrowed to the mean and deviation of the samples
+    vec3 mean = moment1 / 9.0;
+    vec3 deviation = sqrt(max(moment2 / 9.0 - mean * mean, 0.0));
+    vec3 low = max(minimum, mean - 1.25 * deviation);
+    vec3 high = min(maximum, mean + 1.25 * deviation);
+    vec3 previousColor = clamp(toYCoCg(sampleHistory(previousUv)), low, high);
+
+    // Pixels close to one of this frame's samples take more of it, the others mostly keep the history
+    float blend = mix(0.03, 0.15, nearestWeight);
+    FragColor = vec4(fromYCoCg(mix(previousColor, color, blend)), 1.0);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// Same as SimpleVertexShader but with a plain model uniform, only used to benchmark per draw uniforms against the PerObject block
+
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aUV;
+
+out vec2 UV;
+out vec3 FragPos;
+out vec3 Normal;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    FragPos = vec3(model * vec4(aPos, 1.0));
+    Normal = mat3(transpose(inverse(model))) * aNormal;
+    UV = aUV;
+
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+}
@@ -0,0 +1,39 @@
+#version 330 core
+
+// Scene color rendered into the lower left corner of a larger texture, see DynamicResolution.h
+uniform sampler2D sceneTexture;
+// Size of the rendered part in texels
+uniform vec2 renderSize;
+uniform vec2 outputSize;
+// 0 only filters bilinearly, 1 sharpens the most
+uniform float sharpness;
+
+out vec4 FragColor;
+
+vec3 fetch(vec2 texel)
+{
+    // Stay half a texel inside the rendered part, the rest of the texture holds old frames
+    texel = clamp(texel, vec2(0.5), renderSize - 0.5);
+    return texture(sceneTexture, texel / vec2(textureSize(sceneTexture, 0))).rgb;
+}
+
+void main()
+{
+    vec2 texel = gl_FragCoord.xy * renderSize / outputSize;
+
+    // Bilinear upscale of the center and a cross of neighbours one render texel away
+    vec3 center = fetch(texel);
+    vec3 up = fetch(texel + vec2(0.0, 1.0));
+    vec3 down = fetch(texel - vec2(0.0, 1.0));
+    vec3 left = fetch(texel - vec2(1.0, 0.0));
+    vec3 right = fetch(texel + vec2(1.0, 0.0));
+
+    // Contrast adaptive sharpening, edges that already have a lot of contrast are sharpened less so they do not ring
+    vec3 minimum = min(center, min(min(up, down), min(left, right)));
+    vec3 maximum = max(center, max(max(up, down), max(left, right)));
+    vec3 amount = sqrt(clamp(min(minimum, 1.0 - maximum) / max(maximum, 1e-4), 0.0, 1.0));
+    vec3 weight = -amount * mix(0.0, 0.2, sharpness);
+
+    vec3 result = (center + (up + down + left + right) * weight) / (1.0 + 4.0 * weight);
+    FragColor = vec4(clamp(result, 0.0, 1.0), 1.0);
+}
@@ -0,0 +1,14 @@
+#version 330 core
+
+in vec4 CurrentPosition;
+in vec4 PreviousPosition;
+
+// Movement since the last frame in texture coordinates, z marks the pixels of moving objects
+out vec4 Velocity;
+
+void main()
+{
+    vec2 current = CurrentPosition.xy / CurrentPosition.w * 0.5;
+    vec2 previous = PreviousPosition.xy / PreviousPosition.w * 0.5;
+    Velocity = vec4(current - previous, 1.0, 0.0);
+}
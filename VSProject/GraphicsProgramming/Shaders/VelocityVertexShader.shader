@@ -0,0 +1,27 @@
+#version 330 core
+
+layout(location = 0) in vec3 aPos;
+
+uniform mat4 model;
+uniform mat4 previousModel;
+// Jittered projection of the scene, the depth test needs exactly the same positions
+uniform mat4 view;
+uniform mat4 projection;
+// Without jitter, so the motion only contains the movement of the object and the camera
+uniform mat4 viewProjection;
+uniform mat4 previousViewProjection;
+
+// Same expression as in the material vertex shaders
+invariant gl_Position;
+
+out vec4 CurrentPosition;
+out vec4 PreviousPosition;
+
+void main()
+{
+    vec3 FragPos = vec3(model * vec4(aPos, 1.0));
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+
+    CurrentPosition = viewProjection * vec4(FragPos, 1.0);
+    PreviousPosition = previousViewProjection * previousModel * vec4(aPos, 1.0);
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+in vec3 FragPos;
+
+// Page and level of the virtual texture this pixel needs, see VirtualTexture.h
+out uint Feedback;
+
+uniform vec4 virtualRect;
+uniform float virtualSize;
+uniform int virtualLevels;
+uniform int pageTableSize;
+// Corrects the level for the resolution of the feedback buffer
+uniform float lodBias;
+
+void main()
+{
+    // Same level selection as the VIRTUAL_TEXTURE permutation of SimpleFragmentShader
+    vec2 uv = clamp((FragPos.xz - virtualRect.xy) / virtualRect.zw, 0.0, 0.99999);
+    vec2 texel = uv * virtualSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) + lodBias;
+    int level = clamp(int(floor(lod)), 0, virtualLevels - 1);
+
+    ivec2 page = ivec2(uv * float(pageTableSize >> level));
+    Feedback = 0x80000000u | uint(level) << 24 | uint(page.y) << 12 | uint(page.x);
+}
@@ -0,0 +1,20 @@
+#version 330 core
+
+layout(location = 0) in vec3 aPos;
+
+out vec3 FragPos;
+
+// Per object data, bound with glBindBufferRange for every draw
+layout(std140) uniform PerObject
+{
+    mat4 model;
+};
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    FragPos = vec3(model * vec4(aPos, 1.0));
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+}
@@ -0,0 +1,280 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "Bounds.h"
+#include "PositionStream.h"
+#include "Model.h"
+
+// Cascaded shadow maps for the directional light.
+// The view frustum up to SHADOW_DISTANCE is split into cascades that each get a layer of a depth texture array.
+// Every cascade is fitted with a bounding sphere around its part of the frustum and snapped to whole shadow map
+// texels, so its matrix only changes when the camera moved by at least a texel. The far cascades only contain
+// static geometry and are only rendered again when their matrix changes. Casters are culled per cascade and drawn
+// with their position only streams.
+class CascadedShadowMaps {
+public:
+    static const int CASCADE_COUNT = 4;
+    static const int RESOLUTION = 2048;
+    // Cascades from this one on only contain static casters and are cached
+    static const int FIRST_STATIC_CASCADE = 2;
+    static const int TEXTURE_UNIT = 6;
+    // Nothing further away than this from the camera receives shadows
+    static constexpr float SHADOW_DISTANCE = 60.0f;
+
+    // Either a single position stream or all meshes of a model
+    struct Caster {
+        AABB bounds;
+        glm::mat4 model = glm::mat4(1.0f);
+        bool isStatic = false;
+        const PositionStream* positions = nullptr;
+        const Model* object = nullptr;
+    };
+
+    struct Stats {
+        int renderedCascades = 0;
+        int drawnCasters = 0;
+        int culledCasters = 0;
+        double cpuMilliseconds = 0.0;
+        // GPU time of the shadow pass a frame or two ago, the timer query is never waited on
+        double gpuMilliseconds = 0.0;
+    };
+
+private:
+    GLuint depthTexture = 0;
+    GLuint framebuffer = 0;
+    GLuint program = 0;
+    GLint modelLocation = -1;
+    GLint lightViewProjectionLocation = -1;
+
+    glm::mat4 cascadeMatrices[CASCADE_COUNT];
+    bool cascadeValid[CASCADE_COUNT] = {};
+    glm::vec4 cascadeSplits = glm::vec4(0.0f);
+
+    GLuint timerQueries[2] = { 0, 0 };
+    bool timerPending[2] = { false, false };
+    int timerSlot = 0;
+    Stats stats;
+
+    glm::mat4 fitCascade(const glm::vec3 corners[8], const glm::mat4& lightView, const std::vector<Caster>& casters, bool staticOnly) const;
+    void readTimer();
+
+public:
+    // The program draws position streams with uniform model and lightViewProjection matrices
+    void create(GLuint depthProgram);
+    void destroy();
+
+    // Renders the cascades that are out of date, restores the framebuffer and viewport afterwards
+    void render(const glm::mat4& view, const glm::mat4& projection, float near, float far, const glm::vec3& lightDirection, const std::vector<Caster>& casters);
+    // Binds the shadow map and sets the cascade uniforms of a material program built with SHADOWS
+    void setupProgram(GLuint program) const;
+
+    const Stats& getStats() const { return stats; }
+};
+
+constexpr float CascadedShadowMaps::SHADOW_DISTANCE;
+
+void CascadedShadowMaps::create(GLuint depthProgram) {
+    program = depthProgram;
+    modelLocation = glGetUniformLocation(program, "model");
+    lightViewProjectionLocation = glGetUniformLocation(program, "lightViewProjection");
+
+    glGenTextures(1, &depthTexture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, depthTexture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, RESOLUTION, RESOLUTION, CASCADE_COUNT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // Hardware depth comparison, sampled with a sampler2DArrayShadow
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Shadow map framebuffer is incomplete" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenQueries(2, timerQueries);
+}
+
+void CascadedShadowMaps::destroy() {
+    glDeleteQueries(2, timerQueries);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &depthTexture);
+}
+
+glm::mat4 CascadedShadowMaps::fitCascade(const glm::vec3 corners[8], const glm::mat4& lightView, const std::vector<Caster>& casters, bool staticOnly) const {
+    // A sphere does not change its size when the camera rotates, unlike a box around the corners
+    glm::vec3 center = glm::vec3(0.0f);
+    for (int i = 0; i < 8; ++i)
+        center += corners[i];
+    center /= 8.0f;
+    float radius = 0.0f;
+    for (int i = 0; i < 8; ++i)
+        radius = std::max(radius, glm::length(corners[i] - center));
+    radius = std::ceil(radius * 16.0f) / 16.0f;
+
+    // Move the center in whole texels of the light space so the shadow map content does not shimmer
+    glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+    float texelSize = 2.0f * radius / RESOLUTION;
+    lightCenter.x = std::floor(lightCenter.x / texelSize) * texelSize;
+    lightCenter.y = std::floor(lightCenter.y / texelSize) * texelSize;
+
+    // The depth range has to include every caster between the light and the cascade
+    float minZ = lightCenter.z - radius;
+    float maxZ = lightCenter.z + radius;
+    for (const Caster& caster : casters) {
+        if (staticOnly && !caster.isStatic) continue;
+        AABB lightBounds = caster.bounds.transformed(lightView);
+        minZ = std::min(minZ, lightBounds.min.z);
+        maxZ = std::max(maxZ, lightBounds.max.z);
+    }
+    // Coarse steps keep the matrix of the cached cascades stable while the camera moves
+    const float depthStep = 8.0f;
+    minZ = std::floor(minZ / depthStep) * depthStep;
+    maxZ = std::ceil(maxZ / depthStep) * depthStep;
+
+    // The light looks down -z, near and far are distances along it
+    glm::mat4 lightProjection = glm::ortho(lightCenter.x - radius, lightCenter.x + radius, lightCenter.y - radius, lightCenter.y + radius, -maxZ, -minZ);
+    return lightProjection * lightView;
+}
+
+void CascadedShadowMaps::readTimer() {
+    for (int slot = 0; slot < 2; ++slot) {
+        if (!timerPending[slot]) continue;
+
+        GLuint available = 0;
+        glGetQueryObjectuiv(timerQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(timerQueries[slot], GL_QUERY_RESULT, &nanoseconds);
+        timerPending[slot] = false;
+        stats.gpuMilliseconds = nanoseconds / 1000000.0;
+    }
+}
+
+void CascadedShadowMaps::render(const glm::mat4& view, const glm::mat4& projection, float near, float far, const glm::vec3& lightDirection, const std::vector<Caster>& casters) {
+    auto start = std::chrono::high_resolution_clock::now();
+    double gpuMilliseconds = stats.gpuMilliseconds;
+    stats = Stats();
+    stats.gpuMilliseconds = gpuMilliseconds;
+    readTimer();
+
+    // Practical split scheme, a blend of logarithmic and uniform splits
+    float shadowFar = std::min(far, SHADOW_DISTANCE);
+    float splits[CASCADE_COUNT + 1];
+    const float lambda = 0.75f;
+    for (int i = 0; i <= CASCADE_COUNT; ++i) {
+        float fraction = i / (float)CASCADE_COUNT;
+        float logarithmic = near * std::pow(shadowFar / near, fraction);
+        float uniform = near + (shadowFar - near) * fraction;
+        splits[i] = lambda * logarithmic + (1.0f - lambda) * uniform;
+    }
+    cascadeSplits = glm::vec4(splits[1], splits[2], splits[3], splits[4]);
+
+    // Corners of the whole view frustum, every cascade is a slice along its edges
+    glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+    glm::vec3 nearCorners[4], farCorners[4];
+    for (int i = 0; i < 4; ++i) {
+        glm::vec4 nearCorner = inverseViewProjection * glm::vec4(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, -1.0f, 1.0f);
+        glm::vec4 farCorner = inverseViewProjection * glm::vec4(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, 1.0f, 1.0f);
+        nearCorners[i] = glm::vec3(nearCorner) / nearCorner.w;
+        farCorners[i] = glm::vec3(farCorner) / farCorner.w;
+    }
+
+    // Rotation only so the light space does not move with the camera
+    glm::vec3 direction = glm::normalize(lightDirection);
+    glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), direction, up);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLint previousFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+    bool started = false;
+
+    for (int cascade = 0; cascade < CASCADE_COUNT; ++cascade) {
+        glm::vec3 corners[8];
+        for (int i = 0; i < 4; ++i) {
+            corners[i] = nearCorners[i] + (farCorners[i] - nearCorners[i]) * ((splits[cascade] - near) / (far - near));
+            corners[i + 4] = nearCorners[i] + (farCorners[i] - nearCorners[i]) * ((splits[cascade + 1] - near) / (far - near));
+        }
+
+        bool staticOnly = cascade >= FIRST_STATIC_CASCADE;
+        glm::mat4 matrix = fitCascade(corners, lightView, casters, staticOnly);
+        if (staticOnly && cascadeValid[cascade] && matrix == cascadeMatrices[cascade])
+            continue;
+        cascadeMatrices[cascade] = matrix;
+        cascadeValid[cascade] = true;
+
+        if (!started) {
+            started = true;
+            glBeginQuery(GL_TIME_ELAPSED, timerQueries[timerSlot]);
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            glViewport(0, 0, RESOLUTION, RESOLUTION);
+            glEnable(GL_DEPTH_TEST);
+            // The terrain is single sided, and slope scaled offsets keep lit surfaces from shadowing themselves
+            glDisable(GL_CULL_FACE);
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(2.0f, 4.0f);
+            glUseProgram(program);
+        }
+
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0, cascade);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUniformMatrix4fv(lightViewProjectionLocation, 1, GL_FALSE, glm::value_ptr(matrix));
+        stats.renderedCascades++;
+
+        Frustum frustum(matrix);
+        for (const Caster& caster : casters) {
+            if (staticOnly && !caster.isStatic) continue;
+            if (!frustum.intersects(caster.bounds)) {
+                stats.culledCasters++;
+                continue;
+            }
+
+            glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(caster.model));
+            if (caster.positions != nullptr)
+                caster.positions->draw();
+            if (caster.object != nullptr)
+                caster.object->renderDepth();
+            stats.drawnCasters++;
+        }
+    }
+
+    if (started) {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        if (cullFace) glEnable(GL_CULL_FACE);
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        glEndQuery(GL_TIME_ELAPSED);
+        timerPending[timerSlot] = true;
+        timerSlot = 1 - timerSlot;
+    }
+
+    stats.cpuMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void CascadedShadowMaps::setupProgram(GLuint program) const {
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "shadowMap"), TEXTURE_UNIT);
+    glUniformMatrix4fv(glGetUniformLocation(program, "shadowMatrices"), CASCADE_COUNT, GL_FALSE, glm::value_ptr(cascadeMatrices[0]));
+    glUniform4fv(glGetUniformLocation(program, "cascadeSplits"), 1, glm::value_ptr(cascadeSplits));
+
+    glActiveTexture(GL_TEXTURE0 + TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, depthTexture);
+    glActiveTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,317 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "PositionStream.h"
+#include "Model.h"
+#include "DrawStats.h"
+
+// Temporal anti-aliasing with upsampling. The scene is rendered at a fraction of the output resolution with
+// a sub-pixel jitter on the projection that walks a Halton sequence, so over a few frames the samples cover
+// every output pixel. The resolve pass reprojects last frame's full resolution result with per-pixel motion
+// vectors, clamps it to the colors of this frame's neighbourhood and blends a small part of the new samples in.
+// Static geometry only moves with the camera, its motion is computed from the depth buffer in the resolve.
+// Moving objects are drawn again with their position streams to write their own motion vectors.
+class TemporalAA {
+public:
+    static const int JITTER_PHASES = 16;
+    static constexpr float MIN_SCALE = 0.5f;
+    static constexpr float MAX_SCALE = 1.0f;
+
+    // Either a single position stream or all meshes of a model, with the model matrix of the last frame
+    struct MovingObject {
+        glm::mat4 model = glm::mat4(1.0f);
+        glm::mat4 previousModel = glm::mat4(1.0f);
+        const PositionStream* positions = nullptr;
+        const Model* object = nullptr;
+    };
+
+    struct Stats {
+        int renderWidth = 0;
+        int renderHeight = 0;
+        // GPU time of the resolve pass a frame or two ago, the timer query is never waited on
+        double gpuMilliseconds = 0.0;
+    };
+
+private:
+    GLuint sceneColor = 0;
+    GLuint sceneVelocity = 0;
+    GLuint sceneDepth = 0;
+    GLuint sceneFramebuffer = 0;
+    GLuint historyTextures[2] = { 0, 0 };
+    GLuint historyFramebuffers[2] = { 0, 0 };
+    int historyIndex = 0;
+    bool historyValid = false;
+
+    GLuint velocityProgram = 0;
+    GLuint resolveProgram = 0;
+    GLuint emptyVao = 0;
+
+    float scale = 0.6f;
+    int outputWidth = 0;
+    int outputHeight = 0;
+    GLint outputFramebuffer = 0;
+
+    int frameIndex = 0;
+    glm::vec2 jitter = glm::vec2(0.0f);
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    glm::mat4 previousViewProjection = glm::mat4(1.0f);
+    glm::mat4 jitteredProjection = glm::mat4(1.0f);
+
+    GLuint timerQueries[2] = { 0, 0 };
+    bool timerPending[2] = { false, false };
+    int timerSlot = 0;
+    Stats stats;
+
+    static float halton(int index, int base);
+    void resizeTargets(int width, int height);
+    void readTimer();
+
+public:
+    // The velocity program is VelocityVertexShader and VelocityFragmentShader, the resolve program
+    // FullscreenVertexShader and TemporalResolveFragmentShader
+    bool create(GLuint velocityProgram, GLuint resolveProgram, float scale);
+    void destroy();
+
+    // Picks this frame's jitter and binds the scene target with the viewport at the render resolution.
+    // The framebuffer bound before is the output of endFrame.
+    void beginFrame(int outputWidth, int outputHeight, const glm::mat4& view, const glm::mat4& projection);
+    // The projection every pass of the scene has to use this frame
+    const glm::mat4& getJitteredProjection() const { return jitteredProjection; }
+    // Writes the motion vectors of the objects that moved, after the scene so they are depth tested against it
+    void renderVelocity(const glm::mat4& view, const std::vector<MovingObject>& objects);
+    // Resolves into the history and copies it to the output framebuffer
+    void endFrame();
+    // The next frame starts over without history, after a camera cut or when the feature was off
+    void resetHistory() { historyValid = false; }
+
+    int getRenderWidth() const { return stats.renderWidth; }
+    int getRenderHeight() const { return stats.renderHeight; }
+    float getScale() const { return scale; }
+    const Stats& getStats() const { return stats; }
+};
+
+constexpr float TemporalAA::MIN_SCALE;
+constexpr float TemporalAA::MAX_SCALE;
+
+bool TemporalAA::create(GLuint velocityProgram, GLuint resolveProgram, float scale) {
+    this->velocityProgram = velocityProgram;
+    this->resolveProgram = resolveProgram;
+    this->scale = std::min(std::max(scale, MIN_SCALE), MAX_SCALE);
+
+    glUseProgram(resolveProgram);
+    glUniform1i(glGetUniformLocation(resolveProgram, "sceneColor"), 0);
+    glUniform1i(glGetUniformLocation(resolveProgram, "sceneDepth"), 1);
+    glUniform1i(glGetUniformLocation(resolveProgram, "sceneVelocity"), 2);
+    glUniform1i(glGetUniformLocation(resolveProgram, "history"), 3);
+    glUseProgram(0);
+
+    // The core profile needs a vertex array object even when nothing is read from buffers
+    glGenVertexArrays(1, &emptyVao);
+    glGenQueries(2, timerQueries);
+
+    glGenTextures(1, &sceneColor);
+    glGenTextures(1, &sceneVelocity);
+    glGenTextures(1, &sceneDepth);
+    glGenTextures(2, historyTextures);
+    glGenFramebuffers(1, &sceneFramebuffer);
+    glGenFramebuffers(2, historyFramebuffers);
+    resizeTargets(1, 1);
+
+    bool complete = true;
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColor, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, sceneVelocity, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, sceneDepth, 0);
+    complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    for (int i = 0; i < 2; ++i) {
+        glBindFramebuffer(GL_FRAMEBUFFER, historyFramebuffers[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, historyTextures[i], 0);
+        complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+        std::cerr << "Temporal anti-aliasing framebuffers are incomplete" << std::endl;
+    return complete;
+}
+
+void TemporalAA::destroy() {
+    glDeleteFramebuffers(1, &sceneFramebuffer);
+    glDeleteFramebuffers(2, historyFramebuffers);
+    glDeleteTextures(1, &sceneColor);
+    glDeleteTextures(1, &sceneVelocity);
+    glDeleteTextures(1, &sceneDepth);
+    glDeleteTextures(2, historyTextures);
+    glDeleteVertexArrays(1, &emptyVao);
+    glDeleteQueries(2, timerQueries);
+}
+
+float TemporalAA::halton(int index, int base) {
+    float result = 0.0f;
+    float fraction = 1.0f / base;
+    for (int i = index; i > 0; i /= base) {
+        result += (i % base) * fraction;
+        fraction /= base;
+    }
+    return result;
+}
+
+void TemporalAA::resizeTargets(int width, int height) {
+    outputWidth = width;
+    outputHeight = height;
+    stats.renderWidth = std::max((int)(width * scale + 0.5f), 1);
+    stats.renderHeight = std::max((int)(height * scale + 0.5f), 1);
+
+    // The resolve reads the scene with texelFetch, the history is filtered
+    auto allocate = [](GLuint texture, GLint internalFormat, int width, int height, GLenum format, GLenum type, GLint filter) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    };
+    allocate(sceneColor, GL_RGBA8, stats.renderWidth, stats.renderHeight, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST);
+    allocate(sceneVelocity, GL_RGBA16F, stats.renderWidth, stats.renderHeight, GL_RGBA, GL_HALF_FLOAT, GL_NEAREST);
+    // The scene uses the stencil buffer, so the target keeps the layout of the default framebuffer
+    allocate(sceneDepth, GL_DEPTH24_STENCIL8, stats.renderWidth, stats.renderHeight, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, GL_NEAREST);
+    // Half floats so the small steps of the blend do not band
+    for (int i = 0; i < 2; ++i)
+        allocate(historyTextures[i], GL_RGBA16F, width, height, GL_RGBA, GL_HALF_FLOAT, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    historyValid = false;
+}
+
+void TemporalAA::readTimer() {
+    for (int slot = 0; slot < 2; ++slot) {
+        if (!timerPending[slot]) continue;
+
+        GLuint available = 0;
+        glGetQueryObjectuiv(timerQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(timerQueries[slot], GL_QUERY_RESULT, &nanoseconds);
+        timerPending[slot] = false;
+        stats.gpuMilliseconds = nanoseconds / 1000000.0;
+    }
+}
+
+void TemporalAA::beginFrame(int outputWidth, int outputHeight, const glm::mat4& view, const glm::mat4& projection) {
+    readTimer();
+    if (outputWidth != this->outputWidth || outputHeight != this->outputHeight)
+        resizeTargets(outputWidth, outputHeight);
+
+    // Halton (2, 3) offsets in render pixels, moved onto the projection as a translation in clip space
+    frameIndex++;
+    int phase = frameIndex % JITTER_PHASES + 1;
+    jitter = glm::vec2(halton(phase, 2), halton(phase, 3)) - 0.5f;
+    glm::mat4 offset = glm::translate(glm::mat4(1.0f),
+        glm::vec3(2.0f * jitter.x / stats.renderWidth, 2.0f * jitter.y / stats.renderHeight, 0.0f));
+    jitteredProjection = offset * projection;
+
+    previousViewProjection = historyValid ? viewProjection : projection * view;
+    viewProjection = projection * view;
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &outputFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glViewport(0, 0, stats.renderWidth, stats.renderHeight);
+
+    // Pixels without a moving object keep z = 0 and get the camera motion in the resolve
+    const GLenum velocityBuffer = GL_COLOR_ATTACHMENT1;
+    const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    glDrawBuffers(1, &velocityBuffer);
+    glClearBufferfv(GL_COLOR, 0, zero);
+    const GLenum colorBuffer = GL_COLOR_ATTACHMENT0;
+    glDrawBuffers(1, &colorBuffer);
+}
+
+void TemporalAA::renderVelocity(const glm::mat4& view, const std::vector<MovingObject>& objects) {
+    // Fragment output 0 goes into the velocity target, tested against the depth of the scene without writing it
+    const GLenum velocityBuffer = GL_COLOR_ATTACHMENT1;
+    glDrawBuffers(1, &velocityBuffer);
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLint depthFunc = GL_LESS;
+    glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    glDepthMask(GL_FALSE);
+
+    glUseProgram(velocityProgram);
+    glUniformMatrix4fv(glGetUniformLocation(velocityProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(glGetUniformLocation(velocityProgram, "projection"), 1, GL_FALSE, glm::value_ptr(jitteredProjection));
+    glUniformMatrix4fv(glGetUniformLocation(velocityProgram, "viewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+    glUniformMatrix4fv(glGetUniformLocation(velocityProgram, "previousViewProjection"), 1, GL_FALSE, glm::value_ptr(previousViewProjection));
+    GLint modelLocation = glGetUniformLocation(velocityProgram, "model");
+    GLint previousModelLocation = glGetUniformLocation(velocityProgram, "previousModel");
+    for (const MovingObject& object : objects) {
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(object.model));
+        glUniformMatrix4fv(previousModelLocation, 1, GL_FALSE, glm::value_ptr(object.previousModel));
+        if (object.positions != nullptr)
+            object.positions->draw();
+        if (object.object != nullptr)
+            object.object->renderDepth();
+    }
+
+    glDepthMask(GL_TRUE);
+    glDepthFunc(depthFunc);
+    if (!depthTest)
+        glDisable(GL_DEPTH_TEST);
+    const GLenum colorBuffer = GL_COLOR_ATTACHMENT0;
+    glDrawBuffers(1, &colorBuffer);
+}
+
+void TemporalAA::endFrame() {
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[timerSlot]);
+    int writeIndex = 1 - historyIndex;
+    glBindFramebuffer(GL_FRAMEBUFFER, historyFramebuffers[writeIndex]);
+    glViewport(0, 0, outputWidth, outputHeight);
+
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean stencilTest = glIsEnabled(GL_STENCIL_TEST);
+    GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_STENCIL_TEST);
+    glDisable(GL_CULL_FACE);
+
+    glm::mat4 reprojection = previousViewProjection * glm::inverse(viewProjection);
+    glUseProgram(resolveProgram);
+    glUniform2f(glGetUniformLocation(resolveProgram, "renderSize"), (float)stats.renderWidth, (float)stats.renderHeight);
+    glUniform2f(glGetUniformLocation(resolveProgram, "outputSize"), (float)outputWidth, (float)outputHeight);
+    glUniform2fv(glGetUniformLocation(resolveProgram, "jitter"), 1, glm::value_ptr(jitter));
+    glUniformMatrix4fv(glGetUniformLocation(resolveProgram, "reprojection"), 1, GL_FALSE, glm::value_ptr(reprojection));
+    glUniform1i(glGetUniformLocation(resolveProgram, "historyValid"), historyValid);
+
+    GLuint textures[4] = { sceneColor, sceneDepth, sceneVelocity, historyTextures[historyIndex] };
+    for (int i = 0; i < 4; ++i) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+    }
+    glBindVertexArray(emptyVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    drawStats.add(3);
+    glBindVertexArray(0);
+    glActiveTexture(GL_TEXTURE0);
+
+    if (depthTest) glEnable(GL_DEPTH_TEST);
+    if (stencilTest) glEnable(GL_STENCIL_TEST);
+    if (cullFace) glEnable(GL_CULL_FACE);
+
+    // The history is the anti-aliased image, copying it out is cheaper than resolving twice
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, historyFramebuffers[writeIndex]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, outputFramebuffer);
+    glBlitFramebuffer(0, 0, outputWidth, outputHeight, 0, 0, outputWidth, outputHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, outputFramebuffer);
+
+    glEndQuery(GL_TIME_ELAPSED);
+    timerPending[timerSlot] = true;
+    timerSlot = 1 - timerSlot;
+
+    historyIndex = writeIndex;
+    historyValid = true;
+}
@@ -0,0 +1,190 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <FastNoiseLite/FastNoiseLite.h>
+#include "stb_image.h"
+#include "Vertex.h"
+#include "TextureStreamer.h"
+
+// CPU side of the terrain mesh, kept apart from the buffer setup in createTerrain so Microbenchmarks.cpp can time it
+
+// Positions and texture coordinates of a width x depth grid, the height comes from the noise
+void generateTerrainHeights(std::vector<Vertex>& vertices, int width, int depth, float scale, float amplitude, const FastNoiseLite& noise);
+// Two triangles per grid cell
+void generateTerrainIndices(std::vector<GLuint>& indices, int width, int depth);
+// Normals from the height differences of the neighbours, the border vertices are left as they are
+void generateTerrainNormals(std::vector<Vertex>& vertices, int width, int depth);
+
+// Colors of the terrain virtual texture. The tiling detail image is tinted by low frequency noise and blended with
+// patches of dirt, so every region of the terrain looks different. compose is const and may run on any thread.
+class TerrainComposer {
+private:
+    // Mip chain of the detail image in RGB
+    std::vector<TextureStreamer::Level> detail;
+    // World units covered by one repetition of the detail image
+    float tileSize = 10.0f;
+    glm::vec2 origin;
+    glm::vec2 size;
+    FastNoiseLite tintNoise;
+    FastNoiseLite patchNoise;
+
+    glm::vec3 sampleDetail(int level, float u, float v) const;
+
+public:
+    // The virtual texture covers the world rectangle from origin to origin + size on the xz plane.
+    // A procedural grass image replaces the detail image when it cannot be loaded.
+    void create(const char* detailFilename, float tileSize, const glm::vec2& origin, const glm::vec2& size, int seed);
+    // Fills count x count RGBA texels starting at texel (x, y) of the given level, virtualSize is the width of level 0.
+    // Texels outside the texture repeat the closest edge texel.
+    void compose(int level, int x, int y, int count, int virtualSize, unsigned char* rgba) const;
+};
+
+void generateTerrainHeights(std::vector<Vertex>& vertices, int width, int depth, float scale, float amplitude, const FastNoiseLite& noise) {
+    vertices.resize(width * depth);
+
+    for (int z = 0; z < depth; ++z) {
+        for (int x = 0; x < width; ++x) {
+            int index = z * width + x;
+            float height = amplitude * noise.GetNoise(x * scale, z * scale);
+            vertices[index].position = glm::vec3(x, height, z);
+            vertices[index].uv = glm::vec2(x / 10.0f, z / 10.0f);
+        }
+    }
+}
+
+void generateTerrainIndices(std::vector<GLuint>& indices, int width, int depth) {
+    indices.resize((width - 1) * (depth - 1) * 6);
+
+    for (int z = 0; z < depth - 1; ++z) {
+        for (int x = 0; x < width - 1; ++x) {
+            int index = z * (width - 1) + x;
+            indices[index * 6 + 0] = z * width + x;
+            indices[index * 6 + 1] = (z + 1) * width + x;
+            indices[index * 6 + 2] = z * width + x + 1;
+            indices[index * 6 + 3] = (z + 1) * width + x;
+            indices[index * 6 + 4] = (z + 1) * width + x + 1;
+            indices[index * 6 + 5] = z * width + x + 1;
+        }
+    }
+}
+
+void generateTerrainNormals(std::vector<Vertex>& vertices, int width, int depth) {
+    for (int z = 1; z < depth - 1; ++z) {
+        for (int x = 1; x < width - 1; ++x) {
+            glm::vec3& normal = vertices[z * width + x].normal;
+            normal = glm::vec3(0, 1, 0);
+            float heightLeft = vertices[z * width + x - 1].position.y;
+            float heightRight = vertices[z * width + x + 1].position.y;
+            float heightDown = vertices[(z - 1) * width + x].position.y;
+            float heightUp = vertices[(z + 1) * width + x].position.y;
+            normal.x = heightLeft - heightRight;
+            normal.z = heightDown - heightUp;
+            normal = glm::normalize(normal);
+        }
+    }
+}
+
+void TerrainComposer::create(const char* detailFilename, float tileSize, const glm::vec2& origin, const glm::vec2& size, int seed) {
+    this->tileSize = tileSize;
+    this->origin = origin;
+    this->size = size;
+
+    detail.resize(1);
+    TextureStreamer::Level& image = detail[0];
+    stbi_set_flip_vertically_on_load(true);
+    int channels;
+    unsigned char* data = stbi_load(detailFilename, &image.width, &image.height, &channels, 3);
+    if (data) {
+        image.pixels.assign(data, data + (size_t)image.width * image.height * 3);
+        stbi_image_free(data);
+    }
+    else {
+        std::cerr << "Failed to load texture: " << detailFilename << ", using procedural grass" << std::endl;
+        FastNoiseLite grass(seed + 1);
+        grass.SetFrequency(0.05f);
+        image.width = image.height = 256;
+        image.pixels.resize(256 * 256 * 3);
+        for (int y = 0; y < 256; ++y) {
+            for (int x = 0; x < 256; ++x) {
+                // Sampled on a torus so the image tiles
+                float angleX = x / 256.0f * 6.2831853f;
+                float angleY = y / 256.0f * 6.2831853f;
+                float value = 0.5f + 0.5f * grass.GetNoise(40.0f * std::cos(angleX), 40.0f * std::sin(angleX), 40.0f * std::cos(angleY) + 40.0f * std::sin(angleY));
+                unsigned char* texel = &image.pixels[(y * 256 + x) * 3];
+                texel[0] = (unsigned char)(60 + 50 * value);
+                texel[1] = (unsigned char)(100 + 80 * value);
+                texel[2] = (unsigned char)(40 + 30 * value);
+            }
+        }
+    }
+    while (detail.back().width > 1 || detail.back().height > 1) {
+        detail.emplace_back();
+        TextureStreamer::downsample(detail[detail.size() - 2], detail.back(), 3);
+    }
+
+    tintNoise.SetSeed(seed);
+    tintNoise.SetFrequency(0.02f);
+    tintNoise.SetFractalType(FastNoiseLite::FractalType_FBm);
+    tintNoise.SetFractalOctaves(3);
+    patchNoise.SetSeed(seed + 2);
+    patchNoise.SetFrequency(0.12f);
+    patchNoise.SetFractalType(FastNoiseLite::FractalType_FBm);
+    patchNoise.SetFractalOctaves(3);
+}
+
+glm::vec3 TerrainComposer::sampleDetail(int level, float u, float v) const {
+    // Bilinear with repeat, u and v in repetitions of the image
+    const TextureStreamer::Level& image = detail[level];
+    float x = (u - std::floor(u)) * image.width - 0.5f;
+    float y = (v - std::floor(v)) * image.height - 0.5f;
+    int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+    float fx = x - x0, fy = y - y0;
+    auto texel = [&](int tx, int ty) {
+        tx = (tx % image.width + image.width) % image.width;
+        ty = (ty % image.height + image.height) % image.height;
+        const unsigned char* p = &image.pixels[((size_t)ty * image.width + tx) * 3];
+        return glm::vec3(p[0], p[1], p[2]);
+    };
+    return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx), glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx), fy);
+}
+
+void TerrainComposer::compose(int level, int x, int y, int count, int virtualSize, unsigned char* rgba) const {
+    int levelSize = std::max(virtualSize >> level, 1);
+    // World units per texel of this level, the detail image level with about the same footprint avoids aliasing
+    glm::vec2 footprint = size / (float)levelSize;
+    float detailTexels = footprint.x * detail[0].width / tileSize;
+    int detailLevel = std::min(std::max((int)std::floor(std::log2(std::max(detailTexels, 1.0f))), 0), (int)detail.size() - 1);
+    // The patch noise turns into a flat average once a texel covers its finest octave
+    float patchContrast = glm::clamp(1.5f - footprint.x * 2.0f, 0.0f, 1.0f);
+
+    const glm::vec3 dryTint = glm::vec3(1.1f, 1.0f, 0.75f);
+    const glm::vec3 lushTint = glm::vec3(0.8f, 1.0f, 0.85f);
+    const glm::vec3 dirt = glm::vec3(120.0f, 95.0f, 70.0f);
+    for (int row = 0; row < count; ++row) {
+        int texelY = std::min(std::max(y + row, 0), levelSize - 1);
+        float worldZ = origin.y + (texelY + 0.5f) * footprint.y;
+        for (int column = 0; column < count; ++column) {
+            int texelX = std::min(std::max(x + column, 0), levelSize - 1);
+            float worldX = origin.x + (texelX + 0.5f) * footprint.x;
+
+            glm::vec3 color = sampleDetail(detailLevel, worldX / tileSize, worldZ / tileSize);
+            float tint = 0.5f + 0.5f * tintNoise.GetNoise(worldX, worldZ);
+            color *= glm::mix(lushTint, dryTint, tint);
+
+            float patch = glm::smoothstep(0.25f, 0.45f, patchNoise.GetNoise(worldX, worldZ));
+            patch = glm::mix(0.3f, patch, patchContrast);
+            float luminance = glm::dot(color, glm::vec3(0.3f, 0.59f, 0.11f)) / 128.0f;
+            color = glm::mix(color, dirt * luminance, patch);
+
+            unsigned char* texel = &rgba[((size_t)row * count + column) * 4];
+            texel[0] = (unsigned char)glm::clamp(color.r, 0.0f, 255.0f);
+            texel[1] = (unsigned char)glm::clamp(color.g, 0.0f, 255.0f);
+            texel[2] = (unsigned char)glm::clamp(color.b, 0.0f, 255.0f);
+            texel[3] = 255;
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <fstream>
+#include <iostream>
+
+// Reads a whole file into a new null-terminated buffer that the caller frees with delete[]
+void loadTextFromFile(const char* filename, char*& text);
+
+void loadTextFromFile(const char* filename, char*& text)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return;
+    }
+
+    // Determine the file size
+    file.seekg(0, std::ios::end);
+    std::streamsize fileSize = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    // Allocate memory for the text buffer
+    text = new char[fileSize + 1];
+
+    // Read the file contents into the text buffer
+    if (!file.read(text, fileSize))
+    {
+        std::cerr << "Failed to read file: " << filename << std::endl;
+        delete[] text;
+        text = nullptr;
+        return;
+    }
+
+    // Null-terminate the text buffer
+    text[fileSize] = '\0';
+
+    // Close the file
+    file.close();
+}
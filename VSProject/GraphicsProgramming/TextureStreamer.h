@@ -0,0 +1,355 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <map>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "stb_image.h"
+#include "Vertex.h"
+
+// Mip level streaming of the material textures.
+// A texture is decoded once and its mip chain is built on the CPU, but only the small levels of the tail are uploaded
+// when it is loaded. The finer levels follow one at a time as the draws ask for them, at most uploadBudget bytes per
+// frame. GL_TEXTURE_BASE_LEVEL always points at the finest resident level, so the sampler never touches a missing one,
+// and GL_TEXTURE_MIN_LOD fades a new level in over a few frames instead of popping.
+// Levels that were not asked for are only evicted when an upload would exceed memoryBudget, least recently used first.
+// The decoded chain stays in system memory, the budget covers video memory only.
+class TextureStreamer {
+public:
+    // Levels of at most this size are uploaded at load time and never evicted
+    static const int TAIL_SIZE = 64;
+    // Frames a new level takes to fade in
+    static const int FADE_FRAMES = 8;
+
+    struct Stats {
+        int textures = 0;
+        size_t residentBytes = 0;
+        // Size of all textures with every level resident
+        size_t fullBytes = 0;
+        // Since the last resetStats
+        size_t uploadedBytes = 0;
+        int uploadedLevels = 0;
+        int evictedLevels = 0;
+        // Levels that were asked for but not resident after the last update
+        int missingLevels = 0;
+        double loadMilliseconds = 0.0;
+    };
+
+    struct Level {
+        int width;
+        int height;
+        std::vector<unsigned char> pixels;
+    };
+
+    // Next smaller level of a mip chain with a 2x2 box filter
+    static void downsample(const Level& source, Level& target, int channels);
+
+private:
+
+    struct StreamedTexture {
+        GLuint texture = 0;
+        GLenum format = GL_RGB;
+        int channels = 3;
+        std::vector<Level> levels;
+        // Finest resident level, GL_TEXTURE_BASE_LEVEL
+        int residentLevel = 0;
+        // Finest level of the tail
+        int tailLevel = 0;
+        // Finest level asked for since the last update
+        int requestedLevel = 0;
+        bool requested = false;
+        // Level wanted by the draws, the tail when nothing asked for it
+        int wantedLevel = 0;
+        unsigned int lastRequestFrame = 0;
+        float minLod = 0.0f;
+    };
+
+    std::vector<StreamedTexture> textures;
+    std::map<GLuint, int> textureIndices;
+    size_t uploadBudget = 0;
+    size_t memoryBudget = 0;
+    unsigned int frameIndex = 0;
+    Stats stats;
+
+    static size_t levelBytes(const StreamedTexture& texture, int level);
+    void uploadLevel(StreamedTexture& texture, int level);
+    void evictLevel(StreamedTexture& texture);
+    // Frees memory of textures holding levels nobody asked for, false when there is not enough to free
+    bool makeRoom(size_t bytes, const StreamedTexture& receiver);
+
+public:
+    // Both budgets are in bytes
+    void create(size_t uploadBudget, size_t memoryBudget);
+    void destroy();
+
+    // Returns the texture name with the tail resident, or 0 when the file could not be loaded
+    GLuint load(const char* filename);
+
+    // Asks for the level a surface needs that covers uvDensity texture coordinates per world unit at the given distance.
+    // pixelScale is the viewport height in pixels divided by 2 tan(fovy / 2), i.e. projection[1][1] * height / 2.
+    void request(GLuint texture, float uvDensity, float distance, float pixelScale);
+    // Uploads and evicts levels for the requests since the last update, call once per frame before drawing
+    void update();
+
+    int getResidentLevel(GLuint texture) const;
+    const Stats& getStats() const { return stats; }
+    void resetStats();
+
+    // Texture coordinates per world unit averaged over the area of a triangle mesh, the same for every texture size
+    static float uvDensity(const std::vector<Vertex>& vertices, const std::vector<GLuint>& indices);
+};
+
+void TextureStreamer::create(size_t uploadBudget, size_t memoryBudget) {
+    this->uploadBudget = uploadBudget;
+    this->memoryBudget = memoryBudget;
+}
+
+void TextureStreamer::destroy() {
+    for (StreamedTexture& texture : textures)
+        glDeleteTextures(1, &texture.texture);
+    textures.clear();
+    textureIndices.clear();
+    stats = Stats();
+}
+
+size_t TextureStreamer::levelBytes(const StreamedTexture& texture, int level) {
+    // Drivers store RGB8 as RGBA8
+    int texelBytes = texture.channels == 3 ? 4 : texture.channels;
+    return (size_t)texture.levels[level].width * texture.levels[level].height * texelBytes;
+}
+
+void TextureStreamer::downsample(const Level& source, Level& target, int channels) {
+    target.width = std::max(source.width / 2, 1);
+    target.height = std::max(source.height / 2, 1);
+    target.pixels.resize((size_t)target.width * target.height * channels);
+
+    // 2x2 box filter, the last row and column of odd sizes are clamped
+    for (int y = 0; y < target.height; ++y) {
+        int y0 = std::min(y * 2, source.height - 1);
+        int y1 = std::min(y * 2 + 1, source.height - 1);
+        for (int x = 0; x < target.width; ++x) {
+            int x0 = std::min(x * 2, source.width - 1);
+            int x1 = std::min(x * 2 + 1, source.width - 1);
+            for (int c = 0; c < channels; ++c) {
+                int sum = source.pixels[((size_t)y0 * source.width + x0) * channels + c]
+                    + source.pixels[((size_t)y0 * source.width + x1) * channels + c]
+                    + source.pixels[((size_t)y1 * source.width + x0) * channels + c]
+                    + source.pixels[((size_t)y1 * source.width + x1) * channels + c];
+                target.pixels[((size_t)y * target.width + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+GLuint TextureStreamer::load(const char* filename) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    int width, height, numChannels;
+    stbi_set_flip_vertically_on_load(true);
+    unsigned char* data = stbi_load(filename, &width, &height, &numChannels, 0);
+    if (!data) {
+        std::cerr << "Failed to load texture: " << filename << std::endl;
+        return 0;
+    }
+    // Two channel images have no matching unsized format in the regular path either
+    if (numChannels == 2) {
+        std::cerr << "Two channel textures are not supported: " << filename << std::endl;
+        stbi_image_free(data);
+        return 0;
+    }
+
+    StreamedTexture texture;
+    texture.channels = numChannels;
+    texture.format = numChannels == 1 ? GL_RED : numChannels == 3 ? GL_RGB : GL_RGBA;
+    texture.levels.resize(1);
+    texture.levels[0].width = width;
+    texture.levels[0].height = height;
+    texture.levels[0].pixels.assign(data, data + (size_t)width * height * numChannels);
+    stbi_image_free(data);
+    while (texture.levels.back().width > 1 || texture.levels.back().height > 1) {
+        texture.levels.emplace_back();
+        downsample(texture.levels[texture.levels.size() - 2], texture.levels.back(), numChannels);
+    }
+
+    int lastLevel = (int)texture.levels.size() - 1;
+    texture.tailLevel = lastLevel;
+    while (texture.tailLevel > 0 && std::max(texture.levels[texture.tailLevel - 1].width, texture.levels[texture.tailLevel - 1].height) <= TAIL_SIZE)
+        texture.tailLevel--;
+    texture.residentLevel = lastLevel + 1;
+    texture.requestedLevel = texture.wantedLevel = texture.tailLevel;
+
+    glGenTextures(1, &texture.texture);
+    glBindTexture(GL_TEXTURE_2D, texture.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, lastLevel);
+
+    // Smallest level first, the texture is complete after every upload. The tail is not a streaming upload.
+    size_t uploadedBytes = stats.uploadedBytes;
+    int uploadedLevels = stats.uploadedLevels;
+    for (int level = lastLevel; level >= texture.tailLevel; --level)
+        uploadLevel(texture, level);
+    texture.minLod = 0.0f;
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, 0.0f);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (int level = 0; level <= lastLevel; ++level)
+        stats.fullBytes += levelBytes(texture, level);
+    stats.textures++;
+    stats.uploadedBytes = uploadedBytes;
+    stats.uploadedLevels = uploadedLevels;
+    stats.loadMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    GLuint name = texture.texture;
+    textureIndices[name] = (int)textures.size();
+    textures.push_back(std::move(texture));
+    return name;
+}
+
+void TextureStreamer::uploadLevel(StreamedTexture& texture, int level) {
+    const Level& source = texture.levels[level];
+    glBindTexture(GL_TEXTURE_2D, texture.texture);
+    // Rows of odd sized RGB levels are not 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, level, texture.format, source.width, source.height, 0, texture.format, GL_UNSIGNED_BYTE, source.pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // The level below was the finest one until now, it keeps being sampled until the fade reaches the new one.
+    // The LOD of the sampler is relative to the base level.
+    texture.residentLevel = level;
+    texture.minLod = 1.0f;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, texture.minLod);
+
+    size_t bytes = levelBytes(texture, level);
+    stats.residentBytes += bytes;
+    stats.uploadedBytes += bytes;
+    stats.uploadedLevels++;
+}
+
+void TextureStreamer::evictLevel(StreamedTexture& texture) {
+    int level = texture.residentLevel;
+    glBindTexture(GL_TEXTURE_2D, texture.texture);
+    texture.residentLevel = level + 1;
+    texture.minLod = 0.0f;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, texture.residentLevel);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, 0.0f);
+    // An empty image releases the storage of the level
+    glTexImage2D(GL_TEXTURE_2D, level, texture.format, 0, 0, 0, texture.format, GL_UNSIGNED_BYTE, nullptr);
+
+    stats.residentBytes -= levelBytes(texture, level);
+    stats.evictedLevels++;
+}
+
+bool TextureStreamer::makeRoom(size_t bytes, const StreamedTexture& receiver) {
+    while (stats.residentBytes + bytes > memoryBudget) {
+        // Least recently used texture with a level finer than it needs, the larger level on a tie
+        StreamedTexture* victim = nullptr;
+        for (StreamedTexture& texture : textures) {
+            if (&texture == &receiver || texture.residentLevel >= texture.wantedLevel)
+                continue;
+            if (victim == nullptr || texture.lastRequestFrame < victim->lastRequestFrame
+                || (texture.lastRequestFrame == victim->lastRequestFrame && levelBytes(texture, texture.residentLevel) > levelBytes(*victim, victim->residentLevel)))
+                victim = &texture;
+        }
+        if (victim == nullptr)
+            return false;
+        evictLevel(*victim);
+    }
+    return true;
+}
+
+void TextureStreamer::request(GLuint texture, float uvDensity, float distance, float pixelScale) {
+    auto it = textureIndices.find(texture);
+    if (it == textureIndices.end())
+        return;
+    StreamedTexture& streamed = textures[it->second];
+
+    // Texels of level 0 per world unit against pixels per world unit, every level halves the ratio
+    const Level& base = streamed.levels[0];
+    float texelsPerUnit = uvDensity * std::sqrt((float)base.width * base.height);
+    float pixelsPerUnit = pixelScale / std::max(distance, 0.01f);
+    int level = (int)std::floor(std::log2(std::max(texelsPerUnit / pixelsPerUnit, 1.0f)));
+    level = std::min(level, streamed.tailLevel);
+
+    if (!streamed.requested || level < streamed.requestedLevel)
+        streamed.requestedLevel = level;
+    streamed.requested = true;
+    streamed.lastRequestFrame = frameIndex;
+}
+
+void TextureStreamer::update() {
+    for (StreamedTexture& texture : textures) {
+        texture.wantedLevel = texture.requested ? texture.requestedLevel : texture.tailLevel;
+        texture.requested = false;
+
+        if (texture.minLod > 0.0f) {
+            texture.minLod = std::max(texture.minLod - 1.0f / FADE_FRAMES, 0.0f);
+            glBindTexture(GL_TEXTURE_2D, texture.texture);
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, texture.minLod);
+        }
+    }
+
+    // One level per step for the texture that is furthest from what it needs, coarse levels always come first.
+    // The first upload of a frame may exceed the budget, otherwise a level larger than the budget would never load.
+    size_t uploaded = 0;
+    bool memoryFull = false;
+    while (!memoryFull) {
+        StreamedTexture* next = nullptr;
+        for (StreamedTexture& texture : textures) {
+            int missing = texture.residentLevel - texture.wantedLevel;
+            if (missing > 0 && (next == nullptr || missing > next->residentLevel - next->wantedLevel))
+                next = &texture;
+        }
+        if (next == nullptr)
+            break;
+
+        size_t bytes = levelBytes(*next, next->residentLevel - 1);
+        if (uploaded > 0 && uploaded + bytes > uploadBudget)
+            break;
+        if (!makeRoom(bytes, *next)) {
+            memoryFull = true;
+            break;
+        }
+        uploadLevel(*next, next->residentLevel - 1);
+        uploaded += bytes;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    stats.missingLevels = 0;
+    for (const StreamedTexture& texture : textures)
+        stats.missingLevels += std::max(texture.residentLevel - texture.wantedLevel, 0);
+    frameIndex++;
+}
+
+int TextureStreamer::getResidentLevel(GLuint texture) const {
+    auto it = textureIndices.find(texture);
+    return it != textureIndices.end() ? textures[it->second].residentLevel : -1;
+}
+
+void TextureStreamer::resetStats() {
+    stats.uploadedBytes = 0;
+    stats.uploadedLevels = 0;
+    stats.evictedLevels = 0;
+}
+
+float TextureStreamer::uvDensity(const std::vector<Vertex>& vertices, const std::vector<GLuint>& indices) {
+    double worldArea = 0.0;
+    double uvArea = 0.0;
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const Vertex& a = vertices[indices[i]];
+        const Vertex& b = vertices[indices[i + 1]];
+        const Vertex& c = vertices[indices[i + 2]];
+        worldArea += 0.5 * glm::length(glm::cross(b.position - a.position, c.position - a.position));
+        glm::vec2 u = b.uv - a.uv;
+        glm::vec2 v = c.uv - a.uv;
+        uvArea += 0.5 * std::abs(u.x * v.y - u.y * v.x);
+    }
+    return worldArea > 0.0 ? (float)std::sqrt(uvArea / worldArea) : 0.0f;
+}
@@ -0,0 +1,544 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "FrameArena.h"
+#include "AllocationTracker.h"
+
+// Sparse virtual texture. A huge texture is split into pages, and only the pages that are visible live in a fixed
+// atlas of physical pages. The memory stays the same for any size of the virtual texture except for the page table,
+// which has one texel per page.
+// Every frame the geometry is drawn once more into a small feedback buffer that stores the page and level every
+// pixel needs. The buffer is read back through pixel buffer objects a few frames later, the missing pages are
+// produced on worker threads by a producer callback and uploaded into the least recently visible slots of the atlas.
+// The page table has one mip level per level of the virtual texture, every entry points at the resident page that
+// covers it, which is the page itself or the closest coarser one, so a missing page is drawn blurry and never black.
+// The single page of the coarsest level is produced in create and never evicted.
+class VirtualTexture {
+public:
+    // Texels of a page, the border on every side lets bilinear filtering read past the edge of the page
+    static const int PAGE_SIZE = 128;
+    static const int PAGE_BORDER = 4;
+    static const int SLOT_SIZE = PAGE_SIZE + 2 * PAGE_BORDER;
+    // Pages per side of level 0
+    static const int PAGE_TABLE_SIZE = 256;
+    static const int LEVEL_COUNT = 9;
+    static const int VIRTUAL_SIZE = PAGE_TABLE_SIZE * PAGE_SIZE;
+    // Physical pages per side of the atlas
+    static const int ATLAS_PAGES = 16;
+    static const int ATLAS_SIZE = ATLAS_PAGES * SLOT_SIZE;
+    // The feedback buffer has 1/FEEDBACK_DIVISOR of the output resolution
+    static const int FEEDBACK_DIVISOR = 8;
+    // Frames between rendering the feedback and reading it back
+    static const int FEEDBACK_LATENCY = 2;
+    // Pages uploaded per frame and pages queued or in production at once
+    static const int MAX_UPLOADS = 8;
+    static const int MAX_PENDING = 32;
+    static const int PAGE_TABLE_UNIT = 7;
+    static const int ATLAS_UNIT = 8;
+
+    // Fills count x count RGBA texels starting at texel (x, y) of a level, called on the worker threads
+    typedef std::function<void(int level, int x, int y, int count, unsigned char* rgba)> Producer;
+
+    struct Stats {
+        int residentPages = 0;
+        int pendingPages = 0;
+        // Distinct pages in the last feedback buffer
+        int visiblePages = 0;
+        // Since the last resetStats
+        int producedPages = 0;
+        int evictedPages = 0;
+        // Produced pages that found no free slot because every slot was visible
+        int droppedPages = 0;
+        double feedbackMilliseconds = 0.0;
+        // Atlas, page table and feedback buffers, independent of the virtual size
+        size_t memoryBytes = 0;
+    };
+
+private:
+    struct Slot {
+        int level = -1;
+        int x = 0;
+        int y = 0;
+        unsigned int lastVisibleFrame = 0;
+    };
+
+    struct ProducedPage {
+        uint32_t page;
+        std::vector<unsigned char> texels;
+    };
+
+    Producer producer;
+    glm::vec2 origin;
+    glm::vec2 size;
+
+    GLuint pageTableTexture = 0;
+    GLuint atlasTexture = 0;
+    GLuint feedbackProgram = 0;
+    GLuint feedbackFramebuffer = 0;
+    GLuint feedbackColor = 0;
+    GLuint feedbackDepth = 0;
+    GLuint readbackBuffers[FEEDBACK_LATENCY + 1] = {};
+    GLsync readbackFences[FEEDBACK_LATENCY + 1] = {};
+    int readbackWidths[FEEDBACK_LATENCY + 1] = {};
+    int readbackHeights[FEEDBACK_LATENCY + 1] = {};
+    int feedbackWidth = 0;
+    int feedbackHeight = 0;
+    int feedbackIndex = 0;
+
+    // Saved by beginFeedback
+    GLint previousFramebuffer = 0;
+    GLint previousViewport[4];
+
+    // Page table entries per level, RGBA8 with the slot in r and g and the level of the resident page in b
+    std::vector<uint32_t> pageTable[LEVEL_COUNT];
+    // Atlas slot of every page, -1 when it is not resident
+    std::vector<int> pageSlots[LEVEL_COUNT];
+    std::vector<Slot> slots;
+    // Region of level 0 pages whose entries have to be rebuilt, max is exclusive
+    glm::ivec2 dirtyMin = glm::ivec2(0);
+    glm::ivec2 dirtyMax = glm::ivec2(0);
+    std::vector<bool> pending[LEVEL_COUNT];
+    std::vector<uint32_t> visiblePages;
+    unsigned int frameIndex = 1;
+    Stats stats;
+
+    // Shared with the worker threads
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::deque<uint32_t> requests;
+    std::vector<ProducedPage> produced;
+    bool stopping = false;
+
+    static uint32_t packPage(int level, int x, int y) { return (uint32_t)level << 24 | (uint32_t)y << 12 | (uint32_t)x; }
+    static void unpackPage(uint32_t page, int& level, int& x, int& y) {
+        level = (page >> 24) & 0xF;
+        y = (page >> 12) & 0xFFF;
+        x = page & 0xFFF;
+    }
+    static int levelPages(int level) { return PAGE_TABLE_SIZE >> level; }
+
+    void workerLoop();
+    void producePage(uint32_t page, std::vector<unsigned char>& texels) const;
+    void resizeFeedback(int width, int height);
+    void readFeedback();
+    void requestPages();
+    void uploadPages();
+    int findSlot();
+    void markDirty(int level, int x, int y);
+    void updatePageTable();
+
+public:
+    // The virtual texture is mapped onto the world rectangle from origin to origin + size on the xz plane.
+    // The feedback program is VirtualFeedbackVertexShader and VirtualFeedbackFragmentShader.
+    bool create(const Producer& producer, const glm::vec2& origin, const glm::vec2& size, GLuint feedbackProgram, int threadCount = 2);
+    void destroy();
+
+    // Processes the oldest feedback buffer that is ready, queues the missing pages and uploads the finished ones.
+    // Call once per frame before the draws that sample the texture.
+    void update();
+    // Binds the page table and the atlas and sets the uniforms of the VIRTUAL_TEXTURE permutation
+    void setupProgram(GLuint program);
+
+    // Binds the feedback buffer and program, the caller draws every mesh that samples the texture in between.
+    // The PerObject block has to be set up for the feedback program.
+    void beginFeedback(int outputWidth, int outputHeight, const glm::mat4& view, const glm::mat4& projection);
+    // Starts the readback and restores the framebuffer and viewport
+    void endFeedback();
+
+    const Stats& getStats() const { return stats; }
+    void resetStats();
+};
+
+bool VirtualTexture::create(const Producer& producer, const glm::vec2& origin, const glm::vec2& size, GLuint feedbackProgram, int threadCount) {
+    this->producer = producer;
+    this->origin = origin;
+    this->size = size;
+    this->feedbackProgram = feedbackProgram;
+
+    for (int level = 0; level < LEVEL_COUNT; ++level) {
+        int count = levelPages(level) * levelPages(level);
+        pageTable[level].assign(count, 0);
+        pageSlots[level].assign(count, -1);
+        pending[level].assign(count, false);
+    }
+    slots.resize(ATLAS_PAGES * ATLAS_PAGES);
+
+    // One mip level per level of the virtual texture, looked up with texelFetch
+    glGenTextures(1, &pageTableTexture);
+    glBindTexture(GL_TEXTURE_2D, pageTableTexture);
+    for (int level = 0; level < LEVEL_COUNT; ++level)
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, levelPages(level), levelPages(level), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, LEVEL_COUNT - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &atlasTexture);
+    glBindTexture(GL_TEXTURE_2D, atlasTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ATLAS_SIZE, ATLAS_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &feedbackFramebuffer);
+    glGenRenderbuffers(1, &feedbackColor);
+    glGenRenderbuffers(1, &feedbackDepth);
+    glGenBuffers(FEEDBACK_LATENCY + 1, readbackBuffers);
+    resizeFeedback(1, 1);
+    glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete) {
+        std::cerr << "Virtual texture feedback framebuffer is incomplete" << std::endl;
+        return false;
+    }
+
+    // The coarsest level is always resident, so every page table entry has something to point at
+    ProducedPage root;
+    root.page = packPage(LEVEL_COUNT - 1, 0, 0);
+    producePage(root.page, root.texels);
+    produced.push_back(std::move(root));
+    uploadPages();
+    updatePageTable();
+
+    for (int i = 0; i < threadCount; ++i)
+        workers.emplace_back(&VirtualTexture::workerLoop, this);
+    return true;
+}
+
+void VirtualTexture::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+    for (std::thread& worker : workers)
+        worker.join();
+    workers.clear();
+
+    for (int i = 0; i <= FEEDBACK_LATENCY; ++i)
+        if (readbackFences[i] != nullptr)
+            glDeleteSync(readbackFences[i]);
+    glDeleteBuffers(FEEDBACK_LATENCY + 1, readbackBuffers);
+    glDeleteFramebuffers(1, &feedbackFramebuffer);
+    glDeleteRenderbuffers(1, &feedbackColor);
+    glDeleteRenderbuffers(1, &feedbackDepth);
+    glDeleteTextures(1, &pageTableTexture);
+    glDeleteTextures(1, &atlasTexture);
+}
+
+void VirtualTexture::workerLoop() {
+    // Pages are terrain data, whenever they are produced
+    AllocationScope allocationScope(ALLOCATION_TERRAIN);
+    while (true) {
+        uint32_t page;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || !requests.empty(); });
+            if (stopping) return;
+            page = requests.front();
+            requests.pop_front();
+        }
+
+        ProducedPage result;
+        result.page = page;
+        producePage(page, result.texels);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        produced.push_back(std::move(result));
+    }
+}
+
+void VirtualTexture::producePage(uint32_t page, std::vector<unsigned char>& texels) const {
+    int level, x, y;
+    unpackPage(page, level, x, y);
+    texels.resize(SLOT_SIZE * SLOT_SIZE * 4);
+    producer(level, x * PAGE_SIZE - PAGE_BORDER, y * PAGE_SIZE - PAGE_BORDER, SLOT_SIZE, texels.data());
+}
+
+void VirtualTexture::resizeFeedback(int width, int height) {
+    feedbackWidth = width;
+    feedbackHeight = height;
+
+    // Page, level and a valid bit packed into one integer, cleared to 0
+    glBindRenderbuffer(GL_RENDERBUFFER, feedbackColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    for (int i = 0; i <= FEEDBACK_LATENCY; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffers[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * sizeof(uint32_t), nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    stats.memoryBytes = (size_t)ATLAS_SIZE * ATLAS_SIZE * 4 + (size_t)width * height * (4 + 4 + 4 * (FEEDBACK_LATENCY + 1));
+    for (int level = 0; level < LEVEL_COUNT; ++level)
+        stats.memoryBytes += (size_t)levelPages(level) * levelPages(level) * 4;
+}
+
+void VirtualTexture::beginFeedback(int outputWidth, int outputHeight, const glm::mat4& view, const glm::mat4& projection) {
+    int width = std::max(outputWidth / FEEDBACK_DIVISOR, 1);
+    int height = std::max(outputHeight / FEEDBACK_DIVISOR, 1);
+    if (width != feedbackWidth || height != feedbackHeight) {
+        // Readbacks still in flight have the old size and are dropped
+        for (int i = 0; i <= FEEDBACK_LATENCY; ++i) {
+            if (readbackFences[i] != nullptr)
+                glDeleteSync(readbackFences[i]);
+            readbackFences[i] = nullptr;
+        }
+        resizeFeedback(width, height);
+    }
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, previousViewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+    glViewport(0, 0, feedbackWidth, feedbackHeight);
+    GLuint clearValue[4] = { 0, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, 0, clearValue);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+
+    glUseProgram(feedbackProgram);
+    glUniformMatrix4fv(glGetUniformLocation(feedbackProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(glGetUniformLocation(feedbackProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform4f(glGetUniformLocation(feedbackProgram, "virtualRect"), origin.x, origin.y, size.x, size.y);
+    glUniform1f(glGetUniformLocation(feedbackProgram, "virtualSize"), (float)VIRTUAL_SIZE);
+    glUniform1i(glGetUniformLocation(feedbackProgram, "virtualLevels"), LEVEL_COUNT);
+    glUniform1i(glGetUniformLocation(feedbackProgram, "pageTableSize"), PAGE_TABLE_SIZE);
+    // The derivatives of the small buffer are FEEDBACK_DIVISOR times larger than those of the output
+    glUniform1f(glGetUniformLocation(feedbackProgram, "lodBias"), -std::log2((float)FEEDBACK_DIVISOR));
+}
+
+void VirtualTexture::endFeedback() {
+    GLsync& fence = readbackFences[feedbackIndex];
+    if (fence != nullptr)
+        glDeleteSync(fence);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffers[feedbackIndex]);
+    glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readbackWidths[feedbackIndex] = feedbackWidth;
+    readbackHeights[feedbackIndex] = feedbackHeight;
+    feedbackIndex = (feedbackIndex + 1) % (FEEDBACK_LATENCY + 1);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+}
+
+void VirtualTexture::readFeedback() {
+    // The slot written next is the oldest one, FEEDBACK_LATENCY frames old
+    GLsync& fence = readbackFences[feedbackIndex];
+    if (fence == nullptr) return;
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return;
+    glDeleteSync(fence);
+    fence = nullptr;
+
+    int count = readbackWidths[feedbackIndex] * readbackHeights[feedbackIndex];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffers[feedbackIndex]);
+    const uint32_t* pixels = (const uint32_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, count * sizeof(uint32_t), GL_MAP_READ_BIT);
+    visiblePages.clear();
+    if (pixels != nullptr) {
+        for (int i = 0; i < count; ++i)
+            if (pixels[i] & 0x80000000u)
+                visiblePages.push_back(pixels[i] & 0x7FFFFFFFu);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    std::sort(visiblePages.begin(), visiblePages.end());
+    visiblePages.erase(std::unique(visiblePages.begin(), visiblePages.end()), visiblePages.end());
+    stats.visiblePages = (int)visiblePages.size();
+    requestPages();
+}
+
+void VirtualTexture::requestPages() {
+    // A visible page also needs its coarser pages, they are drawn while it is missing
+    FrameVector<uint32_t> missing;
+    for (uint32_t page : visiblePages) {
+        int level, x, y;
+        unpackPage(page, level, x, y);
+        for (; level < LEVEL_COUNT; ++level, x /= 2, y /= 2) {
+            int index = y * levelPages(level) + x;
+            int slot = pageSlots[level][index];
+            if (slot >= 0) {
+                slots[slot].lastVisibleFrame = frameIndex;
+            }
+            else if (!pending[level][index]) {
+                pending[level][index] = true;
+                missing.push_back(packPage(level, x, y));
+            }
+        }
+    }
+
+    // Coarse pages first, they cover the most pixels
+    std::sort(missing.begin(), missing.end(), [](uint32_t a, uint32_t b) { return a > b; });
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t page : missing) {
+        int level, x, y;
+        unpackPage(page, level, x, y);
+        if (stats.pendingPages >= MAX_PENDING) {
+            // Asked for again by a later feedback buffer
+            pending[level][y * levelPages(level) + x] = false;
+            continue;
+        }
+        requests.push_back(page);
+        stats.pendingPages++;
+    }
+    wakeCondition.notify_all();
+}
+
+int VirtualTexture::findSlot() {
+    // A free slot, or the one that has not been visible for the longest time
+    int best = -1;
+    for (int i = 0; i < (int)slots.size(); ++i) {
+        if (slots[i].level < 0) return i;
+        if (slots[i].level == LEVEL_COUNT - 1 || slots[i].lastVisibleFrame >= frameIndex) continue;
+        if (best < 0 || slots[i].lastVisibleFrame < slots[best].lastVisibleFrame)
+            best = i;
+    }
+    return best;
+}
+
+void VirtualTexture::uploadPages() {
+    FrameVector<ProducedPage> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int count = std::min((int)produced.size(), MAX_UPLOADS);
+        finished.assign(std::make_move_iterator(produced.begin()), std::make_move_iterator(produced.begin() + count));
+        produced.erase(produced.begin(), produced.begin() + count);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, atlasTexture);
+    for (ProducedPage& page : finished) {
+        int level, x, y;
+        unpackPage(page.page, level, x, y);
+        int index = y * levelPages(level) + x;
+        if (level < LEVEL_COUNT - 1) {
+            pending[level][index] = false;
+            stats.pendingPages--;
+        }
+        stats.producedPages++;
+
+        int slot = findSlot();
+        if (slot < 0) {
+            stats.droppedPages++;
+            continue;
+        }
+        Slot& target = slots[slot];
+        if (target.level >= 0) {
+            pageSlots[target.level][target.y * levelPages(target.level) + target.x] = -1;
+            markDirty(target.level, target.x, target.y);
+            stats.evictedPages++;
+            stats.residentPages--;
+        }
+        target.level = level;
+        target.x = x;
+        target.y = y;
+        target.lastVisibleFrame = frameIndex;
+        pageSlots[level][index] = slot;
+        markDirty(level, x, y);
+        stats.residentPages++;
+
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % ATLAS_PAGES) * SLOT_SIZE, (slot / ATLAS_PAGES) * SLOT_SIZE,
+            SLOT_SIZE, SLOT_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, page.texels.data());
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void VirtualTexture::markDirty(int level, int x, int y) {
+    glm::ivec2 min = glm::ivec2(x, y) << level;
+    glm::ivec2 max = glm::ivec2(x + 1, y + 1) << level;
+    if (dirtyMax.x <= dirtyMin.x) {
+        dirtyMin = min;
+        dirtyMax = max;
+    }
+    else {
+        dirtyMin = glm::min(dirtyMin, min);
+        dirtyMax = glm::max(dirtyMax, max);
+    }
+}
+
+void VirtualTexture::updatePageTable() {
+    if (dirtyMax.x <= dirtyMin.x) return;
+
+    // Coarse to fine, so a missing page can copy the finished entry of its parent
+    glBindTexture(GL_TEXTURE_2D, pageTableTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (int level = LEVEL_COUNT - 1; level >= 0; --level) {
+        int pages = levelPages(level);
+        glm::ivec2 min = dirtyMin >> level;
+        glm::ivec2 max = (dirtyMax - 1) >> level;
+        for (int y = min.y; y <= max.y; ++y) {
+            for (int x = min.x; x <= max.x; ++x) {
+                int slot = pageSlots[level][y * pages + x];
+                uint32_t& entry = pageTable[level][y * pages + x];
+                if (slot >= 0)
+                    entry = (uint32_t)(slot % ATLAS_PAGES) | (uint32_t)(slot / ATLAS_PAGES) << 8 | (uint32_t)level << 16 | 0xFF000000u;
+                else if (level + 1 < LEVEL_COUNT)
+                    entry = pageTable[level + 1][(y / 2) * (pages / 2) + x / 2];
+            }
+        }
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, pages);
+        glTexSubImage2D(GL_TEXTURE_2D, level, min.x, min.y, max.x - min.x + 1, max.y - min.y + 1, GL_RGBA, GL_UNSIGNED_BYTE,
+            &pageTable[level][min.y * pages + min.x]);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    dirtyMin = dirtyMax = glm::ivec2(0);
+}
+
+void VirtualTexture::update() {
+    auto start = std::chrono::high_resolution_clock::now();
+    readFeedback();
+    uploadPages();
+    updatePageTable();
+    frameIndex++;
+    stats.feedbackMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void VirtualTexture::setupProgram(GLuint program) {
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "pageTable"), PAGE_TABLE_UNIT);
+    glUniform1i(glGetUniformLocation(program, "pageAtlas"), ATLAS_UNIT);
+    glUniform4f(glGetUniformLocation(program, "virtualRect"), origin.x, origin.y, size.x, size.y);
+    glUniform1f(glGetUniformLocation(program, "virtualSize"), (float)VIRTUAL_SIZE);
+    glUniform1i(glGetUniformLocation(program, "virtualLevels"), LEVEL_COUNT);
+    glUniform1i(glGetUniformLocation(program, "pageTableSize"), PAGE_TABLE_SIZE);
+    glUniform3f(glGetUniformLocation(program, "pageLayout"), (float)PAGE_SIZE, (float)PAGE_BORDER, (float)ATLAS_SIZE);
+
+    glActiveTexture(GL_TEXTURE0 + PAGE_TABLE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, pageTableTexture);
+    glActiveTexture(GL_TEXTURE0 + ATLAS_UNIT);
+    glBindTexture(GL_TEXTURE_2D, atlasTexture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void VirtualTexture::resetStats() {
+    stats.producedPages = 0;
+    stats.evictedPages = 0;
+    stats.droppedPages = 0;
+}